@@ -0,0 +1,160 @@
+/*
+ * One huge page backed arena the working planes of a job are carved
+ * from
+ *
+ * the arena is one anonymous mapping of whole ARENA_HUGE_PAGE pages:
+ * explicit (hugetlbfs) huge pages if the system has some reserved,
+ * otherwise ordinary pages aligned to ARENA_HUGE_PAGE and advised to be
+ * backed by transparent huge pages.  allocations are bumped off the
+ * front at any alignment and never freed one by one; the whole arena
+ * is reset (to be carved again by the next job) or released
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+static char *map_explicit(size_t size);
+static char *map_transparent(size_t size, int *pages);
+
+/*
+ * make arena an empty arena of at least size bytes, keeping its
+ * mapping if that is large enough
+ *
+ * returns 0 on success, anything else (leaving arena released) if
+ * nothing could be mapped
+ */
+int arena_reserve(struct arena *arena, size_t size)
+{
+	if (arena->base != NULL && arena->size >= size) {
+		arena_reset(arena);
+		return 0;
+	}
+
+	arena_release(arena);
+	size = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE *
+		ARENA_HUGE_PAGE;
+
+	arena->pages = ARENA_EXPLICIT_HUGE_PAGES;
+	arena->base = map_explicit(size);
+	if (arena->base == NULL)
+		arena->base = map_transparent(size, &arena->pages);
+	if (arena->base == NULL)
+		return -1;
+
+	arena->size = size;
+	arena->used = 0;
+	return 0;
+}
+
+/*
+ * carve size bytes at a multiple of alignment (a power of two) out of
+ * arena
+ *
+ * returns them, or NULL if the arena has no room
+ */
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment)
+{
+	size_t start;
+
+	if (arena->base == NULL)
+		return NULL;
+
+	start = (arena->used + alignment - 1) & ~(alignment - 1);
+	if (start > arena->size || size > arena->size - start)
+		return NULL;
+
+	arena->used = start + size;
+	return arena->base + start;
+}
+
+/* nonzero if p was carved out of arena */
+int arena_owns(struct arena *arena, void *p)
+{
+	return arena->base != NULL && (uintptr_t)p >= (uintptr_t)arena->base
+		&& (uintptr_t)p < (uintptr_t)arena->base + arena->size;
+}
+
+/* empty arena, keeping its pages for the next allocations */
+void arena_reset(struct arena *arena)
+{
+	arena->used = 0;
+}
+
+/* unmap arena (an unreserved one is ignored) */
+void arena_release(struct arena *arena)
+{
+	if (arena->base != NULL)
+		munmap(arena->base, arena->size);
+
+	arena->base = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
+
+/* the kind of pages backing arena, for messages */
+char *arena_pages_name(struct arena *arena)
+{
+	if (arena->pages == ARENA_EXPLICIT_HUGE_PAGES)
+		return "explicit huge pages";
+	if (arena->pages == ARENA_TRANSPARENT_HUGE_PAGES)
+		return "transparent huge pages";
+	return "small pages";
+}
+
+/* size bytes of reserved huge pages, or NULL if there are not enough */
+static char *map_explicit(size_t size)
+{
+#ifdef MAP_HUGETLB
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+			MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+	return NULL;
+}
+
+/*
+ * size bytes of ordinary pages at a huge page boundary (so they can
+ * be collapsed into huge pages), advised to be huge, setting *pages to
+ * what was granted
+ *
+ * returns them, or NULL if they could not be mapped
+ */
+static char *map_transparent(size_t size, int *pages)
+{
+	char *p, *aligned;
+	size_t head;
+
+	/* map a huge page more and trim it off both ends */
+	p = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((uintptr_t)p + ARENA_HUGE_PAGE - 1) &
+			~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+	head = aligned - p;
+	if (head > 0)
+		munmap(p, head);
+	if (ARENA_HUGE_PAGE - head > 0)
+		munmap(aligned + size, ARENA_HUGE_PAGE - head);
+
+	*pages = ARENA_SMALL_PAGES;
+#ifdef MADV_HUGEPAGE
+	if (madvise(aligned, size, MADV_HUGEPAGE) == 0)
+		*pages = ARENA_TRANSPARENT_HUGE_PAGES;
+#endif
+
+	return aligned;
+}
@@ -0,0 +1,38 @@
+/*
+ * One huge page backed arena the working planes of a job are carved
+ * from
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* size (and alignment) of the huge pages an arena is made of */
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+/* how the pages of an arena are backed */
+#define ARENA_SMALL_PAGES 0
+#define ARENA_TRANSPARENT_HUGE_PAGES 1
+#define ARENA_EXPLICIT_HUGE_PAGES 2
+
+struct arena {
+	char *base;
+	size_t size, used;
+	int pages;
+};
+
+int arena_reserve(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment);
+int arena_owns(struct arena *arena, void *p);
+void arena_reset(struct arena *arena);
+void arena_release(struct arena *arena);
+char *arena_pages_name(struct arena *arena);
+
+#endif /* !_ARENA_H_ */
@@ -0,0 +1,394 @@
+/*
+ * Per host and size tuning of the thread count and fftw planner flags
+ *
+ * a candidate is timed on what a pass is made of at the real size: the
+ * r2c/c2r transform pair, planned with its flags on its threads, and
+ * the pointwise stage on a pool of as many threads.  thread counts go
+ * up in powers of two to the processors online, with FFTW_MEASURE,
+ * stopping once two in a row are no faster; then FFTW_ESTIMATE and
+ * FFTW_PATIENT are tried at the best count.  a candidate's planning
+ * time is spread over AUTOTUNE_PAIRS pairs, so a slow planner only
+ * wins when it pays for itself, and each is planned with no wisdom
+ * left by the others.  the best is kept, one line per host and size,
+ * in a text file; later lines override earlier ones
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fftw3.h>
+#include "thread_pool.h"
+#include "autotune.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+/* timed runs of each candidate, the fastest counts */
+#define AUTOTUNE_RUNS 3
+/* pairs a plan is expected to run (about 25 passes of 4 channels) */
+#define AUTOTUNE_PAIRS 100
+/* floats per pointwise task, as in the cpu backend */
+#define AUTOTUNE_BAND 65536
+/* longest host key */
+#define AUTOTUNE_MAX_HOST 256
+
+/* the pointwise stage being timed, out = a * b in bands */
+struct pointwise {
+	float *a, *b, *out;
+	size_t n;
+};
+
+static int host_key(char *buf, size_t size);
+static char *flags_name(unsigned flags);
+static double seconds_since(struct timespec *start);
+static int time_candidate(int width, int height, int n_threads, unsigned
+		flags, double *plan_seconds, double *pair_seconds);
+static void multiply_band(void *arg, int i);
+
+/*
+ * find the tuned configuration of this host for width x height in the
+ * tuning file filename
+ *
+ * returns 0 if found, anything else otherwise
+ */
+int autotune_lookup(char *filename, int width, int height, struct
+		autotune_result *result)
+{
+	FILE *file;
+	char host[AUTOTUNE_MAX_HOST], line_host[AUTOTUNE_MAX_HOST];
+	char line[2 * AUTOTUNE_MAX_HOST];
+	struct autotune_result line_result;
+	int line_width, line_height, found;
+
+	if (host_key(host, sizeof(host)) != 0)
+		return -1;
+
+	file = fopen(filename, "r");
+	if (file == NULL)
+		return -1;
+
+	found = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "%255s %d %d %d %u %lg", line_host,
+					&line_width, &line_height,
+					&line_result.n_threads,
+					&line_result.fft_flags,
+					&line_result.pair_seconds) != 6)
+			continue;
+
+		if (strcmp(line_host, host) != 0 || line_width != width ||
+				line_height != height ||
+				line_result.n_threads < 1)
+			continue;
+
+		*result = line_result;
+		found = 1;
+	}
+
+	fclose(file);
+	return found ? 0 : -1;
+}
+
+/*
+ * time the candidates for width x height on up to max_threads threads
+ * (0 for the processors online) and put the best in result; fftw must
+ * be multithreaded already (fftwf_init_threads)
+ *
+ * returns 0 on success, anything else otherwise
+ */
+int autotune_run(int width, int height, int max_threads, struct
+		autotune_result *result)
+{
+	static const unsigned other_flags[] = {FFTW_ESTIMATE, FFTW_PATIENT};
+	double plan_seconds, pair_seconds, score, best_score;
+	int n_threads, n_worse, i;
+
+	if (max_threads < 1)
+		max_threads = autotune_max_threads();
+
+	printf("Tuning threads and FFT planning for %dx%d on this host\n",
+			width, height);
+	fflush(stdout);
+
+	best_score = 0;
+	n_worse = 0;
+	n_threads = 1;
+	for (;;) {
+		if (time_candidate(width, height, n_threads, FFTW_MEASURE,
+					&plan_seconds, &pair_seconds) != 0)
+			goto out_err;
+
+		score = plan_seconds + AUTOTUNE_PAIRS * pair_seconds;
+		printf("  %d threads, %s: %.4g s per pair, %.3g s planning\n",
+				n_threads, flags_name(FFTW_MEASURE),
+				pair_seconds, plan_seconds);
+		fflush(stdout);
+
+		if (n_threads == 1 || score < best_score) {
+			best_score = score;
+			result->n_threads = n_threads;
+			result->fft_flags = FFTW_MEASURE;
+			result->pair_seconds = pair_seconds;
+			n_worse = 0;
+		} else if (++n_worse == 2) {
+			break;
+		}
+
+		if (n_threads == max_threads)
+			break;
+		n_threads = 2 * n_threads < max_threads ? 2 * n_threads :
+			max_threads;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (time_candidate(width, height, result->n_threads,
+					other_flags[i], &plan_seconds,
+					&pair_seconds) != 0)
+			goto out_err;
+
+		score = plan_seconds + AUTOTUNE_PAIRS * pair_seconds;
+		printf("  %d threads, %s: %.4g s per pair, %.3g s planning\n",
+				result->n_threads,
+				flags_name(other_flags[i]), pair_seconds,
+				plan_seconds);
+		fflush(stdout);
+
+		if (score < best_score) {
+			best_score = score;
+			result->fft_flags = other_flags[i];
+			result->pair_seconds = pair_seconds;
+		}
+	}
+
+	printf("Tuned: %d threads, %s\n", result->n_threads,
+			flags_name(result->fft_flags));
+	fflush(stdout);
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * append result as the tuned configuration of this host for width x
+ * height to the tuning file filename
+ *
+ * returns 0 on success, anything else otherwise
+ */
+int autotune_store(char *filename, int width, int height, struct
+		autotune_result *result)
+{
+	FILE *file;
+	char host[AUTOTUNE_MAX_HOST];
+	int ret;
+
+	if (host_key(host, sizeof(host)) != 0)
+		goto out_err;
+
+	file = fopen(filename, "a");
+	if (file == NULL)
+		goto out_err;
+
+	ret = fprintf(file, "%s %d %d %d %u %.6g\n", host, width, height,
+			result->n_threads, result->fft_flags,
+			result->pair_seconds);
+	if (fclose(file) != 0 || ret < 0)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	fprintf(stderr, "could not store tuning in %s\n", filename);
+	fflush(stderr);
+	return -1;
+}
+
+/*
+ * the default tuning file, AUTOTUNE_FILENAME in $HOME, into buf of
+ * size bytes
+ *
+ * returns 0 on success, anything else if there is no $HOME
+ */
+int autotune_default_filename(char *buf, size_t size)
+{
+	char *home;
+	int n;
+
+	home = getenv("HOME");
+	if (home == NULL || home[0] == '\0')
+		return -1;
+
+	n = snprintf(buf, size, "%s/%s", home, AUTOTUNE_FILENAME);
+	return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+/* processors online, the most threads tuned for */
+int autotune_max_threads()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+/*
+ * the host name and processors online, so a tuning file shared by
+ * several hosts (e.g. in a network home) keeps them apart
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int host_key(char *buf, size_t size)
+{
+	char name[AUTOTUNE_MAX_HOST / 2];
+	int n;
+
+	if (gethostname(name, sizeof(name)) != 0)
+		return -1;
+	name[sizeof(name) - 1] = '\0';
+
+	n = snprintf(buf, size, "%s/%d", name, autotune_max_threads());
+	return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+static char *flags_name(unsigned flags)
+{
+	if (flags == FFTW_ESTIMATE)
+		return "FFTW_ESTIMATE";
+	if (flags == FFTW_PATIENT)
+		return "FFTW_PATIENT";
+	return "FFTW_MEASURE";
+}
+
+static double seconds_since(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec -
+			start->tv_nsec) / 1e9;
+}
+
+/*
+ * plan the width x height transform pair with flags on n_threads
+ * threads, and time it and the pointwise stage on as many
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int time_candidate(int width, int height, int n_threads, unsigned
+		flags, double *plan_seconds, double *pair_seconds)
+{
+	struct thread_pool *pool;
+	struct pointwise op;
+	float *real, *b;
+	fftwf_complex *complex;
+	fftwf_plan forward, backward;
+	struct timespec start;
+	double seconds;
+	size_t i, n;
+	int run;
+
+	n = (size_t)width * height;
+	real = fftwf_malloc(n * sizeof(*real));
+	complex = fftwf_malloc((width/2 + 1) * (size_t)height *
+			sizeof(*complex));
+	b = malloc(n * sizeof(*b));
+	if (real == NULL || complex == NULL || b == NULL)
+		goto out_no_buffers;
+
+	pool = thread_pool_create(n_threads);
+	if (pool == NULL)
+		goto out_no_buffers;
+
+	/* plan from scratch, as a fresh process would: fftw reuses the
+	 * wisdom of the candidates before for less rigorous flags, so
+	 * FFTW_ESTIMATE would get the measured plans for free */
+	fftwf_forget_wisdom();
+	fftwf_plan_with_nthreads(n_threads);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	forward = fftwf_plan_dft_r2c_2d(height, width, real, complex,
+			flags);
+	backward = fftwf_plan_dft_c2r_2d(height, width, complex, real,
+			flags);
+	*plan_seconds = seconds_since(&start);
+	if (forward == NULL || backward == NULL)
+		goto out_no_plans;
+
+	for (i = 0; i < n; i++) {
+		b[i] = 1.0f / n;
+	}
+
+	op.a = real;
+	op.b = b;
+	op.out = real;
+	op.n = n;
+
+	*pair_seconds = 0;
+	for (run = 0; run < AUTOTUNE_RUNS; run++) {
+		for (i = 0; i < n; i++) {
+			real[i] = i % 7;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		fftwf_execute(forward);
+		fftwf_execute(backward);
+		thread_pool_run(pool, (n + AUTOTUNE_BAND - 1) /
+				AUTOTUNE_BAND, multiply_band, &op);
+		seconds = seconds_since(&start);
+
+		if (run == 0 || seconds < *pair_seconds)
+			*pair_seconds = seconds;
+	}
+
+	fftwf_destroy_plan(backward);
+	fftwf_destroy_plan(forward);
+	thread_pool_destroy(pool);
+	fftwf_free(complex);
+	fftwf_free(real);
+	free(b);
+	return 0;
+
+out_no_plans:
+	if (backward != NULL)
+		fftwf_destroy_plan(backward);
+	if (forward != NULL)
+		fftwf_destroy_plan(forward);
+	thread_pool_destroy(pool);
+out_no_buffers:
+	fftwf_free(complex);
+	fftwf_free(real);
+	free(b);
+	say_function_failed();
+	return -1;
+}
+
+/* pool task: band i of a struct pointwise */
+static void multiply_band(void *arg, int i)
+{
+	struct pointwise *op;
+	size_t j, start, end;
+
+	op = arg;
+	start = (size_t)i * AUTOTUNE_BAND;
+	end = start + AUTOTUNE_BAND < op->n ? start + AUTOTUNE_BAND :
+		op->n;
+
+	for (j = start; j < end; j++) {
+		op->out[j] = op->a[j] * op->b[j];
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * Per host and size tuning of the thread count and fftw planner flags
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+#include <stddef.h>
+
+/* tuning file in $HOME used when none is given */
+#define AUTOTUNE_FILENAME ".deconvolute_tuning"
+
+struct autotune_result {
+	int n_threads;
+	/* FFTW_MEASURE, FFTW_ESTIMATE or FFTW_PATIENT */
+	unsigned fft_flags;
+	/* one r2c/c2r pair and pointwise stage at this configuration */
+	double pair_seconds;
+};
+
+int autotune_lookup(char *filename, int width, int height, struct
+		autotune_result *result);
+int autotune_run(int width, int height, int max_threads, struct
+		autotune_result *result);
+int autotune_store(char *filename, int width, int height, struct
+		autotune_result *result);
+int autotune_default_filename(char *buf, size_t size);
+int autotune_max_threads();
+
+#endif /* !_AUTOTUNE_H_ */
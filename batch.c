@@ -0,0 +1,369 @@
+/*
+ * Deconvolute a directory of images as concurrent jobs within memory
+ * budgets
+ *
+ * each image's peak host and device memory is planned from its size
+ * (see deconvolute_plan_job, which also fits a job that would not fit
+ * the budgets alone) before anything is allocated, and jobs start in
+ * name order whenever the next one fits beside the running ones in
+ * both budgets and a thread is free; the free threads are split evenly
+ * among the jobs that fit together.  a job that would not fit even on
+ * its own is refused instead of started.  the engine keeps its state
+ * in globals, so each job runs in a process of its own
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "deconvolute.h"
+#include "float_image.h"
+#include "batch.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+#define JOB_PENDING 0
+#define JOB_REFUSED 1
+#define JOB_RUNNING 2
+#define JOB_DONE 3
+
+struct job {
+	char *name;
+	size_t host, device;
+	int n_threads;
+	int state;
+	pid_t pid;
+};
+
+static int list_jobs(char *input_dir, struct job **jobs);
+static void free_jobs(struct job *jobs, int n_jobs);
+static int compare_jobs(const void *a, const void *b);
+static int is_image(char *name);
+static int job_path(char *buf, char *dir, char *name);
+static int count_fitting(struct job *jobs, int next, int n_jobs, size_t
+		host_free, size_t device_free, int max);
+static pid_t start_job(struct job *job, char *input_dir, char
+		*psf_image_filename, char *output_dir, int n_iterations,
+		struct deconvolute_options *options);
+
+/*
+ * deconvolute every image in input_dir with the same psf into a file
+ * of the same name in output_dir, running as many jobs at once as
+ * host_budget bytes of memory, device_budget bytes of opencl memory
+ * (either 0 for no limit) and n_threads threads allow
+ *
+ * checkpoints and previews are not written, as jobs would share them
+ *
+ * returns the number of images that failed or were refused, or -1 if
+ * the batch could not run at all
+ */
+int batch_run(char *input_dir, char *psf_image_filename, char
+		*output_dir, int n_iterations, int n_threads, size_t
+		host_budget, size_t device_budget, struct
+		deconvolute_options *options)
+{
+	struct job *jobs;
+	struct deconvolute_options job_options, fitted;
+	struct deconvolute_plan plan;
+	char path[FILENAME_MAX];
+	int n_jobs, next, n_running, n_failed, threads_free, k, i, status;
+	size_t host_used, device_used;
+	pid_t pid;
+
+	job_options = *options;
+	job_options.checkpoint_filename = NULL;
+	job_options.preview_filename = NULL;
+	job_options.background_output = 0;
+	job_options.memory_budget = host_budget;
+	job_options.device_memory_budget = device_budget;
+
+	if (host_budget == 0)
+		host_budget = SIZE_MAX;
+	if (device_budget == 0)
+		device_budget = SIZE_MAX;
+	if (n_threads < 1)
+		n_threads = 1;
+
+	n_jobs = list_jobs(input_dir, &jobs);
+	if (n_jobs < 0)
+		goto out_no_jobs;
+
+	n_failed = 0;
+	for (i = 0; i < n_jobs; i++) {
+		/* the job plans the same fitted configuration again */
+		fitted = job_options;
+		if (job_path(path, input_dir, jobs[i].name) != 0 ||
+				deconvolute_plan_job(path,
+					psf_image_filename, n_threads,
+					&fitted, &plan) != 0) {
+			fprintf(stderr, "%s: refused\n", jobs[i].name);
+			fflush(stderr);
+			jobs[i].state = JOB_REFUSED;
+			n_failed++;
+			continue;
+		}
+
+		jobs[i].host = plan.host;
+		jobs[i].device = plan.device;
+	}
+
+	next = 0;
+	n_running = 0;
+	host_used = 0;
+	device_used = 0;
+	threads_free = n_threads;
+	for (;;) {
+		while (next < n_jobs && jobs[next].state == JOB_REFUSED)
+			next++;
+
+		k = 0;
+		if (next < n_jobs)
+			k = count_fitting(jobs, next, n_jobs, host_budget -
+					host_used, device_budget -
+					device_used, threads_free);
+
+		if (k > 0) {
+			jobs[next].n_threads = threads_free / k;
+			jobs[next].pid = start_job(&jobs[next], input_dir,
+					psf_image_filename, output_dir,
+					n_iterations, &job_options);
+			if (jobs[next].pid < 0) {
+				jobs[next].state = JOB_DONE;
+				n_failed++;
+				next++;
+				continue;
+			}
+
+			printf("Started %s: %d threads, %.1f MB, %.1f MB on the device\n",
+					jobs[next].name, jobs[next].n_threads,
+					jobs[next].host / 1e6,
+					jobs[next].device / 1e6);
+			fflush(stdout);
+
+			jobs[next].state = JOB_RUNNING;
+			host_used += jobs[next].host;
+			device_used += jobs[next].device;
+			threads_free -= jobs[next].n_threads;
+			n_running++;
+			next++;
+			continue;
+		}
+
+		if (n_running == 0)
+			break;
+
+		/* the next job must wait for a running one to finish */
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out_err;
+		}
+
+		for (i = 0; i < n_jobs; i++) {
+			if (jobs[i].state == JOB_RUNNING && jobs[i].pid ==
+					pid)
+				break;
+		}
+		if (i == n_jobs)
+			continue;
+
+		jobs[i].state = JOB_DONE;
+		host_used -= jobs[i].host;
+		device_used -= jobs[i].device;
+		threads_free += jobs[i].n_threads;
+		n_running--;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: failed\n", jobs[i].name);
+			fflush(stderr);
+			n_failed++;
+		} else {
+			printf("Finished %s\n", jobs[i].name);
+			fflush(stdout);
+		}
+	}
+
+	free_jobs(jobs, n_jobs);
+	return n_failed;
+
+out_err:
+	/* don't leave running jobs behind */
+	while (n_running > 0 && waitpid(-1, NULL, 0) > 0)
+		n_running--;
+	free_jobs(jobs, n_jobs);
+out_no_jobs:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * list the images in input_dir, sorted by name, into a malloced array
+ * of pending jobs
+ *
+ * returns the number of jobs, or -1 on failure
+ */
+static int list_jobs(char *input_dir, struct job **jobs)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int n_jobs;
+
+	dir = opendir(input_dir);
+	if (dir == NULL)
+		goto out_no_dir;
+
+	*jobs = calloc(BATCH_MAX_JOBS, sizeof(**jobs));
+	if (*jobs == NULL)
+		goto out_no_jobs;
+
+	n_jobs = 0;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || !is_image(entry->d_name))
+			continue;
+
+		if (n_jobs == BATCH_MAX_JOBS) {
+			fprintf(stderr, "%s has more than %d images\n",
+					input_dir, BATCH_MAX_JOBS);
+			fflush(stderr);
+			goto out_err;
+		}
+
+		(*jobs)[n_jobs].name = strdup(entry->d_name);
+		if ((*jobs)[n_jobs].name == NULL)
+			goto out_err;
+		(*jobs)[n_jobs].state = JOB_PENDING;
+		n_jobs++;
+	}
+
+	closedir(dir);
+	qsort(*jobs, n_jobs, sizeof(**jobs), compare_jobs);
+
+	return n_jobs;
+
+out_err:
+	free_jobs(*jobs, n_jobs);
+out_no_jobs:
+	closedir(dir);
+out_no_dir:
+	return -1;
+}
+
+static void free_jobs(struct job *jobs, int n_jobs)
+{
+	int i;
+
+	for (i = 0; i < n_jobs; i++) {
+		free(jobs[i].name);
+	}
+	free(jobs);
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+	return strcmp(((struct job *)a)->name, ((struct job *)b)->name);
+}
+
+/* whether name is an image, judging by its extension */
+static int is_image(char *name)
+{
+	char *ext;
+
+	if (float_image_is_float(name))
+		return 1;
+
+	ext = strrchr(name, '.');
+	if (ext == NULL)
+		return 0;
+
+	return strcasecmp(ext, ".tif") == 0 || strcasecmp(ext, ".tiff") ==
+		0;
+}
+
+/*
+ * join dir and name into buf of FILENAME_MAX bytes
+ *
+ * returns 0 on success, anything else if too long
+ */
+static int job_path(char *buf, char *dir, char *name)
+{
+	int n;
+
+	n = snprintf(buf, FILENAME_MAX, "%s/%s", dir, name);
+	return n >= 0 && n < FILENAME_MAX ? 0 : -1;
+}
+
+/*
+ * how many pending jobs from next on (at most max) fit together in
+ * the free memory, stopping at the first that does not, so jobs start
+ * in order
+ */
+static int count_fitting(struct job *jobs, int next, int n_jobs, size_t
+		host_free, size_t device_free, int max)
+{
+	int i, k;
+
+	k = 0;
+	for (i = next; i < n_jobs && k < max; i++) {
+		if (jobs[i].state == JOB_REFUSED)
+			continue;
+
+		if (jobs[i].host > host_free || jobs[i].device >
+				device_free)
+			break;
+
+		host_free -= jobs[i].host;
+		device_free -= jobs[i].device;
+		k++;
+	}
+
+	return k;
+}
+
+/*
+ * fork a process running job on its share of the threads
+ *
+ * returns the process id, or -1 on failure
+ */
+static pid_t start_job(struct job *job, char *input_dir, char
+		*psf_image_filename, char *output_dir, int n_iterations,
+		struct deconvolute_options *options)
+{
+	char input[FILENAME_MAX], output[FILENAME_MAX];
+	pid_t pid;
+	int ret;
+
+	if (job_path(input, input_dir, job->name) != 0)
+		return -1;
+	if (job_path(output, output_dir, job->name) != 0)
+		return -1;
+
+	/* so nothing buffered is printed twice */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	ret = deconvolute_image_with_options(input, psf_image_filename,
+			output, n_iterations, job->n_threads, options);
+	fflush(stdout);
+	fflush(stderr);
+	_exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,26 @@
+/*
+ * Deconvolute a directory of images as concurrent jobs within memory
+ * budgets
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stddef.h>
+#include "deconvolute.h"
+
+/* most images a batch directory may hold */
+#define BATCH_MAX_JOBS 4096
+
+int batch_run(char *input_dir, char *psf_image_filename, char
+		*output_dir, int n_iterations, int n_threads, size_t
+		host_budget, size_t device_budget, struct
+		deconvolute_options *options);
+
+#endif /* !_BATCH_H_ */
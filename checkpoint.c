@@ -0,0 +1,320 @@
+/*
+ * Checkpoints of a running deconvolution
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define ENDIAN_CHECK 0x01020304
+
+static void *write_checkpoint(void *arg);
+
+static uint64_t round_up(uint64_t size)
+{
+	return (size + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN *
+		CHECKPOINT_ALIGN;
+}
+
+/* 64-bit FNV-1a hash of data, to tie a checkpoint to its input and psf */
+uint64_t checkpoint_hash(const void *data, size_t size)
+{
+	size_t i;
+	uint64_t hash;
+	const unsigned char *bytes;
+
+	bytes = data;
+	hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * prepare a writer for checkpoints of n_channels width x height planes
+ * to filename
+ *
+ * returns 0 on success, anything else on failure
+ */
+int checkpoint_writer_init(struct checkpoint_writer *writer, char
+		*filename, int width, int height, int n_channels)
+{
+	struct checkpoint_header *header;
+
+	memset(writer, 0, sizeof(*writer));
+	writer->filename = filename;
+
+	header = &writer->header;
+	memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+	header->version = CHECKPOINT_VERSION;
+	header->endian_check = ENDIAN_CHECK;
+	header->width = width;
+	header->height = height;
+	header->n_channels = n_channels;
+	header->plane_offset = round_up(sizeof(*header));
+	header->plane_stride = round_up((uint64_t)width * height *
+			sizeof(float));
+
+	writer->snapshot = malloc((size_t)width * height * n_channels *
+			sizeof(*writer->snapshot));
+	if (writer->snapshot == NULL)
+		goto out_nomem;
+
+	return 0;
+
+out_nomem:
+	fprintf(stderr, "checkpoint_writer_init: no memory\n");
+	fflush(stderr);
+	checkpoint_writer_cleanup(writer);
+	return -1;
+}
+
+/*
+ * snapshot planes and write them to the checkpoint file on a
+ * background thread, after waiting for any previous write to finish
+ *
+ * returns 0 on success, anything else if this or the previous write
+ * failed
+ */
+int checkpoint_write_async(struct checkpoint_writer *writer, float
+		**planes, int iteration, uint64_t input_hash, uint64_t
+		psf_hash)
+{
+	int c, ret;
+	size_t plane_size;
+
+	ret = checkpoint_writer_wait(writer);
+	if (ret != 0)
+		return ret;
+
+	plane_size = (size_t)writer->header.width *
+		writer->header.height;
+	for (c = 0; c < writer->header.n_channels; c++) {
+		memcpy(writer->snapshot + c * plane_size, planes[c],
+				plane_size * sizeof(*writer->snapshot));
+	}
+
+	writer->header.iteration = iteration;
+	writer->header.input_hash = input_hash;
+	writer->header.psf_hash = psf_hash;
+
+	ret = pthread_create(&writer->thread, NULL, write_checkpoint,
+			writer);
+	if (ret != 0)
+		return ret;
+	writer->busy = 1;
+
+	return 0;
+}
+
+/*
+ * wait for a pending write
+ *
+ * returns 0 if there was none or it succeeded, anything else otherwise
+ */
+int checkpoint_writer_wait(struct checkpoint_writer *writer)
+{
+	if (!writer->busy)
+		return 0;
+
+	pthread_join(writer->thread, NULL);
+	writer->busy = 0;
+
+	return writer->ret;
+}
+
+/* waits for a pending write and frees the writer's buffers */
+void checkpoint_writer_cleanup(struct checkpoint_writer *writer)
+{
+	checkpoint_writer_wait(writer);
+
+	free(writer->snapshot);
+	writer->snapshot = NULL;
+}
+
+/*
+ * write all of buf to fd
+ *
+ * returns 0 on success, -1 otherwise
+ */
+static int write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t n;
+	const char *p;
+
+	for (p = buf; size > 0; p += n, size -= n) {
+		n = write(fd, p, size);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * thread function writing a snapshot to filename.tmp and renaming it
+ * over filename, so a crash mid-write leaves the last checkpoint intact
+ */
+static void *write_checkpoint(void *arg)
+{
+	int c, fd;
+	struct checkpoint_writer *writer;
+	struct checkpoint_header *header;
+	char tmp_filename[FILENAME_MAX];
+	size_t plane_size;
+
+	writer = arg;
+	header = &writer->header;
+	plane_size = (size_t)header->width * header->height *
+		sizeof(*writer->snapshot);
+	writer->ret = -1;
+
+	if (snprintf(tmp_filename, FILENAME_MAX, "%s.tmp",
+				writer->filename) >= FILENAME_MAX)
+		goto out_no_open;
+
+	fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		goto out_no_open;
+
+	/* the planes are placed by offset, the gaps are left as holes */
+	if (ftruncate(fd, header->plane_offset + header->n_channels *
+				header->plane_stride) != 0)
+		goto out_write_err;
+	if (write_all(fd, header, sizeof(*header)) != 0)
+		goto out_write_err;
+
+	for (c = 0; c < header->n_channels; c++) {
+		if (lseek(fd, header->plane_offset + c *
+					header->plane_stride, SEEK_SET) == -1)
+			goto out_write_err;
+		if (write_all(fd, (char *)writer->snapshot + c *
+					plane_size, plane_size) != 0)
+			goto out_write_err;
+	}
+
+	if (fsync(fd) != 0)
+		goto out_write_err;
+	if (close(fd) != 0)
+		goto out_no_close;
+	if (rename(tmp_filename, writer->filename) != 0)
+		goto out_no_close;
+
+	writer->ret = 0;
+	return NULL;
+
+out_write_err:
+	close(fd);
+out_no_close:
+	remove(tmp_filename);
+out_no_open:
+	fprintf(stderr, "checkpoint: could not write %s\n",
+			writer->filename);
+	fflush(stderr);
+	return NULL;
+}
+
+/*
+ * map a checkpoint, check that it belongs to this width x height x
+ * n_channels job with the given input and psf hashes, and copy its
+ * planes out
+ *
+ * returns 0 on success, 1 if filename does not exist, anything else if
+ * it is not a usable checkpoint
+ */
+int checkpoint_read(char *filename, float **planes, int width, int
+		height, int n_channels, uint64_t input_hash, uint64_t
+		psf_hash, int *iteration)
+{
+	int c, fd, ret;
+	size_t plane_size;
+	struct stat st;
+	char *map;
+	struct checkpoint_header *header;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 1 : -1;
+
+	ret = -1;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header))
+		goto out_bad_file;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out_bad_file;
+
+	header = (struct checkpoint_header *)map;
+	if (memcmp(header->magic, CHECKPOINT_MAGIC,
+				sizeof(header->magic)) != 0 ||
+			header->version != CHECKPOINT_VERSION ||
+			header->endian_check != ENDIAN_CHECK) {
+		fprintf(stderr, "checkpoint_read: %s is not a checkpoint\n",
+				filename);
+		goto out_mismatch;
+	}
+
+	if (header->width != width || header->height != height ||
+			header->n_channels != n_channels) {
+		fprintf(stderr, "checkpoint_read: %s has the wrong dimensions\n",
+				filename);
+		goto out_mismatch;
+	}
+
+	if (header->input_hash != input_hash || header->psf_hash !=
+			psf_hash) {
+		fprintf(stderr, "checkpoint_read: %s is for a different input or psf\n",
+				filename);
+		goto out_mismatch;
+	}
+
+	/* every plane within the file (in this order, so nothing the
+	 * file says can overflow) */
+	plane_size = (size_t)width * height * sizeof(*planes[0]);
+	if (header->plane_stride < plane_size || header->plane_offset >
+			(uint64_t)st.st_size || ((uint64_t)st.st_size -
+				header->plane_offset) / n_channels <
+			header->plane_stride) {
+		fprintf(stderr, "checkpoint_read: %s is truncated\n",
+				filename);
+		goto out_mismatch;
+	}
+
+	for (c = 0; c < n_channels; c++) {
+		memcpy(planes[c], map + header->plane_offset + c *
+				header->plane_stride, plane_size);
+	}
+
+	*iteration = header->iteration;
+	ret = 0;
+
+out_mismatch:
+	fflush(stderr);
+	munmap(map, st.st_size);
+out_bad_file:
+	close(fd);
+	return ret;
+}
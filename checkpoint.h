@@ -0,0 +1,65 @@
+/*
+ * Checkpoints of a running deconvolution
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define CHECKPOINT_MAGIC "RLCKPT1"
+#define CHECKPOINT_VERSION 2
+/* planes start on page boundaries so the file can be mmapped directly */
+#define CHECKPOINT_ALIGN 4096
+
+/*
+ * on-disk header, followed by n_channels planes of width * height
+ * native-endian floats at plane_offset + c * plane_stride
+ */
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian_check;
+	int32_t width;
+	int32_t height;
+	int32_t n_channels;
+	int32_t iteration;
+	uint64_t input_hash;
+	uint64_t psf_hash;
+	uint64_t plane_offset;
+	uint64_t plane_stride;
+};
+
+/* writes checkpoints on a background thread */
+struct checkpoint_writer {
+	pthread_t thread;
+	int busy;
+	int ret;
+	char *filename;
+	struct checkpoint_header header;
+	float *snapshot;
+};
+
+uint64_t checkpoint_hash(const void *data, size_t size);
+
+int checkpoint_writer_init(struct checkpoint_writer *writer, char
+		*filename, int width, int height, int n_channels);
+int checkpoint_write_async(struct checkpoint_writer *writer, float
+		**planes, int iteration, uint64_t input_hash, uint64_t
+		psf_hash);
+int checkpoint_writer_wait(struct checkpoint_writer *writer);
+void checkpoint_writer_cleanup(struct checkpoint_writer *writer);
+
+int checkpoint_read(char *filename, float **planes, int width, int
+		height, int n_channels, uint64_t input_hash, uint64_t
+		psf_hash, int *iteration);
+
+#endif /* !_CHECKPOINT_H_ */
@@ -0,0 +1,557 @@
+/*
+ * Conversion between interleaved integer pixels and float planes
+ *
+ * the loops run over bands of rows on a thread pool, with SSSE3 paths
+ * for RGB (8 pixels at a time) where available and plain loops
+ * otherwise; strided caller buffers (struct deconvolute_buffer) of
+ * 16-bit or float samples are converted the same way
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#include "thread_pool.h"
+#include "convert.h"
+
+/* bands per thread, so uneven bands even out */
+#define BANDS_PER_THREAD 4
+
+/* 8x8 ordered (Bayer) dither thresholds, in 64ths of an LSB */
+static const float bayer[8][8] = {
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+/* arguments of a conversion, shared by all bands */
+struct conversion {
+	uint16_t *packed;
+	float **planes;
+	int n_channels;
+	int width, height;
+	int n_bands;
+	int dither;
+
+	/* a strided buffer instead of packed, read from x, y on, and the
+	 * floats between rows of the planes */
+	struct deconvolute_buffer *buffer;
+	int x, y;
+	size_t plane_stride;
+};
+
+/* rows [*first, *last) of band i */
+static void band_rows(struct conversion *conv, int i, int *first, int
+		*last)
+{
+	*first = (long)conv->height * i / conv->n_bands;
+	*last = (long)conv->height * (i + 1) / conv->n_bands;
+}
+
+/* run task over bands of conv on pool */
+static void run_bands(struct thread_pool *pool, struct conversion *conv,
+		void (*task)(void *arg, int i))
+{
+	conv->n_bands = BANDS_PER_THREAD * thread_pool_size(pool);
+	if (conv->n_bands > conv->height)
+		conv->n_bands = conv->height;
+
+	thread_pool_run(pool, conv->n_bands, task, conv);
+}
+
+/* quantize one sample in [0, 1] (NaN counts as 0) with an offset */
+static uint16_t quantize(float v, float offset)
+{
+	if (!(v > 0))
+		v = 0;
+	else if (v > 1)
+		v = 1;
+
+	v = v * UINT16_MAX + offset;
+	if (v < 0)
+		v = 0;
+	else if (v > UINT16_MAX)
+		v = UINT16_MAX;
+
+	return lrintf(v);
+}
+
+#ifdef __SSSE3__
+/*
+ * pshufb masks gathering channel c of 8 RGB pixels from vector v,
+ * indexed [c][v]
+ */
+static const int8_t deinterleave_mask[3][3][16] = {
+	{
+		{0, 1, 6, 7, 12, 13, -128, -128, -128, -128, -128, -128,
+			-128, -128, -128, -128},
+		{-128, -128, -128, -128, -128, -128, 2, 3, 8, 9, 14, 15,
+			-128, -128, -128, -128},
+		{-128, -128, -128, -128, -128, -128, -128, -128, -128,
+			-128, -128, -128, 4, 5, 10, 11},
+	}, {
+		{2, 3, 8, 9, 14, 15, -128, -128, -128, -128, -128, -128,
+			-128, -128, -128, -128},
+		{-128, -128, -128, -128, -128, -128, 4, 5, 10, 11, -128,
+			-128, -128, -128, -128, -128},
+		{-128, -128, -128, -128, -128, -128, -128, -128, -128,
+			-128, 0, 1, 6, 7, 12, 13},
+	}, {
+		{4, 5, 10, 11, -128, -128, -128, -128, -128, -128, -128,
+			-128, -128, -128, -128, -128},
+		{-128, -128, -128, -128, 0, 1, 6, 7, 12, 13, -128, -128,
+			-128, -128, -128, -128},
+		{-128, -128, -128, -128, -128, -128, -128, -128, -128,
+			-128, 2, 3, 8, 9, 14, 15},
+	},
+};
+
+/*
+ * pshufb masks placing channel c of 8 pixels into RGB vector v,
+ * indexed [v][c]
+ */
+static const int8_t interleave_mask[3][3][16] = {
+	{
+		{0, 1, -128, -128, -128, -128, 2, 3, -128, -128, -128,
+			-128, 4, 5, -128, -128},
+		{-128, -128, 0, 1, -128, -128, -128, -128, 2, 3, -128,
+			-128, -128, -128, 4, 5},
+		{-128, -128, -128, -128, 0, 1, -128, -128, -128, -128, 2,
+			3, -128, -128, -128, -128},
+	}, {
+		{-128, -128, 6, 7, -128, -128, -128, -128, 8, 9, -128,
+			-128, -128, -128, 10, 11},
+		{-128, -128, -128, -128, 6, 7, -128, -128, -128, -128, 8,
+			9, -128, -128, -128, -128},
+		{4, 5, -128, -128, -128, -128, 6, 7, -128, -128, -128,
+			-128, 8, 9, -128, -128},
+	}, {
+		{-128, -128, -128, -128, 12, 13, -128, -128, -128, -128,
+			14, 15, -128, -128, -128, -128},
+		{10, 11, -128, -128, -128, -128, 12, 13, -128, -128,
+			-128, -128, 14, 15, -128, -128},
+		{-128, -128, 10, 11, -128, -128, -128, -128, 12, 13, -128,
+			-128, -128, -128, 14, 15},
+	},
+};
+
+static __m128i load_mask(const int8_t *mask)
+{
+	return _mm_loadu_si128((const __m128i *)mask);
+}
+
+/* 8 RGB pixels to 8 floats per channel, returns pixels done */
+static int deinterleave_rgb(uint16_t *in, float **out, int n)
+{
+	int x, c;
+	__m128i v[3], lanes, zero;
+	__m128 scale;
+
+	zero = _mm_setzero_si128();
+	scale = _mm_set1_ps(1.0f / UINT16_MAX);
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		v[0] = _mm_loadu_si128((__m128i *)(in + 3 * x));
+		v[1] = _mm_loadu_si128((__m128i *)(in + 3 * x + 8));
+		v[2] = _mm_loadu_si128((__m128i *)(in + 3 * x + 16));
+
+		for (c = 0; c < 3; c++) {
+			lanes = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(v[0], load_mask(
+						deinterleave_mask[c][0])),
+					_mm_shuffle_epi8(v[1], load_mask(
+						deinterleave_mask[c][1]))),
+					_mm_shuffle_epi8(v[2], load_mask(
+						deinterleave_mask[c][2])));
+
+			_mm_storeu_ps(out[c] + x, _mm_mul_ps(scale,
+					_mm_cvtepi32_ps(
+						_mm_unpacklo_epi16(lanes,
+							zero))));
+			_mm_storeu_ps(out[c] + x + 4, _mm_mul_ps(scale,
+					_mm_cvtepi32_ps(
+						_mm_unpackhi_epi16(lanes,
+							zero))));
+		}
+	}
+
+	return x;
+}
+
+/*
+ * 8 floats per channel to 8 RGB pixels, clamped, scaled, offset by
+ * dither thresholds and rounded; returns pixels done
+ */
+static int interleave_rgb(float **in, uint16_t *out, int n, const float
+		*dither)
+{
+	int x, c;
+	__m128i lanes[3], v, bias;
+	__m128 zero, one, scale, offset[2], lo, hi;
+
+	zero = _mm_setzero_ps();
+	one = _mm_set1_ps(1);
+	scale = _mm_set1_ps(UINT16_MAX);
+	offset[0] = _mm_loadu_ps(dither);
+	offset[1] = _mm_loadu_ps(dither + 4);
+	bias = _mm_set1_epi32(0x8000);
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		for (c = 0; c < 3; c++) {
+			/* max first, so NaN becomes 0 */
+			lo = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in[c] + x),
+						zero), one);
+			hi = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in[c] + x
+							+ 4), zero), one);
+			lo = _mm_add_ps(_mm_mul_ps(lo, scale), offset[0]);
+			hi = _mm_add_ps(_mm_mul_ps(hi, scale), offset[1]);
+
+			/* signed saturating pack of value - 0x8000, then
+			 * flip the sign bit back */
+			lanes[c] = _mm_xor_si128(_mm_packs_epi32(
+					_mm_sub_epi32(_mm_cvtps_epi32(lo),
+						bias),
+					_mm_sub_epi32(_mm_cvtps_epi32(hi),
+						bias)),
+					_mm_set1_epi16(-0x8000));
+		}
+
+		for (c = 0; c < 3; c++) {
+			v = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(lanes[0], load_mask(
+						interleave_mask[c][0])),
+					_mm_shuffle_epi8(lanes[1], load_mask(
+						interleave_mask[c][1]))),
+					_mm_shuffle_epi8(lanes[2], load_mask(
+						interleave_mask[c][2])));
+			_mm_storeu_si128((__m128i *)(out + 3 * x + 8 * c),
+					v);
+		}
+	}
+
+	return x;
+}
+#endif /* __SSSE3__ */
+
+/* sample s of pixel x, y of buffer */
+static char *buffer_sample(struct deconvolute_buffer *buffer, int x, int
+		y, int s)
+{
+	return (char *)buffer->data + (size_t)y * buffer->row_stride +
+		(size_t)x * buffer->pixel_stride + (size_t)s *
+		buffer->sample_stride;
+}
+
+#ifdef __SSSE3__
+/* nonzero if the rows of buffer are packed 16-bit RGB pixels */
+static int packed_rgb(struct deconvolute_buffer *buffer)
+{
+	return buffer->type == DECONVOLUTE_U16 && buffer->n_samples == 3 &&
+		buffer->pixel_stride == 3 * sizeof(uint16_t) &&
+		buffer->sample_stride == sizeof(uint16_t);
+}
+#endif
+
+/* task converting band i of a struct conversion to floats */
+static void u16_to_float_band(void *arg, int i)
+{
+	int x, y, c, first, last, done;
+	struct conversion *conv;
+	uint16_t *in;
+	size_t offset;
+#ifdef __SSSE3__
+	float *out[3];
+#endif
+
+	conv = arg;
+	band_rows(conv, i, &first, &last);
+
+	for (y = first; y < last; y++) {
+		offset = (size_t)y * conv->width;
+		in = conv->packed + conv->n_channels * offset;
+		done = 0;
+
+#ifdef __SSSE3__
+		if (conv->n_channels == 3) {
+			for (c = 0; c < 3; c++) {
+				out[c] = conv->planes[c] + offset;
+			}
+			done = deinterleave_rgb(in, out, conv->width);
+		}
+#endif
+
+		for (x = done; x < conv->width; x++) {
+			for (c = 0; c < conv->n_channels; c++) {
+				conv->planes[c][offset + x] = (float)in[
+					conv->n_channels * x + c] /
+					UINT16_MAX;
+			}
+		}
+	}
+}
+
+/* task converting band i of a struct conversion to 16-bit */
+static void float_to_u16_band(void *arg, int i)
+{
+	int x, y, c, first, last, done;
+	struct conversion *conv;
+	uint16_t *out;
+	float dither[8];
+	size_t offset;
+#ifdef __SSSE3__
+	float *in[3];
+#endif
+
+	conv = arg;
+	band_rows(conv, i, &first, &last);
+
+	for (y = first; y < last; y++) {
+		offset = (size_t)y * conv->width;
+		out = conv->packed + conv->n_channels * offset;
+		done = 0;
+
+		for (x = 0; x < 8; x++) {
+			dither[x] = conv->dither ? (bayer[y % 8][x] + 0.5f)
+				/ 64 - 0.5f : 0;
+		}
+
+#ifdef __SSSE3__
+		if (conv->n_channels == 3) {
+			for (c = 0; c < 3; c++) {
+				in[c] = conv->planes[c] + offset;
+			}
+			done = interleave_rgb(in, out, conv->width, dither);
+		}
+#endif
+
+		for (x = done; x < conv->width; x++) {
+			for (c = 0; c < conv->n_channels; c++) {
+				out[conv->n_channels * x + c] = quantize(
+						conv->planes[c][offset + x],
+						dither[x % 8]);
+			}
+		}
+	}
+}
+
+/*
+ * convert interleaved 16-bit pixels (n_channels per pixel) to float
+ * planes in [0, 1], on pool (may be NULL)
+ */
+void convert_u16_to_float(struct thread_pool *pool, uint16_t *in, float
+		**out, int n_channels, int width, int height)
+{
+	struct conversion conv;
+
+	conv.packed = in;
+	conv.planes = out;
+	conv.n_channels = n_channels;
+	conv.width = width;
+	conv.height = height;
+	conv.dither = 0;
+
+	run_bands(pool, &conv, u16_to_float_band);
+}
+
+/*
+ * convert float planes to interleaved 16-bit pixels (n_channels per
+ * pixel), clamping to [0, 1] and rounding to nearest, or with an 8x8
+ * ordered dither if dither is nonzero, on pool (may be NULL)
+ */
+void convert_float_to_u16(struct thread_pool *pool, float **in, uint16_t
+		*out, int n_channels, int width, int height, int dither)
+{
+	struct conversion conv;
+
+	conv.packed = out;
+	conv.planes = in;
+	conv.n_channels = n_channels;
+	conv.width = width;
+	conv.height = height;
+	conv.dither = dither;
+
+	run_bands(pool, &conv, float_to_u16_band);
+}
+
+/*
+ * one float sample to 16 bits as convert_float_to_u16 does without
+ * dither: clamped to [0, 1] (NaN to 0) and rounded to nearest
+ */
+uint16_t convert_float_sample_to_u16(float v)
+{
+	return quantize(v, 0);
+}
+
+/* task converting band i of a strided struct conversion to floats */
+static void buffer_to_float_band(void *arg, int i)
+{
+	int x, y, c, first, last, done;
+	struct conversion *conv;
+	struct deconvolute_buffer *buffer;
+	char *in;
+	float *out;
+#ifdef __SSSE3__
+	float *planes[3];
+#endif
+
+	conv = arg;
+	buffer = conv->buffer;
+	band_rows(conv, i, &first, &last);
+
+	for (y = first; y < last; y++) {
+		done = 0;
+
+#ifdef __SSSE3__
+		if (packed_rgb(buffer)) {
+			for (c = 0; c < 3; c++) {
+				planes[c] = conv->planes[c] + y *
+					conv->plane_stride;
+			}
+			done = deinterleave_rgb((uint16_t *)buffer_sample(
+						buffer, conv->x, conv->y +
+						y, 0), planes, conv->width);
+		}
+#endif
+
+		for (c = 0; c < conv->n_channels; c++) {
+			in = buffer_sample(buffer, conv->x, conv->y + y, c);
+			out = conv->planes[c] + y * conv->plane_stride;
+
+			if (buffer->type == DECONVOLUTE_FLOAT) {
+				for (x = done; x < conv->width; x++) {
+					out[x] = *(float *)(in + (size_t)x *
+							buffer->pixel_stride);
+				}
+			} else {
+				for (x = done; x < conv->width; x++) {
+					out[x] = (float)*(uint16_t *)(in +
+							(size_t)x *
+							buffer->pixel_stride)
+						/ UINT16_MAX;
+				}
+			}
+		}
+	}
+}
+
+/* task converting band i of floats to a strided struct conversion */
+static void float_to_buffer_band(void *arg, int i)
+{
+	int x, y, c, first, last, done;
+	struct conversion *conv;
+	struct deconvolute_buffer *buffer;
+	char *out;
+	float *in;
+	float dither[8];
+#ifdef __SSSE3__
+	float *planes[3];
+#endif
+
+	conv = arg;
+	buffer = conv->buffer;
+	band_rows(conv, i, &first, &last);
+
+	for (y = first; y < last; y++) {
+		done = 0;
+
+		for (x = 0; x < 8; x++) {
+			dither[x] = conv->dither ? (bayer[y % 8][x] + 0.5f)
+				/ 64 - 0.5f : 0;
+		}
+
+#ifdef __SSSE3__
+		if (packed_rgb(buffer)) {
+			for (c = 0; c < 3; c++) {
+				planes[c] = conv->planes[c] + y *
+					conv->plane_stride;
+			}
+			done = interleave_rgb(planes, (uint16_t *)
+					buffer_sample(buffer, 0, y, 0),
+					conv->width, dither);
+		}
+#endif
+
+		for (c = 0; c < conv->n_channels; c++) {
+			in = conv->planes[c] + y * conv->plane_stride;
+			out = buffer_sample(buffer, 0, y, c);
+
+			if (buffer->type == DECONVOLUTE_FLOAT) {
+				for (x = done; x < conv->width; x++) {
+					*(float *)(out + (size_t)x *
+							buffer->pixel_stride)
+						= in[x];
+				}
+			} else {
+				for (x = done; x < conv->width; x++) {
+					*(uint16_t *)(out + (size_t)x *
+							buffer->pixel_stride)
+						= quantize(in[x],
+								dither[x %
+								8]);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * convert the width x height pixels at x, y of a strided buffer to
+ * float planes of that size, 16-bit samples scaled to [0, 1] and float
+ * ones as they are, on pool (may be NULL)
+ */
+void convert_buffer_to_float(struct thread_pool *pool, struct
+		deconvolute_buffer *in, int x, int y, float **out, int width,
+		int height)
+{
+	struct conversion conv;
+
+	conv.buffer = in;
+	conv.x = x;
+	conv.y = y;
+	conv.planes = out;
+	conv.plane_stride = width;
+	conv.n_channels = in->n_samples;
+	conv.width = width;
+	conv.height = height;
+	conv.dither = 0;
+
+	run_bands(pool, &conv, buffer_to_float_band);
+}
+
+/*
+ * convert float planes, with rows in_stride floats apart, to a strided
+ * buffer of their size: 16-bit samples as convert_float_to_u16 does
+ * (with its dither if dither is nonzero), float ones as they are, on
+ * pool (may be NULL)
+ */
+void convert_float_to_buffer(struct thread_pool *pool, float **in,
+		size_t in_stride, struct deconvolute_buffer *out, int
+		dither)
+{
+	struct conversion conv;
+
+	conv.buffer = out;
+	conv.x = 0;
+	conv.y = 0;
+	conv.planes = in;
+	conv.plane_stride = in_stride;
+	conv.n_channels = out->n_samples;
+	conv.width = out->width;
+	conv.height = out->height;
+	conv.dither = dither;
+
+	run_bands(pool, &conv, float_to_buffer_band);
+}
@@ -0,0 +1,30 @@
+/*
+ * Conversion between interleaved integer pixels and float planes
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stdint.h>
+#include "thread_pool.h"
+#include "deconvolute.h"
+
+void convert_u16_to_float(struct thread_pool *pool, uint16_t *in, float
+		**out, int n_channels, int width, int height);
+void convert_float_to_u16(struct thread_pool *pool, float **in, uint16_t
+		*out, int n_channels, int width, int height, int dither);
+uint16_t convert_float_sample_to_u16(float v);
+void convert_buffer_to_float(struct thread_pool *pool, struct
+		deconvolute_buffer *in, int x, int y, float **out, int width,
+		int height);
+void convert_float_to_buffer(struct thread_pool *pool, float **in,
+		size_t in_stride, struct deconvolute_buffer *out, int
+		dither);
+
+#endif /* !_CONVERT_H_ */
@@ -0,0 +1,430 @@
+/*
+ * Long-running deconvolution server on a Unix domain socket
+ *
+ * jobs run one at a time in the server process, which keeps fftw
+ * plans, psf spectra and the opencl program warm between them (see
+ * deconvolute_keep_warm), so a job of a size seen before costs only
+ * its decode, passes and encode; connections waiting their turn queue
+ * in the listen backlog
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "deconvolute.h"
+#include "daemon.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+/* pending connections the kernel queues while a job runs */
+#define LISTEN_BACKLOG 64
+/* seconds a client may take to send its request (or stall a send) */
+#define CLIENT_TIMEOUT 10
+
+static int socket_address(struct sockaddr_un *address, char
+		*socket_path);
+static int remove_stale_socket(char *socket_path);
+static int connect_to(char *socket_path);
+static int run_job(int fd, char *request, int n_threads);
+static int report_pass(void *arg, int pass, int n_passes);
+static int send_line(int fd, char *line);
+static int read_line(int fd, char *buf, size_t size);
+static int absolute_path(char *buf, size_t size, char *filename);
+
+/*
+ * listen on socket_path (replacing a stale socket there) and run jobs
+ * on n_threads threads (<= 0 for those tuned for each size) until
+ * asked to quit, keeping n_warm sizes warm; only the server's user may
+ * connect, as jobs read and write files as that user
+ *
+ * returns 0 after a quit request, anything else on failure
+ */
+int daemon_serve(char *socket_path, int n_threads, int n_warm)
+{
+	int fd, client;
+	struct sockaddr_un address;
+	struct timeval timeout;
+	char request[DAEMON_MAX_LINE];
+	mode_t mask;
+
+	if (socket_address(&address, socket_path) != 0)
+		goto out_no_socket;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto out_no_socket;
+
+	if (remove_stale_socket(socket_path) != 0)
+		goto out_no_bind;
+
+	/* the socket is created 0600 */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		umask(mask);
+		goto out_no_bind;
+	}
+	umask(mask);
+	if (listen(fd, LISTEN_BACKLOG) != 0)
+		goto out_no_listen;
+
+	if (deconvolute_keep_warm(n_warm) != 0)
+		goto out_no_listen;
+
+	printf("Listening on %s\n", socket_path);
+	fflush(stdout);
+
+	for (;;) {
+		client = accept(fd, NULL, NULL);
+		if (client < 0)
+			continue;
+
+		/* a client that never finishes its request (or stops
+		 * reading its progress) cannot hold up the others */
+		timeout.tv_sec = CLIENT_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+				sizeof(timeout));
+
+		if (read_line(client, request, sizeof(request)) != 0) {
+			close(client);
+			continue;
+		}
+
+		if (strcmp(request, "quit") == 0) {
+			send_line(client, "bye\n");
+			close(client);
+			break;
+		}
+
+		run_job(client, request, n_threads);
+		close(client);
+	}
+
+	deconvolute_keep_warm(0);
+	close(fd);
+	unlink(socket_path);
+
+	return 0;
+
+out_no_listen:
+	unlink(socket_path);
+out_no_bind:
+	close(fd);
+out_no_socket:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * have the server on socket_path run a job, printing its progress
+ *
+ * returns 0 if the job succeeded, anything else otherwise
+ */
+int daemon_submit(char *socket_path, char *input_image_filename, char
+		*psf_image_filename, char *output_image_filename, int
+		n_iterations)
+{
+	int fd, ret, pass, n_passes;
+	char input[FILENAME_MAX], psf[FILENAME_MAX], output[FILENAME_MAX];
+	char line[DAEMON_MAX_LINE];
+
+	if (absolute_path(input, sizeof(input), input_image_filename) !=
+			0)
+		goto out_no_connection;
+	if (absolute_path(psf, sizeof(psf), psf_image_filename) != 0)
+		goto out_no_connection;
+	if (absolute_path(output, sizeof(output), output_image_filename)
+			!= 0)
+		goto out_no_connection;
+
+	fd = connect_to(socket_path);
+	if (fd < 0)
+		goto out_no_connection;
+
+	snprintf(line, sizeof(line), "job\t%d\t%s\t%s\t%s\n",
+			n_iterations, input, psf, output);
+	if (send_line(fd, line) != 0)
+		goto out_err;
+
+	ret = -1;
+	while (read_line(fd, line, sizeof(line)) == 0) {
+		if (sscanf(line, "pass %d %d", &pass, &n_passes) == 2) {
+			printf("Pass %d/%d\n", pass, n_passes);
+			fflush(stdout);
+		} else if (sscanf(line, "done %d", &ret) == 1) {
+			break;
+		}
+	}
+
+	close(fd);
+	return ret;
+
+out_err:
+	close(fd);
+out_no_connection:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * ask the server on socket_path to quit once its current job is done
+ *
+ * returns 0 on success, anything else otherwise
+ */
+int daemon_stop(char *socket_path)
+{
+	int fd, ret;
+	char line[DAEMON_MAX_LINE];
+
+	fd = connect_to(socket_path);
+	if (fd < 0)
+		goto out_err;
+
+	ret = send_line(fd, "quit\n");
+	if (ret == 0)
+		ret = read_line(fd, line, sizeof(line));
+	close(fd);
+	if (ret != 0)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * fill in the address of socket_path
+ *
+ * returns 0 on success, anything else if the path is too long
+ */
+static int socket_address(struct sockaddr_un *address, char
+		*socket_path)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+
+	if (strlen(socket_path) >= sizeof(address->sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n",
+				socket_path);
+		fflush(stderr);
+		return -1;
+	}
+	strcpy(address->sun_path, socket_path);
+
+	return 0;
+}
+
+/*
+ * remove a socket left at socket_path by a server that is gone, but not
+ * a live server's socket or anything that is not a socket
+ *
+ * returns 0 if the path is free, anything else otherwise
+ */
+static int remove_stale_socket(char *socket_path)
+{
+	struct stat st;
+	struct sockaddr_un address;
+	int fd, live;
+
+	if (lstat(socket_path, &st) != 0)
+		return errno == ENOENT ? 0 : -1;
+
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s exists and is not a socket\n",
+				socket_path);
+		fflush(stderr);
+		return -1;
+	}
+
+	if (socket_address(&address, socket_path) != 0)
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	live = connect(fd, (struct sockaddr *)&address, sizeof(address)) ==
+		0 || errno != ECONNREFUSED;
+	close(fd);
+
+	if (live) {
+		fprintf(stderr, "a server is already listening on %s\n",
+				socket_path);
+		fflush(stderr);
+		return -1;
+	}
+
+	return unlink(socket_path);
+}
+
+/*
+ * connect to the server on socket_path
+ *
+ * returns the connected socket, or -1 on failure
+ */
+static int connect_to(char *socket_path)
+{
+	int fd;
+	struct sockaddr_un address;
+
+	if (socket_address(&address, socket_path) != 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) !=
+			0) {
+		fprintf(stderr, "could not connect to %s\n", socket_path);
+		fflush(stderr);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * run the job in request, streaming its progress and result to fd
+ *
+ * returns the job's result
+ */
+static int run_job(int fd, char *request, int n_threads)
+{
+	int ret, n_iterations;
+	char *fields[5], *next;
+	char line[64];
+	int i;
+	struct deconvolute_options options;
+
+	next = request;
+	for (i = 0; i < 5; i++) {
+		fields[i] = next;
+		next = strchr(next, '\t');
+		if (next == NULL)
+			break;
+		*next++ = '\0';
+	}
+
+	ret = -1;
+	if (i != 4 || strcmp(fields[0], "job") != 0) {
+		fprintf(stderr, "daemon: bad request\n");
+		fflush(stderr);
+		goto out;
+	}
+	n_iterations = atoi(fields[1]);
+
+	printf("Job %s -> %s (%d passes)\n", fields[2], fields[4],
+			n_iterations);
+	fflush(stdout);
+
+	deconvolute_default_options(&options);
+	options.progress = report_pass;
+	options.progress_arg = &fd;
+
+	ret = deconvolute_image_with_options(fields[2], fields[3],
+			fields[4], n_iterations, n_threads, &options);
+
+out:
+	snprintf(line, sizeof(line), "done %d\n", ret);
+	send_line(fd, line);
+
+	return ret;
+}
+
+/*
+ * progress callback: tell the client (its socket in *arg) the pass
+ *
+ * returns nonzero, cancelling the job, if the client went away
+ */
+static int report_pass(void *arg, int pass, int n_passes)
+{
+	char line[64];
+
+	snprintf(line, sizeof(line), "pass %d %d\n", pass, n_passes);
+	return send_line(*(int *)arg, line);
+}
+
+/*
+ * send all of line; a client that went away is not worth a SIGPIPE
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int send_line(int fd, char *line)
+{
+	size_t done, size;
+	ssize_t n;
+
+	size = strlen(line);
+	for (done = 0; done < size; done += n) {
+		n = send(fd, line + done, size - done, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * read a line (without its newline) of at most size - 1 bytes
+ *
+ * returns 0 on success, anything else on end of file, error or a line
+ * too long
+ */
+static int read_line(int fd, char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < size; i++) {
+		if (read(fd, &buf[i], 1) != 1)
+			return -1;
+
+		if (buf[i] == '\n') {
+			buf[i] = '\0';
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * filename relative to the current directory made absolute, so the
+ * server finds it
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int absolute_path(char *buf, size_t size, char *filename)
+{
+	size_t n;
+
+	if (filename[0] == '/') {
+		n = snprintf(buf, size, "%s", filename);
+		return n < size ? 0 : -1;
+	}
+
+	if (getcwd(buf, size) == NULL)
+		return -1;
+
+	n = strlen(buf);
+	n += snprintf(buf + n, size - n, "/%s", filename);
+	return n < size ? 0 : -1;
+}
@@ -0,0 +1,34 @@
+/*
+ * Long-running deconvolution server on a Unix domain socket
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stdio.h>
+
+/*
+ * the protocol is one request line per connection:
+ *
+ *   job<TAB>iterations<TAB>input<TAB>psf<TAB>output
+ *   quit
+ *
+ * (absolute paths, as the server resolves them from its own directory)
+ * answered by a "pass N TOTAL\n" line after each pass and a final
+ * "done RET\n" (RET 0 on success), or "bye\n" to quit
+ */
+#define DAEMON_MAX_LINE (3 * FILENAME_MAX + 64)
+
+int daemon_serve(char *socket_path, int n_threads, int n_warm);
+int daemon_submit(char *socket_path, char *input_image_filename, char
+		*psf_image_filename, char *output_image_filename, int
+		n_iterations);
+int daemon_stop(char *socket_path);
+
+#endif /* !_DAEMON_H_ */
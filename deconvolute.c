@@ -8,36 +8,208 @@
  * published by the Free Software Foundation.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include <fftw3.h>
 #include <CL/opencl.h>
+#include "deconvolute.h"
 #include "tiff_goodness.h"
 #include "opencl_utils.h"
+#include "checkpoint.h"
+#include "preview.h"
+#include "thread_pool.h"
+#include "convert.h"
+#include "float_image.h"
+#include "psf_grid.h"
+#include "multires.h"
+#include "warm_cache.h"
+#include "numa.h"
+#include "autotune.h"
+#include "arena.h"
+#include "multiframe.h"
+/* arithmetic.cl as the string arithmetic_cl, generated by make */
+#include "arithmetic_cl.h"
 
 #define say_function_failed() \
 	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
 
+/*
+ * relative tolerance (w.r.t. the brightest psf pixel) under which the
+ * psf is taken to be point-symmetric about its centre, in which case
+ * its spectrum is real
+ */
+#define PSF_SYMMETRY_TOLERANCE 1e-4f
+
+/* pixels per task of the cpu backend's pointwise arithmetic */
+#define POINTWISE_BAND 65536
+
+/* least wiener start pixel, as a share of the input's mean */
+#define WIENER_START_FLOOR 1e-3f
+
+/*
+ * halo around a region of interest, in psf sizes on each side: each
+ * pass reaches about one psf further, so the region's own (periodic or
+ * reflected) edges still creep into the roi after a few passes, but
+ * faintly; the roi only approximates a run on the whole image
+ */
+#define ROI_HALO_SUPPORTS 2
+
+/* least alignment of every plane (a cache line, enough for any simd
+ * load) */
+#define PLANE_ALIGNMENT 64
+/* least alignment of planes shared with a unified memory device */
+#define SHARED_PLANE_ALIGNMENT 4096
+/* shared buffer sizes are padded to a multiple of this */
+#define SHARED_PLANE_GRANULE 64
+/* input, current, two scratch, two more estimate sets and three
+ * complex planes of real and imaginary parts per channel */
+#define SHARED_PLANES_MAX (DECONVOLUTE_MAX_CHANNELS * 12)
+
+/* transform side, runs and copy size of the planning benchmarks */
+#define CALIBRATION_SIZE 256
+#define CALIBRATION_RUNS 8
+#define CALIBRATION_BYTES (16 * 1024 * 1024)
+
 /********************************/
 /* STATIC VARS, PROTOTYPES, ETC */
 /********************************/
 
 static int width, height;
+static int psf_width, psf_height;
+
+/*
+ * samples per input pixel, of which the first n_channels are
+ * deconvoluted and the n_extra after them (alpha etc) passed through;
+ * and samples per psf pixel (1 for one psf shared by all channels)
+ */
+static int n_samples, n_extra, n_channels;
+static int psf_samples;
 static uint16_t *original_input_image;
 static uint8_t *original_psf_image;
 
+/* float inputs (and psfs) are mapped and used in place instead */
+static struct float_image input_map, psf_map;
+
+/*
+ * the caller's images of a deconvolute_image_buffers job, standing in
+ * for the files whose names are these (see image_buffer): the input is
+ * converted straight into input_image, the psf into psf_map.data (with
+ * no map) and the output out of the planes
+ */
+static struct deconvolute_buffer *input_buffer, *psf_buffer,
+		*output_buffer;
+static char input_buffer_name[] = "input buffer";
+static char psf_buffer_name[] = "psf buffer";
+static char output_buffer_name[] = "output buffer";
+
 /* real images */
-static float *input_image[3];
-static float *current_image[3];
-static float *psf_image[3];
-static float *image_a[3];
-static float *image_b[3];
+static float *input_image[DECONVOLUTE_MAX_CHANNELS];
+static float *current_image[DECONVOLUTE_MAX_CHANNELS];
+static float *psf_image[DECONVOLUTE_MAX_CHANNELS];
+static float *image_a[DECONVOLUTE_MAX_CHANNELS];
+static float *image_b[DECONVOLUTE_MAX_CHANNELS];
+
+/*
+ * when previews are written, the estimate rotates through three buffer
+ * sets: current_set (current_image), next_set (written by the next
+ * pass) and at most one loaned_set borrowed by the preview writer, so
+ * a snapshot costs a pointer swap and the passes never wait on disk;
+ * kernels get a copy of a loaned plane, never the plane itself
+ */
+static float *estimate_sets[3][DECONVOLUTE_MAX_CHANNELS];
+static int current_set, next_set, loaned_set;
+static int rotate_estimate;
 
 /* complex images */
-static float *cimage_a[3][2];
-static float *cimage_b[3][2];
-static float *cimage_psf[3][2];
+static float *cimage_a[DECONVOLUTE_MAX_CHANNELS][2];
+static float *cimage_b[DECONVOLUTE_MAX_CHANNELS][2];
+static float *cimage_psf[DECONVOLUTE_MAX_CHANNELS][2];
+
+/*
+ * nonzero if the psf is centro-symmetric: its spectrum is then real,
+ * cimage_psf[c][1] is never allocated, and convolving with psf(x) or
+ * psf(-x) is the same operation
+ */
+static int psf_symmetric;
+
+/*
+ * nonzero to convolve by dct instead of fft (see dct): reflective
+ * edges at the image size, with no padding and no complex images, for
+ * a psf symmetric about both axes; cimage_psf[c][0] then holds the
+ * real width x height dct spectrum of the psf, and fft_forward_plan
+ * and fft_backward_plan the dct pair
+ */
+static int use_dct;
+
+/*
+ * psf grid (psf_grid_x x psf_grid_y mosaic) of a spatially varying
+ * psf, which replaces the whole image transforms and cimage_* when
+ * use_grid is nonzero; also used, as a 1 x 1 grid, when use_opencl is
+ * zero and the pointwise arithmetic runs on the pool instead (unless
+ * use_dct, which needs no complex arithmetic)
+ */
+static int psf_grid_x, psf_grid_y;
+static int use_grid;
+
+/*
+ * nonzero in joint mode (deconvolute_frames_with_options): setup only
+ * reads the first frame and psf into input_image and current_image, as
+ * multiframe has its own planes, spectra and transforms; no psf grid,
+ * image_a or image_b is built
+ */
+static int frames_only;
+static int use_opencl;
+static struct psf_grid *psf_grid;
+
+/*
+ * with deconvolute_keep_warm, fftw plans (keyed by size and threads)
+ * and psf spectra (keyed by psf and size) are put in these caches at
+ * cleanup and taken back by later jobs, and the opencl program is
+ * kept, with the programs built for other sizes in program_cache;
+ * psf_ready is nonzero once cimage_psf holds the spectrum
+ */
+static int keeping_warm;
+static struct warm_cache *plan_cache;
+static struct warm_cache *psf_cache;
+static struct warm_cache *program_cache;
+static int psf_ready;
+static int fftw_threads_ready;
+static int fft_n_threads;
+/* planner flags of the job's transforms (options->fft_flags) */
+static unsigned fft_flags;
+
+struct warm_plans {
+	float *real;
+	fftwf_complex *complex;
+	fftwf_plan forward, backward;
+};
+
+struct warm_psf {
+	float *spectrum[DECONVOLUTE_MAX_CHANNELS][2];
+};
+
+/* threads for the pixel conversion loops */
+static struct thread_pool *pool;
+
+/*
+ * with options->numa, the pool's threads are pinned in contiguous
+ * blocks to the numa nodes (the main thread being thread 0), loops
+ * hand each thread the same block of rows every time, and the planes
+ * are first touched the same way, so each node's rows stay in its own
+ * memory; with HAVE_FFTW_THREADS_CALLBACK fftw's loops run on the
+ * pinned pool too, without it the main thread is not pinned, as fftw's
+ * own threads would inherit its node
+ */
+static int use_numa;
+static int numa_threads;
+static struct numa_topology topology;
 
 /* fftw vars */
 static fftwf_plan fft_forward_plan;
@@ -45,52 +217,291 @@ static fftwf_plan fft_backward_plan;
 static float *fft_real;
 static fftwf_complex *fft_complex;
 
-/* opencl vars */
+/* opencl vars; the program is built for vectors of program_width
+ * values */
 static size_t global_work_size[2];
+static int program_width;
 static cl_device_id device;
 static cl_context context;
 static cl_command_queue queue;
 static cl_program program;
-static cl_kernel mult_k[3];
-static cl_kernel complex_mult_k[3];
-static cl_kernel complex_conj_mult_k[3];
-static cl_kernel divide_k[3];
-/* wait (sync) events */
-static cl_event copy_events[3][3];
-static cl_event kernel_events[3];
+static cl_kernel mult_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel complex_mult_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel complex_conj_mult_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel real_complex_mult_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel complex_wiener_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel real_complex_wiener_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel real_wiener_k[DECONVOLUTE_MAX_CHANNELS];
+static cl_kernel divide_k[DECONVOLUTE_MAX_CHANNELS];
+/* wait (sync) events, released once waited for (see wait_kernels) */
+static cl_event kernel_events[DECONVOLUTE_MAX_CHANNELS];
 /* opencl memory buffers */
-static cl_mem k_input_image[3];
-static cl_mem k_image_a[3];
-static cl_mem k_image_b[3];
-static cl_mem k_image_c[3];
-static cl_mem k_cimage_a[3][2];
-static cl_mem k_cimage_b[3][2];
-static cl_mem k_cimage_psf[3][2];
+static cl_mem k_input_image[DECONVOLUTE_MAX_CHANNELS];
+static cl_mem k_image_a[DECONVOLUTE_MAX_CHANNELS];
+static cl_mem k_image_b[DECONVOLUTE_MAX_CHANNELS];
+static cl_mem k_image_c[DECONVOLUTE_MAX_CHANNELS];
+static cl_mem k_cimage_a[DECONVOLUTE_MAX_CHANNELS][2];
+static cl_mem k_cimage_b[DECONVOLUTE_MAX_CHANNELS][2];
+static cl_mem k_cimage_psf[DECONVOLUTE_MAX_CHANNELS][2];
+
+/*
+ * on a device sharing the host's memory (CL_DEVICE_HOST_UNIFIED_MEMORY,
+ * cpu runtimes and integrated gpus), the planes are allocated aligned
+ * and each is wrapped in a CL_MEM_USE_HOST_PTR buffer, so host and
+ * kernels use the same memory: a plane stays mapped while the host
+ * works on it and is unmapped (lent) while kernels use it, instead of
+ * being copied in and out.  the k_ buffers above are then only made
+ * (with CL_MEM_ALLOC_HOST_PTR) for a plane that could not be shared,
+ * e.g. a mapped float input
+ */
+struct shared_plane {
+	float *host;
+	size_t size;
+	cl_mem mem;
+	int mapped;
+};
+static int zero_copy;
+static size_t plane_alignment;
+static struct shared_plane shared_planes[SHARED_PLANES_MAX];
+static int n_shared_planes;
+
+/*
+ * the arena the planes of a job and the fft arrays are carved from
+ * (see reserve_arena), on huge pages where it can be; planes kept
+ * warm beyond the job are allocated on their own instead.  while
+ * keeping warm, the next job carves the same arena again
+ */
+static struct arena arena;
+
+/*
+ * seconds per point and log2 point of a transform, and per byte
+ * copied, measured once per process for planning (see calibrate)
+ */
+static int calibrated;
+static double fft_seconds, byte_seconds;
+
+/* sizes a job is planned from (see deconvolute_plan_job) */
+struct job_sizes {
+	int width, height, n_samples, n_extra;
+	int psf_width, psf_height, psf_samples;
+	int float_input;
+	/* the psf allows the dct (see psf_allows_dct) and the options
+	 * do not rule it out */
+	int dct;
+};
+
+/* a plane being first touched in bands on the pool (numa mode) */
+struct first_touch {
+	char *data;
+	size_t size;
+	int n_bands;
+};
+
+/* a parallel loop of fftw running on the pool (numa mode) */
+struct fftw_loop {
+	void *(*work)(char *);
+	char *jobdata;
+	size_t elsize;
+};
+
+/* a pointwise operation of the cpu backend running on the pool */
+struct pointwise {
+	float **a, **b, **out;
+	int divide;
+	/* if > 0, the wiener filter a * b / (a^2 + regularization) */
+	float regularization;
+	size_t n, n_bands;
+};
+
+/* a frame being decoded or encoded on its own thread (sequence mode) */
+struct frame_job {
+	pthread_t thread;
+	char filename[FILENAME_MAX];
+	int page;
+	uint16_t *data;
+	int width, height;
+	int n_samples, n_extra;
+	/* threads to (de)compress strips on, and output compression (a
+	 * TIFF_GOODNESS_*), tile size (0 for strips) and pyramid levels */
+	int n_threads;
+	int compression;
+	int tile_size, n_levels;
+	/* if region_width is nonzero, only the region_width x
+	 * region_height region at x, y is decoded */
+	int x, y, region_width, region_height;
+	int ret;
+};
+
+/*
+ * the part of the input a job works on: all of it, or with
+ * options->roi_width the roi grown by a halo to a size fftw transforms
+ * fast (see find_region), of which only the roi is written
+ */
+struct region {
+	int image_width, image_height;
+	int x, y, width, height;
+	/* the roi, relative to the region */
+	int roi_x, roi_y, roi_width, roi_height;
+	/* nonzero if the region is not the whole image */
+	int cropped;
+};
+static struct region region;
+
+/* input and psf being decoded while fftw plans and opencl builds */
+static struct frame_job input_job, psf_job;
+static int decoding_images, decoding_psf;
+
+/* output being encoded in the background (background_output) */
+static struct frame_job output_job;
+static int output_pending;
 
 /* functions */
-static int init_images(char *input_image_filename, char
+static int plan_job(char *input_image_filename, char
+		*psf_image_filename, int n_threads, struct
+		deconvolute_options *options);
+static int setup(char *input_image_filename, char *psf_image_filename,
+		int n_threads, struct deconvolute_options *options);
+static void cleanup();
+
+static int start_decode_images(char *input_image_filename, char
 		*psf_image_filename);
+static int finish_decode_images();
+static int finish_decode_psf();
+static void cancel_decode_images();
+static void *decode_psf(void *arg);
+static struct deconvolute_buffer *image_buffer(char *filename);
+static int check_buffer(struct deconvolute_buffer *buffer, char *name);
+static void release_psf_map();
+
+static int init_images();
 static void cleanup_init_images();
+static int init_psf_grid();
+static int load_psf_mosaic(float **mosaic);
+static void free_psf_mosaic(float **mosaic);
+static void load_input_image(uint16_t *data, int warm);
+static float psf_value(int c, int i);
+static uint64_t psf_data_hash();
+static int take_warm_psf();
+static void put_warm_psf();
+static void free_warm_psf(void *value);
 
 static int init_fftw(int n_threads);
+static int ready_fftw_threads();
 static void cleanup_init_fftw();
+static void free_warm_plans(void *value);
 
 static int init_opencl();
 static void cleanup_init_opencl();
+static void release_opencl_program();
+static int specialize_program();
+static int make_kernel(cl_kernel *kernel, char *name);
+static void release_kernels();
+static void free_warm_program(void *value);
+static void release_mem(cl_mem *mem);
+static void release_kernel(cl_kernel *kernel);
+static cl_int wait_kernels();
+static void release_kernel_events();
+static void reserve_arena(int previews);
+static size_t arena_plane_size(size_t size);
+static void release_arena();
+static float *alloc_plane(size_t size);
+static float *alloc_kept_plane(size_t size);
+static void free_plane(float *plane);
+static int share_plane(float *host, size_t size);
+static void unshare_plane(float *host);
+static void unshare_planes();
+static struct shared_plane *find_shared_plane(float *host);
+static cl_mem lend_plane(float *host);
+static int on_loan(float *host);
+static cl_int reclaim_planes();
+static cl_mem opencl_buffer(float *host, cl_mem copy);
+static cl_int to_opencl(float *host, cl_mem *fallback, size_t size,
+		cl_mem *mem);
+static cl_int opencl_target(float *host, cl_mem *fallback, size_t size,
+		cl_mem *mem);
+static cl_int from_opencl(float *host, cl_mem mem, size_t size);
 
 static int copy_reusables_to_opencl();
+static int copy_input_to_opencl();
 
 static int do_iteration();
-
-static int output(char *output_image_filename);
-
-static int cpsf_multiply(float *in[3][2], float *out[3][2]);
-static int image_input_divide(float *in[3], float *out[3]);
-static int cpsf_conj_multiply(float *in[3][2], float *out[3][2]);
-static int image_multiply(float *a[3], float *b[3], float *out[3]);
+static int wiener_estimate(float k, int start);
+static int run_iterations(int n_iterations, struct deconvolute_options
+		*options);
+static int coarse_start(int n_iterations, struct deconvolute_options
+		*options);
+static int init_estimate_sets();
+static void cleanup_estimate_sets();
+static int preview(struct preview_writer *writer, char *pattern, int
+		pass);
+
+static int output(char *output_image_filename, struct
+		deconvolute_options *options);
+static void quantize_output(uint16_t *out, int dither);
+static void output_planes(float **planes);
+
+static int read_image_size(char *filename, int *w, int *h, int
+		*samples, int *extra);
+static int tuned_threads(char *input_image_filename, char
+		*psf_image_filename, int n_threads, int tune, struct
+		deconvolute_options *options);
+static int find_region(char *input_image_filename, char
+		*psf_image_filename, struct deconvolute_options *options,
+		struct region *r);
+static int fft_size(int n);
+static void crop_output(uint16_t *data);
+static int write_float_output(char *output_image_filename);
+static void plan_config(struct job_sizes *sizes, int n_threads, struct
+		deconvolute_options *options, struct deconvolute_plan
+		*plan);
+static int plan_fits(struct deconvolute_plan *plan, struct
+		deconvolute_options *options);
+static void calibrate();
+
+static int sequence_filename(char *buf, char *pattern, int n);
+static int count_frames(char *input_pattern, int first_frame);
+static void *decode_frame(void *arg);
+static void *encode_frame(void *arg);
+static int read_frame_psf(char *filename, float **planes);
+static void free_frame_planes(float **planes, int n);
+
+static int psf_is_symmetric();
+static int psf_allows_dct();
+static int psf_file_allows_dct(char *filename, int w, int h, int n);
+static int psf_planes_allow_dct(float **planes, int n_psfs, int psf_w,
+		int psf_h, int w, int h);
+static float psf_tap(int c, int x, int y);
+static void dct_spectrum(int c, float total);
+
+static int cpsf_multiply(float *in[][2], float *out[][2]);
+static cl_int real_complex_multiply(int c, cl_mem psf, cl_mem *in,
+		cl_mem *out);
+static int image_input_divide(float **in, float **out);
+static int cpsf_conj_multiply(float *in[][2], float *out[][2]);
+static int image_multiply(float **a, float **b, float **out);
+static void cpu_pointwise(float **a, float **b, float **out, int
+		divide);
+static void cpu_wiener(float **a, float **b, float **out, float k);
+static int wiener_multiply(float *in[][2], float *out[][2], float k);
+static int dct_wiener_multiply(float **in, float **out, float k);
+static void pointwise_band(void *arg, int t);
+static void pin_thread(void *arg, int thread);
+static void first_touch(void *data, size_t size);
+static void touch_band(void *arg, int i);
+static void touch_planes();
+static void route_fftw_loops(int on);
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+static void fftw_parallel_loop(void *(*work)(char *), char *jobdata,
+		size_t elsize, int njobs, void *data);
+static void fftw_loop_task(void *arg, int i);
+#endif
+static int convolve(float **in, float **out, int adjoint);
+static int dct_psf_multiply(float **in, float **out);
 
 static void fft(float *in, float *out[2]);
 static void ifft(float *in[2], float *out);
+static void dct(float *in, float *out);
+static void idct(float *in, float *out);
 
 /******************/
 /* IMPLEMENTATION */
@@ -99,9 +510,17 @@ static void ifft(float *in[2], float *out);
 /*
  * global function to deconvolute an image via Richardson–Lucy
  *
- * the input image must be a 16-bit RGB TIFF
- * the psf image must be a 8-bit RGB TIFF (due to GIMP limitations)
- * the outputted image will be a 16-bit RGB TIFF
+ * the input image must be a 16-bit TIFF with any number of channels
+ * (gray, RGB, ...) up to DECONVOLUTE_MAX_CHANNELS; extra samples such
+ * as alpha are passed through untouched
+ * the psf image must be a 8-bit TIFF (due to GIMP limitations) with
+ * either one channel, used for every channel, or one per channel
+ * the outputted image will be a 16-bit TIFF laid out like the input
+ *
+ * the input, psf and output may instead be planar float32 .npy, FITS
+ * or .raw images (see float_image.h), which are mapped and used in
+ * place rather than decoded; float outputs are written unquantized and
+ * never in the background
  *
  * if any part of it fails, it will undo itself (goto styled stack-esque
  * wind and unwind)
@@ -112,594 +531,4613 @@ int deconvolute_image(char *input_image_filename, char
 		*psf_image_filename, char *output_image_filename, int
 		n_iterations, int n_threads)
 {
-	int ret;
-	int i;
+	struct deconvolute_options options;
 
-	/* setup */
-	ret = init_images(input_image_filename, psf_image_filename);
-	if (ret != 0)
-		goto out_no_init_images;
+	deconvolute_default_options(&options);
 
-	ret = init_fftw(n_threads);
-	if (ret != 0)
-		goto out_no_init_fftw;
+	return deconvolute_image_with_options(input_image_filename,
+			psf_image_filename, output_image_filename,
+			n_iterations, n_threads, &options);
+}
+
+/* fill options with the defaults used by deconvolute_image */
+void deconvolute_default_options(struct deconvolute_options *options)
+{
+	options->checkpoint_filename = NULL;
+	options->checkpoint_interval = 0;
+	options->resume = 0;
+	options->preview_filename = NULL;
+	options->preview_interval = 0;
+	options->preview_scale = 1;
+	options->background_output = 0;
+	options->dither = 0;
+	options->compression = TIFF_GOODNESS_NONE;
+	options->tile_size = 0;
+	options->pyramid_levels = 0;
+	options->psf_grid_x = 1;
+	options->psf_grid_y = 1;
+	options->coarse_levels = 0;
+	options->coarse_iterations = 10;
+	options->progress = NULL;
+	options->progress_arg = NULL;
+	options->cpu_only = 0;
+	options->memory_budget = 0;
+	options->device_memory_budget = 0;
+	options->print_plan = 0;
+	options->numa = 0;
+	options->fft_flags = FFTW_MEASURE;
+	options->tuning_filename = NULL;
+	options->retune = 0;
+	options->periodic_edges = 0;
+	options->roi_x = 0;
+	options->roi_y = 0;
+	options->roi_width = 0;
+	options->roi_height = 0;
+	options->wiener = 0;
+	options->wiener_start = 0;
+}
 
-	ret = init_opencl();
+/*
+ * same as deconvolute_image, with the extra behaviour described by
+ * options
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_image_with_options(char *input_image_filename, char
+		*psf_image_filename, char *output_image_filename, int
+		n_iterations, int n_threads, struct deconvolute_options
+		*options)
+{
+	int ret;
+	struct deconvolute_options planned;
+
+	/* plan within the budgets, on the tuned threads if none given */
+	planned = *options;
+	options = &planned;
+	n_threads = tuned_threads(input_image_filename,
+			psf_image_filename, n_threads, 1, options);
+	ret = plan_job(input_image_filename, psf_image_filename, n_threads,
+			options);
 	if (ret != 0)
-		goto out_no_init_opencl;
+		goto out_no_setup;
 
-	ret = copy_reusables_to_opencl();
+	/* setup */
+	ret = setup(input_image_filename, psf_image_filename, n_threads,
+			options);
 	if (ret != 0)
-		goto out_no_copy_reusables;
+		goto out_no_setup;
 
 	/* run deconvolution */
-	for (i = 0; i < n_iterations; i++) {
-		printf("Pass %d...\n", i);
-
-		ret = do_iteration();
-		if (ret != 0)
-			goto out_iteration_failed;
-	}
+	ret = run_iterations(n_iterations, options);
+	if (ret != 0)
+		goto out_iteration_failed;
 
 	/* output result */
-	ret = output(output_image_filename);
+	ret = output(output_image_filename, options);
 	if (ret != 0)
 		goto out_no_output;
 
 out_no_output:
 out_iteration_failed:
-out_no_copy_reusables:
-	cleanup_init_opencl();
-out_no_init_opencl:
-	cleanup_init_fftw();
-out_no_init_fftw:
-	cleanup_init_images();
-out_no_init_images:
+	cleanup();
+out_no_setup:
 	return ret;
 }
 
-/********************/
-/* STATIC FUNCTIONS */
-/********************/
-
 /*
- * read in images, alloc memory for real images, pad and normalize
- * psf
+ * same as deconvolute_image_with_options on images in the caller's
+ * memory, read and written in place (see deconvolute.h)
  *
- * returns 0 on success, anything else otherwise
+ * returns 0 on success, anything else on failure
  */
-static int init_images(char *input_image_filename, char *psf_image_filename)
+int deconvolute_image_buffers(struct deconvolute_buffer *input, struct
+		deconvolute_buffer *psf, struct deconvolute_buffer *output,
+		int n_iterations, int n_threads, struct deconvolute_options
+		*options)
 {
-	int i, j, c;
-	int psf_width, psf_height;
-	int x, y, index, psf_index;
+	int ret;
+	int output_width, output_height;
 
-	/* read in images */
-	original_input_image = read_tiff16(input_image_filename, &width,
-			&height);
-	if (original_input_image == NULL)
+	if (check_buffer(input, input_buffer_name) != 0 ||
+			check_buffer(psf, psf_buffer_name) != 0 ||
+			check_buffer(output, output_buffer_name) != 0)
 		goto out_err;
 
-	original_psf_image = read_tiff8(psf_image_filename, &psf_width,
-			&psf_height);
-	if (original_psf_image == NULL)
+	if (psf->n_extra != 0) {
+		fprintf(stderr, "psf buffer has extra samples\n");
+		fflush(stderr);
 		goto out_err;
-
-	/* alloc memory for images */
-	for (c = 0; c < 3; c++) {
-		input_image[c] = malloc(width * height *
-				sizeof(*input_image[c]));
-		current_image[c] = malloc(width * height *
-				sizeof(*current_image[c]));
-		psf_image[c] = calloc(width * height,
-				sizeof(*psf_image[c]));
-		image_a[c] = malloc(width * height *
-				sizeof(*image_a[c]));
-		image_b[c] = malloc(width * height *
-				sizeof(*image_b[c]));
-
-		if (input_image[c] == NULL)
-			goto out_err;
-		if (current_image[c] == NULL)
-			goto out_err;
-		if (psf_image[c] == NULL)
-			goto out_err;
-		if (image_a[c] == NULL)
-			goto out_err;
-		if (image_b[c] == NULL)
-			goto out_err;
-
-		/* alloc memory for complex images */
-		for (i = 0; i < 2; i++) {
-			cimage_a[c][i] = malloc((width/2 + 1) * height *
-					sizeof(*cimage_a[c][i]));
-			cimage_b[c][i] = malloc((width/2 + 1) * height *
-					sizeof(*cimage_b[c][i]));
-			cimage_psf[c][i] = malloc((width/2 + 1) * height
-					* sizeof(*cimage_psf[c][i]));
-
-			if (cimage_a[c][i] == NULL)
-				goto out_err;
-			if (cimage_b[c][i] == NULL)
-				goto out_err;
-			if (cimage_psf[c][i] == NULL)
-				goto out_err;
-		}
-	}
-
-	/* convert input image over to float */
-	for (i = 0; i < 3 * width * height; i++) {
-		input_image[i%3][i/3] = (float)original_input_image[i]/UINT16_MAX;
-		current_image[i%3][i/3] = (float)original_input_image[i]/UINT16_MAX;
 	}
 
-	float total[3] = {0, 0, 0};
-	for (i = 0; i < 3 * psf_width * psf_height; i++) {
-		total[i%3] += (float)original_psf_image[i];
+	/* the output is the roi, if there is one */
+	output_width = options->roi_width > 0 ? options->roi_width :
+		input->width;
+	output_height = options->roi_width > 0 ? options->roi_height :
+		input->height;
+	if (output->width != output_width || output->height !=
+			output_height || output->n_samples !=
+			input->n_samples || output->n_extra !=
+			input->n_extra) {
+		fprintf(stderr, "output buffer is %dx%d with %d samples, not %dx%d with %d\n",
+				output->width, output->height,
+				output->n_samples, output_width,
+				output_height, input->n_samples);
+		fflush(stderr);
+		goto out_err;
 	}
 
-	/* copy psf over to padded float psf image */
-	for (c = 0; c < 3; c++) {
-		for (i = 0; i < psf_width; i++) {
-			for (j = 0; j < psf_height; j++) {
-				x = (width - psf_width/2 + i) % width;
-				y = (height - psf_height/2 + j) % height;
-				index = y * width + x;
-				psf_index = 3 * (j * psf_width + i) + c;
+	input_buffer = input;
+	psf_buffer = psf;
+	output_buffer = output;
 
-				psf_image[c][index] = (float)
-					original_psf_image[psf_index]/total[c];
-			}
-		}
-	}
+	ret = deconvolute_image_with_options(input_buffer_name,
+			psf_buffer_name, output_buffer_name, n_iterations,
+			n_threads, options);
 
-	return 0;
+	input_buffer = NULL;
+	psf_buffer = NULL;
+	output_buffer = NULL;
+	return ret;
 
 out_err:
 	say_function_failed();
-	cleanup_init_images();
 	return -1;
 }
 
-/* will only be called once */
-static void cleanup_init_images()
+/*
+ * wait for the output of previous deconvolute_image_with_options calls
+ * made with background_output to be written
+ *
+ * returns 0 on success, anything else if a write failed
+ */
+int deconvolute_wait_output()
 {
-	int c, i;
+	int ret;
 
-	for (c = 0; c < 3; c++) {
-		free(input_image[c]);
-		free(current_image[c]);
-		free(psf_image[c]);
-		free(image_a[c]);
-		free(image_b[c]);
+	if (!output_pending)
+		return 0;
 
-		for (i = 0; i < 2; i++) {
-			free(cimage_a[c][i]);
-			free(cimage_b[c][i]);
-			free(cimage_psf[c][i]);
-		}
-	}
+	pthread_join(output_job.thread, NULL);
+	output_pending = 0;
 
-	free(original_psf_image);
-	free(original_input_image);
+	ret = output_job.ret;
+	free(output_job.data);
+	output_job.data = NULL;
+
+	return ret;
 }
 
 /*
- * allocate fftw input/output arrays and create plans
+ * keep fftw plans, psf spectra and opencl programs of up to n_entries
+ * sizes (and psfs) between jobs, so later jobs of the same size skip
+ * planning, the psf transform and the program build; the least
+ * recently used entries are dropped first.  0 frees all of it
  *
- * returns 0 on success, anything else otherwise
+ * returns 0 on success, anything else on failure
  */
-static int init_fftw(int n_threads)
+int deconvolute_keep_warm(int n_entries)
 {
-	/* make fftw multithreaded */
-	if (fftwf_init_threads() == 0)
-		goto out_err;
-
-	fftwf_plan_with_nthreads(n_threads);
-
-	/* allocate memory for doing fft computations */
-	fft_real = fftwf_malloc(width * height * sizeof(*fft_real));
-	if (fft_real == NULL)
-		goto out_err;
+	warm_cache_destroy(plan_cache);
+	plan_cache = NULL;
+	warm_cache_destroy(psf_cache);
+	psf_cache = NULL;
+	warm_cache_destroy(program_cache);
+	program_cache = NULL;
+	keeping_warm = 0;
+
+	if (n_entries <= 0) {
+		release_opencl_program();
+		arena_release(&arena);
+		return 0;
+	}
 
-	fft_complex = fftwf_malloc((width/2 + 1) * height *
-			sizeof(*fft_complex));
-	if (fft_complex == NULL)
+	plan_cache = warm_cache_create(n_entries, free_warm_plans);
+	if (plan_cache == NULL)
 		goto out_err;
 
-	/* create fftw plans for both forward and backward ffts */
-	fft_forward_plan = fftwf_plan_dft_r2c_2d(height, width,
-			fft_real, fft_complex, FFTW_MEASURE);
-	if (fft_forward_plan == NULL)
+	psf_cache = warm_cache_create(n_entries, free_warm_psf);
+	if (psf_cache == NULL)
 		goto out_err;
 
-	fft_backward_plan = fftwf_plan_dft_c2r_2d(height, width,
-			fft_complex, fft_real, FFTW_MEASURE);
-	if (fft_backward_plan == NULL)
+	program_cache = warm_cache_create(n_entries, free_warm_program);
+	if (program_cache == NULL)
 		goto out_err;
 
+	keeping_warm = 1;
 	return 0;
 
 out_err:
 	say_function_failed();
-	cleanup_init_fftw();
+	warm_cache_destroy(plan_cache);
+	plan_cache = NULL;
+	warm_cache_destroy(psf_cache);
+	psf_cache = NULL;
 	return -1;
 }
 
-/* will only be called once */
-static void cleanup_init_fftw()
-{
-	if (fft_backward_plan != NULL)
-		fftwf_destroy_plan(fft_backward_plan);
-	if (fft_forward_plan != NULL)
-		fftwf_destroy_plan(fft_forward_plan);
-	if (fft_complex != NULL)
-		fftwf_free(fft_complex);
-	if (fft_real != NULL)
-		fftwf_free(fft_real);
-}
-
 /*
- * create opencl context, queue, program, and kernels and alloc opencl
- * buffers
+ * plan a job from the image sizes, fitting options to the budgets (see
+ * deconvolute.h)
  *
- * returns 0 on success, anything else otherwise
+ * returns 0 if the plan fits, anything else otherwise
  */
-static int init_opencl()
+int deconvolute_plan_job(char *input_image_filename, char
+		*psf_image_filename, int n_threads, struct
+		deconvolute_options *options, struct deconvolute_plan *plan)
 {
-	int ret;
-	int c, i;
+	struct job_sizes sizes;
+	struct region r;
+	int psf_extra;
 
-	/* set work sizes */
-	global_work_size[0] = width * height;
-	global_work_size[1] = (width/2 + 1) * height;
-
-	/* setup context, queue, program, and kernels */
-	ret = cl_utils_setup_gpu(&context, &queue, &device);
-	if (ret != 0)
+	if (read_image_size(input_image_filename, &sizes.width,
+				&sizes.height, &sizes.n_samples,
+				&sizes.n_extra) != 0)
 		goto out_err;
-
-	ret = cl_utils_create_program(&program, "arithmetic.cl",
-			context, device);
-	if (ret != 0)
+	if (find_region(input_image_filename, psf_image_filename, options,
+				&r) != 0)
 		goto out_err;
-
-	for (c = 0; c < 3; c++) {
-		mult_k[c] = clCreateKernel(program, "mult", NULL);
-		complex_mult_k[c] = clCreateKernel(program,
-				"complex_mult", NULL);
-		complex_conj_mult_k[c] = clCreateKernel(program,
-				"complex_conj_mult", NULL);
-		divide_k[c] = clCreateKernel(program, "divide", NULL);
-
-		if (mult_k[c] == NULL)
-			goto out_err;
-		if (complex_mult_k[c] == NULL)
-			goto out_err;
-		if (complex_conj_mult_k[c] == NULL)
-			goto out_err;
-		if (divide_k[c] == NULL)
+	sizes.width = r.width;
+	sizes.height = r.height;
+	if (read_image_size(psf_image_filename, &sizes.psf_width,
+				&sizes.psf_height, &sizes.psf_samples,
+				&psf_extra) != 0)
+		goto out_err;
+	sizes.float_input = float_image_is_float(input_image_filename);
+
+	/* decided like setup does, from the psf itself */
+	sizes.dct = 0;
+	if (!options->periodic_edges && options->psf_grid_x *
+			options->psf_grid_y == 1) {
+		sizes.dct = psf_file_allows_dct(psf_image_filename,
+				sizes.width, sizes.height, sizes.n_samples -
+				sizes.n_extra);
+		if (sizes.dct < 0)
 			goto out_err;
 	}
 
-	/* allocate opencl buffers */
-	for (c = 0; c < 3; c++) {
-		k_input_image[c] = clCreateBuffer(context,
-				CL_MEM_READ_ONLY, width * height *
-				sizeof(cl_float), NULL, NULL);
-		k_image_a[c] = clCreateBuffer(context,
-				CL_MEM_READ_WRITE, width * height *
-				sizeof(cl_float), NULL, NULL);
-		k_image_b[c] = clCreateBuffer(context,
-				CL_MEM_READ_WRITE, width * height *
-				sizeof(cl_float), NULL, NULL);
-		k_image_c[c] = clCreateBuffer(context,
-				CL_MEM_READ_WRITE, width * height *
-				sizeof(cl_float), NULL, NULL);
-
-		if (k_input_image[c] == NULL)
-			goto out_err;
-		if (k_image_a[c] == NULL)
-			goto out_err;
-		if (k_image_b[c] == NULL)
-			goto out_err;
-		if (k_image_c[c] == NULL)
-			goto out_err;
-
-		/* allocate complex buffers */
-		for (i = 0; i < 2; i++) {
-			k_cimage_a[c][i] = clCreateBuffer(context,
-					CL_MEM_READ_WRITE, (width/2 + 1)
-					* height * sizeof(cl_float),
-					NULL, NULL);
-			k_cimage_b[c][i] = clCreateBuffer(context,
-					CL_MEM_READ_WRITE, (width/2 + 1)
-					* height * sizeof(cl_float),
-					NULL, NULL);
-			k_cimage_psf[c][i] = clCreateBuffer(context,
-					CL_MEM_READ_ONLY, (width/2 + 1)
-					* height * sizeof(cl_float),
-					NULL, NULL);
-
-			if (k_cimage_a[c][i] == NULL)
-				goto out_err;
-			if (k_cimage_b[c][i] == NULL)
-				goto out_err;
-			if (k_cimage_psf[c][i] == NULL)
-				goto out_err;
+	n_threads = tuned_threads(input_image_filename,
+			psf_image_filename, n_threads, 0, options);
+
+	if (!calibrated)
+		calibrate();
+
+	/* give up the cheapest thing that still leaves the job
+	 * unchanged in result first; the device only shrinks on the cpu
+	 * backend */
+	plan_config(&sizes, n_threads, options, plan);
+	while (!plan_fits(plan, options)) {
+		if (options->device_memory_budget > 0 && plan->device >
+				options->device_memory_budget &&
+				!options->cpu_only) {
+			printf("Over the device memory budget, using the CPU backend\n");
+			options->cpu_only = 1;
+		} else if (plan->coarse_levels > 0) {
+			printf("Over the memory budget, %d coarse levels instead of %d\n",
+					plan->coarse_levels - 1,
+					plan->coarse_levels);
+			options->coarse_levels = plan->coarse_levels - 1;
+		} else if (!options->cpu_only) {
+			printf("Over the memory budget, using the CPU backend\n");
+			options->cpu_only = 1;
+		} else if (plan->previews) {
+			printf("Over the memory budget, writing no previews\n");
+			options->preview_filename = NULL;
+		} else {
+			fprintf(stderr, "%s needs %.1f MB (%.1f MB on the device), over the budget\n",
+					input_image_filename, plan->host /
+					1e6, plan->device / 1e6);
+			fflush(stderr);
+			return -1;
 		}
+		fflush(stdout);
+
+		plan_config(&sizes, n_threads, options, plan);
 	}
 
 	return 0;
 
 out_err:
 	say_function_failed();
-	cleanup_init_opencl();
 	return -1;
 }
 
-/* will only be called once */
-static void cleanup_init_opencl()
+/* print plan, as planned by deconvolute_plan_job */
+void deconvolute_print_plan(struct deconvolute_plan *plan)
 {
-	int c, i;
-
-	for (c = 0; c < 3; c++) {
-		if (k_input_image[c] != NULL)
-			clReleaseMemObject(k_input_image[c]);
-		if (k_image_a[c] != NULL)
-			clReleaseMemObject(k_image_a[c]);
-		if (k_image_b[c] != NULL)
-			clReleaseMemObject(k_image_b[c]);
-		if (k_image_c[c] != NULL)
-			clReleaseMemObject(k_image_c[c]);
-
-		for (i = 0; i < 2; i++) {
-			if (k_cimage_a[c][i] != NULL)
-				clReleaseMemObject(k_cimage_a[c][i]);
-			if (k_cimage_b[c][i] != NULL)
-				clReleaseMemObject(k_cimage_b[c][i]);
-			if (k_cimage_psf[c][i] != NULL)
-				clReleaseMemObject(k_cimage_psf[c][i]);
-		}
-	}
+	printf("Plan: %dx%d, %d channel%s on the %s backend%s%s\n",
+			plan->width, plan->height, plan->n_channels,
+			plan->n_channels == 1 ? "" : "s",
+			plan->cpu_only ? "CPU" : "OpenCL",
+			plan->coarse_levels > 0 ? ", coarse-to-fine" : "",
+			plan->previews ? ", previews" : "");
+	printf("  peak memory: %.1f MB host (%zu bytes), %.1f MB device (%zu bytes)\n",
+			plan->host / 1e6, plan->host, plan->device / 1e6,
+			plan->device);
+	printf("  %s: %d of %dx%d per pass\n", plan->dct ? "DCTs" :
+			"FFTs", plan->n_ffts, plan->fft_width,
+			plan->fft_height);
+	printf("  about %.3g s per pass\n", plan->pass_seconds);
+	fflush(stdout);
+}
 
-	for (c = 0; c < 3; c++) {
-		if (mult_k[c] != NULL)
-			clReleaseKernel(mult_k[c]);
-		if (complex_mult_k[c] != NULL)
-			clReleaseKernel(complex_mult_k[c]);
-		if (complex_conj_mult_k[c] != NULL)
-			clReleaseKernel(complex_conj_mult_k[c]);
-		if (divide_k[c] != NULL)
-			clReleaseKernel(divide_k[c]);
-	}
+/*
+ * global function to deconvolute a sequence of frames via
+ * Richardson–Lucy
+ *
+ * input_pattern is either a multi-page TIFF or a numbered series such
+ * as "frame%04d.tif" starting at first_frame; output_pattern must be
+ * a numbered series and output frame n is written under number n
+ *
+ * the first frame runs n_iterations from the input; every later frame
+ * is seeded with the previous frame's result and runs only
+ * n_warm_iterations.  decoding frame n+1 and encoding frame n-1 run on
+ * their own threads while frame n is computed
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_sequence(char *input_pattern, char *psf_image_filename,
+		char *output_pattern, int first_frame, int n_iterations,
+		int n_warm_iterations, int n_threads)
+{
+	struct deconvolute_options options;
 
-	if (program != NULL)
-		clReleaseProgram(program);
+	deconvolute_default_options(&options);
 
-	cl_utils_cleanup_gpu(&context, &queue);
+	return deconvolute_sequence_with_options(input_pattern,
+			psf_image_filename, output_pattern, first_frame,
+			n_iterations, n_warm_iterations, n_threads,
+			&options);
 }
 
 /*
- * copy reusable images to opencl buffers (also computes fft of psf
- * before copying that)
+ * same as deconvolute_sequence, with the dither and output layout
+ * (compression, tiles, pyramid) of options applied to every output
+ * frame and its psf grid to every frame (other options are ignored)
  *
  * returns 0 on success, anything else on failure
  */
-static int copy_reusables_to_opencl()
+int deconvolute_sequence_with_options(char *input_pattern, char
+		*psf_image_filename, char *output_pattern, int
+		first_frame, int n_iterations, int n_warm_iterations, int
+		n_threads, struct deconvolute_options *options)
 {
-	cl_int ret;
-	int c, i;
+	int ret;
+	int i, n, n_frames, multipage;
+	int decoding, encoding;
+	struct frame_job decode, encode;
+	char first_filename[FILENAME_MAX];
+	struct deconvolute_options planned;
+
+	decoding = 0;
+	encoding = 0;
+	decode.data = NULL;
+	decode.region_width = 0;
+	encode.data = NULL;
+	multipage = strchr(input_pattern, '%') == NULL;
+
+	/* check patterns and find the frames */
+	ret = -1;
+	if (options->roi_width > 0) {
+		fprintf(stderr, "deconvolute_sequence: a region of interest is for single images\n");
+		fflush(stderr);
+		goto out_no_setup;
+	}
 
-	/* compute fft of psf */
-	for (c = 0; c < 3; c++) {
-		fft(psf_image[c], cimage_psf[c]);
+	if (float_image_is_float(input_pattern) ||
+			float_image_is_float(output_pattern)) {
+		fprintf(stderr, "deconvolute_sequence: frames must be TIFF\n");
+		fflush(stderr);
+		goto out_no_setup;
 	}
 
-	for (c = 0; c < 3; c++) {
-		ret = clEnqueueWriteBuffer(queue, k_input_image[c],
-				CL_TRUE, 0, width * height *
-				sizeof(cl_float), input_image[c], 0,
-				NULL, &copy_events[c][2]);
-		if (ret != CL_SUCCESS)
+	if (sequence_filename(encode.filename, output_pattern, 0) != 0) {
+		fprintf(stderr, "deconvolute_sequence: output %s must be a numbered pattern such as out%%04d.tif\n",
+				output_pattern);
+		fflush(stderr);
+		goto out_no_setup;
+	}
+
+	if (multipage) {
+		n_frames = count_tiff_pages(input_pattern);
+		strncpy(first_filename, input_pattern, FILENAME_MAX - 1);
+		first_filename[FILENAME_MAX - 1] = '\0';
+	} else {
+		n_frames = count_frames(input_pattern, first_frame);
+		sequence_filename(first_filename, input_pattern,
+				first_frame);
+	}
+	if (n_frames < 1) {
+		fprintf(stderr, "deconvolute_sequence: no frames in %s\n",
+				input_pattern);
+		fflush(stderr);
+		goto out_no_setup;
+	}
+
+	/* plan within the budgets (and tune) by the first frame */
+	planned = *options;
+	options = &planned;
+	n_threads = tuned_threads(first_filename, psf_image_filename,
+			n_threads, 1, options);
+	ret = plan_job(first_filename, psf_image_filename, n_threads,
+			options);
+	if (ret != 0)
+		goto out_no_setup;
+
+	/* setup, which also reads the first frame */
+	ret = setup(first_filename, psf_image_filename, n_threads,
+			options);
+	if (ret != 0)
+		goto out_no_setup;
+
+	ret = -1;
+	encode.data = malloc((size_t)n_samples * width * height *
+			sizeof(*encode.data));
+	if (encode.data == NULL)
+		goto out_no_encode_buffer;
+	encode.width = width;
+	encode.height = height;
+	encode.n_samples = n_samples;
+	encode.n_extra = n_extra;
+	encode.n_threads = thread_pool_size(pool);
+	encode.compression = options->compression;
+	encode.tile_size = options->tile_size;
+	encode.n_levels = options->pyramid_levels;
+	decode.n_threads = thread_pool_size(pool);
+
+	for (n = 0; n < n_frames; n++) {
+		printf("Frame %d/%d...\n", n + 1, n_frames);
+
+		/* warm start from the previous frame's result */
+		if (n > 0) {
+			load_input_image(decode.data, 1);
+			free(decode.data);
+			decode.data = NULL;
+
+			ret = use_opencl ? copy_input_to_opencl() : 0;
+			if (ret != 0)
+				goto out_frame_failed;
+		}
+
+		/* decode the next frame while this one is computed */
+		if (n + 1 < n_frames) {
+			if (multipage) {
+				strcpy(decode.filename, first_filename);
+				decode.page = n + 1;
+			} else {
+				sequence_filename(decode.filename,
+						input_pattern,
+						first_frame + n + 1);
+				decode.page = 0;
+			}
+
+			ret = pthread_create(&decode.thread, NULL,
+					decode_frame, &decode);
+			if (ret != 0)
+				goto out_frame_failed;
+			decoding = 1;
+		}
+
+		for (i = 0; i < (n == 0 ? n_iterations :
+					n_warm_iterations); i++) {
+			printf("Pass %d...\n", i);
+
+			ret = do_iteration();
+			if (ret != 0)
+				goto out_frame_failed;
+		}
+
+		/* the previous frame must be written before its buffer is
+		 * reused for this one */
+		if (encoding) {
+			pthread_join(encode.thread, NULL);
+			encoding = 0;
+			ret = encode.ret;
+			if (ret != 0)
+				goto out_frame_failed;
+		}
+
+		quantize_output(encode.data, options->dither);
+		sequence_filename(encode.filename, output_pattern, n);
+		ret = pthread_create(&encode.thread, NULL, encode_frame,
+				&encode);
+		if (ret != 0)
+			goto out_frame_failed;
+		encoding = 1;
+
+		if (decoding) {
+			pthread_join(decode.thread, NULL);
+			decoding = 0;
+			ret = decode.ret;
+			if (ret != 0)
+				goto out_frame_failed;
+
+			if (decode.width != width || decode.height !=
+					height || decode.n_samples !=
+					n_samples || decode.n_extra !=
+					n_extra) {
+				fprintf(stderr, "deconvolute_sequence: %s page %d is %dx%dx%d, expected %dx%dx%d\n",
+						decode.filename,
+						decode.page,
+						decode.width,
+						decode.height,
+						decode.n_samples,
+						width, height,
+						n_samples);
+				fflush(stderr);
+				ret = -1;
+				goto out_frame_failed;
+			}
+		}
+	}
+
+out_frame_failed:
+	if (decoding) {
+		pthread_join(decode.thread, NULL);
+		if (ret == 0)
+			ret = decode.ret;
+	}
+	free(decode.data);
+	if (encoding) {
+		pthread_join(encode.thread, NULL);
+		if (ret == 0)
+			ret = encode.ret;
+	}
+	free(encode.data);
+out_no_encode_buffer:
+	cleanup();
+out_no_setup:
+	return ret;
+}
+
+/*
+ * deconvolute frames of one image jointly (see deconvolute.h)
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_frames_with_options(char *input_pattern, char
+		*psf_pattern, char *output_image_filename, int
+		first_frame, int n_frames, int n_iterations, int
+		n_threads, struct deconvolute_options *options)
+{
+	int ret;
+	int c, i, k, n_psfs, n_available, multipage, psf_per_frame;
+	int w, h, samples, extra;
+	size_t k_size, plane, j;
+	char first_filename[FILENAME_MAX], first_psf[FILENAME_MAX];
+	char filename[FILENAME_MAX];
+	uint16_t *data;
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+	float *mosaic[DECONVOLUTE_MAX_CHANNELS];
+	float *scratch, **observed, **psfs;
+	struct multiframe *frames;
+	struct deconvolute_options planned;
+	struct deconvolute_plan plan;
+
+	multipage = strchr(input_pattern, '%') == NULL;
+	psf_per_frame = strchr(psf_pattern, '%') != NULL;
+
+	/* check patterns and find the frames */
+	ret = -1;
+	if (options->roi_width > 0 || options->psf_grid_x *
+			options->psf_grid_y > 1) {
+		fprintf(stderr, "deconvolute_frames: no region of interest or psf grid for joint frames\n");
+		fflush(stderr);
+		goto out_no_setup;
+	}
+
+	if (float_image_is_float(input_pattern)) {
+		fprintf(stderr, "deconvolute_frames: frames must be TIFF\n");
+		fflush(stderr);
+		goto out_no_setup;
+	}
+
+	if (multipage) {
+		n_available = count_tiff_pages(input_pattern);
+		strncpy(first_filename, input_pattern, FILENAME_MAX - 1);
+		first_filename[FILENAME_MAX - 1] = '\0';
+	} else {
+		n_available = count_frames(input_pattern, first_frame);
+		sequence_filename(first_filename, input_pattern,
+				first_frame);
+	}
+	if (n_frames <= 0)
+		n_frames = n_available;
+	if (n_available < 1 || n_frames > n_available) {
+		fprintf(stderr, "deconvolute_frames: %d frames in %s, %d wanted\n",
+				n_available > 0 ? n_available : 0,
+				input_pattern, n_frames);
+		fflush(stderr);
+		goto out_no_setup;
+	}
+
+	if (psf_per_frame) {
+		if (sequence_filename(first_psf, psf_pattern, first_frame)
+				!= 0) {
+			fprintf(stderr, "deconvolute_frames: psf %s must be one file or a numbered pattern such as psf%%04d.tif\n",
+					psf_pattern);
+			fflush(stderr);
+			goto out_no_setup;
+		}
+	} else {
+		strncpy(first_psf, psf_pattern, FILENAME_MAX - 1);
+		first_psf[FILENAME_MAX - 1] = '\0';
+	}
+
+	/* the engine is set up by the first frame, on the cpu, and only
+	 * holds it (and the output); the frames' memory comes on top */
+	planned = *options;
+	options = &planned;
+	frames_only = 1;
+	options->cpu_only = 1;
+	options->periodic_edges = 1;
+	options->coarse_levels = 0;
+	options->preview_filename = NULL;
+	n_threads = tuned_threads(first_filename, first_psf, n_threads, 1,
+			options);
+
+	if (options->memory_budget > 0 || options->print_plan) {
+		if (read_image_size(first_filename, &w, &h, &samples,
+					&extra) != 0 ||
+				deconvolute_plan_job(first_filename,
+					first_psf, n_threads, options,
+					&plan) != 0)
+			goto out_no_setup;
+
+		plan.host += multiframe_memory(n_frames, samples - extra,
+				w, h) + (size_t)(n_frames - 1) * (samples
+				- extra) * w * h * sizeof(float);
+		if (options->print_plan)
+			deconvolute_print_plan(&plan);
+		if (options->memory_budget > 0 && plan.host >
+				options->memory_budget) {
+			fprintf(stderr, "%d frames of %s need %.1f MB, over the budget\n",
+					n_frames, input_pattern,
+					plan.host / 1e6);
+			fflush(stderr);
+			goto out_no_setup;
+		}
+	}
+
+	/* setup, which also reads the first frame and psf */
+	ret = setup(first_filename, first_psf, n_threads, options);
+	if (ret != 0)
+		goto out_no_setup;
+
+	/* frame 0 is the input image; the other frames' passed through
+	 * samples all go to the scratch plane */
+	ret = -1;
+	plane = (size_t)width * height * sizeof(float);
+	k_size = (size_t)n_channels * n_frames;
+	observed = calloc(k_size, sizeof(*observed));
+	if (observed == NULL)
+		goto out_no_observed;
+	scratch = malloc(plane);
+	if (scratch == NULL)
+		goto out_no_frames;
+
+	for (c = 0; c < n_channels; c++) {
+		observed[c * n_frames] = input_image[c];
+	}
+
+	for (k = 1; k < n_frames; k++) {
+		if (multipage) {
+			data = read_tiff16_page(first_filename, k,
+					thread_pool_size(pool), &w, &h,
+					&samples, &extra);
+		} else {
+			sequence_filename(filename, input_pattern,
+					first_frame + k);
+			data = read_tiff16_page(filename, 0,
+					thread_pool_size(pool), &w, &h,
+					&samples, &extra);
+		}
+		if (data == NULL)
+			goto out_no_frames;
+
+		if (w != width || h != height || samples != n_samples ||
+				extra != n_extra) {
+			fprintf(stderr, "deconvolute_frames: frame %d is %dx%dx%d, expected %dx%dx%d\n",
+					k, w, h, samples, width, height,
+					n_samples);
+			fflush(stderr);
+			free(data);
+			goto out_no_frames;
+		}
+
+		for (c = 0; c < n_samples; c++) {
+			planes[c] = scratch;
+			if (c >= n_channels)
+				continue;
+
+			planes[c] = observed[c * n_frames + k] =
+				malloc(plane);
+			if (planes[c] == NULL)
+				break;
+		}
+		if (c < n_samples) {
+			free(data);
+			goto out_no_frames;
+		}
+
+		convert_u16_to_float(pool, data, planes, n_samples, width,
+				height);
+		free(data);
+	}
+
+	/* the psfs of every frame, psf p of frame k at k * n_psfs + p;
+	 * frame 0's is the engine's */
+	n_psfs = load_psf_mosaic(mosaic);
+	if (n_psfs < 0)
+		goto out_no_frames;
+
+	psfs = calloc((size_t)n_frames * n_psfs, sizeof(*psfs));
+	if (psfs == NULL)
+		goto out_no_psfs;
+
+	for (k = 0; k < n_frames; k++) {
+		if (k == 0 || !psf_per_frame) {
+			memcpy(psfs + k * n_psfs, mosaic, n_psfs *
+					sizeof(*psfs));
+			continue;
+		}
+
+		sequence_filename(filename, psf_pattern, first_frame + k);
+		if (read_frame_psf(filename, psfs + k * n_psfs) != 0)
+			goto out_no_spectra;
+	}
+
+	printf("Joint deconvolution of %d frames, %d psf spectra cached\n",
+			n_frames, n_frames * n_psfs);
+	fflush(stdout);
+	frames = multiframe_create(pool, psfs, n_frames, n_psfs,
+			psf_width, psf_height, width, height, fft_flags);
+	if (frames == NULL)
+		goto out_no_spectra;
+
+	/* start from the mean of the frames */
+	for (c = 0; c < n_channels; c++) {
+		for (k = 1; k < n_frames; k++) {
+			for (j = 0; j < (size_t)width * height; j++) {
+				current_image[c][j] += observed[c *
+					n_frames + k][j];
+			}
+		}
+		for (j = 0; j < (size_t)width * height; j++) {
+			current_image[c][j] /= n_frames;
+		}
+	}
+
+	for (i = 0; i < n_iterations; i++) {
+		printf("Pass %d...\n", i);
+
+		for (c = 0; c < n_channels; c++) {
+			multiframe_iterate(frames, c, observed + c *
+					n_frames, current_image[c]);
+		}
+
+		if (options->progress != NULL &&
+				options->progress(options->progress_arg, i
+					+ 1, n_iterations) != 0) {
+			fprintf(stderr, "cancelled after pass %d\n", i + 1);
+			fflush(stderr);
+			goto out_iteration_failed;
+		}
+	}
+
+	ret = output(output_image_filename, options);
+
+out_iteration_failed:
+	multiframe_destroy(frames);
+out_no_spectra:
+	if (psf_per_frame) {
+		for (k = 1; k < n_frames; k++) {
+			free_frame_planes(psfs + k * n_psfs, n_psfs);
+		}
+	}
+	free(psfs);
+out_no_psfs:
+	free_psf_mosaic(mosaic);
+out_no_frames:
+	for (c = 0; c < n_channels; c++) {
+		free_frame_planes(observed + c * n_frames + 1, n_frames -
+				1);
+	}
+	free(scratch);
+	free(observed);
+out_no_observed:
+	cleanup();
+out_no_setup:
+	frames_only = 0;
+	return ret;
+}
+
+/********************/
+/* STATIC FUNCTIONS */
+/********************/
+
+/*
+ * plan the job if it has budgets or its plan is to be printed,
+ * changing options to fit the budgets
+ *
+ * returns 0 on success, anything else if it cannot fit
+ */
+static int plan_job(char *input_image_filename, char
+		*psf_image_filename, int n_threads, struct
+		deconvolute_options *options)
+{
+	struct deconvolute_plan plan;
+
+	if (options->memory_budget == 0 && options->device_memory_budget
+			== 0 && !options->print_plan)
+		return 0;
+
+	if (deconvolute_plan_job(input_image_filename,
+				psf_image_filename, n_threads, options,
+				&plan) != 0)
+		return -1;
+
+	if (options->print_plan)
+		deconvolute_print_plan(&plan);
+
+	return 0;
+}
+
+/*
+ * read in the input and psf images, plan the ffts and build the opencl
+ * program, with the decoding of both images overlapping the fftw
+ * planning and opencl program build
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int setup(char *input_image_filename, char *psf_image_filename,
+		int n_threads, struct deconvolute_options *options)
+{
+	int ret;
+
+	ret = find_region(input_image_filename, psf_image_filename, options,
+			&region);
+	if (ret != 0)
+		goto out_no_pool;
+
+	psf_grid_x = options->psf_grid_x;
+	psf_grid_y = options->psf_grid_y;
+	use_opencl = !options->cpu_only;
+	zero_copy = 0;
+	use_numa = options->numa;
+	fft_flags = options->fft_flags;
+
+	if (use_numa) {
+		numa_read_topology(&topology);
+		numa_threads = n_threads;
+		pool = thread_pool_create_pinned(n_threads, pin_thread,
+				NULL);
+	} else {
+		pool = thread_pool_create(n_threads);
+	}
+	if (pool == NULL) {
+		ret = -1;
+		goto out_no_pool;
+	}
+
+	/* without the callback fftw starts its own threads from the main
+	 * thread and they would inherit its node's cpus, so it is left
+	 * unpinned (and thread 0's rows go wherever it runs) */
+	if (use_numa) {
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+		pin_thread(NULL, 0);
+#endif
+		numa_print(&topology, thread_pool_size(pool));
+#ifndef HAVE_FFTW_THREADS_CALLBACK
+		printf("  thread 0 (the main thread) left unpinned for fftw's threads\n");
+#endif
+	}
+
+	ret = start_decode_images(input_image_filename,
+			psf_image_filename);
+	if (ret != 0)
+		goto out_no_decode;
+
+	/* the transforms planned depend on the psf's symmetry, so it is
+	 * decoded first (the input still overlaps the planning) */
+	ret = finish_decode_psf();
+	if (ret != 0)
+		goto out_no_init_fftw;
+
+	use_dct = !options->periodic_edges && psf_grid_x * psf_grid_y ==
+		1 && psf_allows_dct();
+	use_grid = !use_dct && (psf_grid_x * psf_grid_y > 1 ||
+			!use_opencl);
+	psf_symmetric = use_dct || (!use_grid && psf_is_symmetric());
+
+	reserve_arena(options->preview_filename != NULL &&
+			options->preview_interval > 0);
+
+	ret = init_fftw(n_threads);
+	if (ret != 0)
+		goto out_no_init_fftw;
+
+	if (use_opencl) {
+		ret = init_opencl();
+		if (ret != 0)
+			goto out_no_init_opencl;
+	}
+
+	ret = finish_decode_images();
+	if (ret != 0)
+		goto out_no_images;
+
+	ret = init_images();
+	if (ret != 0)
+		goto out_no_images;
+
+	if (use_opencl) {
+		ret = copy_reusables_to_opencl();
+		if (ret != 0)
+			goto out_no_copy_reusables;
+	}
+
+	return 0;
+
+out_no_copy_reusables:
+	cleanup_init_images();
+out_no_images:
+	if (use_opencl)
+		cleanup_init_opencl();
+out_no_init_opencl:
+	cleanup_init_fftw();
+out_no_init_fftw:
+	release_arena();
+	cancel_decode_images();
+out_no_decode:
+	route_fftw_loops(0);
+	thread_pool_destroy(pool);
+	pool = NULL;
+	if (use_numa)
+		numa_unpin(&topology);
+out_no_pool:
+	return ret;
+}
+
+/* undo setup */
+static void cleanup()
+{
+	cleanup_init_images();
+	if (use_opencl)
+		cleanup_init_opencl();
+	cleanup_init_fftw();
+	release_arena();
+	route_fftw_loops(0);
+	thread_pool_destroy(pool);
+	pool = NULL;
+	if (use_numa)
+		numa_unpin(&topology);
+}
+
+/*
+ * read the input image size (so fftw and opencl can be set up with it)
+ * and start decoding the input and psf images on their own threads;
+ * float images are mapped instead, which needs no thread
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int start_decode_images(char *input_image_filename, char
+		*psf_image_filename)
+{
+	int ret;
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+	struct deconvolute_buffer *buffer;
+	int c;
+
+	buffer = image_buffer(input_image_filename);
+	if (buffer != NULL) {
+		width = buffer->width;
+		height = buffer->height;
+		n_samples = buffer->n_samples;
+		n_extra = buffer->n_extra;
+		ret = 0;
+	} else if (float_image_is_float(input_image_filename)) {
+		ret = float_image_map(&input_map, input_image_filename);
+		width = input_map.width;
+		height = input_map.height;
+		n_samples = input_map.n_channels;
+		n_extra = 0;
+	} else {
+		ret = read_tiff_size(input_image_filename, &width, &height,
+				&n_samples, &n_extra);
+	}
+	if (ret != 0)
+		goto out_no_input;
+
+	/* a region of interest is all that is decoded, or copied out of
+	 * a mapped input (see init_images) */
+	if (width != region.image_width || height != region.image_height) {
+		fprintf(stderr, "%s changed size\n", input_image_filename);
+		fflush(stderr);
+		goto out_err;
+	}
+	width = region.width;
+	height = region.height;
+	input_job.x = region.x;
+	input_job.y = region.y;
+	input_job.region_width = region.cropped ? region.width : 0;
+	input_job.region_height = region.height;
+
+	/* a psf buffer is small, it is converted to float planes here */
+	buffer = image_buffer(psf_image_filename);
+	if (buffer != NULL) {
+		psf_width = buffer->width;
+		psf_height = buffer->height;
+		psf_samples = buffer->n_samples;
+		psf_map.data = malloc((size_t)psf_samples * psf_width *
+				psf_height * sizeof(*psf_map.data));
+		if (psf_map.data == NULL)
+			goto out_err;
+
+		for (c = 0; c < psf_samples; c++) {
+			planes[c] = psf_map.data + (size_t)c * psf_width *
+				psf_height;
+		}
+		convert_buffer_to_float(NULL, buffer, 0, 0, planes,
+				psf_width, psf_height);
+	} else if (float_image_is_float(psf_image_filename)) {
+		ret = float_image_map(&psf_map, psf_image_filename);
+		psf_width = psf_map.width;
+		psf_height = psf_map.height;
+		psf_samples = psf_map.n_channels;
+		if (ret != 0)
+			goto out_err;
+	}
+
+	n_channels = n_samples - n_extra;
+	if (n_channels < 1 || n_samples > DECONVOLUTE_MAX_CHANNELS) {
+		fprintf(stderr, "%s has %d channels, at most %d supported\n",
+				input_image_filename, n_samples,
+				DECONVOLUTE_MAX_CHANNELS);
+		fflush(stderr);
+		goto out_err;
+	}
+
+	strncpy(input_job.filename, input_image_filename, FILENAME_MAX -
+			1);
+	input_job.filename[FILENAME_MAX - 1] = '\0';
+	input_job.page = 0;
+	input_job.n_threads = thread_pool_size(pool);
+	strncpy(psf_job.filename, psf_image_filename, FILENAME_MAX - 1);
+	psf_job.filename[FILENAME_MAX - 1] = '\0';
+
+	if (input_map.map == NULL && input_buffer == NULL) {
+		ret = pthread_create(&input_job.thread, NULL,
+				decode_frame, &input_job);
+		if (ret != 0)
+			goto out_err;
+	}
+
+	if (psf_map.data == NULL) {
+		ret = pthread_create(&psf_job.thread, NULL, decode_psf,
+				&psf_job);
+		if (ret != 0)
+			goto out_no_psf_thread;
+		decoding_psf = 1;
+	}
+
+	decoding_images = 1;
+	return 0;
+
+out_no_psf_thread:
+	if (input_map.map == NULL && input_buffer == NULL) {
+		pthread_join(input_job.thread, NULL);
+		free(input_job.data);
+		input_job.data = NULL;
+	}
+out_err:
+	release_psf_map();
+	float_image_unmap(&input_map);
+out_no_input:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * wait for the input and psf images to be decoded into
+ * original_input_image and original_psf_image
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int finish_decode_images()
+{
+	decoding_images = 0;
+	if (finish_decode_psf() != 0)
+		goto out_no_psf;
+	if (input_map.map != NULL || input_buffer != NULL)
+		return 0;
+
+	pthread_join(input_job.thread, NULL);
+	original_input_image = input_job.data;
+	input_job.data = NULL;
+
+	if (input_job.ret != 0)
+		goto out_err;
+
+	if (input_job.width != width || input_job.height != height ||
+			input_job.n_samples != n_samples ||
+			input_job.n_extra != n_extra) {
+		fprintf(stderr, "%s changed size while being read\n",
+				input_job.filename);
+		fflush(stderr);
+		goto out_err;
+	}
+
+	return 0;
+
+out_no_psf:
+	if (input_map.map == NULL && input_buffer == NULL)
+		pthread_join(input_job.thread, NULL);
+	original_input_image = input_job.data;
+	input_job.data = NULL;
+out_err:
+	say_function_failed();
+	free(original_input_image);
+	original_input_image = NULL;
+	free(original_psf_image);
+	original_psf_image = NULL;
+	float_image_unmap(&input_map);
+	release_psf_map();
+	return -1;
+}
+
+/*
+ * wait for the psf image to be decoded into original_psf_image (if it
+ * still is), leaving the input decoding
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int finish_decode_psf()
+{
+	if (!decoding_psf)
+		return psf_map.data == NULL && original_psf_image == NULL ?
+			-1 : 0;
+
+	decoding_psf = 0;
+	pthread_join(psf_job.thread, NULL);
+
+	return psf_job.ret;
+}
+
+/* wait for and throw away images that are still being decoded */
+static void cancel_decode_images()
+{
+	if (!decoding_images)
+		return;
+
+	finish_decode_images();
+	free(original_input_image);
+	original_input_image = NULL;
+	free(original_psf_image);
+	original_psf_image = NULL;
+	float_image_unmap(&input_map);
+	release_psf_map();
+}
+
+/* thread function decoding the psf image */
+static void *decode_psf(void *arg)
+{
+	struct frame_job *job;
+
+	job = arg;
+	original_psf_image = read_tiff8(job->filename, &psf_width,
+			&psf_height, &psf_samples);
+	job->ret = original_psf_image == NULL ? -1 : 0;
+
+	return NULL;
+}
+
+/* the caller's buffer standing in for filename, or NULL for a file */
+static struct deconvolute_buffer *image_buffer(char *filename)
+{
+	if (filename == input_buffer_name)
+		return input_buffer;
+	if (filename == psf_buffer_name)
+		return psf_buffer;
+	if (filename == output_buffer_name)
+		return output_buffer;
+	return NULL;
+}
+
+/*
+ * check that buffer (called name in messages) describes an image
+ *
+ * returns 0 if it does, anything else otherwise
+ */
+static int check_buffer(struct deconvolute_buffer *buffer, char *name)
+{
+	if (buffer == NULL || buffer->data == NULL) {
+		fprintf(stderr, "no %s\n", name);
+		goto out_err;
+	}
+
+	if (buffer->type != DECONVOLUTE_U16 && buffer->type !=
+			DECONVOLUTE_FLOAT) {
+		fprintf(stderr, "%s has an unknown sample type %d\n", name,
+				buffer->type);
+		goto out_err;
+	}
+
+	if (buffer->width < 1 || buffer->height < 1 || buffer->n_samples
+			< 1 || buffer->n_samples >
+			DECONVOLUTE_MAX_CHANNELS || buffer->n_extra < 0 ||
+			buffer->n_extra >= buffer->n_samples) {
+		fprintf(stderr, "%s is %dx%d with %d samples (%d extra)\n",
+				name, buffer->width, buffer->height,
+				buffer->n_samples, buffer->n_extra);
+		goto out_err;
+	}
+
+	return 0;
+
+out_err:
+	fflush(stderr);
+	return -1;
+}
+
+/* unmap a mapped psf, or free one converted from a psf buffer */
+static void release_psf_map()
+{
+	if (psf_map.map == NULL)
+		free(psf_map.data);
+	float_image_unmap(&psf_map);
+}
+
+/*
+ * alloc memory for real images, convert the decoded input image (or
+ * point input_image at the mapped planes), pad and normalize psf
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_images()
+{
+	int i, j, c;
+	int x, y;
+	size_t index;
+
+	/* alloc memory for images, input_image also holds the passed
+	 * through samples */
+	for (c = 0; c < n_samples; c++) {
+		if (input_map.map != NULL && !region.cropped) {
+			input_image[c] = input_map.data + (size_t)c * width
+				* height;
+			continue;
+		}
+
+		input_image[c] = alloc_plane((size_t)width * height *
+				sizeof(*input_image[c]));
+		if (input_image[c] == NULL)
+			goto out_err;
+	}
+
+	for (c = 0; c < n_channels; c++) {
+		current_image[c] = alloc_plane((size_t)width * height *
+				sizeof(*current_image[c]));
+		if (current_image[c] == NULL)
+			goto out_err;
+		if (frames_only)
+			continue;
+
+		image_a[c] = alloc_plane((size_t)width * height *
+				sizeof(*image_a[c]));
+		image_b[c] = alloc_plane((size_t)width * height *
+				sizeof(*image_b[c]));
+
+		if (image_a[c] == NULL)
+			goto out_err;
+		if (image_b[c] == NULL)
+			goto out_err;
+
+		/* the psf grid has its own (tile) transforms, the dct
+		 * needs no more */
+		if (use_grid || use_dct)
+			continue;
+
+		psf_image[c] = alloc_plane((size_t)width * height *
+				sizeof(*psf_image[c]));
+		if (psf_image[c] == NULL)
+			goto out_err;
+		memset(psf_image[c], 0, (size_t)width * height *
+				sizeof(*psf_image[c]));
+
+		/* alloc memory for complex images */
+		for (i = 0; i < 2; i++) {
+			cimage_a[c][i] = alloc_plane((size_t)(width/2 + 1)
+					* height * sizeof(*cimage_a[c][i]));
+			cimage_b[c][i] = alloc_plane((size_t)(width/2 + 1)
+					* height * sizeof(*cimage_b[c][i]));
+
+			if (cimage_a[c][i] == NULL)
+				goto out_err;
+			if (cimage_b[c][i] == NULL)
+				goto out_err;
+		}
+	}
+
+	if (use_numa)
+		touch_planes();
+
+	/* the planes kernels use are shared with a unified memory device
+	 * (the psf spectrum once it is known, in copy_reusables_to_opencl)
+	 * as far as they can be */
+	for (c = 0; c < n_samples; c++) {
+		share_plane(input_image[c], (size_t)width * height *
+				sizeof(*input_image[c]));
+	}
+	for (c = 0; c < n_channels; c++) {
+		share_plane(current_image[c], (size_t)width * height *
+				sizeof(*current_image[c]));
+		share_plane(image_a[c], (size_t)width * height *
+				sizeof(*image_a[c]));
+		share_plane(image_b[c], (size_t)width * height *
+				sizeof(*image_b[c]));
+
+		for (i = 0; i < 2; i++) {
+			share_plane(cimage_a[c][i], (size_t)(width/2 + 1) *
+					height * sizeof(*cimage_a[c][i]));
+			share_plane(cimage_b[c][i], (size_t)(width/2 + 1) *
+					height * sizeof(*cimage_b[c][i]));
+		}
+	}
+
+	/* a crop of a mapped input is copied out of it, touching only
+	 * its rows */
+	if (input_map.map != NULL && region.cropped) {
+		for (c = 0; c < n_samples; c++) {
+			for (y = 0; y < height; y++) {
+				memcpy(input_image[c] + (size_t)y * width,
+						input_map.data + ((size_t)c
+							*
+							region.image_height
+							+ region.y + y) *
+						region.image_width +
+						region.x, (size_t)width *
+						sizeof(*input_image[c]));
+			}
+		}
+	}
+
+	/* a caller's buffer is converted straight into the planes */
+	if (input_buffer != NULL)
+		convert_buffer_to_float(pool, input_buffer, region.x,
+				region.y, input_image, width, height);
+
+	/* convert input image over to float */
+	load_input_image(original_input_image, 0);
+
+	/* a one channel psf is shared by all channels, otherwise channel
+	 * c uses psf sample c */
+	if (psf_samples != 1 && psf_samples < n_channels) {
+		fprintf(stderr, "psf has %d channels, image has %d\n",
+				psf_samples, n_channels);
+		fflush(stderr);
+		goto out_err;
+	}
+
+	if (use_grid) {
+		if (!frames_only && init_psf_grid() != 0)
+			goto out_err;
+		return 0;
+	}
+
+	/* a warm spectrum of this psf at this size needs none of the
+	 * below, nor the transform in copy_reusables_to_opencl */
+	if (take_warm_psf() == 0)
+		return 0;
+
+	float total[DECONVOLUTE_MAX_CHANNELS] = {0};
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < psf_width * psf_height; i++) {
+			total[c] += psf_value(c, i);
+		}
+	}
+
+	if (use_dct) {
+		printf("PSF is symmetric about both axes, using DCT convolution with reflective edges\n");
+		for (c = 0; c < n_channels; c++) {
+			/* a spectrum kept warm outlives the arena's
+			 * job */
+			cimage_psf[c][0] = psf_cache != NULL ?
+				alloc_kept_plane((size_t)width * height *
+						sizeof(*cimage_psf[c][0])) :
+				alloc_plane((size_t)width * height *
+						sizeof(*cimage_psf[c][0]));
+			if (cimage_psf[c][0] == NULL)
+				goto out_err;
+			if (use_numa)
+				first_touch(cimage_psf[c][0],
+						(size_t)width * height *
+						sizeof(*cimage_psf[c][0]));
+
+			dct_spectrum(c, total[c]);
+		}
+		psf_ready = 1;
+		return 0;
+	}
+
+	/* copy psf over to padded float psf image */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < psf_width; i++) {
+			for (j = 0; j < psf_height; j++) {
+				x = (width - psf_width/2 + i) % width;
+				y = (height - psf_height/2 + j) % height;
+				index = (size_t)y * width + x;
+
+				psf_image[c][index] = psf_value(c, j *
+						psf_width + i) / total[c];
+			}
+		}
+	}
+
+	/* a symmetric psf only needs the real part of its spectrum */
+	if (psf_symmetric)
+		printf("PSF is centro-symmetric, using real spectrum\n");
+
+	/* alloc memory for complex psf */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < (psf_symmetric ? 1 : 2); i++) {
+			cimage_psf[c][i] = psf_cache != NULL ?
+				alloc_kept_plane((size_t)(width/2 + 1) *
+						height *
+						sizeof(*cimage_psf[c][i])) :
+				alloc_plane((size_t)(width/2 + 1) * height *
+						sizeof(*cimage_psf[c][i]));
+			if (cimage_psf[c][i] == NULL)
+				goto out_err;
+			if (use_numa)
+				first_touch(cimage_psf[c][i],
+						(size_t)(width/2 + 1) *
+						height *
+						sizeof(*cimage_psf[c][i]));
+		}
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	cleanup_init_images();
+	return -1;
+}
+
+/*
+ * convert a 16-bit interleaved frame to the float input image (data is
+ * NULL for a mapped float input, which needs no conversion); the
+ * current image (the estimate) is reset to the input unless warm is
+ * nonzero, in which case it keeps the previous result as its starting
+ * point
+ */
+static void load_input_image(uint16_t *data, int warm)
+{
+	int c;
+
+	if (data != NULL)
+		convert_u16_to_float(pool, data, input_image, n_samples,
+				width, height);
+
+	if (warm)
+		return;
+
+	for (c = 0; c < n_channels; c++) {
+		memcpy(current_image[c], input_image[c], (size_t)width *
+				height * sizeof(*current_image[c]));
+	}
+}
+
+/* safe to call again, so one process can run many jobs */
+static void cleanup_init_images()
+{
+	int c, i;
+
+	unshare_planes();
+	put_warm_psf();
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		if (input_map.map == NULL || region.cropped)
+			free_plane(input_image[c]);
+		input_image[c] = NULL;
+		free_plane(current_image[c]);
+		current_image[c] = NULL;
+		free_plane(psf_image[c]);
+		psf_image[c] = NULL;
+		free_plane(image_a[c]);
+		image_a[c] = NULL;
+		free_plane(image_b[c]);
+		image_b[c] = NULL;
+
+		for (i = 0; i < 2; i++) {
+			free_plane(cimage_a[c][i]);
+			cimage_a[c][i] = NULL;
+			free_plane(cimage_b[c][i]);
+			cimage_b[c][i] = NULL;
+			free_plane(cimage_psf[c][i]);
+			cimage_psf[c][i] = NULL;
+		}
+	}
+
+	psf_grid_destroy(psf_grid);
+	psf_grid = NULL;
+
+	free(original_psf_image);
+	original_psf_image = NULL;
+	free(original_input_image);
+	original_input_image = NULL;
+	release_psf_map();
+	float_image_unmap(&input_map);
+}
+
+/*
+ * cut the image into tiles and cache the interpolated psf spectrum of
+ * each from the psf mosaic (see psf_grid.h)
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_psf_grid()
+{
+	int n_psfs;
+	float *mosaic[DECONVOLUTE_MAX_CHANNELS];
+
+	n_psfs = load_psf_mosaic(mosaic);
+	if (n_psfs < 0)
+		goto out_no_mosaic;
+
+	psf_grid = psf_grid_create(pool, mosaic, n_psfs, psf_width,
+			psf_height, psf_grid_x, psf_grid_y, width, height,
+			fft_flags);
+	if (psf_grid == NULL)
+		goto out_err;
+
+	if (psf_grid_x * psf_grid_y > 1)
+		printf("PSF varies over a %dx%d grid, using %d tiles\n",
+				psf_grid_x, psf_grid_y,
+				psf_grid_tiles(psf_grid));
+
+	free_psf_mosaic(mosaic);
+	return 0;
+
+out_err:
+	free_psf_mosaic(mosaic);
+out_no_mosaic:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * copy the psf (all of the mosaic of a psf grid) to float planes, one
+ * per channel or one shared by all
+ *
+ * returns the number of planes, or -1 on failure
+ */
+static int load_psf_mosaic(float **mosaic)
+{
+	int c, i, n_psfs;
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		mosaic[c] = NULL;
+	}
+
+	n_psfs = psf_samples == 1 ? 1 : n_channels;
+	for (c = 0; c < n_psfs; c++) {
+		mosaic[c] = malloc((size_t)psf_width * psf_height *
+				sizeof(*mosaic[c]));
+		if (mosaic[c] == NULL)
+			goto out_err;
+
+		for (i = 0; i < psf_width * psf_height; i++) {
+			mosaic[c][i] = psf_value(c, i);
+		}
+	}
+
+	return n_psfs;
+
+out_err:
+	say_function_failed();
+	free_psf_mosaic(mosaic);
+	return -1;
+}
+
+/* free planes made by load_psf_mosaic */
+static void free_psf_mosaic(float **mosaic)
+{
+	int c;
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		free(mosaic[c]);
+		mosaic[c] = NULL;
+	}
+}
+
+/*
+ * pixel i (row-major) of the psf for channel c, from the decoded 8-bit
+ * psf or the mapped float one
+ */
+static float psf_value(int c, int i)
+{
+	if (psf_samples == 1)
+		c = 0;
+
+	if (psf_map.data != NULL)
+		return psf_map.data[(size_t)c * psf_width * psf_height + i];
+
+	return original_psf_image[psf_samples * i + c];
+}
+
+/* hash of the psf as read (8-bit or mapped float) */
+static uint64_t psf_data_hash()
+{
+	if (psf_map.data != NULL)
+		return checkpoint_hash(psf_map.data, (size_t)psf_samples *
+				psf_width * psf_height *
+				sizeof(*psf_map.data));
+
+	return checkpoint_hash(original_psf_image, (size_t)psf_samples *
+			psf_width * psf_height *
+			sizeof(*original_psf_image));
+}
+
+/* what a warm psf spectrum is keyed by */
+struct warm_psf_key {
+	uint64_t hash;
+	int width, height, n_channels;
+	int psf_width, psf_height, psf_samples;
+	/* a dct spectrum (see use_dct) rather than an fft one */
+	int dct;
+};
+
+static void warm_psf_key(struct warm_psf_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->hash = psf_data_hash();
+	key->width = width;
+	key->height = height;
+	key->n_channels = n_channels;
+	key->psf_width = psf_width;
+	key->psf_height = psf_height;
+	key->psf_samples = psf_samples;
+	key->dct = use_dct;
+}
+
+/*
+ * take the spectrum of this psf at this size from the warm cache into
+ * cimage_psf
+ *
+ * returns 0 if there was one, anything else otherwise
+ */
+static int take_warm_psf()
+{
+	int c, i;
+	struct warm_psf_key key;
+	struct warm_psf *entry;
+
+	if (psf_cache == NULL)
+		return -1;
+
+	warm_psf_key(&key);
+	entry = warm_cache_take(psf_cache, &key, sizeof(key));
+	if (entry == NULL)
+		return -1;
+
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			cimage_psf[c][i] = entry->spectrum[c][i];
+		}
+	}
+	psf_ready = 1;
+	free(entry);
+
+	printf("Using warm PSF spectrum\n");
+	return 0;
+}
+
+/*
+ * hand a finished cimage_psf over to the warm cache (if keeping warm),
+ * leaving it NULL
+ */
+static void put_warm_psf()
+{
+	int c, i;
+	struct warm_psf_key key;
+	struct warm_psf *entry;
+
+	if (psf_cache == NULL || !psf_ready)
+		goto out;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		goto out;
+
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			entry->spectrum[c][i] = cimage_psf[c][i];
+			cimage_psf[c][i] = NULL;
+		}
+	}
+
+	warm_psf_key(&key);
+	warm_cache_put(psf_cache, &key, sizeof(key), entry);
+
+out:
+	psf_ready = 0;
+}
+
+/* free a warm_psf entry */
+static void free_warm_psf(void *value)
+{
+	int c, i;
+	struct warm_psf *entry;
+
+	entry = value;
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		for (i = 0; i < 2; i++) {
+			free(entry->spectrum[c][i]);
+		}
+	}
+	free(entry);
+}
+
+/* what warm fftw plans are keyed by */
+struct warm_plans_key {
+	int width, height, n_threads;
+	/* dct plans (see use_dct) rather than fft ones */
+	int dct;
+	/* planned with these flags, by threads pinned to numa nodes */
+	unsigned fft_flags;
+	int numa;
+};
+
+static void warm_plans_key(struct warm_plans_key *key, int n_threads)
+{
+	memset(key, 0, sizeof(*key));
+	key->width = width;
+	key->height = height;
+	key->n_threads = n_threads;
+	key->dct = use_dct;
+	key->fft_flags = fft_flags;
+	key->numa = use_numa;
+}
+
+/*
+ * allocate fftw input/output arrays and create plans
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_fftw(int n_threads)
+{
+	struct warm_plans *plans;
+	struct warm_plans_key key;
+
+	if (ready_fftw_threads() != 0)
+		goto out_err;
+
+	fftwf_plan_with_nthreads(n_threads);
+	fft_n_threads = n_threads;
+	route_fftw_loops(use_numa);
+
+	/* a psf grid plans its own tile transforms */
+	if (use_grid)
+		return 0;
+
+	/* take warm plans for this size if there are any */
+	warm_plans_key(&key, n_threads);
+	plans = plan_cache == NULL ? NULL : warm_cache_take(plan_cache,
+			&key, sizeof(key));
+	if (plans != NULL) {
+		fft_real = plans->real;
+		fft_complex = plans->complex;
+		fft_forward_plan = plans->forward;
+		fft_backward_plan = plans->backward;
+		free(plans);
+		return 0;
+	}
+
+	/* allocate memory for doing fft computations */
+	/* the arrays of warm plans are kept with them, the others
+	 * carved out of the arena */
+	fft_real = plan_cache != NULL ? NULL : arena_alloc(&arena,
+			(size_t)width * height * sizeof(*fft_real),
+			PLANE_ALIGNMENT);
+	if (fft_real == NULL)
+		fft_real = fftwf_malloc((size_t)width * height *
+				sizeof(*fft_real));
+	if (fft_real == NULL)
+		goto out_err;
+
+	/* the dct pair works in place on fft_real */
+	if (use_dct) {
+		if (use_numa)
+			first_touch(fft_real, (size_t)width * height *
+					sizeof(*fft_real));
+
+		fft_forward_plan = fftwf_plan_r2r_2d(height, width,
+				fft_real, fft_real, FFTW_REDFT10,
+				FFTW_REDFT10, fft_flags);
+		if (fft_forward_plan == NULL)
+			goto out_err;
+
+		fft_backward_plan = fftwf_plan_r2r_2d(height, width,
+				fft_real, fft_real, FFTW_REDFT01,
+				FFTW_REDFT01, fft_flags);
+		if (fft_backward_plan == NULL)
+			goto out_err;
+
+		return 0;
+	}
+
+	fft_complex = plan_cache != NULL ? NULL : arena_alloc(&arena,
+			(size_t)(width/2 + 1) * height * sizeof(*fft_complex),
+			PLANE_ALIGNMENT);
+	if (fft_complex == NULL)
+		fft_complex = fftwf_malloc((size_t)(width/2 + 1) * height *
+				sizeof(*fft_complex));
+	if (fft_complex == NULL)
+		goto out_err;
+
+	if (use_numa) {
+		first_touch(fft_real, (size_t)width * height *
+				sizeof(*fft_real));
+		first_touch(fft_complex, (size_t)(width/2 + 1) * height *
+				sizeof(*fft_complex));
+	}
+
+	/* create fftw plans for both forward and backward ffts */
+	fft_forward_plan = fftwf_plan_dft_r2c_2d(height, width,
+			fft_real, fft_complex, fft_flags);
+	if (fft_forward_plan == NULL)
+		goto out_err;
+
+	fft_backward_plan = fftwf_plan_dft_c2r_2d(height, width,
+			fft_complex, fft_real, fft_flags);
+	if (fft_backward_plan == NULL)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	cleanup_init_fftw();
+	return -1;
+}
+
+/*
+ * make fftw multithreaded, once per process
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int ready_fftw_threads()
+{
+	if (fftw_threads_ready)
+		return 0;
+
+	if (fftwf_init_threads() == 0)
+		return -1;
+	fftw_threads_ready = 1;
+
+	return 0;
+}
+
+/*
+ * safe to call again, so one process can run many jobs; when keeping
+ * warm, complete plans go to the warm cache instead
+ */
+static void cleanup_init_fftw()
+{
+	struct warm_plans *plans;
+	struct warm_plans_key key;
+
+	if (plan_cache != NULL && fft_forward_plan != NULL &&
+			fft_backward_plan != NULL) {
+		plans = malloc(sizeof(*plans));
+		if (plans == NULL)
+			goto out_free;
+
+		plans->real = fft_real;
+		plans->complex = fft_complex;
+		plans->forward = fft_forward_plan;
+		plans->backward = fft_backward_plan;
+		warm_plans_key(&key, fft_n_threads);
+		warm_cache_put(plan_cache, &key, sizeof(key), plans);
+
+		fft_real = NULL;
+		fft_complex = NULL;
+		fft_forward_plan = NULL;
+		fft_backward_plan = NULL;
+		return;
+	}
+
+out_free:
+	if (fft_backward_plan != NULL)
+		fftwf_destroy_plan(fft_backward_plan);
+	fft_backward_plan = NULL;
+	if (fft_forward_plan != NULL)
+		fftwf_destroy_plan(fft_forward_plan);
+	fft_forward_plan = NULL;
+	if (fft_complex != NULL && !arena_owns(&arena, fft_complex))
+		fftwf_free(fft_complex);
+	fft_complex = NULL;
+	if (fft_real != NULL && !arena_owns(&arena, fft_real))
+		fftwf_free(fft_real);
+	fft_real = NULL;
+}
+
+/* free a warm_plans entry */
+static void free_warm_plans(void *value)
+{
+	struct warm_plans *plans;
+
+	plans = value;
+	fftwf_destroy_plan(plans->backward);
+	fftwf_destroy_plan(plans->forward);
+	fftwf_free(plans->complex);
+	fftwf_free(plans->real);
+	free(plans);
+}
+
+/*
+ * create opencl context, queue, program, and kernels and alloc opencl
+ * buffers
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_opencl()
+{
+	int ret;
+	int c, i;
+	cl_bool unified;
+	cl_uint align_bits;
+
+	/* setup context, queue, program, and kernels (still there from
+	 * the last job when keeping warm, the program if it was built
+	 * for the same sizes) */
+	if (context == NULL) {
+		ret = cl_utils_setup_gpu(&context, &queue, &device);
+		if (ret != 0)
+			goto out_err;
+	}
+
+	ret = specialize_program();
+	if (ret != 0)
+		goto out_err;
+
+	/* one work item per vector of values */
+	global_work_size[0] = (size_t)width * height / program_width;
+	global_work_size[1] = (size_t)(width/2 + 1) * height /
+			program_width;
+
+	/* the kernels this psf's convolution uses: a real spectrum (the
+	 * dct's, or a symmetric psf's) needs no complex one, a psf grid
+	 * only the real ones */
+	for (c = 0; c < n_channels; c++) {
+		if (make_kernel(&mult_k[c], "mult") != 0)
+			goto out_err;
+		if (make_kernel(&divide_k[c], "divide") != 0)
+			goto out_err;
+
+		if (use_dct) {
+			if (make_kernel(&real_wiener_k[c], "real_wiener") !=
+					0)
+				goto out_err;
+		} else if (use_grid) {
+			continue;
+		} else if (psf_symmetric) {
+			if (make_kernel(&real_complex_mult_k[c],
+						"real_complex_mult") != 0)
+				goto out_err;
+			if (make_kernel(&real_complex_wiener_k[c],
+						"real_complex_wiener") != 0)
+				goto out_err;
+		} else {
+			if (make_kernel(&complex_mult_k[c], "complex_mult")
+					!= 0)
+				goto out_err;
+			if (make_kernel(&complex_conj_mult_k[c],
+						"complex_conj_mult") != 0)
+				goto out_err;
+			if (make_kernel(&complex_wiener_k[c],
+						"complex_wiener") != 0)
+				goto out_err;
+		}
+	}
+
+	/* a device sharing the host's memory uses the planes themselves,
+	 * with buffers made only for planes that cannot be shared */
+	ret = clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+			sizeof(unified), &unified, NULL);
+	zero_copy = ret == CL_SUCCESS && unified;
+	if (zero_copy) {
+		plane_alignment = SHARED_PLANE_ALIGNMENT;
+		ret = clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+				sizeof(align_bits), &align_bits, NULL);
+		if (ret == CL_SUCCESS && align_bits / 8 > plane_alignment)
+			plane_alignment = align_bits / 8;
+
+		printf("OpenCL device shares host memory, using zero-copy buffers\n");
+		return 0;
+	}
+
+	/* allocate opencl buffers */
+	for (c = 0; c < n_channels; c++) {
+		k_input_image[c] = clCreateBuffer(context,
+				CL_MEM_READ_ONLY, (size_t)width * height *
+				sizeof(cl_float), NULL, NULL);
+		k_image_a[c] = clCreateBuffer(context,
+				CL_MEM_READ_WRITE, (size_t)width * height *
+				sizeof(cl_float), NULL, NULL);
+		k_image_b[c] = clCreateBuffer(context,
+				CL_MEM_READ_WRITE, (size_t)width * height *
+				sizeof(cl_float), NULL, NULL);
+		k_image_c[c] = clCreateBuffer(context,
+				CL_MEM_READ_WRITE, (size_t)width * height *
+				sizeof(cl_float), NULL, NULL);
+
+		if (k_input_image[c] == NULL)
+			goto out_err;
+		if (k_image_a[c] == NULL)
+			goto out_err;
+		if (k_image_b[c] == NULL)
+			goto out_err;
+		if (k_image_c[c] == NULL)
+			goto out_err;
+
+		/* allocate complex buffers (none for the dct) */
+		for (i = 0; i < (use_dct ? 0 : 2); i++) {
+			k_cimage_a[c][i] = clCreateBuffer(context,
+					CL_MEM_READ_WRITE,
+					(size_t)(width/2 + 1) * height *
+					sizeof(cl_float), NULL, NULL);
+			k_cimage_b[c][i] = clCreateBuffer(context,
+					CL_MEM_READ_WRITE,
+					(size_t)(width/2 + 1) * height *
+					sizeof(cl_float), NULL, NULL);
+
+			if (k_cimage_a[c][i] == NULL)
+				goto out_err;
+			if (k_cimage_b[c][i] == NULL)
+				goto out_err;
+		}
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	cleanup_init_opencl();
+	release_opencl_program();
+	return -1;
+}
+
+/* release a buffer (if any) and forget it */
+static void release_mem(cl_mem *mem)
+{
+	if (*mem != NULL)
+		clReleaseMemObject(*mem);
+	*mem = NULL;
+}
+
+/* release a kernel (if any) and forget it */
+static void release_kernel(cl_kernel *kernel)
+{
+	if (*kernel != NULL)
+		clReleaseKernel(*kernel);
+	*kernel = NULL;
+}
+
+/*
+ * wait for the kernels just enqueued on every channel and release
+ * their events, which would otherwise pile up in a process running
+ * many jobs
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int wait_kernels()
+{
+	cl_int ret;
+
+	ret = clWaitForEvents(n_channels, kernel_events);
+	release_kernel_events();
+
+	return ret;
+}
+
+/* release the events of kernel_events (safe to call again) */
+static void release_kernel_events()
+{
+	int c;
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		if (kernel_events[c] != NULL)
+			clReleaseEvent(kernel_events[c]);
+		kernel_events[c] = NULL;
+	}
+}
+
+/*
+ * safe to call again, so one process can run many jobs; when keeping
+ * warm, only the buffers are released
+ */
+static void cleanup_init_opencl()
+{
+	int c, i;
+
+	release_kernel_events();
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		release_mem(&k_input_image[c]);
+		release_mem(&k_image_a[c]);
+		release_mem(&k_image_b[c]);
+		release_mem(&k_image_c[c]);
+
+		for (i = 0; i < 2; i++) {
+			release_mem(&k_cimage_a[c][i]);
+			release_mem(&k_cimage_b[c][i]);
+			release_mem(&k_cimage_psf[c][i]);
+		}
+	}
+
+	if (!keeping_warm)
+		release_opencl_program();
+}
+
+/*
+ * make program the arithmetic kernels (see arithmetic.cl, compiled in
+ * as arithmetic_cl) with the widest vectors dividing this job's plane
+ * sizes: kept from the last job if it had the same width, taken from
+ * the warm programs, or built; the program it replaces goes to the
+ * warm programs when keeping warm, and its kernels are released
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int specialize_program()
+{
+	int ret, vector_width;
+	size_t n_real, n_complex;
+	char options[64];
+
+	/* every work item does a whole vector, no kernel checks bounds */
+	n_real = (size_t)width * height;
+	n_complex = (size_t)(width/2 + 1) * height;
+	vector_width = 4;
+	while (n_real % vector_width != 0 || n_complex % vector_width !=
+			0)
+		vector_width /= 2;
+
+	if (program != NULL && vector_width == program_width)
+		return 0;
+
+	release_kernels();
+	if (program != NULL && program_cache != NULL)
+		warm_cache_put(program_cache, &program_width,
+				sizeof(program_width), program);
+	else if (program != NULL)
+		clReleaseProgram(program);
+	program = NULL;
+
+	if (program_cache != NULL)
+		program = warm_cache_take(program_cache, &vector_width,
+				sizeof(vector_width));
+
+	if (program == NULL) {
+		snprintf(options, sizeof(options),
+				"-D VECTOR_WIDTH=%d -D NATIVE_MATH",
+				vector_width);
+		ret = cl_utils_create_program_from_source(&program,
+				arithmetic_cl, options, context, device);
+		if (ret != 0)
+			goto out_err;
+		printf("OpenCL kernels built for %d-wide vectors\n",
+				vector_width);
+	}
+
+	program_width = vector_width;
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * make *kernel program's kernel name, unless it already is (kernels
+ * are kept as long as the program)
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int make_kernel(cl_kernel *kernel, char *name)
+{
+	if (*kernel == NULL)
+		*kernel = clCreateKernel(program, name, NULL);
+
+	return *kernel == NULL ? -1 : 0;
+}
+
+/* release the kernels (of all channels) */
+static void release_kernels()
+{
+	int c;
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		release_kernel(&mult_k[c]);
+		release_kernel(&complex_mult_k[c]);
+		release_kernel(&complex_conj_mult_k[c]);
+		release_kernel(&real_complex_mult_k[c]);
+		release_kernel(&complex_wiener_k[c]);
+		release_kernel(&real_complex_wiener_k[c]);
+		release_kernel(&real_wiener_k[c]);
+		release_kernel(&divide_k[c]);
+	}
+}
+
+/* free a program kept warm */
+static void free_warm_program(void *value)
+{
+	clReleaseProgram(value);
+}
+
+/* release the kernels, programs, queue and context */
+static void release_opencl_program()
+{
+	release_kernels();
+	warm_cache_destroy(program_cache);
+	program_cache = NULL;
+
+	if (program != NULL)
+		clReleaseProgram(program);
+	program = NULL;
+
+	cl_utils_cleanup_gpu(&context, &queue);
+}
+
+/*
+ * allocate a plane of size bytes, aligned and padded for sharing with
+ * the device if zero_copy (free with free)
+ *
+ * returns the plane, or NULL if failed
+ */
+static float *alloc_plane(size_t size)
+{
+	float *plane;
+
+	plane = arena_alloc(&arena, (size + SHARED_PLANE_GRANULE - 1) /
+			SHARED_PLANE_GRANULE * SHARED_PLANE_GRANULE,
+			zero_copy ? plane_alignment : PLANE_ALIGNMENT);
+	if (plane != NULL)
+		return plane;
+
+	return alloc_kept_plane(size);
+}
+
+/*
+ * allocate a plane like alloc_plane, but on its own, so it may outlive
+ * the job (a psf spectrum kept warm)
+ *
+ * returns the plane, or NULL if failed
+ */
+static float *alloc_kept_plane(size_t size)
+{
+	void *plane;
+
+	size = (size + SHARED_PLANE_GRANULE - 1) / SHARED_PLANE_GRANULE *
+		SHARED_PLANE_GRANULE;
+	if (posix_memalign(&plane, zero_copy ? plane_alignment :
+				PLANE_ALIGNMENT, size) != 0)
+		return NULL;
+
+	return plane;
+}
+
+/* free a plane of alloc_plane (NULL is ignored) */
+static void free_plane(float *plane)
+{
+	if (!arena_owns(&arena, plane))
+		free(plane);
+}
+
+/*
+ * make the arena large enough for every plane init_images, init_fftw
+ * and (if previews is nonzero) init_estimate_sets will carve out of
+ * it, once the sizes and the convolution (use_dct, use_grid) are
+ * known; without it the planes are allocated one by one
+ */
+static void reserve_arena(int previews)
+{
+	size_t size, plane, cplane;
+
+	plane = arena_plane_size((size_t)width * height * sizeof(float));
+	cplane = arena_plane_size((size_t)(width/2 + 1) * height *
+			sizeof(float));
+
+	size = (frames_only ? 1 : previews ? 5 : 3) * n_channels * plane;
+	if (input_map.map == NULL || region.cropped)
+		size += n_samples * plane;
+
+	/* psf_image, cimage_a and cimage_b */
+	if (!use_grid && !use_dct)
+		size += n_channels * (plane + 4 * cplane);
+
+	/* the psf spectrum and fft arrays, unless they are kept warm */
+	if (psf_cache == NULL && use_dct)
+		size += n_channels * plane;
+	else if (psf_cache == NULL && !use_grid)
+		size += 2 * n_channels * cplane;
+	if (plan_cache == NULL && !use_grid)
+		size += plane + (use_dct ? 0 : 2 * cplane);
+
+	if (arena_reserve(&arena, size) != 0) {
+		fprintf(stderr, "no arena of %.1f MB, allocating the planes one by one\n",
+				size / (1024.0 * 1024.0));
+		fflush(stderr);
+		return;
+	}
+
+	printf("Arena: %.1f MB on %s\n", arena.size / (1024.0 * 1024.0),
+			arena_pages_name(&arena));
+}
+
+/* bytes a plane of size bytes may take of the arena, padding included */
+static size_t arena_plane_size(size_t size)
+{
+	return (size + SHARED_PLANE_GRANULE - 1) / SHARED_PLANE_GRANULE *
+		SHARED_PLANE_GRANULE + (use_opencl ? SHARED_PLANE_ALIGNMENT
+				: PLANE_ALIGNMENT);
+}
+
+/*
+ * empty the arena for the next job while keeping warm (except in numa
+ * mode, whose pages must be first touched again), release it otherwise
+ */
+static void release_arena()
+{
+	if (keeping_warm && !use_numa)
+		arena_reset(&arena);
+	else
+		arena_release(&arena);
+}
+
+/*
+ * share the host plane of size bytes with the device (if zero_copy),
+ * leaving it mapped for the host
+ *
+ * returns 0 if shared, anything else if the plane is to be copied
+ * instead (not zero_copy, not aligned, or the device would not have it)
+ */
+static int share_plane(float *host, size_t size)
+{
+	cl_int ret;
+	struct shared_plane *plane;
+	void *mapped;
+
+	if (!zero_copy || host == NULL || (uintptr_t)host %
+			plane_alignment != 0 || n_shared_planes ==
+			SHARED_PLANES_MAX)
+		return -1;
+
+	if (find_shared_plane(host) != NULL)
+		return 0;
+
+	plane = &shared_planes[n_shared_planes];
+	plane->mem = clCreateBuffer(context, CL_MEM_READ_WRITE |
+			CL_MEM_USE_HOST_PTR, size, host, &ret);
+	if (plane->mem == NULL)
+		return -1;
+
+	/* the host may only use a buffer's memory while it is mapped,
+	 * which for a CL_MEM_USE_HOST_PTR buffer is at host itself */
+	mapped = clEnqueueMapBuffer(queue, plane->mem, CL_TRUE,
+			CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL,
+			&ret);
+	if (mapped != host) {
+		if (mapped != NULL) {
+			clEnqueueUnmapMemObject(queue, plane->mem, mapped,
+					0, NULL, NULL);
+			clFinish(queue);
+		}
+		release_mem(&plane->mem);
+		return -1;
+	}
+
+	plane->host = host;
+	plane->size = size;
+	plane->mapped = 1;
+	n_shared_planes++;
+
+	return 0;
+}
+
+/* stop sharing the host plane (if it is), before it is freed */
+static void unshare_plane(float *host)
+{
+	struct shared_plane *plane;
+
+	plane = find_shared_plane(host);
+	if (plane == NULL)
+		return;
+
+	/* kernels may still be using a lent plane */
+	if (plane->mapped)
+		clEnqueueUnmapMemObject(queue, plane->mem, plane->host, 0,
+				NULL, NULL);
+	clFinish(queue);
+	release_mem(&plane->mem);
+
+	*plane = shared_planes[--n_shared_planes];
+}
+
+/* stop sharing all planes */
+static void unshare_planes()
+{
+	while (n_shared_planes > 0) {
+		unshare_plane(shared_planes[0].host);
+	}
+}
+
+/* the shared plane at host, or NULL if it is not shared */
+static struct shared_plane *find_shared_plane(float *host)
+{
+	int i;
+
+	for (i = 0; i < n_shared_planes; i++) {
+		if (shared_planes[i].host == host)
+			return &shared_planes[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * unmap the host plane for kernels until reclaim_planes (the queue is
+ * in order, so the kernels enqueued after see it)
+ *
+ * returns its buffer, or NULL if it is not shared or is on loan to the
+ * preview writer (which reads it meanwhile, so it is copied instead)
+ */
+static cl_mem lend_plane(float *host)
+{
+	struct shared_plane *plane;
+
+	plane = find_shared_plane(host);
+	if (plane == NULL || on_loan(host))
+		return NULL;
+
+	if (plane->mapped) {
+		if (clEnqueueUnmapMemObject(queue, plane->mem, host, 0,
+					NULL, NULL) != CL_SUCCESS)
+			return NULL;
+		plane->mapped = 0;
+	}
+
+	return plane->mem;
+}
+
+/*
+ * whether the host plane is in the estimate set loaned to the preview
+ * writer (see preview), which may still be reading it
+ */
+static int on_loan(float *host)
+{
+	int c;
+
+	if (loaned_set < 0)
+		return 0;
+
+	for (c = 0; c < n_channels; c++) {
+		if (estimate_sets[loaned_set][c] == host)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * map the lent planes back for the host, once the kernels using them
+ * are done
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int reclaim_planes()
+{
+	cl_int ret;
+	int i;
+
+	for (i = 0; i < n_shared_planes; i++) {
+		if (shared_planes[i].mapped)
+			continue;
+
+		clEnqueueMapBuffer(queue, shared_planes[i].mem, CL_TRUE,
+				CL_MAP_READ | CL_MAP_WRITE, 0,
+				shared_planes[i].size, 0, NULL, NULL, &ret);
+		if (ret != CL_SUCCESS)
+			return ret;
+		shared_planes[i].mapped = 1;
+	}
+
+	return CL_SUCCESS;
+}
+
+/*
+ * the buffer holding the host plane on the device: its own if it is
+ * shared, otherwise copy (see copy_reusables_to_opencl)
+ */
+static cl_mem opencl_buffer(float *host, cl_mem copy)
+{
+	cl_mem mem;
+
+	mem = lend_plane(host);
+	return mem != NULL ? mem : copy;
+}
+
+/*
+ * the buffer kernels read the host plane of size bytes from into mem:
+ * its own if it is shared, otherwise *fallback with the plane copied
+ * in
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int to_opencl(float *host, cl_mem *fallback, size_t size,
+		cl_mem *mem)
+{
+	cl_int ret;
+
+	ret = opencl_target(host, fallback, size, mem);
+	if (ret != CL_SUCCESS || *mem != *fallback)
+		return ret;
+
+	return clEnqueueWriteBuffer(queue, *mem, CL_TRUE, 0, size, host,
+			0, NULL, NULL);
+}
+
+/*
+ * the buffer kernels write the host plane of size bytes to into mem:
+ * its own if it is shared, otherwise *fallback (made on first use when
+ * zero_copy) to be copied back by from_opencl
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int opencl_target(float *host, cl_mem *fallback, size_t size,
+		cl_mem *mem)
+{
+	cl_int ret;
+
+	*mem = lend_plane(host);
+	if (*mem != NULL)
+		return CL_SUCCESS;
+
+	if (*fallback == NULL) {
+		*fallback = clCreateBuffer(context, CL_MEM_READ_WRITE |
+				CL_MEM_ALLOC_HOST_PTR, size, NULL, &ret);
+		if (*fallback == NULL)
+			return ret;
+	}
+
+	*mem = *fallback;
+	return CL_SUCCESS;
+}
+
+/*
+ * copy a kernel's result in mem back to the host plane of size bytes,
+ * unless mem is the plane's own (then reclaim_planes maps it back)
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int from_opencl(float *host, cl_mem mem, size_t size)
+{
+	struct shared_plane *plane;
+
+	plane = find_shared_plane(host);
+	if (plane != NULL && plane->mem == mem)
+		return CL_SUCCESS;
+
+	return clEnqueueReadBuffer(queue, mem, CL_TRUE, 0, size, host, 0,
+			NULL, NULL);
+}
+
+/*
+ * copy reusable images to opencl buffers (also computes fft of psf
+ * and allocates its buffers, now that its symmetry is known, before
+ * copying that)
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int copy_reusables_to_opencl()
+{
+	cl_int ret;
+	int c, i;
+	size_t size;
+
+	if (use_grid)
+		return copy_input_to_opencl();
+
+	/* the dct spectrum is computed in init_images, real and of the
+	 * image size */
+	if (use_dct) {
+		size = (size_t)width * height * sizeof(cl_float);
+		for (c = 0; c < n_channels; c++) {
+			if (share_plane(cimage_psf[c][0], size) == 0)
+				continue;
+
+			k_cimage_psf[c][0] = clCreateBuffer(context,
+					CL_MEM_READ_ONLY, size, NULL, &ret);
+			if (k_cimage_psf[c][0] == NULL)
+				goto out_err;
+
+			ret = clEnqueueWriteBuffer(queue,
+					k_cimage_psf[c][0], CL_TRUE, 0,
+					size, cimage_psf[c][0], 0, NULL,
+					NULL);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
+
+		return copy_input_to_opencl();
+	}
+
+	/* compute fft of psf, unless it was warm */
+	if (!psf_ready) {
+		for (c = 0; c < n_channels; c++) {
+			fft(psf_image[c], cimage_psf[c]);
+		}
+		psf_ready = 1;
+	}
+
+	size = (size_t)(width/2 + 1) * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < (psf_symmetric ? 1 : 2); i++) {
+			if (share_plane(cimage_psf[c][i], size) == 0)
+				continue;
+
+			k_cimage_psf[c][i] = clCreateBuffer(context,
+					CL_MEM_READ_ONLY, size, NULL, &ret);
+			if (k_cimage_psf[c][i] == NULL)
+				goto out_err;
+		}
+	}
+
+	ret = copy_input_to_opencl();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
+	/* shared spectra need no copy */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			if (k_cimage_psf[c][i] == NULL)
+				continue;
+
+			ret = clEnqueueWriteBuffer(queue,
+					k_cimage_psf[c][i], CL_TRUE, 0,
+					size, cimage_psf[c][i], 0, NULL,
+					NULL);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return ret;
+}
+
+/*
+ * copy the input image to opencl buffers (again for every frame in
+ * sequence mode; a shared input needs none)
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int copy_input_to_opencl()
+{
+	cl_int ret;
+	int c;
+	cl_mem mem;
+
+	for (c = 0; c < n_channels; c++) {
+		ret = to_opencl(input_image[c], &k_input_image[c],
+				(size_t)width * height * sizeof(cl_float),
+				&mem);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+	}
+
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return ret;
+}
+
+/*
+ * run the Richardson–Lucy iterations up to n_iterations in total,
+ * resuming from and writing checkpoints as asked for by options (or
+ * only the one-shot wiener deconvolution)
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int run_iterations(int n_iterations, struct deconvolute_options
+		*options)
+{
+	int ret;
+	int i, first, checkpointing, previewing;
+	uint64_t input_hash, psf_hash;
+	struct checkpoint_writer writer;
+	struct preview_writer preview_writer;
+
+	/* a one-shot wiener result replaces the passes */
+	if (options->wiener > 0 && !options->wiener_start)
+		return wiener_estimate(options->wiener, 0);
+
+	first = 0;
+	input_hash = 0;
+	psf_hash = 0;
+	checkpointing = options->checkpoint_filename != NULL;
+	previewing = options->preview_filename != NULL &&
+		options->preview_interval > 0;
+
+	/* a crop of a mapped input, or a caller's buffer, is hashed as
+	 * copied out */
+	if (checkpointing && ((input_map.map != NULL && region.cropped) ||
+				input_buffer != NULL)) {
+		for (i = 0; i < n_samples; i++) {
+			input_hash = input_hash * 31 +
+				checkpoint_hash(input_image[i],
+						(size_t)width * height *
+						sizeof(*input_image[i]));
+		}
+	} else if (checkpointing && input_map.map != NULL)
+		input_hash = checkpoint_hash(input_map.data,
+				(size_t)n_samples * width * height *
+				sizeof(*input_map.data));
+	else if (checkpointing)
+		input_hash = checkpoint_hash(original_input_image,
+				(size_t)n_samples * width * height *
+				sizeof(*original_input_image));
+
+	if (checkpointing)
+		psf_hash = psf_data_hash();
+
+	if (checkpointing && options->resume) {
+		ret = checkpoint_read(options->checkpoint_filename,
+				current_image, width, height, n_channels,
+				input_hash, psf_hash, &first);
+		if (ret < 0)
+			goto out_no_writer;
+		if (ret == 0)
+			printf("Resuming from %s at pass %d\n",
+					options->checkpoint_filename,
+					first);
+	}
+
+	/* a resumed estimate is already past the coarse levels (or the
+	 * wiener start) */
+	if (first == 0 && options->wiener > 0 && options->wiener_start) {
+		ret = wiener_estimate(options->wiener, 1);
+		if (ret != 0)
+			goto out_no_writer;
+	} else if (first == 0 && options->coarse_levels > 0) {
+		ret = coarse_start(n_iterations, options);
+		if (ret != 0)
+			goto out_no_writer;
+	}
+
+	if (checkpointing) {
+		ret = checkpoint_writer_init(&writer,
+				options->checkpoint_filename, width,
+				height, n_channels);
+		if (ret != 0)
+			goto out_no_writer;
+	}
+
+	if (previewing) {
+		ret = preview_writer_init(&preview_writer, width, height,
+				n_channels, options->preview_scale);
+		if (ret != 0)
+			goto out_no_preview_writer;
+
+		ret = init_estimate_sets();
+		if (ret != 0)
+			goto out_no_estimate_sets;
+	}
+
+	for (i = first; i < n_iterations; i++) {
+		printf("Pass %d...\n", i);
+
+		ret = do_iteration();
+		if (ret != 0)
+			goto out_iteration_failed;
+
+		if (options->progress != NULL &&
+				options->progress(options->progress_arg, i
+					+ 1, n_iterations) != 0) {
+			fprintf(stderr, "cancelled after pass %d\n", i + 1);
+			fflush(stderr);
+			ret = -1;
+			goto out_iteration_failed;
+		}
+
+		if (previewing && (i + 1) % options->preview_interval ==
+				0) {
+			ret = preview(&preview_writer,
+					options->preview_filename, i + 1);
+			if (ret != 0)
+				goto out_iteration_failed;
+		}
+
+		/* the last pass is always checkpointed, so a finished
+		 * run can be resumed with more iterations */
+		if (checkpointing && (i + 1 == n_iterations ||
+					(options->checkpoint_interval > 0
+					 && (i + 1) %
+					 options->checkpoint_interval ==
+					 0))) {
+			ret = checkpoint_write_async(&writer,
+					current_image, i + 1, input_hash,
+					psf_hash);
+			if (ret != 0)
+				goto out_iteration_failed;
+		}
+	}
+
+	/* a failed preview is not worth failing the run for */
+	if (previewing) {
+		if (preview_writer_wait(&preview_writer) != 0) {
+			fprintf(stderr, "preview: could not write %s\n",
+					preview_writer.filename);
+			fflush(stderr);
+		}
+		cleanup_estimate_sets();
+		preview_writer_cleanup(&preview_writer);
+	}
+
+	if (checkpointing) {
+		ret = checkpoint_writer_wait(&writer);
+		if (ret != 0)
+			goto out_no_estimate_sets;
+		checkpoint_writer_cleanup(&writer);
+	}
+
+	return 0;
+
+out_iteration_failed:
+	if (previewing) {
+		preview_writer_wait(&preview_writer);
+		cleanup_estimate_sets();
+	}
+out_no_estimate_sets:
+	if (previewing)
+		preview_writer_cleanup(&preview_writer);
+out_no_preview_writer:
+	if (checkpointing)
+		checkpoint_writer_cleanup(&writer);
+out_no_writer:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * start current_image from options->coarse_levels of downsampled
+ * passes (see multires.h) and report the cost of the transforms
+ * against a flat run of the same number of passes
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int coarse_start(int n_iterations, struct deconvolute_options
+		*options)
+{
+	int n_psfs, n_levels;
+	double cost, full_size, per_pass;
+	float *mosaic[DECONVOLUTE_MAX_CHANNELS];
+
+	n_psfs = load_psf_mosaic(mosaic);
+	if (n_psfs < 0)
+		goto out_no_mosaic;
+
+	cost = 0;
+	n_levels = multires_estimate(pool, input_image, n_channels, width,
+			height, mosaic, n_psfs, psf_width, psf_height,
+			psf_grid_x, psf_grid_y, options->coarse_levels,
+			options->coarse_iterations, current_image, &cost);
+	if (n_levels < 0)
+		goto out_err;
+
+	/* in transforms of the whole image: two convolutions of two
+	 * transforms each per channel and pass */
+	full_size = use_grid ? (double)psf_grid_transform_size(psf_grid)
+		/ ((double)width * height) : 1;
+	per_pass = 4.0 * n_channels * full_size;
+	printf("Coarse-to-fine: %.1f full-size FFTs (%.1f on %d coarse levels), a flat run of the same %d passes: %.1f\n",
+			cost + per_pass * n_iterations, cost, n_levels,
+			n_iterations + n_levels *
+			options->coarse_iterations, per_pass *
+			(n_iterations + n_levels *
+			 options->coarse_iterations));
+
+	free_psf_mosaic(mosaic);
+	return 0;
+
+out_err:
+	free_psf_mosaic(mosaic);
+out_no_mosaic:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * allocate two more estimate buffer sets so passes can write out of
+ * place (set 0 is current_image itself)
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_estimate_sets()
+{
+	int c, i;
+
+	current_set = 0;
+	for (c = 0; c < n_channels; c++) {
+		estimate_sets[0][c] = current_image[c];
+
+		for (i = 1; i < 3; i++) {
+			estimate_sets[i][c] = alloc_plane((size_t)width *
+					height * sizeof(*estimate_sets[i][c]));
+			if (estimate_sets[i][c] == NULL)
+				goto out_err;
+			share_plane(estimate_sets[i][c], (size_t)width *
+					height * sizeof(*estimate_sets[i][c]));
+		}
+	}
+
+	next_set = 1;
+	loaned_set = -1;
+	rotate_estimate = 1;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	cleanup_estimate_sets();
+	return -1;
+}
+
+/*
+ * free the estimate buffer sets other than the current one, which
+ * stays in current_image (freed by cleanup_init_images)
+ */
+static void cleanup_estimate_sets()
+{
+	int c, i;
+
+	for (i = 0; i < 3; i++) {
+		for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+			if (i != current_set) {
+				unshare_plane(estimate_sets[i][c]);
+				free_plane(estimate_sets[i][c]);
+			}
+			estimate_sets[i][c] = NULL;
+		}
+	}
+
+	loaned_set = -1;
+	rotate_estimate = 0;
+}
+
+/*
+ * lend the current estimate to the preview writer, unless it is still
+ * busy with the previous one, in which case this preview is skipped
+ * rather than making the passes wait; pattern may be numbered by pass
+ * (e.g. preview%04d.tif), otherwise the same file is overwritten
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int preview(struct preview_writer *writer, char *pattern, int
+		pass)
+{
+	int ret;
+	char filename[FILENAME_MAX];
+
+	if (!preview_writer_idle(writer)) {
+		printf("Preview of pass %d skipped, previous preview still writing\n",
+				pass);
+		return 0;
+	}
+
+	if (writer->ret != 0) {
+		fprintf(stderr, "preview: could not write %s\n",
+				writer->filename);
+		fflush(stderr);
+		writer->ret = 0;
+	}
+
+	if (strchr(pattern, '%') == NULL) {
+		ret = snprintf(filename, FILENAME_MAX, "%s", pattern) >=
+			FILENAME_MAX;
+	} else {
+		ret = sequence_filename(filename, pattern, pass);
+	}
+	if (ret != 0)
+		goto out_err;
+
+	loaned_set = current_set;
+	ret = preview_write_async(writer, filename, current_image);
+	if (ret != 0)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/* do one iteration of Richardson–Lucy deconvolution */
+static int do_iteration()
+{
+	int ret;
+	int c;
+
+	/* compute convolution of psf and current image */
+	ret = convolve(current_image, image_a, 0);
+	if (ret != 0)
+		goto out_err;
+
+	/* compute original image/(convolution of psf and current image) */
+	ret = image_input_divide(image_a, image_b);
+	if (ret != 0)
+		goto out_err;
+
+	/* compute convolution of psf(-x) and previous result */
+	ret = convolve(image_b, image_a, 1);
+	if (ret != 0)
+		goto out_err;
+
+	/* multiply current image by previous result to get new current
+	 * image */
+	if (!rotate_estimate) {
+		ret = image_multiply(current_image, image_a,
+				current_image);
+		if (ret != 0)
+			goto out_err;
+
+		return 0;
+	}
+
+	ret = image_multiply(current_image, image_a,
+			estimate_sets[next_set]);
+	if (ret != 0)
+		goto out_err;
+
+	/* the old estimate becomes the next target, unless the preview
+	 * writer still has it */
+	c = current_set;
+	current_set = next_set;
+	next_set = c == loaned_set ? 3 - current_set - loaned_set : c;
+	for (c = 0; c < n_channels; c++) {
+		current_image[c] = estimate_sets[current_set][c];
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * one-shot Wiener (Tikhonov) deconvolution of the input into the
+ * current image with regularization k, by the transforms and psf
+ * spectrum of the passes: one forward transform, one pointwise pass
+ * and one inverse transform per channel.  to start the passes (start
+ * nonzero) it is raised to at least WIENER_START_FLOOR of the input's
+ * mean, since a Richardson–Lucy estimate must be positive and never
+ * leaves 0
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int wiener_estimate(float k, int start)
+{
+	int ret;
+	int c;
+	size_t i, n;
+	double mean;
+	float least;
+
+	printf("Wiener deconvolution, regularization %g\n", k);
+
+	if (use_grid) {
+		for (c = 0; c < n_channels; c++) {
+			psf_grid_wiener(psf_grid, c, input_image[c],
+					current_image[c], k);
+		}
+	} else if (use_dct) {
+		for (c = 0; c < n_channels; c++) {
+			dct(input_image[c], image_a[c]);
+		}
+
+		ret = dct_wiener_multiply(image_a, image_a, k);
+		if (ret != 0)
+			goto out_err;
+
+		for (c = 0; c < n_channels; c++) {
+			idct(image_a[c], current_image[c]);
+		}
+	} else {
+		for (c = 0; c < n_channels; c++) {
+			fft(input_image[c], cimage_a[c]);
+		}
+
+		ret = wiener_multiply(cimage_a, cimage_b, k);
+		if (ret != 0)
+			goto out_err;
+
+		for (c = 0; c < n_channels; c++) {
+			ifft(cimage_b[c], current_image[c]);
+		}
+	}
+
+	if (!start)
+		return 0;
+
+	n = (size_t)width * height;
+	for (c = 0; c < n_channels; c++) {
+		mean = 0;
+		for (i = 0; i < n; i++) {
+			mean += input_image[c][i];
+		}
+		least = WIENER_START_FLOOR * mean / n;
+
+		for (i = 0; i < n; i++) {
+			if (current_image[c][i] < least)
+				current_image[c][i] = least;
+		}
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * quantize the current image and write it as laid out by options; in
+ * the background if options->background_output is nonzero (see
+ * deconvolute_wait_output), so the caller can get on with its next job
+ *
+ * returns 0 on success, anything else on failure
+ */
+static int output(char *output_image_filename, struct
+		deconvolute_options *options)
+{
+	int ret;
+	int c;
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+
+	/* the previous background write still owns the buffer */
+	ret = deconvolute_wait_output();
+	if (ret != 0)
+		goto out_err;
+
+	/* a caller's buffer is filled straight from the planes (their
+	 * roi) */
+	if (image_buffer(output_image_filename) != NULL) {
+		output_planes(planes);
+		for (c = 0; c < n_samples; c++) {
+			planes[c] += (size_t)region.roi_y * width +
+				region.roi_x;
+		}
+		convert_float_to_buffer(pool, planes, width, output_buffer,
+				options->dither);
+		return 0;
+	}
+
+	/* float images are written straight from the planes, before
+	 * cleanup frees them */
+	if (float_image_is_float(output_image_filename)) {
+		ret = write_float_output(output_image_filename);
+		if (ret != 0)
+			goto out_err;
+		return 0;
+	}
+
+	ret = -1;
+
+	/* allocate output buffer */
+	output_job.data = malloc((size_t)n_samples * width * height *
+			sizeof(*output_job.data));
+	if (output_job.data == NULL)
+		goto out_err;
+
+	/* copy the current image to output buffer */
+	quantize_output(output_job.data, options->dither);
+	crop_output(output_job.data);
+
+	strncpy(output_job.filename, output_image_filename, FILENAME_MAX
+			- 1);
+	output_job.filename[FILENAME_MAX - 1] = '\0';
+	output_job.width = region.roi_width;
+	output_job.height = region.roi_height;
+	output_job.n_samples = n_samples;
+	output_job.n_extra = n_extra;
+	output_job.n_threads = thread_pool_size(pool);
+	output_job.compression = options->compression;
+	output_job.tile_size = options->tile_size;
+	output_job.n_levels = options->pyramid_levels;
+
+	/* write TIFF image */
+	if (options->background_output) {
+		ret = pthread_create(&output_job.thread, NULL,
+				encode_frame, &output_job);
+		if (ret != 0)
+			goto out_no_write;
+		output_pending = 1;
+		return 0;
+	}
+
+	encode_frame(&output_job);
+	ret = output_job.ret;
+	if (ret != 0)
+		goto out_no_write;
+
+	free(output_job.data);
+	output_job.data = NULL;
+	return 0;
+
+out_no_write:
+	free(output_job.data);
+	output_job.data = NULL;
+out_err:
+	say_function_failed();
+	return ret;
+}
+
+/*
+ * size and sample layout of a TIFF or float image
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int read_image_size(char *filename, int *w, int *h, int
+		*samples, int *extra)
+{
+	struct deconvolute_buffer *buffer;
+
+	buffer = image_buffer(filename);
+	if (buffer != NULL) {
+		*w = buffer->width;
+		*h = buffer->height;
+		*samples = buffer->n_samples;
+		*extra = buffer->n_extra;
+		return 0;
+	}
+
+	if (float_image_is_float(filename)) {
+		*extra = 0;
+		return float_image_size(filename, w, h, samples);
+	}
+
+	return read_tiff_size(filename, w, h, samples, extra);
+}
+
+/*
+ * the threads to run a job on the input on: n_threads if given (> 0),
+ * otherwise those tuned for this host and the input's size, putting
+ * the tuned planner flags in options; a size not in the tuning file
+ * (or any with options->retune) is tuned and stored first if tune is
+ * nonzero, and runs on every processor otherwise
+ */
+static int tuned_threads(char *input_image_filename, char
+		*psf_image_filename, int n_threads, int tune, struct
+		deconvolute_options *options)
+{
+	struct autotune_result result;
+	struct region r;
+	char default_filename[FILENAME_MAX];
+	char *filename;
+	int w, h;
+
+	if (n_threads > 0)
+		return n_threads;
+
+	filename = options->tuning_filename;
+	if (filename == NULL && autotune_default_filename(default_filename,
+				sizeof(default_filename)) == 0)
+		filename = default_filename;
+
+	if (find_region(input_image_filename, psf_image_filename, options,
+				&r) != 0)
+		goto out_untuned;
+	w = r.width;
+	h = r.height;
+
+	if (filename != NULL && !(tune && options->retune) &&
+			autotune_lookup(filename, w, h, &result) == 0)
+		goto out_tuned;
+
+	if (!tune || ready_fftw_threads() != 0 || autotune_run(w, h, 0,
+				&result) != 0)
+		goto out_untuned;
+	if (filename != NULL)
+		autotune_store(filename, w, h, &result);
+
+out_tuned:
+	options->fft_flags = result.fft_flags;
+	printf("Using %d threads, tuned for %dx%d\n", result.n_threads, w,
+			h);
+	fflush(stdout);
+	return result.n_threads;
+
+out_untuned:
+	return autotune_max_threads();
+}
+
+/*
+ * work out the region of the input a job on options deconvolutes: the
+ * whole image, or the roi grown by ROI_HALO_SUPPORTS psf sizes on each
+ * side and then to a size fft_size likes, as far as the image allows
+ * (centred on the roi, moved in at the image's edges)
+ *
+ * returns 0 on success, anything else if the roi is not in the image
+ */
+static int find_region(char *input_image_filename, char
+		*psf_image_filename, struct deconvolute_options *options,
+		struct region *r)
+{
+	int samples, extra, psf_w, psf_h;
+	int halo_x, halo_y;
+
+	if (read_image_size(input_image_filename, &r->image_width,
+				&r->image_height, &samples, &extra) != 0)
+		return -1;
+
+	r->x = 0;
+	r->y = 0;
+	r->width = r->image_width;
+	r->height = r->image_height;
+	r->roi_x = 0;
+	r->roi_y = 0;
+	r->roi_width = r->width;
+	r->roi_height = r->height;
+	r->cropped = 0;
+	if (options->roi_width <= 0)
+		return 0;
+
+	if (options->roi_x < 0 || options->roi_y < 0 ||
+			options->roi_height <= 0 || options->roi_x +
+			options->roi_width > r->image_width ||
+			options->roi_y + options->roi_height >
+			r->image_height) {
+		fprintf(stderr, "region of interest %dx%d+%d+%d is not within the %dx%d image %s\n",
+				options->roi_width, options->roi_height,
+				options->roi_x, options->roi_y,
+				r->image_width, r->image_height,
+				input_image_filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	if (options->psf_grid_x * options->psf_grid_y > 1) {
+		fprintf(stderr, "a region of interest needs a 1 x 1 psf grid\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	if (read_image_size(psf_image_filename, &psf_w, &psf_h, &samples,
+				&extra) != 0)
+		return -1;
+
+	halo_x = ROI_HALO_SUPPORTS * psf_w;
+	halo_y = ROI_HALO_SUPPORTS * psf_h;
+	r->width = fft_size(options->roi_width + 2 * halo_x);
+	r->height = fft_size(options->roi_height + 2 * halo_y);
+	if (r->width > r->image_width)
+		r->width = r->image_width;
+	if (r->height > r->image_height)
+		r->height = r->image_height;
+
+	r->x = options->roi_x - (r->width - options->roi_width) / 2;
+	r->y = options->roi_y - (r->height - options->roi_height) / 2;
+	if (r->x + r->width > r->image_width)
+		r->x = r->image_width - r->width;
+	if (r->y + r->height > r->image_height)
+		r->y = r->image_height - r->height;
+	if (r->x < 0)
+		r->x = 0;
+	if (r->y < 0)
+		r->y = 0;
+
+	r->roi_x = options->roi_x - r->x;
+	r->roi_y = options->roi_y - r->y;
+	r->roi_width = options->roi_width;
+	r->roi_height = options->roi_height;
+	r->cropped = r->width != r->image_width || r->height !=
+		r->image_height;
+
+	return 0;
+}
+
+/* the least size from n up with no prime factors over 7 */
+static int fft_size(int n)
+{
+	int m;
+
+	for (;; n++) {
+		m = n;
+		while (m % 2 == 0)
+			m /= 2;
+		while (m % 3 == 0)
+			m /= 3;
+		while (m % 5 == 0)
+			m /= 5;
+		while (m % 7 == 0)
+			m /= 7;
+		if (m == 1)
+			return n;
+	}
+}
+
+/*
+ * move the roi of a quantized width x height region to the start of
+ * data, as a roi_width x roi_height image
+ */
+static void crop_output(uint16_t *data)
+{
+	int y;
+	size_t pixel;
+
+	if (region.roi_width == width && region.roi_height == height)
+		return;
+
+	/* each row moves back, never over a row still to move */
+	pixel = n_samples * sizeof(*data);
+	for (y = 0; y < region.roi_height; y++) {
+		memmove((char *)data + (size_t)y * region.roi_width * pixel,
+				(char *)data + ((size_t)(region.roi_y + y)
+					* width + region.roi_x) * pixel,
+				region.roi_width * pixel);
+	}
+}
+
+/*
+ * write the planes (the roi of them) as a float image
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int write_float_output(char *output_image_filename)
+{
+	int ret;
+	int c, y;
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+	float *crop[DECONVOLUTE_MAX_CHANNELS] = {NULL};
+
+	output_planes(planes);
+	if (region.roi_width == width && region.roi_height == height)
+		return float_image_write(output_image_filename, planes,
+				width, height, n_samples);
+
+	ret = -1;
+	for (c = 0; c < n_samples; c++) {
+		crop[c] = malloc((size_t)region.roi_width *
+				region.roi_height * sizeof(*crop[c]));
+		if (crop[c] == NULL)
+			goto out;
+
+		for (y = 0; y < region.roi_height; y++) {
+			memcpy(crop[c] + (size_t)y * region.roi_width,
+					planes[c] + (size_t)(region.roi_y +
+						y) * width + region.roi_x,
+					region.roi_width *
+					sizeof(*crop[c]));
+		}
+	}
+
+	ret = float_image_write(output_image_filename, crop,
+			region.roi_width, region.roi_height, n_samples);
+
+out:
+	for (c = 0; c < n_samples; c++) {
+		free(crop[c]);
+	}
+	return ret;
+}
+
+/*
+ * plan the job of sizes as configured by options: the peak of the
+ * buffers setup, the passes and output allocate at once (following
+ * init_images, init_fftw, init_opencl, run_iterations and output; the
+ * small and transient ones aside), the transforms of a pass and their
+ * time by the calibrated benchmarks
+ */
+static void plan_config(struct job_sizes *sizes, int n_threads, struct
+		deconvolute_options *options, struct deconvolute_plan
+		*plan)
+{
+	int k, n, n_psfs, w, h, scale, n_tiles, grid;
+	size_t plane, half_plane, tiles, spectra, coarse, streamed;
+	double n_points;
+
+	n = sizes->n_samples - sizes->n_extra;
+	n_psfs = sizes->psf_samples == 1 ? 1 : n;
+	grid = !sizes->dct && (options->psf_grid_x * options->psf_grid_y
+			> 1 || options->cpu_only);
+	plane = (size_t)sizes->width * sizes->height * sizeof(float);
+	half_plane = (size_t)(sizes->width/2 + 1) * sizes->height *
+		sizeof(float);
+
+	plan->width = sizes->width;
+	plan->height = sizes->height;
+	plan->n_channels = n;
+	plan->cpu_only = options->cpu_only;
+	plan->dct = sizes->dct;
+	plan->previews = options->preview_filename != NULL &&
+		options->preview_interval > 0;
+
+	/* the quantized output; a TIFF input is also decoded to 16 bits
+	 * and converted to input_image, a float one used in place */
+	plan->host = (size_t)sizes->n_samples * sizes->width *
+		sizes->height * sizeof(uint16_t);
+	if (!sizes->float_input)
+		plan->host += (size_t)sizes->n_samples * sizes->width *
+			sizes->height * sizeof(uint16_t) +
+			sizes->n_samples * plane;
+
+	/* current_image, image_a and image_b (only the first in joint
+	 * mode) */
+	plan->host += (frames_only ? 1 : 3) * n * plane;
+
+	if (grid) {
+		psf_grid_geometry(sizes->psf_width, sizes->psf_height,
+				options->psf_grid_x, options->psf_grid_y,
+				sizes->width, sizes->height,
+				&plan->fft_width, &plan->fft_height,
+				&n_tiles);
+		if (!frames_only)
+			plan->host += psf_grid_memory(n_psfs,
+					sizes->psf_width,
+					sizes->psf_height,
+					options->psf_grid_x,
+					options->psf_grid_y, sizes->width,
+					sizes->height);
+	} else if (sizes->dct) {
+		plan->fft_width = sizes->width;
+		plan->fft_height = sizes->height;
+		n_tiles = 1;
+
+		/* the real psf spectrum and the plane the dct pair works
+		 * in */
+		plan->host += n * plane + plane;
+	} else {
+		plan->fft_width = sizes->width;
+		plan->fft_height = sizes->height;
+		n_tiles = 1;
+
+		/* psf_image, cimage_a, cimage_b, cimage_psf (at most)
+		 * and the fftw buffers */
+		plan->host += n * plane + 6 * n * half_plane;
+		plan->host += plane + 2 * half_plane;
+	}
+
+	/* estimate sets and the preview writer's buffer */
+	if (plan->previews) {
+		scale = options->preview_scale > 0 ? options->preview_scale :
+			1;
+		plan->host += 2 * n * plane;
+		plan->host += (size_t)(n >= 3 ? 3 : 1) * (sizes->width /
+				scale + 1) * (sizes->height/scale + 1) *
+			sizeof(uint16_t);
+	}
+
+	/* the checkpoint snapshot */
+	if (options->checkpoint_filename != NULL)
+		plan->host += n * plane;
+
+	/* the coarse levels (while all the above is allocated): input,
+	 * estimate and two scratch planes per level plus its whole image
+	 * psf_grid */
+	w = sizes->width;
+	h = sizes->height;
+	coarse = 0;
+	for (k = 0; k < options->coarse_levels; k++) {
+		if ((w + 1) / 2 < MULTIRES_MIN_SIZE || (h + 1) / 2 <
+				MULTIRES_MIN_SIZE)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		coarse += (size_t)(2 * n + 2) * w * h * sizeof(float);
+		coarse += psf_grid_memory(n_psfs, sizes->psf_width,
+				sizes->psf_height, options->psf_grid_x,
+				options->psf_grid_y, w, h);
+	}
+	plan->host += coarse;
+	plan->coarse_levels = k;
+
+	/* k_input_image, k_image_a/b/c, k_cimage_a/b and k_cimage_psf
+	 * (no complex buffers and a real spectrum for the dct) */
+	plan->device = 0;
+	if (!options->cpu_only && sizes->dct) {
+		plan->device = 5 * n * plane;
+	} else if (!options->cpu_only) {
+		plan->device = 4 * n * plane + 4 * n * half_plane;
+		if (!grid)
+			plan->device += 2 * n * half_plane;
+	}
+
+	/* two convolutions of a forward and a backward transform per
+	 * channel and tile */
+	plan->n_ffts = 4 * n * n_tiles;
+
+	/* and the bytes streamed around them: through the tiles and
+	 * spectra on the cpu, or to and from the device */
+	tiles = (size_t)n_tiles * plan->fft_width * plan->fft_height *
+		sizeof(float);
+	spectra = (size_t)n_tiles * (plan->fft_width/2 + 1) *
+		plan->fft_height * 2 * sizeof(float);
+	if (grid)
+		streamed = 2 * (tiles + 3 * spectra + plane);
+	else if (sizes->dct)
+		streamed = 4 * plane;
+	else
+		streamed = 4 * spectra;
+	streamed += (options->cpu_only ? 6 : 5) * plane;
+	streamed *= n;
+
+	n_points = (double)plan->fft_width * plan->fft_height;
+	plan->pass_seconds = plan->n_ffts * n_points * log2(n_points) *
+		fft_seconds / (n_threads > 0 ? n_threads : 1) + streamed *
+		byte_seconds;
+}
+
+/* whether plan is within the budgets of options */
+static int plan_fits(struct deconvolute_plan *plan, struct
+		deconvolute_options *options)
+{
+	if (options->memory_budget > 0 && plan->host >
+			options->memory_budget)
+		return 0;
+	if (options->device_memory_budget > 0 && plan->device >
+			options->device_memory_budget)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * benchmark this host once per process: seconds per point and log2
+ * point of a fftw transform pair on one thread, and per byte copied
+ * (for the arithmetic and transfers around them)
+ */
+static void calibrate()
+{
+	float *real;
+	fftwf_complex *complex;
+	fftwf_plan forward, backward;
+	char *from, *to;
+	struct timespec start, end;
+	double n_points;
+	int i;
+
+	calibrated = 1;
+
+	real = fftwf_malloc(CALIBRATION_SIZE * CALIBRATION_SIZE *
+			sizeof(*real));
+	complex = fftwf_malloc((CALIBRATION_SIZE/2 + 1) *
+			CALIBRATION_SIZE * sizeof(*complex));
+	if (real == NULL || complex == NULL)
+		goto out_no_buffers;
+
+	if (fftw_threads_ready)
+		fftwf_plan_with_nthreads(1);
+	forward = fftwf_plan_dft_r2c_2d(CALIBRATION_SIZE,
+			CALIBRATION_SIZE, real, complex, FFTW_ESTIMATE);
+	backward = fftwf_plan_dft_c2r_2d(CALIBRATION_SIZE,
+			CALIBRATION_SIZE, complex, real, FFTW_ESTIMATE);
+	if (forward == NULL || backward == NULL)
+		goto out_no_plans;
+
+	for (i = 0; i < CALIBRATION_SIZE * CALIBRATION_SIZE; i++) {
+		real[i] = i % 7;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < CALIBRATION_RUNS; i++) {
+		fftwf_execute(forward);
+		fftwf_execute(backward);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	n_points = (double)CALIBRATION_SIZE * CALIBRATION_SIZE;
+	fft_seconds = ((end.tv_sec - start.tv_sec) + (end.tv_nsec -
+				start.tv_nsec) / 1e9) / (2.0 *
+				CALIBRATION_RUNS * n_points *
+				log2(n_points));
+
+	/* large enough not to fit in cache */
+	from = calloc(CALIBRATION_BYTES, 1);
+	to = malloc(CALIBRATION_BYTES);
+	if (from != NULL && to != NULL) {
+		memcpy(to, from, CALIBRATION_BYTES);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < CALIBRATION_RUNS; i++) {
+			memcpy(i % 2 ? from : to, i % 2 ? to : from,
+					CALIBRATION_BYTES);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		byte_seconds = ((end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9) /
+			(2.0 * CALIBRATION_RUNS * CALIBRATION_BYTES);
+	}
+	free(to);
+	free(from);
+
+out_no_plans:
+	if (backward != NULL)
+		fftwf_destroy_plan(backward);
+	if (forward != NULL)
+		fftwf_destroy_plan(forward);
+out_no_buffers:
+	if (complex != NULL)
+		fftwf_free(complex);
+	if (real != NULL)
+		fftwf_free(real);
+}
+
+/*
+ * format frame number n into a FILENAME_MAX sized buf using pattern,
+ * which must contain exactly one %d style conversion (optionally with
+ * a zero flag and a width, e.g. %04d) and no other conversions
+ *
+ * returns 0 on success, anything else if pattern is not a valid
+ * numbered pattern or the name does not fit
+ */
+static int sequence_filename(char *buf, char *pattern, int n)
+{
+	char *p;
+	int n_conversions;
+
+	n_conversions = 0;
+	for (p = strchr(pattern, '%'); p != NULL; p = strchr(p, '%')) {
+		p++;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (*p != 'd')
+			return -1;
+		n_conversions++;
+	}
+	if (n_conversions != 1)
+		return -1;
+
+	if (snprintf(buf, FILENAME_MAX, pattern, n) >= FILENAME_MAX)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * count consecutive existing files of a numbered series starting at
+ * first_frame
+ *
+ * returns the number of frames, or -1 if pattern is not a valid
+ * numbered pattern
+ */
+static int count_frames(char *input_pattern, int first_frame)
+{
+	int n;
+	FILE *file;
+	char filename[FILENAME_MAX];
+
+	for (n = 0; ; n++) {
+		if (sequence_filename(filename, input_pattern,
+					first_frame + n) != 0)
+			return -1;
+
+		if ((file = fopen(filename, "rb")) == NULL)
+			return n;
+		fclose(file);
+	}
+}
+
+/* thread function decoding a struct frame_job */
+static void *decode_frame(void *arg)
+{
+	struct frame_job *job;
+
+	job = arg;
+	/* not pinned to the main thread's node, nor are its threads */
+	if (use_numa)
+		numa_unpin(&topology);
+	if (job->region_width > 0) {
+		job->data = read_tiff16_region(job->filename, job->page,
+				job->x, job->y, job->region_width,
+				job->region_height, &job->n_samples,
+				&job->n_extra);
+		job->width = job->region_width;
+		job->height = job->region_height;
+	} else {
+		job->data = read_tiff16_page(job->filename, job->page,
+				job->n_threads, &job->width,
+				&job->height, &job->n_samples,
+				&job->n_extra);
+	}
+	job->ret = job->data == NULL ? -1 : 0;
+
+	return NULL;
+}
+
+/* thread function encoding a struct frame_job */
+static void *encode_frame(void *arg)
+{
+	struct frame_job *job;
+
+	job = arg;
+	/* not pinned to the main thread's node, nor are its threads */
+	if (use_numa)
+		numa_unpin(&topology);
+	job->ret = write_tiff16_tiled(job->filename, job->data, job->width,
+			job->height, job->n_samples, job->n_extra,
+			job->compression, job->n_threads, job->tile_size,
+			job->n_levels);
+
+	return NULL;
+}
+
+/*
+ * read the psf of a frame into float planes, one per channel or one
+ * shared by all like the engine's psf, which it must match in size and
+ * samples
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int read_frame_psf(char *filename, float **planes)
+{
+	int c, i, n_psfs;
+	int w, h, samples;
+	uint8_t *data;
+	struct float_image map;
+
+	data = NULL;
+	map.data = NULL;
+	if (float_image_is_float(filename)) {
+		if (float_image_map(&map, filename) != 0)
+			goto out_no_psf;
+		w = map.width;
+		h = map.height;
+		samples = map.n_channels;
+	} else {
+		data = read_tiff8(filename, &w, &h, &samples);
+		if (data == NULL)
+			goto out_no_psf;
+	}
+
+	if (w != psf_width || h != psf_height || samples != psf_samples) {
+		fprintf(stderr, "%s is %dx%dx%d, expected %dx%dx%d like the first psf\n",
+				filename, w, h, samples, psf_width,
+				psf_height, psf_samples);
+		fflush(stderr);
+		goto out_err;
+	}
+
+	n_psfs = psf_samples == 1 ? 1 : n_channels;
+	for (c = 0; c < n_psfs; c++) {
+		planes[c] = malloc((size_t)psf_width * psf_height *
+				sizeof(*planes[c]));
+		if (planes[c] == NULL) {
+			free_frame_planes(planes, c);
+			goto out_err;
+		}
+
+		for (i = 0; i < psf_width * psf_height; i++) {
+			planes[c][i] = map.data != NULL ? map.data[(size_t)c
+				* psf_width * psf_height + i] :
+				data[psf_samples * i + c];
+		}
+	}
+
+	if (map.data != NULL)
+		float_image_unmap(&map);
+	free(data);
+	return 0;
+
+out_err:
+	if (map.data != NULL)
+		float_image_unmap(&map);
+	free(data);
+out_no_psf:
+	say_function_failed();
+	return -1;
+}
+
+/* free n planes (NULL ones are fine), leaving them NULL */
+static void free_frame_planes(float **planes, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(planes[i]);
+		planes[i] = NULL;
+	}
+}
+
+/*
+ * quantize the current image to a 16-bit interleaved buffer, rounding
+ * to nearest or with an ordered dither; samples past n_channels are
+ * passed through from the input
+ */
+static void quantize_output(uint16_t *out, int dither)
+{
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+
+	output_planes(planes);
+	convert_float_to_u16(pool, planes, out, n_samples, width, height,
+			dither);
+}
+
+/*
+ * the planes of the output: the current image, then the passed through
+ * samples of the input
+ */
+static void output_planes(float **planes)
+{
+	int c;
+
+	for (c = 0; c < n_samples; c++) {
+		planes[c] = c < n_channels ? current_image[c] :
+			input_image[c];
+	}
+}
+
+/*
+ * check whether every channel's psf (as read) is point-symmetric about
+ * its centre pixel, as it is padded (centred on pixel 0), i.e. psf(x)
+ * == psf(-x) to within PSF_SYMMETRY_TOLERANCE
+ *
+ * returns nonzero if symmetric, 0 otherwise
+ */
+static int psf_is_symmetric()
+{
+	int c, x, y, i, mx, my;
+	float max, v, diff;
+
+	if (psf_samples != 1 && psf_samples < n_channels)
+		return 0;
+
+	for (c = 0; c < n_channels; c++) {
+		max = 0;
+		for (i = 0; i < psf_width * psf_height; i++) {
+			if (psf_value(c, i) > max)
+				max = psf_value(c, i);
+		}
+
+		for (y = 0; y < psf_height; y++) {
+			for (x = 0; x < psf_width; x++) {
+				/* mirrored through the centre, 0 past the
+				 * edge (of an even psf) */
+				mx = psf_width / 2 * 2 - x;
+				my = psf_height / 2 * 2 - y;
+				v = mx < psf_width && my < psf_height ?
+					psf_value(c, my * psf_width + mx) :
+					0;
+
+				diff = psf_value(c, y * psf_width + x) - v;
+				if (diff > PSF_SYMMETRY_TOLERANCE * max ||
+						-diff >
+						PSF_SYMMETRY_TOLERANCE * max)
+					return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * check whether every channel's psf (as read) is symmetric about both
+ * axes through its centre pixel, to within PSF_SYMMETRY_TOLERANCE, and
+ * no more than twice the image size, so the dct can convolve with it
+ *
+ * returns nonzero if so, 0 otherwise
+ */
+static int psf_allows_dct()
+{
+	int n_psfs, ret;
+	float *mosaic[DECONVOLUTE_MAX_CHANNELS];
+
+	if (psf_samples != 1 && psf_samples < n_channels)
+		return 0;
+
+	n_psfs = load_psf_mosaic(mosaic);
+	if (n_psfs < 0)
+		return 0;
+
+	ret = psf_planes_allow_dct(mosaic, n_psfs, psf_width, psf_height,
+			width, height);
+	free_psf_mosaic(mosaic);
+
+	return ret;
+}
+
+/*
+ * psf_allows_dct for the psf in filename (a file or the psf buffer),
+ * read on its own for planning a w x h job of n channels
+ *
+ * returns nonzero if it allows the dct, 0 if not, -1 if it could not
+ * be read
+ */
+static int psf_file_allows_dct(char *filename, int w, int h, int n)
+{
+	int c, i, ret;
+	int psf_w, psf_h, samples;
+	uint8_t *data;
+	float *values;
+	float *planes[DECONVOLUTE_MAX_CHANNELS];
+	struct float_image map;
+	struct deconvolute_buffer *buffer;
+
+	data = NULL;
+	values = NULL;
+	map.data = NULL;
+	buffer = image_buffer(filename);
+	if (buffer != NULL) {
+		psf_w = buffer->width;
+		psf_h = buffer->height;
+		samples = buffer->n_samples;
+	} else if (float_image_is_float(filename)) {
+		if (float_image_map(&map, filename) != 0)
+			goto out_err;
+		psf_w = map.width;
+		psf_h = map.height;
+		samples = map.n_channels;
+	} else {
+		data = read_tiff8(filename, &psf_w, &psf_h, &samples);
+		if (data == NULL)
+			goto out_err;
+	}
+
+	ret = 0;
+	if ((samples != 1 && samples < n) || samples >
+			DECONVOLUTE_MAX_CHANNELS)
+		goto out;
+
+	if (map.data != NULL) {
+		for (c = 0; c < samples; c++) {
+			planes[c] = map.data + (size_t)c * psf_w * psf_h;
+		}
+	} else {
+		values = malloc((size_t)samples * psf_w * psf_h *
+				sizeof(*values));
+		if (values == NULL)
 			goto out_err;
-
-		for (i = 0; i < 2; i++) {
-			ret = clEnqueueWriteBuffer(queue,
-					k_cimage_psf[c][i], CL_TRUE, 0,
-					(width/2 + 1) * height *
-					sizeof(cl_float),
-					cimage_psf[c][i], 0, NULL,
-					&copy_events[c][i]);
-			if (ret != CL_SUCCESS)
-				goto out_err;
+		for (c = 0; c < samples; c++) {
+			planes[c] = values + (size_t)c * psf_w * psf_h;
 		}
 
-		ret = clWaitForEvents(3, copy_events[c]);
-		if (ret != CL_SUCCESS)
-			goto out_err;
+		if (buffer != NULL) {
+			convert_buffer_to_float(NULL, buffer, 0, 0, planes,
+					psf_w, psf_h);
+		} else {
+			for (c = 0; c < samples; c++) {
+				for (i = 0; i < psf_w * psf_h; i++) {
+					planes[c][i] = data[samples * i +
+						c];
+				}
+			}
+		}
 	}
 
-	return 0;
+	ret = psf_planes_allow_dct(planes, samples == 1 ? 1 : n, psf_w,
+			psf_h, w, h);
+
+out:
+	if (map.data != NULL)
+		float_image_unmap(&map);
+	free(values);
+	free(data);
+	return ret;
 
 out_err:
 	say_function_failed();
-	return ret;
+	if (map.data != NULL)
+		float_image_unmap(&map);
+	free(data);
+	return -1;
 }
 
-/* do one iteration of Richardson–Lucy deconvolution */
-static int do_iteration()
+/*
+ * the test of psf_allows_dct on n_psfs psf_w x psf_h planes, for a
+ * w x h image
+ *
+ * returns nonzero if they allow the dct, 0 otherwise
+ */
+static int psf_planes_allow_dct(float **planes, int n_psfs, int psf_w,
+		int psf_h, int w, int h)
 {
-	int ret;
-	int c;
+	int c, x, y, i;
+	float max, v, diff;
+	float *psf;
+
+	if (psf_w % 2 == 0 || psf_h % 2 == 0 || psf_w / 2 >= w || psf_h /
+			2 >= h)
+		return 0;
+
+	for (c = 0; c < n_psfs; c++) {
+		psf = planes[c];
+		max = 0;
+		for (i = 0; i < psf_w * psf_h; i++) {
+			if (psf[i] > max)
+				max = psf[i];
+		}
 
-	/* compute convolution of psf and current image */
-	for (c = 0; c < 3; c++) {
-		fft(current_image[c], cimage_a[c]);
+		for (y = 0; y < psf_h; y++) {
+			for (x = 0; x < psf_w; x++) {
+				v = psf[y * psf_w + x];
+				diff = v - psf[y * psf_w + psf_w - 1 - x];
+				if (diff > PSF_SYMMETRY_TOLERANCE * max ||
+						-diff >
+						PSF_SYMMETRY_TOLERANCE * max)
+					return 0;
+
+				diff = v - psf[(psf_h - 1 - y) * psf_w + x];
+				if (diff > PSF_SYMMETRY_TOLERANCE * max ||
+						-diff >
+						PSF_SYMMETRY_TOLERANCE * max)
+					return 0;
+			}
+		}
 	}
 
-	ret = cpsf_multiply(cimage_a, cimage_b);
-	if (ret != 0)
-		goto out_err;
+	return 1;
+}
+
+/* psf of channel c at offset (x, y) from its centre, 0 past its edge */
+static float psf_tap(int c, int x, int y)
+{
+	if (x > psf_width / 2 || y > psf_height / 2)
+		return 0;
 
-	for (c = 0; c < 3; c++) {
-		ifft(cimage_b[c], image_a[c]);
+	return psf_value(c, (y + psf_height / 2) * psf_width + x +
+			psf_width / 2);
+}
+
+/*
+ * the dct spectrum of channel c's psf (normalized by total) into
+ * cimage_psf[c][0]: the dct of the blurred unit impulse at pixel 0
+ * (reflected about the edges, each pixel gathers the psf taps at its
+ * offset and one past it along each axis) divided by the dct of the
+ * impulse itself, 4 cos(pi kx / 2w) cos(pi ky / 2h)
+ */
+static void dct_spectrum(int c, float total)
+{
+	float *spectrum;
+	double pi, wx, wy;
+	int x, y;
+
+	spectrum = cimage_psf[c][0];
+	memset(spectrum, 0, (size_t)width * height * sizeof(*spectrum));
+
+	for (y = 0; y <= psf_height / 2; y++) {
+		for (x = 0; x <= psf_width / 2; x++) {
+			spectrum[(size_t)y * width + x] = (psf_tap(c, x, y) +
+					psf_tap(c, x + 1, y) + psf_tap(c,
+						x, y + 1) + psf_tap(c, x +
+						1, y + 1)) / total;
+		}
 	}
 
-	/* compute original image/(convolution of psf and current image) */
-	ret = image_input_divide(image_a, image_b);
-	if (ret != 0)
-		goto out_err;
+	dct(spectrum, spectrum);
 
-	/* compute convolution of psf(-x) and previous result */
-	for (c = 0; c < 3; c++) {
-		fft(image_b[c], cimage_b[c]);
+	pi = acos(-1.0);
+	for (y = 0; y < height; y++) {
+		wy = 4 * cos(pi * y / (2.0 * height));
+		for (x = 0; x < width; x++) {
+			wx = cos(pi * x / (2.0 * width));
+			spectrum[(size_t)y * width + x] /= wx * wy;
+		}
 	}
+}
 
-	ret = cpsf_conj_multiply(cimage_b, cimage_a);
-	if (ret != 0)
+/*
+ * multiply complex psf with complex image
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int cpsf_multiply(float *in[][2], float *out[][2])
+{
+	cl_int ret;
+	int c, i;
+	size_t size;
+	cl_mem psf[2];
+	cl_mem a[DECONVOLUTE_MAX_CHANNELS][2];
+	cl_mem b[DECONVOLUTE_MAX_CHANNELS][2];
+
+	/* copy in to opencl buffers */
+	size = (size_t)(width/2 + 1) * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			ret = to_opencl(in[c][i], &k_cimage_a[c][i], size,
+					&a[c][i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+
+			ret = opencl_target(out[c][i], &k_cimage_b[c][i],
+					size, &b[c][i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
+	}
+
+	/* run kernels */
+	for (c = 0; c < n_channels; c++) {
+		psf[0] = opencl_buffer(cimage_psf[c][0], k_cimage_psf[c][0]);
+		if (psf_symmetric) {
+			ret = real_complex_multiply(c, psf[0], a[c], b[c]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+			continue;
+		}
+		psf[1] = opencl_buffer(cimage_psf[c][1], k_cimage_psf[c][1]);
+
+		ret = clSetKernelArg(complex_mult_k[c], 0, sizeof(cl_mem),
+				&psf[0]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_mult_k[c], 1, sizeof(cl_mem),
+				&psf[1]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_mult_k[c], 2, sizeof(cl_mem),
+				&a[c][0]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_mult_k[c], 3, sizeof(cl_mem),
+				&a[c][1]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_mult_k[c], 4, sizeof(cl_mem),
+				&b[c][0]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_mult_k[c], 5, sizeof(cl_mem),
+				&b[c][1]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clEnqueueNDRangeKernel(queue, complex_mult_k[c],
+				1, NULL, &global_work_size[1], NULL, 0,
+				NULL, &kernel_events[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+	}
+
+	ret = wait_kernels();
+	if (ret != CL_SUCCESS)
 		goto out_err;
 
-	for (c = 0; c < 3; c++) {
-		ifft(cimage_a[c], image_a[c]);
+	/* copy opencl buffers to out */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			ret = from_opencl(out[c][i], b[c][i], size);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
 	}
 
-	/* multiply current image by previous result to get new current
-	 * image */
-	ret = image_multiply(current_image, image_a, current_image);
-	if (ret != 0)
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
 		goto out_err;
 
 	return 0;
 
 out_err:
 	say_function_failed();
-	return -1;
+	return ret;
 }
 
-static int output(char *output_image_filename)
+/*
+ * enqueue the real psf spectrum times in into out for channel c
+ * (symmetric psf only)
+ *
+ * returns CL_SUCCESS on success, anything else otherwise
+ */
+static cl_int real_complex_multiply(int c, cl_mem psf, cl_mem *in,
+		cl_mem *out)
 {
-	int i;
-	int ret;
-	uint16_t *original_output_image;
+	cl_int ret;
 
-	ret = -1;
+	ret = clSetKernelArg(real_complex_mult_k[c], 0, sizeof(cl_mem),
+			&psf);
+	if (ret != CL_SUCCESS)
+		return ret;
 
-	/* allocate output buffer */
-	original_output_image = malloc(3 * width * height *
-			sizeof(*original_output_image));
-	if (original_output_image == NULL)
-		goto out_nomem;
+	ret = clSetKernelArg(real_complex_mult_k[c], 1, sizeof(cl_mem),
+			&in[0]);
+	if (ret != CL_SUCCESS)
+		return ret;
 
-	/* copy the current image to output buffer */
-	for (i = 0; i < 3 * width * height; i++) {
-		if (current_image[i%3][i/3] >= 1) {
-			original_output_image[i] = UINT16_MAX;
-		} else {
-			original_output_image[i] =
-				current_image[i%3][i/3] * UINT16_MAX;
-		}
+	ret = clSetKernelArg(real_complex_mult_k[c], 2, sizeof(cl_mem),
+			&in[1]);
+	if (ret != CL_SUCCESS)
+		return ret;
+
+	ret = clSetKernelArg(real_complex_mult_k[c], 3, sizeof(cl_mem),
+			&out[0]);
+	if (ret != CL_SUCCESS)
+		return ret;
+
+	ret = clSetKernelArg(real_complex_mult_k[c], 4, sizeof(cl_mem),
+			&out[1]);
+	if (ret != CL_SUCCESS)
+		return ret;
+
+	return clEnqueueNDRangeKernel(queue, real_complex_mult_k[c], 1,
+			NULL, &global_work_size[1], NULL, 0, NULL,
+			&kernel_events[c]);
+}
+
+/*
+ * divide input image with a real image
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int image_input_divide(float **in, float **out)
+{
+	cl_int ret;
+	int c;
+	size_t size;
+	cl_mem input;
+	cl_mem a[DECONVOLUTE_MAX_CHANNELS], b[DECONVOLUTE_MAX_CHANNELS];
+
+	if (!use_opencl) {
+		cpu_pointwise(in, input_image, out, 1);
+		return 0;
 	}
 
-	/* write TIFF image */
-	ret = write_tiff16(output_image_filename, original_output_image,
-			width, height);
-	if (ret != 0)
-		goto out_no_write;
+	/* copy in to opencl buffers */
+	size = (size_t)width * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		ret = to_opencl(in[c], &k_image_a[c], size, &a[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = opencl_target(out[c], &k_image_b[c], size, &b[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+	}
+
+	/* run kernels */
+	for (c = 0; c < n_channels; c++) {
+		input = opencl_buffer(input_image[c], k_input_image[c]);
+		ret = clSetKernelArg(divide_k[c], 0, sizeof(cl_mem),
+				&input);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(divide_k[c], 1, sizeof(cl_mem),
+				&a[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(divide_k[c], 2, sizeof(cl_mem),
+				&b[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clEnqueueNDRangeKernel(queue, divide_k[c], 1,
+				NULL, &global_work_size[0], NULL, 0,
+				NULL, &kernel_events[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+	}
+
+	ret = wait_kernels();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
+	/* copy opencl buffers to out */
+	for (c = 0; c < n_channels; c++) {
+		ret = from_opencl(out[c], b[c], size);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+	}
+
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
 
-	free(original_output_image);
 	return 0;
 
-out_no_write:
-	free(original_output_image);
-out_nomem:
+out_err:
 	say_function_failed();
 	return ret;
 }
 
 /*
- * multiply complex psf with complex image
+ * multiply conj(psf) with complex image
  *
  * returns 0 on success, anything else otherwise
  */
-static int cpsf_multiply(float *in[3][2], float *out[3][2])
+static int cpsf_conj_multiply(float *in[][2], float *out[][2])
 {
 	cl_int ret;
 	int c, i;
+	size_t size;
+	cl_mem psf[2];
+	cl_mem a[DECONVOLUTE_MAX_CHANNELS][2];
+	cl_mem b[DECONVOLUTE_MAX_CHANNELS][2];
 
 	/* copy in to opencl buffers */
-	for (c = 0; c < 3; c++) {
+	size = (size_t)(width/2 + 1) * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
 		for (i = 0; i < 2; i++) {
-			ret = clEnqueueWriteBuffer(queue,
-					k_cimage_a[c][i], CL_TRUE, 0,
-					(width/2 + 1) * height *
-					sizeof(cl_float), in[c][i], 0,
-					NULL, &copy_events[c][i]);
+			ret = to_opencl(in[c][i], &k_cimage_a[c][i], size,
+					&a[c][i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+
+			ret = opencl_target(out[c][i], &k_cimage_b[c][i],
+					size, &b[c][i]);
 			if (ret != CL_SUCCESS)
 				goto out_err;
 		}
+	}
+
+	/* run kernels */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			psf[i] = opencl_buffer(cimage_psf[c][i],
+					k_cimage_psf[c][i]);
+		}
 
-		ret = clWaitForEvents(2, copy_events[c]);
+		ret = clSetKernelArg(complex_conj_mult_k[c], 0,
+				sizeof(cl_mem), &psf[0]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
-	}
 
-	/* run kernels */
-	for (c = 0; c < 3; c++) {
-		ret = clSetKernelArg(complex_mult_k[c], 0, sizeof(cl_mem),
-				&k_cimage_psf[c][0]);
+		ret = clSetKernelArg(complex_conj_mult_k[c], 1,
+				sizeof(cl_mem), &psf[1]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_mult_k[c], 1, sizeof(cl_mem),
-				&k_cimage_psf[c][1]);
+		ret = clSetKernelArg(complex_conj_mult_k[c], 2,
+				sizeof(cl_mem), &a[c][0]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_mult_k[c], 2, sizeof(cl_mem),
-				&k_cimage_a[c][0]);
+		ret = clSetKernelArg(complex_conj_mult_k[c], 3,
+				sizeof(cl_mem), &a[c][1]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_mult_k[c], 3, sizeof(cl_mem),
-				&k_cimage_a[c][1]);
+		ret = clSetKernelArg(complex_conj_mult_k[c], 4,
+				sizeof(cl_mem), &b[c][0]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clSetKernelArg(complex_conj_mult_k[c], 5,
+				sizeof(cl_mem), &b[c][1]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = clEnqueueNDRangeKernel(queue,
+				complex_conj_mult_k[c], 1, NULL,
+				&global_work_size[1], NULL, 0, NULL,
+				&kernel_events[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
+	}
+
+	ret = wait_kernels();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
+	/* copy opencl buffers to out */
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			ret = from_opencl(out[c][i], b[c][i], size);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
+	}
+
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return ret;
+}
+
+/*
+ * wiener filter the complex images in by the psf spectrum into out:
+ * conj(psf) * in / (|psf|^2 + k)
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int wiener_multiply(float *in[][2], float *out[][2], float k)
+{
+	cl_int ret;
+	int c, i, n;
+	size_t size;
+	cl_kernel kernel;
+	cl_mem args[7];
+	cl_mem a[DECONVOLUTE_MAX_CHANNELS][2];
+	cl_mem b[DECONVOLUTE_MAX_CHANNELS][2];
+
+	/* copy in to opencl buffers */
+	size = (size_t)(width/2 + 1) * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		for (i = 0; i < 2; i++) {
+			ret = to_opencl(in[c][i], &k_cimage_a[c][i], size,
+					&a[c][i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+
+			ret = opencl_target(out[c][i], &k_cimage_b[c][i],
+					size, &b[c][i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
+	}
 
-		ret = clSetKernelArg(complex_mult_k[c], 4, sizeof(cl_mem),
-				&k_cimage_b[c][0]);
-		if (ret != CL_SUCCESS)
-			goto out_err;
+	/* run kernels: psf spectrum (one part if it is real), in, out,
+	 * then k */
+	for (c = 0; c < n_channels; c++) {
+		n = 0;
+		args[n++] = opencl_buffer(cimage_psf[c][0],
+				k_cimage_psf[c][0]);
+		if (!psf_symmetric)
+			args[n++] = opencl_buffer(cimage_psf[c][1],
+					k_cimage_psf[c][1]);
+		args[n++] = a[c][0];
+		args[n++] = a[c][1];
+		args[n++] = b[c][0];
+		args[n++] = b[c][1];
+		kernel = psf_symmetric ? real_complex_wiener_k[c] :
+			complex_wiener_k[c];
+
+		for (i = 0; i < n; i++) {
+			ret = clSetKernelArg(kernel, i, sizeof(cl_mem),
+					&args[i]);
+			if (ret != CL_SUCCESS)
+				goto out_err;
+		}
 
-		ret = clSetKernelArg(complex_mult_k[c], 5, sizeof(cl_mem),
-				&k_cimage_b[c][1]);
+		ret = clSetKernelArg(kernel, n, sizeof(cl_float), &k);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clEnqueueNDRangeKernel(queue, complex_mult_k[c],
-				1, NULL, &global_work_size[1], NULL, 0,
-				NULL, &kernel_events[c]);
+		ret = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+				&global_work_size[1], NULL, 0, NULL,
+				&kernel_events[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
-	ret = clWaitForEvents(3, kernel_events);
+	ret = wait_kernels();
 	if (ret != CL_SUCCESS)
 		goto out_err;
 
 	/* copy opencl buffers to out */
-	for (c = 0; c < 3; c++) {
+	for (c = 0; c < n_channels; c++) {
 		for (i = 0; i < 2; i++) {
-			ret = clEnqueueReadBuffer(queue,
-					k_cimage_b[c][i], CL_TRUE, 0,
-					(width/2 + 1) * height *
-					sizeof(cl_float), out[c][i], 0,
-					NULL, NULL);
+			ret = from_opencl(out[c][i], b[c][i], size);
 			if (ret != CL_SUCCESS)
 				goto out_err;
 		}
 	}
 
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
 	return 0;
 
 out_err:
@@ -708,65 +5146,79 @@ out_err:
 }
 
 /*
- * divide input image with a real image
+ * multiply two real images
  *
  * returns 0 on success, anything else otherwise
  */
-static int image_input_divide(float *in[3], float *out[3])
+static int image_multiply(float **a, float **b, float **out)
 {
 	cl_int ret;
 	int c;
+	size_t size;
+	cl_mem k_a[DECONVOLUTE_MAX_CHANNELS], k_b[DECONVOLUTE_MAX_CHANNELS];
+	cl_mem k_out[DECONVOLUTE_MAX_CHANNELS];
 
-	/* copy in to opencl buffers */
-	for (c = 0; c < 3; c++) {
-		ret = clEnqueueWriteBuffer(queue, k_image_a[c], CL_TRUE,
-				0, width * height * sizeof(cl_float),
-				in[c], 0, NULL, &copy_events[c][0]);
+	if (!use_opencl) {
+		cpu_pointwise(a, b, out, 0);
+		return 0;
+	}
+
+	/* copy images to opencl buffers */
+	size = (size_t)width * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		ret = to_opencl(a[c], &k_image_a[c], size, &k_a[c]);
+		if (ret != CL_SUCCESS)
+			goto out_err;
+
+		ret = to_opencl(b[c], &k_image_b[c], size, &k_b[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clWaitForEvents(1, copy_events[c]);
+		ret = opencl_target(out[c], &k_image_c[c], size,
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
 	/* run kernels */
-	for (c = 0; c < 3; c++) {
-		ret = clSetKernelArg(divide_k[c], 0, sizeof(cl_mem),
-				&k_input_image[c]);
+	for (c = 0; c < n_channels; c++) {
+		ret = clSetKernelArg(mult_k[c], 0, sizeof(cl_mem),
+				&k_a[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(divide_k[c], 1, sizeof(cl_mem),
-				&k_image_a[c]);
+		ret = clSetKernelArg(mult_k[c], 1, sizeof(cl_mem),
+				&k_b[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(divide_k[c], 2, sizeof(cl_mem),
-				&k_image_b[c]);
+		ret = clSetKernelArg(mult_k[c], 2, sizeof(cl_mem),
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clEnqueueNDRangeKernel(queue, divide_k[c], 1,
-				NULL, &global_work_size[0], NULL, 0,
-				NULL, &kernel_events[c]);
+		ret = clEnqueueNDRangeKernel(queue, mult_k[c], 1, NULL,
+				&global_work_size[0], NULL, 0, NULL,
+				&kernel_events[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
-	ret = clWaitForEvents(3, kernel_events);
+	ret = wait_kernels();
 	if (ret != CL_SUCCESS)
 		goto out_err;
 
 	/* copy opencl buffers to out */
-	for (c = 0; c < 3; c++) {
-		ret = clEnqueueReadBuffer(queue, k_image_b[c], CL_TRUE,
-				0, width * height * sizeof(cl_float),
-				out[c], 0, NULL, NULL);
+	for (c = 0; c < n_channels; c++) {
+		ret = from_opencl(out[c], k_out[c], size);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
 	return 0;
 
 out_err:
@@ -775,89 +5227,310 @@ out_err:
 }
 
 /*
- * multiply conj(psf) with complex image
+ * out = a * b, or b / a (0 where a is 0, like the divide kernel) if
+ * divide is nonzero, for every channel in bands on the pool (the cpu
+ * backend)
+ */
+static void cpu_pointwise(float **a, float **b, float **out, int
+		divide)
+{
+	struct pointwise op;
+
+	op.a = a;
+	op.b = b;
+	op.out = out;
+	op.divide = divide;
+	op.regularization = 0;
+	op.n = (size_t)width * height;
+	op.n_bands = (op.n + POINTWISE_BAND - 1) / POINTWISE_BAND;
+
+	thread_pool_run(pool, n_channels * op.n_bands, pointwise_band,
+			&op);
+}
+
+/*
+ * out = a * b / (a^2 + k), the wiener filter of the real spectra b by
+ * the real psf spectra a, like cpu_pointwise
+ */
+static void cpu_wiener(float **a, float **b, float **out, float k)
+{
+	struct pointwise op;
+
+	op.a = a;
+	op.b = b;
+	op.out = out;
+	op.divide = 0;
+	op.regularization = k;
+	op.n = (size_t)width * height;
+	op.n_bands = (op.n + POINTWISE_BAND - 1) / POINTWISE_BAND;
+
+	thread_pool_run(pool, n_channels * op.n_bands, pointwise_band,
+			&op);
+}
+
+/*
+ * pool task: band t / n_channels of channel t % n_channels, so a
+ * pinned pool gives each thread the same rows of every channel
+ */
+static void pointwise_band(void *arg, int t)
+{
+	struct pointwise *op;
+	float *a, *b, *out;
+	size_t i, start, end;
+	int c;
+
+	op = arg;
+	c = t % n_channels;
+	start = (t / n_channels) * (size_t)POINTWISE_BAND;
+	end = start + POINTWISE_BAND < op->n ? start + POINTWISE_BAND :
+		op->n;
+	a = op->a[c];
+	b = op->b[c];
+	out = op->out[c];
+
+	if (op->divide) {
+		for (i = start; i < end; i++) {
+			out[i] = a[i] != 0 ? b[i] / a[i] : 0;
+		}
+		return;
+	}
+
+	if (op->regularization > 0) {
+		for (i = start; i < end; i++) {
+			out[i] = a[i] * b[i] / (a[i] * a[i] +
+					op->regularization);
+		}
+		return;
+	}
+
+	for (i = start; i < end; i++) {
+		out[i] = a[i] * b[i];
+	}
+}
+
+/*
+ * convolve the channels of in with the psf, or with psf(-x) if adjoint
+ * is nonzero, into out: tile by tile for a psf grid, by dct with
+ * reflective edges for use_dct, otherwise by whole image transforms
+ * (cimage_a and cimage_b are scratch)
  *
  * returns 0 on success, anything else otherwise
  */
-static int cpsf_conj_multiply(float *in[3][2], float *out[3][2])
+static int convolve(float **in, float **out, int adjoint)
 {
-	cl_int ret;
-	int c, i;
+	int ret;
+	int c;
 
-	/* copy in to opencl buffers */
-	for (c = 0; c < 3; c++) {
-		for (i = 0; i < 2; i++) {
-			ret = clEnqueueWriteBuffer(queue,
-					k_cimage_a[c][i], CL_TRUE, 0,
-					(width/2 + 1) * height *
-					sizeof(cl_float), in[c][i], 0,
-					NULL, &copy_events[c][i]);
-			if (ret != CL_SUCCESS)
-				goto out_err;
+	if (use_grid) {
+		for (c = 0; c < n_channels; c++) {
+			psf_grid_convolve(psf_grid, c, in[c], out[c],
+					adjoint);
+		}
+		return 0;
+	}
+
+	/* the psf is symmetric, so the adjoint is the same; out is
+	 * the scratch */
+	if (use_dct) {
+		for (c = 0; c < n_channels; c++) {
+			dct(in[c], out[c]);
 		}
 
-		ret = clWaitForEvents(2, copy_events[c]);
-		if (ret != CL_SUCCESS)
+		ret = dct_psf_multiply(out, out);
+		if (ret != 0)
 			goto out_err;
+
+		for (c = 0; c < n_channels; c++) {
+			idct(out[c], out[c]);
+		}
+
+		return 0;
 	}
 
-	/* run kernels */
-	for (c = 0; c < 3; c++) {
-		ret = clSetKernelArg(complex_conj_mult_k[c], 0,
-				sizeof(cl_mem), &k_cimage_psf[c][0]);
-		if (ret != CL_SUCCESS)
-			goto out_err;
+	for (c = 0; c < n_channels; c++) {
+		fft(in[c], cimage_a[c]);
+	}
 
-		ret = clSetKernelArg(complex_conj_mult_k[c], 1,
-				sizeof(cl_mem), &k_cimage_psf[c][1]);
+	if (adjoint && !psf_symmetric)
+		ret = cpsf_conj_multiply(cimage_a, cimage_b);
+	else
+		ret = cpsf_multiply(cimage_a, cimage_b);
+	if (ret != 0)
+		goto out_err;
+
+	for (c = 0; c < n_channels; c++) {
+		ifft(cimage_b[c], out[c]);
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return ret;
+}
+
+/*
+ * helper function to compute forward fft of real image data
+ *
+ * image must be width x height (static var); if out[1] is NULL the
+ * imaginary part is discarded (for spectra known to be real)
+ */
+static void fft(float *in, float *out[2])
+{
+	size_t i;
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		fft_real[i] = in[i];
+	}
+
+	fftwf_execute(fft_forward_plan);
+
+	for (i = 0; i < (size_t)(width/2 + 1) * height; i++) {
+		out[0][i] = fft_complex[i][0];
+	}
+
+	if (out[1] == NULL)
+		return;
+
+	for (i = 0; i < (size_t)(width/2 + 1) * height; i++) {
+		out[1][i] = fft_complex[i][1];
+	}
+}
+
+/*
+ * helper function to compute inverse fft of complex image data
+ * to real image data
+ *
+ * image must be width x height (static var)
+ */
+static void ifft(float *in[2], float *out)
+{
+	size_t i;
+
+	for (i = 0; i < (size_t)(width/2 + 1) * height; i++) {
+		fft_complex[i][0] = in[0][i];
+		fft_complex[i][1] = in[1][i];
+	}
+
+	fftwf_execute(fft_backward_plan);
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		out[i] = fft_real[i] / ((float)width * height);
+	}
+}
+
+/*
+ * forward dct (REDFT10, a dct-ii, along both axes) of a width x height
+ * real image, which may be out
+ *
+ * the dct-ii diagonalizes convolution with a psf symmetric about both
+ * axes when the image is extended by reflection about its edges, so
+ * idct(spectrum * dct(in)) convolves with reflective edges at the
+ * image size
+ */
+static void dct(float *in, float *out)
+{
+	size_t i;
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		fft_real[i] = in[i];
+	}
+
+	fftwf_execute(fft_forward_plan);
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		out[i] = fft_real[i];
+	}
+}
+
+/* inverse of dct (REDFT01, normalized), in may be out */
+static void idct(float *in, float *out)
+{
+	size_t i;
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		fft_real[i] = in[i];
+	}
+
+	fftwf_execute(fft_backward_plan);
+
+	for (i = 0; i < (size_t)width * height; i++) {
+		out[i] = fft_real[i] / (4.0f * width * height);
+	}
+}
+
+/*
+ * multiply the dct images in by the psf's dct spectrum into out (which
+ * may be in), on opencl or the pool
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int dct_psf_multiply(float **in, float **out)
+{
+	cl_int ret;
+	int c;
+	size_t size;
+	float *spectrum[DECONVOLUTE_MAX_CHANNELS];
+	cl_mem psf, k_in[DECONVOLUTE_MAX_CHANNELS];
+	cl_mem k_out[DECONVOLUTE_MAX_CHANNELS];
+
+	if (!use_opencl) {
+		for (c = 0; c < n_channels; c++) {
+			spectrum[c] = cimage_psf[c][0];
+		}
+		cpu_pointwise(spectrum, in, out, 0);
+		return 0;
+	}
+
+	size = (size_t)width * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		ret = to_opencl(in[c], &k_image_b[c], size, &k_in[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_conj_mult_k[c], 2,
-				sizeof(cl_mem), &k_cimage_a[c][0]);
+		ret = opencl_target(out[c], &k_image_c[c], size,
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
+	}
 
-		ret = clSetKernelArg(complex_conj_mult_k[c], 3,
-				sizeof(cl_mem), &k_cimage_a[c][1]);
+	for (c = 0; c < n_channels; c++) {
+		psf = opencl_buffer(cimage_psf[c][0], k_cimage_psf[c][0]);
+		ret = clSetKernelArg(mult_k[c], 0, sizeof(cl_mem), &psf);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_conj_mult_k[c], 4,
-				sizeof(cl_mem), &k_cimage_b[c][0]);
+		ret = clSetKernelArg(mult_k[c], 1, sizeof(cl_mem),
+				&k_in[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(complex_conj_mult_k[c], 5,
-				sizeof(cl_mem), &k_cimage_b[c][1]);
+		ret = clSetKernelArg(mult_k[c], 2, sizeof(cl_mem),
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clEnqueueNDRangeKernel(queue,
-				complex_conj_mult_k[c], 1, NULL,
-				&global_work_size[1], NULL, 0, NULL,
+		ret = clEnqueueNDRangeKernel(queue, mult_k[c], 1, NULL,
+				&global_work_size[0], NULL, 0, NULL,
 				&kernel_events[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
-	ret = clWaitForEvents(3, kernel_events);
+	ret = wait_kernels();
 	if (ret != CL_SUCCESS)
 		goto out_err;
 
-	/* copy opencl buffers to out */
-	for (c = 0; c < 3; c++) {
-		for (i = 0; i < 2; i++) {
-			ret = clEnqueueReadBuffer(queue,
-					k_cimage_b[c][i], CL_TRUE, 0,
-					(width/2 + 1) * height *
-					sizeof(cl_float), out[c][i], 0,
-					NULL, NULL);
-			if (ret != CL_SUCCESS)
-				goto out_err;
-		}
+	for (c = 0; c < n_channels; c++) {
+		ret = from_opencl(out[c], k_out[c], size);
+		if (ret != CL_SUCCESS)
+			goto out_err;
 	}
 
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
 	return 0;
 
 out_err:
@@ -866,71 +5539,83 @@ out_err:
 }
 
 /*
- * multiply two real images
+ * wiener filter the dct images in by the psf's dct spectrum into out
+ * (which may be in): psf * in / (psf^2 + k), on opencl or the pool
  *
  * returns 0 on success, anything else otherwise
  */
-static int image_multiply(float *a[3], float *b[3], float *out[3])
+static int dct_wiener_multiply(float **in, float **out, float k)
 {
 	cl_int ret;
 	int c;
+	size_t size;
+	float *spectrum[DECONVOLUTE_MAX_CHANNELS];
+	cl_mem psf, k_in[DECONVOLUTE_MAX_CHANNELS];
+	cl_mem k_out[DECONVOLUTE_MAX_CHANNELS];
+
+	if (!use_opencl) {
+		for (c = 0; c < n_channels; c++) {
+			spectrum[c] = cimage_psf[c][0];
+		}
+		cpu_wiener(spectrum, in, out, k);
+		return 0;
+	}
 
-	/* copy images to opencl buffers */
-	for (c = 0; c < 3; c++) {
-		ret = clEnqueueWriteBuffer(queue, k_image_a[c], CL_TRUE,
-				0, width * height * sizeof(cl_float),
-				a[c], 0, NULL, &copy_events[c][0]);
+	size = (size_t)width * height * sizeof(cl_float);
+	for (c = 0; c < n_channels; c++) {
+		ret = to_opencl(in[c], &k_image_b[c], size, &k_in[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clEnqueueWriteBuffer(queue, k_image_b[c], CL_TRUE,
-				0, width * height * sizeof(cl_float),
-				b[c], 0, NULL, &copy_events[c][1]);
+		ret = opencl_target(out[c], &k_image_c[c], size,
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
+	}
 
-		ret = clWaitForEvents(2, copy_events[c]);
+	for (c = 0; c < n_channels; c++) {
+		psf = opencl_buffer(cimage_psf[c][0], k_cimage_psf[c][0]);
+		ret = clSetKernelArg(real_wiener_k[c], 0, sizeof(cl_mem),
+				&psf);
 		if (ret != CL_SUCCESS)
 			goto out_err;
-	}
 
-	/* run kernels */
-	for (c = 0; c < 3; c++) {
-		ret = clSetKernelArg(mult_k[c], 0, sizeof(cl_mem),
-				&k_image_a[c]);
+		ret = clSetKernelArg(real_wiener_k[c], 1, sizeof(cl_mem),
+				&k_in[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(mult_k[c], 1, sizeof(cl_mem),
-				&k_image_b[c]);
+		ret = clSetKernelArg(real_wiener_k[c], 2, sizeof(cl_mem),
+				&k_out[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clSetKernelArg(mult_k[c], 2, sizeof(cl_mem),
-				&k_image_c[c]);
+		ret = clSetKernelArg(real_wiener_k[c], 3, sizeof(cl_float),
+				&k);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 
-		ret = clEnqueueNDRangeKernel(queue, mult_k[c], 1, NULL,
-				&global_work_size[0], NULL, 0, NULL,
+		ret = clEnqueueNDRangeKernel(queue, real_wiener_k[c], 1,
+				NULL, &global_work_size[0], NULL, 0, NULL,
 				&kernel_events[c]);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
-	ret = clWaitForEvents(3, kernel_events);
+	ret = wait_kernels();
 	if (ret != CL_SUCCESS)
 		goto out_err;
 
-	/* copy opencl buffers to out */
-	for (c = 0; c < 3; c++) {
-		ret = clEnqueueReadBuffer(queue, k_image_c[c], CL_TRUE,
-				0, width * height * sizeof(cl_float),
-				out[c], 0, NULL, NULL);
+	for (c = 0; c < n_channels; c++) {
+		ret = from_opencl(out[c], k_out[c], size);
 		if (ret != CL_SUCCESS)
 			goto out_err;
 	}
 
+	ret = reclaim_planes();
+	if (ret != CL_SUCCESS)
+		goto out_err;
+
 	return 0;
 
 out_err:
@@ -938,45 +5623,126 @@ out_err:
 	return ret;
 }
 
+/* pin thread (0 the main thread) of the pool to its numa node */
+static void pin_thread(void *arg, int thread)
+{
+	numa_pin(&topology, numa_node_of_thread(&topology, thread,
+				numa_threads));
+}
+
 /*
- * helper function to compute forward fft of real image data
- *
- * image must be width x height (static var)
+ * write size bytes of data in one band per pool thread, so each of
+ * its pages is placed on the node of the thread that later works on
+ * that part of the plane
  */
-static void fft(float *in, float *out[2])
+static void first_touch(void *data, size_t size)
 {
-	int i;
+	struct first_touch touch;
 
-	for (i = 0; i < width * height; i++) {
-		fft_real[i] = in[i];
+	touch.data = data;
+	touch.size = size;
+	touch.n_bands = thread_pool_size(pool);
+
+	thread_pool_run(pool, touch.n_bands, touch_band, &touch);
+}
+
+/* pool task: band i of a struct first_touch */
+static void touch_band(void *arg, int i)
+{
+	struct first_touch *touch;
+	size_t start, end;
+
+	touch = arg;
+	start = touch->size * i / touch->n_bands;
+	end = touch->size * (i + 1) / touch->n_bands;
+
+	memset(touch->data + start, 0, end - start);
+}
+
+/* first touch the planes init_images allocated */
+static void touch_planes()
+{
+	size_t size, csize;
+	int c, i;
+
+	size = (size_t)width * height * sizeof(float);
+	csize = (size_t)(width/2 + 1) * height * sizeof(float);
+
+	for (c = 0; c < n_samples; c++) {
+		if (input_map.map == NULL || region.cropped)
+			first_touch(input_image[c], size);
 	}
 
-	fftwf_execute(fft_forward_plan);
+	for (c = 0; c < n_channels; c++) {
+		first_touch(current_image[c], size);
+		first_touch(image_a[c], size);
+		first_touch(image_b[c], size);
+		if (use_grid || use_dct)
+			continue;
 
-	for (i = 0; i < (width/2 + 1) * height; i++) {
-		out[0][i] = fft_complex[i][0];
-		out[1][i] = fft_complex[i][1];
+		first_touch(psf_image[c], size);
+		for (i = 0; i < 2; i++) {
+			first_touch(cimage_a[c][i], csize);
+			first_touch(cimage_b[c][i], csize);
+		}
 	}
 }
 
 /*
- * helper function to compute inverse fft of complex image data
- * to real image data
- *
- * image must be width x height (static var)
+ * run fftw's parallel loops on the pinned pool if on is nonzero, on
+ * fftw's own threads otherwise (which is all there is without
+ * HAVE_FFTW_THREADS_CALLBACK, needing fftw 3.3.9)
  */
-static void ifft(float *in[2], float *out)
+static void route_fftw_loops(int on)
+{
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+	if (!fftw_threads_ready)
+		return;
+
+	if (on)
+		fftwf_threads_set_callback(fftw_parallel_loop, pool);
+	else
+		fftwf_threads_set_callback(NULL, NULL);
+#endif
+}
+
+#ifdef HAVE_FFTW_THREADS_CALLBACK
+/* set while a thread runs a job of fftw_parallel_loop */
+static _Thread_local int in_fftw_loop;
+
+/*
+ * fftw's spawn loop: work(jobdata + i * elsize) for i in [0, njobs) on
+ * the pool; a loop fftw spawns from within one of the jobs runs on
+ * that job's thread, as the pool runs one loop at a time
+ */
+static void fftw_parallel_loop(void *(*work)(char *), char *jobdata,
+		size_t elsize, int njobs, void *data)
 {
+	struct fftw_loop loop;
 	int i;
 
-	for (i = 0; i < (width/2 + 1) * height; i++) {
-		fft_complex[i][0] = in[0][i];
-		fft_complex[i][1] = in[1][i];
+	if (in_fftw_loop) {
+		for (i = 0; i < njobs; i++) {
+			work(jobdata + elsize * i);
+		}
+		return;
 	}
 
-	fftwf_execute(fft_backward_plan);
+	loop.work = work;
+	loop.jobdata = jobdata;
+	loop.elsize = elsize;
 
-	for (i = 0; i < width * height; i++) {
-		out[i] = fft_real[i] / (width * height);
-	}
+	thread_pool_run(data, njobs, fftw_loop_task, &loop);
+}
+
+/* pool task: job i of a struct fftw_loop */
+static void fftw_loop_task(void *arg, int i)
+{
+	struct fftw_loop *loop;
+
+	loop = arg;
+	in_fftw_loop = 1;
+	loop->work(loop->jobdata + loop->elsize * i);
+	in_fftw_loop = 0;
 }
+#endif
@@ -11,20 +11,335 @@
 #ifndef _DECONVOLUTE_H_
 #define _DECONVOLUTE_H_
 
+#include <stddef.h>
+
+/* most samples per pixel (channels plus alpha etc) an image may have */
+#define DECONVOLUTE_MAX_CHANNELS 16
+
+/* optional behaviour for deconvolute_image_with_options */
+struct deconvolute_options {
+	/*
+	 * file to write checkpoints of the estimate to, or NULL for no
+	 * checkpoints; the final pass is always checkpointed
+	 */
+	char *checkpoint_filename;
+	/* passes between checkpoints, 0 to only checkpoint at the end */
+	int checkpoint_interval;
+	/*
+	 * if nonzero and checkpoint_filename exists, continue from it
+	 * (e.g. to add more iterations to a finished run)
+	 */
+	int resume;
+	/*
+	 * file to write previews of the estimate to every
+	 * preview_interval passes, or NULL for none; a name with a %d
+	 * style number (e.g. preview%04d.tif) gets the pass number,
+	 * otherwise the same file is replaced each time.  previews are
+	 * written on a background thread and skipped if the previous one
+	 * is still being written
+	 */
+	char *preview_filename;
+	int preview_interval;
+	/* integer factor previews are downscaled by, 1 for full size */
+	int preview_scale;
+	/*
+	 * if nonzero, return as soon as the output is quantized and
+	 * write it on a background thread, so the next job can start
+	 * computing; call deconvolute_wait_output before exiting (or
+	 * reading the output)
+	 */
+	int background_output;
+	/* if nonzero, quantize the output with an ordered dither */
+	int dither;
+	/*
+	 * compression of the output, one of the TIFF_GOODNESS_* in
+	 * tiff_goodness.h; deflate strips are compressed on the
+	 * n_threads threads
+	 */
+	int compression;
+	/*
+	 * write the output in tile_size x tile_size tiles (a multiple of
+	 * 16) instead of strips, for fast region reads; 0 for strips
+	 */
+	int tile_size;
+	/*
+	 * reduced-resolution levels, each half the size of the one
+	 * before, written as SubIFDs of the output for viewers
+	 */
+	int pyramid_levels;
+	/*
+	 * for a spatially varying psf, the psf image is a mosaic of
+	 * psf_grid_x x psf_grid_y equally sized psfs, each measured at
+	 * the centre of its region of the image split the same way;
+	 * tiles of the image are deconvoluted with psfs interpolated
+	 * between them.  1 x 1 for one psf everywhere
+	 */
+	int psf_grid_x, psf_grid_y;
+	/*
+	 * coarse-to-fine start: run coarse_iterations passes on each of
+	 * coarse_levels halvings of the image and psf, coarsest first,
+	 * and start the full size passes from the upsampled result; 0
+	 * levels to start from the input.  ignored when resuming
+	 */
+	int coarse_levels;
+	int coarse_iterations;
+	/*
+	 * nonzero to do the pointwise arithmetic on the n_threads
+	 * threads instead of opencl, convolving like a 1 x 1 psf grid;
+	 * slower, but needs no device and less host memory
+	 */
+	int cpu_only;
+	/*
+	 * peak host and opencl memory, in bytes, the job may use, 0 for
+	 * no limit; a job planned over them runs in a configuration that
+	 * fits (see deconvolute_plan_job) or not at all
+	 */
+	size_t memory_budget;
+	size_t device_memory_budget;
+	/* if nonzero, print the job's plan before it starts */
+	int print_plan;
+	/*
+	 * nonzero to pin the threads to the numa nodes in blocks and
+	 * place each block's rows of the planes in its node's memory
+	 */
+	int numa;
+	/*
+	 * fftw planner flags of the transforms, FFTW_MEASURE by default;
+	 * a job on n_threads <= 0 threads uses the tuned flags instead
+	 */
+	unsigned fft_flags;
+	/*
+	 * tuning file of the thread counts and planner flags tuned for
+	 * each host and size (NULL for AUTOTUNE_FILENAME in $HOME, see
+	 * autotune.h), and nonzero retune to tune again even if it has
+	 * the size
+	 */
+	char *tuning_filename;
+	int retune;
+	/*
+	 * a psf symmetric about both axes (and a 1 x 1 psf grid) is
+	 * convolved by dct, with the image reflected about its edges;
+	 * nonzero to keep the periodic fft convolution instead
+	 */
+	int periodic_edges;
+	/*
+	 * region of interest: if roi_width is nonzero, only the
+	 * roi_width x roi_height crop at roi_x, roi_y is deconvoluted,
+	 * from just the rows (and tiles) of the input around it, and
+	 * written as the output; single images with a 1 x 1 psf grid
+	 * only
+	 */
+	int roi_x, roi_y, roi_width, roi_height;
+	/*
+	 * if > 0, a one-shot Wiener (Tikhonov) deconvolution with this
+	 * regularization constant (the noise to signal power ratio)
+	 * replaces the passes: one forward transform, one pointwise
+	 * pass and one inverse transform per channel, e.g. for a quick
+	 * look or to tune a psf; with wiener_start nonzero it starts the
+	 * passes instead, in place of any coarse levels
+	 */
+	float wiener;
+	int wiener_start;
+	/*
+	 * if not NULL, called with progress_arg after each full size
+	 * pass (numbered from 1) of n_passes, e.g. to report progress;
+	 * returning nonzero cancels the job, which then fails
+	 */
+	int (*progress)(void *arg, int pass, int n_passes);
+	void *progress_arg;
+};
+
+/* sample types of a struct deconvolute_buffer */
+#define DECONVOLUTE_U16 0
+#define DECONVOLUTE_FLOAT 1
+
+/*
+ * an image in the caller's memory: width x height pixels of n_samples
+ * samples of type (DECONVOLUTE_U16, in [0, 65535], or
+ * DECONVOLUTE_FLOAT, used as is), the last n_extra of them (alpha etc)
+ * passed through.  sample s of pixel x, y is at data + y * row_stride
+ * + x * pixel_stride + s * sample_stride bytes, which describes
+ * interleaved pixels (sample_stride the sample size) as well as planes
+ * (pixel_stride the sample size, sample_stride a plane), padded rows
+ * included
+ */
+struct deconvolute_buffer {
+	void *data;
+	int type;
+	int width, height, n_samples, n_extra;
+	size_t row_stride, pixel_stride, sample_stride;
+};
+
 /*
  * global function to deconvolute an image via Richardson–Lucy
  *
- * the input image must be a 16-bit RGB TIFF
- * the psf image must be a 8-bit RGB TIFF (due to GIMP limitations)
- * the outputted image will be a 16-bit RGB TIFF
+ * the input image must be a 16-bit TIFF with any number of channels
+ * (gray, RGB, ...) up to DECONVOLUTE_MAX_CHANNELS; extra samples such
+ * as alpha are passed through untouched
+ * the psf image must be a 8-bit TIFF (due to GIMP limitations) with
+ * either one channel, used for every channel, or one per channel
+ * the outputted image will be a 16-bit TIFF laid out like the input
+ *
+ * the input, psf and output may instead be planar float32 .npy, FITS
+ * or .raw images (see float_image.h), which are mapped and used in
+ * place rather than decoded; float outputs are written unquantized and
+ * never in the background
+ *
+ * n_threads <= 0 uses the thread count (and fftw planner flags) tuned
+ * for this host and the input's size, timing the candidates first if
+ * they were never tuned (see autotune.h)
  *
  * if any part of it fails, it will undo itself (goto styled stack-esque
  * wind and unwind)
  *
+ * none of these functions is reentrant: a job keeps all its state
+ * (and deconvolute_keep_warm the warm state) in static variables, so
+ * they must be called from one thread at a time, one job at a time
+ *
  * returns 0 on success, anything else on failure
  */
 int deconvolute_image(char *input_image_filename, char
 		*psf_image_filename, char *output_image_filename, int
 		n_iterations, int n_threads);
 
+void deconvolute_default_options(struct deconvolute_options *options);
+
+/*
+ * same as deconvolute_image, with the extra behaviour described by
+ * options (see struct deconvolute_options)
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_image_with_options(char *input_image_filename, char
+		*psf_image_filename, char *output_image_filename, int
+		n_iterations, int n_threads, struct deconvolute_options
+		*options);
+
+/*
+ * same as deconvolute_image_with_options on images in the caller's
+ * memory instead of files: input is read and output written in place,
+ * converted straight to and from the planes the job works on, with no
+ * files and no copies in between
+ *
+ * psf may have one sample, used for every channel, or one per channel
+ * and no extra samples; output must be laid out like input (any type
+ * and strides), the size of the input or of options' region of
+ * interest.  a u16 output is quantized (dithered with options->dither),
+ * a float one written unquantized; the output is always written before
+ * returning
+ *
+ * returns 0 on success, anything else on failure (or if cancelled by
+ * options->progress)
+ */
+int deconvolute_image_buffers(struct deconvolute_buffer *input, struct
+		deconvolute_buffer *psf, struct deconvolute_buffer *output,
+		int n_iterations, int n_threads, struct deconvolute_options
+		*options);
+
+/*
+ * wait for outputs being written in the background (background_output)
+ *
+ * returns 0 on success, anything else if a write failed
+ */
+int deconvolute_wait_output();
+
+/*
+ * keep fftw plans, psf spectra and opencl programs (built for each
+ * size) for up to n_entries image sizes (and psfs), least recently
+ * used dropped first, between jobs, so a long-running process pays for
+ * them once; 0 releases everything kept
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_keep_warm(int n_entries);
+
+/* what a job will use, worked out from the image sizes alone */
+struct deconvolute_plan {
+	int width, height, n_channels;
+	/* peak bytes of host and opencl memory */
+	size_t host, device;
+	/* size of the ffts (a tile for a psf grid) and how many a pass
+	 * runs */
+	int fft_width, fft_height, n_ffts;
+	/* estimated seconds per pass, from benchmarks of this host */
+	double pass_seconds;
+	/* the configuration planned: options->cpu_only etc, and
+	 * whether the psf convolves with dcts (see deconvolute.c) */
+	int cpu_only, coarse_levels, previews, dct;
+};
+
+/*
+ * plan a deconvolute_image_with_options job on n_threads threads,
+ * reading only the image sizes and the psf (whose symmetry decides the
+ * transforms), so it can be sized before anything is allocated; if
+ * it does not fit options->memory_budget and device_memory_budget,
+ * options is changed to the nearest configuration that does (fewer
+ * coarse levels, the cpu only backend, no previews, in that order);
+ * n_threads <= 0 plans on the tuned thread count if there is one,
+ * without tuning
+ *
+ * returns 0 if the plan fits, anything else if it cannot or an image
+ * could not be read
+ */
+int deconvolute_plan_job(char *input_image_filename, char
+		*psf_image_filename, int n_threads, struct
+		deconvolute_options *options, struct deconvolute_plan *plan);
+
+void deconvolute_print_plan(struct deconvolute_plan *plan);
+
+/*
+ * global function to deconvolute a sequence of frames via
+ * Richardson–Lucy
+ *
+ * input_pattern is either a multi-page 16-bit TIFF or a numbered
+ * series such as "frame%04d.tif" starting at first_frame;
+ * output_pattern must be a numbered series, e.g. "out%04d.tif", and
+ * output frames are numbered from 0
+ *
+ * the first frame is deconvoluted with n_iterations, every later frame
+ * starts from the previous frame's result and gets n_warm_iterations.
+ * the next frame is decoded and the previous frame encoded while the
+ * current one is computed
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_sequence(char *input_pattern, char *psf_image_filename,
+		char *output_pattern, int first_frame, int n_iterations,
+		int n_warm_iterations, int n_threads);
+
+/*
+ * same as deconvolute_sequence, with the dither and output layout
+ * (compression, tiles, pyramid) of options applied to every output
+ * frame and its psf grid to every frame
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_sequence_with_options(char *input_pattern, char
+		*psf_image_filename, char *output_pattern, int
+		first_frame, int n_iterations, int n_warm_iterations, int
+		n_threads, struct deconvolute_options *options);
+
+/*
+ * global function to deconvolute n_frames observations of one image
+ * jointly into one output via multi-frame Richardson–Lucy
+ *
+ * input_pattern is either a multi-page 16-bit TIFF or a numbered series
+ * such as "frame%04d.tif" starting at first_frame (n_frames <= 0 takes
+ * every frame); psf_pattern is either one psf for every frame or a
+ * numbered series with one psf per frame, numbered like the frames.
+ * every pass corrects the estimate by the mean of the frames' own
+ * corrections, starting from the mean of the frames
+ *
+ * the output, its dither and layout, progress and the budgets are as
+ * for deconvolute_image_with_options; the arithmetic runs on the cpu,
+ * the edges are periodic, and there are no checkpoints, previews,
+ * coarse levels, roi or psf grid
+ *
+ * returns 0 on success, anything else on failure
+ */
+int deconvolute_frames_with_options(char *input_pattern, char
+		*psf_pattern, char *output_image_filename, int
+		first_frame, int n_frames, int n_iterations, int
+		n_threads, struct deconvolute_options *options);
+
 #endif /* !_DECONVOLUTE_H_ */
@@ -0,0 +1,658 @@
+/*
+ * Memory-mapped planar float images (.npy, FITS and raw)
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "float_image.h"
+
+#define FORMAT_NONE 0
+#define FORMAT_NPY 1
+#define FORMAT_FITS 2
+#define FORMAT_RAW 3
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+
+/* floats byte-swapped at a time when writing */
+#define SWAP_CHUNK 65536
+
+/* where and how the planes of a float image file are stored */
+struct layout {
+	int width, height, n_channels;
+	size_t data_offset;
+	int big_endian;
+};
+
+static int file_format(char *filename);
+static int host_big_endian();
+static int map_file(char *filename, void **map, size_t *size);
+static int parse_layout(int format, unsigned char *head, size_t size,
+		struct layout *layout);
+static int parse_npy(unsigned char *head, size_t size, struct layout
+		*layout);
+static int parse_fits(unsigned char *head, size_t size, struct layout
+		*layout);
+static int parse_raw(unsigned char *head, size_t size, struct layout
+		*layout);
+static int card_is(char *card, char *keyword);
+static void swap_floats(float *data, size_t n);
+static int write_planes(FILE *file, float **planes, int n_planes,
+		size_t plane_size, int swap);
+
+/* whether filename is a float image, judging by its extension */
+int float_image_is_float(char *filename)
+{
+	return file_format(filename) != FORMAT_NONE;
+}
+
+/*
+ * read only the size of a float image: the header pages are all that
+ * is touched (nothing is swapped), so planning is cheap for any format
+ *
+ * returns 0 on success, anything else if failed
+ */
+int float_image_size(char *filename, int *width, int *height, int
+		*n_channels)
+{
+	void *map;
+	size_t map_size;
+	struct layout layout;
+	int ret;
+
+	if (map_file(filename, &map, &map_size) != 0)
+		return -1;
+
+	ret = parse_layout(file_format(filename), map, map_size, &layout);
+	munmap(map, map_size);
+	if (ret != 0) {
+		fprintf(stderr, "float_image_size: %s is not a planar float32 image\n",
+				filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	*width = layout.width;
+	*height = layout.height;
+	*n_channels = layout.n_channels;
+
+	return 0;
+}
+
+/*
+ * map the planes of a float image; they are used in place when stored
+ * in the host's byte order, otherwise swapped once in a private copy
+ * (e.g. FITS, which is big-endian, on x86)
+ *
+ * returns 0 on success, anything else if failed
+ */
+int float_image_map(struct float_image *image, char *filename)
+{
+	size_t n;
+	struct layout layout;
+
+	memset(image, 0, sizeof(*image));
+
+	if (map_file(filename, &image->map, &image->map_size) != 0)
+		goto out_no_map;
+
+	if (parse_layout(file_format(filename), image->map,
+				image->map_size, &layout) != 0) {
+		fprintf(stderr, "float_image_map: %s is not a planar float32 image\n",
+				filename);
+		fflush(stderr);
+		goto out_bad_layout;
+	}
+
+	image->width = layout.width;
+	image->height = layout.height;
+	image->n_channels = layout.n_channels;
+	image->data = (float *)((char *)image->map + layout.data_offset);
+
+	n = (size_t)layout.width * layout.height * layout.n_channels;
+	if (layout.big_endian != host_big_endian())
+		swap_floats(image->data, n);
+
+	posix_madvise(image->map, image->map_size, POSIX_MADV_WILLNEED);
+	return 0;
+
+out_bad_layout:
+	munmap(image->map, image->map_size);
+	image->map = NULL;
+out_no_map:
+	return -1;
+}
+
+/* unmap an image (safe to call again) */
+void float_image_unmap(struct float_image *image)
+{
+	if (image->map != NULL)
+		munmap(image->map, image->map_size);
+
+	image->map = NULL;
+	image->data = NULL;
+}
+
+/*
+ * write n_channels width x height planes as a float image, in the
+ * format given by the extension of filename
+ *
+ * returns 0 on success, anything else if failed
+ */
+int float_image_write(char *filename, float **planes, int width, int
+		height, int n_channels)
+{
+	int i, n, big_endian;
+	FILE *file;
+	size_t plane_size, data_size, header_size;
+	char header[FLOAT_IMAGE_RAW_HEADER], shape[64];
+	static const char zeros[FITS_BLOCK];
+
+	big_endian = host_big_endian();
+	plane_size = (size_t)width * height;
+	data_size = plane_size * n_channels * sizeof(**planes);
+
+	/* build the header */
+	switch (file_format(filename)) {
+	case FORMAT_NPY:
+		if (n_channels == 1)
+			snprintf(shape, sizeof(shape), "(%d, %d)", height,
+					width);
+		else
+			snprintf(shape, sizeof(shape), "(%d, %d, %d)",
+					n_channels, height, width);
+
+		memcpy(header, "\x93NUMPY\x01\x00", 8);
+		n = snprintf(header + 10, sizeof(header) - 10,
+				"{'descr': '%cf4', 'fortran_order': False, 'shape': %s, }",
+				big_endian ? '>' : '<', shape);
+
+		/* pad with spaces and a newline to a multiple of 64 */
+		header_size = (10 + n + 1 + 63) / 64 * 64;
+		memset(header + 10 + n, ' ', header_size - 10 - n - 1);
+		header[header_size - 1] = '\n';
+		header[8] = (header_size - 10) & 0xff;
+		header[9] = (header_size - 10) >> 8;
+		break;
+
+	case FORMAT_FITS:
+		n = 0;
+		n += snprintf(header + n, FITS_CARD + 1, "%-8s= %20s%50s",
+				"SIMPLE", "T", "");
+		n += snprintf(header + n, FITS_CARD + 1, "%-8s= %20d%50s",
+				"BITPIX", -32, "");
+		n += snprintf(header + n, FITS_CARD + 1, "%-8s= %20d%50s",
+				"NAXIS", n_channels == 1 ? 2 : 3, "");
+		n += snprintf(header + n, FITS_CARD + 1, "%-8s= %20d%50s",
+				"NAXIS1", width, "");
+		n += snprintf(header + n, FITS_CARD + 1, "%-8s= %20d%50s",
+				"NAXIS2", height, "");
+		if (n_channels != 1)
+			n += snprintf(header + n, FITS_CARD + 1,
+					"%-8s= %20d%50s", "NAXIS3",
+					n_channels, "");
+		n += snprintf(header + n, FITS_CARD + 1, "%-80s", "END");
+
+		header_size = FITS_BLOCK;
+		memset(header + n, ' ', header_size - n);
+		break;
+
+	case FORMAT_RAW:
+		memset(header, 0, sizeof(header));
+		snprintf(header, sizeof(header),
+				"%s\nwidth %d\nheight %d\nchannels %d\n",
+				FLOAT_IMAGE_RAW_MAGIC, width, height,
+				n_channels);
+		header_size = FLOAT_IMAGE_RAW_HEADER;
+		break;
+
+	default:
+		fprintf(stderr, "float_image_write: %s is not .npy, .fits or .raw\n",
+				filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	if ((file = fopen(filename, "wb")) == NULL) {
+		fprintf(stderr, "float_image_write: could not open %s\n",
+				filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	if (fwrite(header, 1, header_size, file) != header_size)
+		goto out_write_err;
+
+	/* fits data is big-endian and padded to a whole block, raw data
+	 * little-endian, npy data in the byte order its header says */
+	switch (file_format(filename)) {
+	case FORMAT_FITS:
+		if (write_planes(file, planes, n_channels, plane_size,
+					!big_endian) != 0)
+			goto out_write_err;
+		i = (FITS_BLOCK - data_size % FITS_BLOCK) % FITS_BLOCK;
+		if (fwrite(zeros, 1, i, file) != (size_t)i)
+			goto out_write_err;
+		break;
+	case FORMAT_RAW:
+		if (write_planes(file, planes, n_channels, plane_size,
+					big_endian) != 0)
+			goto out_write_err;
+		break;
+	default:
+		if (write_planes(file, planes, n_channels, plane_size, 0)
+				!= 0)
+			goto out_write_err;
+		break;
+	}
+
+	if (fclose(file) != 0)
+		goto out_close_err;
+	return 0;
+
+out_write_err:
+	fclose(file);
+out_close_err:
+	fprintf(stderr, "float_image_write: error in writing %s\n",
+			filename);
+	fflush(stderr);
+	return -1;
+}
+
+/* format of a float image by extension, FORMAT_NONE if not one */
+static int file_format(char *filename)
+{
+	char *ext;
+
+	ext = strrchr(filename, '.');
+	if (ext == NULL)
+		return FORMAT_NONE;
+
+	if (strcasecmp(ext, ".npy") == 0)
+		return FORMAT_NPY;
+	if (strcasecmp(ext, ".fits") == 0 || strcasecmp(ext, ".fit") == 0
+			|| strcasecmp(ext, ".fts") == 0)
+		return FORMAT_FITS;
+	if (strcasecmp(ext, ".raw") == 0)
+		return FORMAT_RAW;
+
+	return FORMAT_NONE;
+}
+
+static int host_big_endian()
+{
+	uint16_t one;
+
+	one = 1;
+	return *(uint8_t *)&one == 0;
+}
+
+/*
+ * map a whole file privately, writable so its data can be swapped in
+ * place without touching the file
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int map_file(char *filename, void **map, size_t *size)
+{
+	int fd;
+	struct stat st;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		goto out_no_open;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+		goto out_no_map;
+
+	*size = st.st_size;
+	*map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+			0);
+	if (*map == MAP_FAILED)
+		goto out_no_map;
+
+	close(fd);
+	return 0;
+
+out_no_map:
+	close(fd);
+out_no_open:
+	fprintf(stderr, "float_image: could not map %s\n", filename);
+	fflush(stderr);
+	*map = NULL;
+	return -1;
+}
+
+/*
+ * parse the header of a mapped file of the given format and check its
+ * planes fit in the file and are float-aligned
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int parse_layout(int format, unsigned char *head, size_t size,
+		struct layout *layout)
+{
+	int ret;
+
+	switch (format) {
+	case FORMAT_NPY:
+		ret = parse_npy(head, size, layout);
+		break;
+	case FORMAT_FITS:
+		ret = parse_fits(head, size, layout);
+		break;
+	case FORMAT_RAW:
+		ret = parse_raw(head, size, layout);
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+	if (ret != 0)
+		return ret;
+
+	if (layout->width < 1 || layout->height < 1 || layout->n_channels
+			< 1)
+		return -1;
+	if (layout->data_offset > size || layout->data_offset %
+			sizeof(float) != 0)
+		return -1;
+	if ((size - layout->data_offset) / sizeof(float) /
+			layout->width / layout->height <
+			(size_t)layout->n_channels)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * parse a .npy header: little- or big-endian float32 in C order, shaped
+ * (channels, height, width) or (height, width)
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int parse_npy(unsigned char *head, size_t size, struct layout
+		*layout)
+{
+	int n_dims, ret;
+	long dims[3];
+	size_t header_len, start;
+	char *dict, *p, *end;
+
+	if (size < 12 || memcmp(head, "\x93NUMPY", 6) != 0)
+		return -1;
+
+	if (head[6] == 1) {
+		header_len = head[8] | head[9] << 8;
+		start = 10;
+	} else {
+		header_len = head[8] | head[9] << 8 | head[10] << 16 |
+			(size_t)head[11] << 24;
+		start = 12;
+	}
+	if (header_len > size - start)
+		return -1;
+
+	dict = malloc(header_len + 1);
+	if (dict == NULL)
+		return -1;
+	memcpy(dict, head + start, header_len);
+	dict[header_len] = '\0';
+
+	ret = -1;
+
+	/* dtype */
+	if ((p = strstr(dict, "'descr'")) == NULL)
+		goto out;
+	if ((p = strchr(p + 7, '\'')) == NULL)
+		goto out;
+	if (strncmp(p, "'<f4'", 5) == 0)
+		layout->big_endian = 0;
+	else if (strncmp(p, "'>f4'", 5) == 0)
+		layout->big_endian = 1;
+	else
+		goto out;
+
+	/* only C order is planar */
+	if ((p = strstr(dict, "'fortran_order'")) == NULL)
+		goto out;
+	p += strspn(p + 15, ": ") + 15;
+	if (strncmp(p, "False", 5) != 0)
+		goto out;
+
+	/* shape */
+	if ((p = strstr(dict, "'shape'")) == NULL)
+		goto out;
+	if ((p = strchr(p, '(')) == NULL)
+		goto out;
+	for (n_dims = 0, p++; n_dims < 3; n_dims++) {
+		dims[n_dims] = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (dims[n_dims] < 1 || dims[n_dims] > INT_MAX)
+			goto out;
+		p = end + strspn(end, ", ");
+	}
+	if (*p != ')')
+		goto out;
+
+	if (n_dims == 2) {
+		layout->n_channels = 1;
+		layout->height = dims[0];
+		layout->width = dims[1];
+	} else if (n_dims == 3) {
+		layout->n_channels = dims[0];
+		layout->height = dims[1];
+		layout->width = dims[2];
+	} else {
+		goto out;
+	}
+
+	layout->data_offset = start + header_len;
+	ret = 0;
+out:
+	free(dict);
+	return ret;
+}
+
+/*
+ * parse a FITS primary header: BITPIX -32 with NAXIS1 the width, NAXIS2
+ * the height and the optional NAXIS3 the channels, no scaling
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int parse_fits(unsigned char *head, size_t size, struct layout
+		*layout)
+{
+	size_t i;
+	long bitpix, naxis, naxis3;
+	char *card, value[FITS_CARD];
+	double bzero, bscale;
+
+	if (size < FITS_BLOCK || !card_is((char *)head, "SIMPLE"))
+		return -1;
+
+	bitpix = 0;
+	naxis = 0;
+	naxis3 = 1;
+	bzero = 0;
+	bscale = 1;
+	layout->width = 0;
+	layout->height = 0;
+
+	for (i = 0; (i + 1) * FITS_CARD <= size; i++) {
+		card = (char *)head + i * FITS_CARD;
+		if (card_is(card, "END"))
+			break;
+		if (card[8] != '=')
+			continue;
+
+		memcpy(value, card + 10, FITS_CARD - 10);
+		value[FITS_CARD - 10] = '\0';
+
+		if (card_is(card, "BITPIX"))
+			bitpix = strtol(value, NULL, 10);
+		else if (card_is(card, "NAXIS"))
+			naxis = strtol(value, NULL, 10);
+		else if (card_is(card, "NAXIS1"))
+			layout->width = strtol(value, NULL, 10);
+		else if (card_is(card, "NAXIS2"))
+			layout->height = strtol(value, NULL, 10);
+		else if (card_is(card, "NAXIS3"))
+			naxis3 = strtol(value, NULL, 10);
+		else if (card_is(card, "BZERO"))
+			bzero = strtod(value, NULL);
+		else if (card_is(card, "BSCALE"))
+			bscale = strtod(value, NULL);
+	}
+	if ((i + 1) * FITS_CARD > size)
+		return -1;
+
+	if (bitpix != -32 || (naxis != 2 && naxis != 3) || bzero != 0 ||
+			bscale != 1 || naxis3 < 1 || naxis3 > INT_MAX)
+		return -1;
+
+	layout->n_channels = naxis == 3 ? naxis3 : 1;
+	layout->data_offset = ((i + 1) * FITS_CARD + FITS_BLOCK - 1) /
+		FITS_BLOCK * FITS_BLOCK;
+	layout->big_endian = 1;
+
+	return 0;
+}
+
+/*
+ * parse a raw header (see FLOAT_IMAGE_RAW_MAGIC)
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int parse_raw(unsigned char *head, size_t size, struct layout
+		*layout)
+{
+	long value;
+	char header[FLOAT_IMAGE_RAW_HEADER + 1], key[32];
+	char *line;
+
+	if (size < FLOAT_IMAGE_RAW_HEADER)
+		return -1;
+
+	memcpy(header, head, FLOAT_IMAGE_RAW_HEADER);
+	header[FLOAT_IMAGE_RAW_HEADER] = '\0';
+
+	line = header;
+	if (strncmp(line, FLOAT_IMAGE_RAW_MAGIC "\n",
+				strlen(FLOAT_IMAGE_RAW_MAGIC) + 1) != 0)
+		return -1;
+
+	layout->width = 0;
+	layout->height = 0;
+	layout->n_channels = 0;
+	while ((line = strchr(line, '\n')) != NULL) {
+		line++;
+		if (sscanf(line, "%31s %ld", key, &value) != 2)
+			continue;
+		if (value < 1 || value > INT_MAX)
+			return -1;
+
+		if (strcmp(key, "width") == 0)
+			layout->width = value;
+		else if (strcmp(key, "height") == 0)
+			layout->height = value;
+		else if (strcmp(key, "channels") == 0)
+			layout->n_channels = value;
+	}
+
+	layout->data_offset = FLOAT_IMAGE_RAW_HEADER;
+	layout->big_endian = 0;
+
+	return 0;
+}
+
+/* whether a FITS card has the given keyword (space padded to 8) */
+static int card_is(char *card, char *keyword)
+{
+	size_t n;
+
+	n = strlen(keyword);
+	if (strncmp(card, keyword, n) != 0)
+		return 0;
+
+	for (; n < 8; n++) {
+		if (card[n] != ' ')
+			return 0;
+	}
+
+	return 1;
+}
+
+/* reverse the byte order of n floats in place */
+static void swap_floats(float *data, size_t n)
+{
+	size_t i;
+	uint32_t v;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&v, data + i, sizeof(v));
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+			(v << 24);
+		memcpy(data + i, &v, sizeof(v));
+	}
+}
+
+/*
+ * write n_planes planes of plane_size floats, byte-swapped if swap is
+ * nonzero
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int write_planes(FILE *file, float **planes, int n_planes,
+		size_t plane_size, int swap)
+{
+	int c;
+	size_t i, n;
+	float *buffer;
+
+	if (!swap) {
+		for (c = 0; c < n_planes; c++) {
+			if (fwrite(planes[c], sizeof(**planes), plane_size,
+						file) != plane_size)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	buffer = malloc(SWAP_CHUNK * sizeof(*buffer));
+	if (buffer == NULL)
+		return -1;
+
+	for (c = 0; c < n_planes; c++) {
+		for (i = 0; i < plane_size; i += n) {
+			n = plane_size - i < SWAP_CHUNK ? plane_size - i :
+				SWAP_CHUNK;
+			memcpy(buffer, planes[c] + i, n * sizeof(*buffer));
+			swap_floats(buffer, n);
+			if (fwrite(buffer, sizeof(*buffer), n, file) != n) {
+				free(buffer);
+				return -1;
+			}
+		}
+	}
+
+	free(buffer);
+	return 0;
+}
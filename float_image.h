@@ -0,0 +1,42 @@
+/*
+ * Memory-mapped planar float images (.npy, FITS and raw)
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _FLOAT_IMAGE_H_
+#define _FLOAT_IMAGE_H_
+
+#include <stddef.h>
+
+/*
+ * the raw format is a FLOAT_IMAGE_RAW_HEADER byte text header of
+ * "key value" lines (width, height, channels) after the
+ * FLOAT_IMAGE_RAW_MAGIC line, padded with NULs, then little-endian
+ * float planes
+ */
+#define FLOAT_IMAGE_RAW_MAGIC "DECONVOLUTE RAW FLOAT32"
+#define FLOAT_IMAGE_RAW_HEADER 4096
+
+/* a mapped image, plane c is at data + c * width * height */
+struct float_image {
+	int width, height, n_channels;
+	float *data;
+
+	void *map;
+	size_t map_size;
+};
+
+int float_image_is_float(char *filename);
+int float_image_size(char *filename, int *width, int *height, int
+		*n_channels);
+int float_image_map(struct float_image *image, char *filename);
+void float_image_unmap(struct float_image *image);
+int float_image_write(char *filename, float **planes, int width, int
+		height, int n_channels);
+
+#endif /* !_FLOAT_IMAGE_H_ */
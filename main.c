@@ -1,20 +1,350 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "deconvolute.h"
+#include "tiff_goodness.h"
+#include "daemon.h"
+#include "batch.h"
 
 #define OUTPUT_FILENAME "deconvoluted_image.tif"
+#define SEQUENCE_OUTPUT_PATTERN "deconvoluted_%04d.tif"
+/* sizes (and psfs) a daemon keeps plans and spectra for */
+#define DAEMON_WARM_ENTRIES 4
+/* share of physical memory batch jobs may use by default, in percent */
+#define BATCH_MEMORY_SHARE 75
+
+static size_t default_host_budget();
+static int n_processors();
+
+static void usage()
+{
+	fprintf(stderr, "Usage: deconvolute [options] [input 16-bit TIFF image] [psf 8-bit TIFF image] [number of iterations]\n"
+			"       deconvolute -B -o OUTPUT_DIR [options] [input directory] [psf] [number of iterations]\n"
+			"       deconvolute -D SOCKET | -K SOCKET\n"
+			"  (any image may also be a planar float32 .npy, .fits or .raw file)\n"
+			"  -o FILE  output file (a numbered pattern in sequence mode)\n"
+			"  -s       sequence mode: input is a multi-page TIFF or a numbered series such as frame%%04d.tif\n"
+			"  -f N     first frame number of a numbered input series (default 0)\n"
+			"  -k N     joint mode: deconvolute N frames (0 for all) of a multi-page TIFF or numbered series into one output; the psf may be numbered too, one per frame\n"
+			"  -w N     iterations for each frame after the first in sequence mode (default: a quarter of the iterations)\n"
+			"  -c FILE  write checkpoints of the estimate to FILE (always after the last pass)\n"
+			"  -C N     also checkpoint every N passes\n"
+			"  -r       resume from the checkpoint file if it exists, e.g. to add passes to a finished run\n"
+			"  -p FILE  write a preview to FILE (or FILE%%04d.tif numbered by pass) in the background\n"
+			"  -P N     passes between previews (default 10)\n"
+			"  -S N     downscale previews by N\n"
+			"  -d       dither the output when quantizing to 16 bits\n"
+			"  -z TYPE  compress the output with deflate, zstd or lzw\n"
+			"  -t N     write the output in N x N tiles\n"
+			"  -L N     add N half-size pyramid levels to the output\n"
+			"  -g XxY   the psf is a mosaic of X x Y psfs varying over the image\n"
+			"  -m N     start from N coarse (half-size) levels of passes\n"
+			"  -M N     passes on each coarse level (default 10)\n"
+			"  -D SOCK  run as a daemon taking jobs on the Unix socket SOCK, keeping plans warm\n"
+			"  -J SOCK  have the daemon on SOCK run the job (and print its progress)\n"
+			"  -K SOCK  stop the daemon on SOCK\n"
+			"  -B       batch mode: deconvolute every image in the input directory into the -o directory, as many at once as the budgets allow\n"
+			"  -R MB    memory budget (default: 75%% of physical memory); a job over it runs in a configuration that fits\n"
+			"  -V MB    OpenCL device memory budget (default: no limit)\n"
+			"  -X       do the pointwise arithmetic on the CPU instead of OpenCL\n"
+			"  -j N     run on N threads (default: the count tuned for this host and image size; in batch mode, split among the jobs, by default all processors)\n"
+			"  -T       tune the thread count and FFT planning for this image size again\n"
+			"  -x WxH+X+Y  only deconvolute (and write) the W x H region of interest at X, Y\n"
+			"  -F       keep periodic (FFT) edges even for a PSF symmetric about both axes, which uses DCT convolution with reflective edges\n"
+			"  -W K     one-shot Wiener (Tikhonov) deconvolution with regularization K instead of the passes, for a quick look or to tune a psf\n"
+			"  -E       with -W, start the passes from the Wiener result instead\n"
+			"  -N       NUMA mode: pin the threads to the nodes and keep each node's rows in its own memory\n"
+			"  -n       only print the plan of the job: peak memory, FFT sizes and time per pass\n");
+	fflush(stderr);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 4) {
-		fprintf(stderr, "Usage: deconvolute [input 16-bit TIFF image] [psf 8-bit TIFF image] [number of iterations]\n");
-		fflush(stderr);
+	int opt;
+	int sequence, batch, plan_only;
+	int first_frame, n_frames, n_iterations, n_warm_iterations, n_threads;
+	size_t host_budget, device_budget;
+	char *output_filename;
+	char *daemon_socket, *job_socket, *stop_socket;
+	struct deconvolute_options options;
+	struct deconvolute_plan plan;
+
+	sequence = 0;
+	batch = 0;
+	plan_only = 0;
+	host_budget = default_host_budget();
+	device_budget = 0;
+	first_frame = 0;
+	n_frames = -1;
+	n_warm_iterations = -1;
+	n_threads = 0;
+	output_filename = NULL;
+	daemon_socket = NULL;
+	job_socket = NULL;
+	stop_socket = NULL;
+	deconvolute_default_options(&options);
+	options.background_output = 1;
+	options.print_plan = 1;
+
+	while ((opt = getopt(argc, argv, "o:sf:k:w:c:C:rp:P:S:dz:t:L:g:m:M:D:J:K:BR:V:XNnj:TFx:W:E")) != -1) {
+		switch (opt) {
+		case 'o':
+			output_filename = optarg;
+			break;
+		case 's':
+			sequence = 1;
+			break;
+		case 'f':
+			first_frame = atoi(optarg);
+			break;
+		case 'k':
+			n_frames = atoi(optarg);
+			break;
+		case 'w':
+			n_warm_iterations = atoi(optarg);
+			break;
+		case 'c':
+			options.checkpoint_filename = optarg;
+			break;
+		case 'C':
+			options.checkpoint_interval = atoi(optarg);
+			break;
+		case 'r':
+			options.resume = 1;
+			break;
+		case 'p':
+			options.preview_filename = optarg;
+			if (options.preview_interval == 0)
+				options.preview_interval = 10;
+			break;
+		case 'P':
+			options.preview_interval = atoi(optarg);
+			break;
+		case 'S':
+			options.preview_scale = atoi(optarg);
+			break;
+		case 'd':
+			options.dither = 1;
+			break;
+		case 'z':
+			if (strcmp(optarg, "deflate") == 0) {
+				options.compression = TIFF_GOODNESS_DEFLATE;
+			} else if (strcmp(optarg, "zstd") == 0) {
+				options.compression = TIFF_GOODNESS_ZSTD;
+			} else if (strcmp(optarg, "lzw") == 0) {
+				options.compression = TIFF_GOODNESS_LZW;
+			} else {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			options.tile_size = atoi(optarg);
+			break;
+		case 'L':
+			options.pyramid_levels = atoi(optarg);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &options.psf_grid_x,
+						&options.psf_grid_y) != 2 ||
+					options.psf_grid_x < 1 ||
+					options.psf_grid_y < 1) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			options.coarse_levels = atoi(optarg);
+			break;
+		case 'M':
+			options.coarse_iterations = atoi(optarg);
+			break;
+		case 'D':
+			daemon_socket = optarg;
+			break;
+		case 'J':
+			job_socket = optarg;
+			break;
+		case 'K':
+			stop_socket = optarg;
+			break;
+		case 'B':
+			batch = 1;
+			break;
+		case 'R':
+			host_budget = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 'V':
+			device_budget = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 'X':
+			options.cpu_only = 1;
+			break;
+		case 'N':
+			options.numa = 1;
+			break;
+		case 'j':
+			n_threads = atoi(optarg);
+			break;
+		case 'T':
+			options.retune = 1;
+			break;
+		case 'F':
+			options.periodic_edges = 1;
+			break;
+		case 'x':
+			if (sscanf(optarg, "%dx%d+%d+%d", &options.roi_width,
+						&options.roi_height,
+						&options.roi_x,
+						&options.roi_y) != 4 ||
+					options.roi_width < 1 ||
+					options.roi_height < 1) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			options.wiener = atof(optarg);
+			break;
+		case 'E':
+			options.wiener_start = 1;
+			break;
+		case 'n':
+			plan_only = 1;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (daemon_socket != NULL) {
+		if (daemon_serve(daemon_socket, n_threads,
+					DAEMON_WARM_ENTRIES) != 0)
+			return EXIT_FAILURE;
+		return 0;
+	}
+
+	if (stop_socket != NULL) {
+		if (daemon_stop(stop_socket) != 0)
+			return EXIT_FAILURE;
+		return 0;
+	}
+
+	if (argc - optind != 3) {
+		usage();
 		return EXIT_FAILURE;
 	}
 
-	if (deconvolute_image(argv[1], argv[2], OUTPUT_FILENAME,
-			atoi(argv[3]), 8) != 0) {
+	n_iterations = atoi(argv[optind + 2]);
+	options.memory_budget = host_budget;
+	options.device_memory_budget = device_budget;
+
+	if (plan_only) {
+		if (deconvolute_plan_job(argv[optind], argv[optind + 1],
+					n_threads, &options, &plan) != 0)
+			return EXIT_FAILURE;
+		deconvolute_print_plan(&plan);
+		return 0;
+	}
+
+	if (job_socket != NULL) {
+		if (output_filename == NULL)
+			output_filename = OUTPUT_FILENAME;
+
+		if (daemon_submit(job_socket, argv[optind], argv[optind +
+					1], output_filename,
+					n_iterations) != 0)
+			return EXIT_FAILURE;
+		return 0;
+	}
+
+	if (batch) {
+		if (output_filename == NULL) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		if (batch_run(argv[optind], argv[optind + 1], output_filename,
+					n_iterations, n_threads > 0 ?
+					n_threads : n_processors(),
+					host_budget, device_budget,
+					&options) != 0)
+			return EXIT_FAILURE;
+		return 0;
+	}
+
+	if (n_frames >= 0) {
+		if (output_filename == NULL)
+			output_filename = OUTPUT_FILENAME;
+
+		if (deconvolute_frames_with_options(argv[optind],
+				argv[optind + 1], output_filename,
+				first_frame, n_frames, n_iterations,
+				n_threads, &options) != 0)
+			return EXIT_FAILURE;
+
+		if (deconvolute_wait_output() != 0)
+			return EXIT_FAILURE;
+		return 0;
+	}
+
+	if (sequence) {
+		if (n_warm_iterations < 0)
+			n_warm_iterations = (n_iterations + 3) / 4;
+		if (output_filename == NULL)
+			output_filename = SEQUENCE_OUTPUT_PATTERN;
+
+		if (deconvolute_sequence_with_options(argv[optind],
+				argv[optind + 1], output_filename,
+				first_frame, n_iterations,
+				n_warm_iterations, n_threads, &options) != 0) {
+			return EXIT_FAILURE;
+		}
+
+		return 0;
+	}
+
+	if (output_filename == NULL)
+		output_filename = OUTPUT_FILENAME;
+
+	if (deconvolute_image_with_options(argv[optind], argv[optind + 1],
+			output_filename, n_iterations, n_threads, &options) != 0) {
 		return EXIT_FAILURE;
 	}
 
+	if (deconvolute_wait_output() != 0)
+		return EXIT_FAILURE;
+
 	return 0;
 }
+
+/* BATCH_MEMORY_SHARE of physical memory, or 1 GB if it is unknown */
+static size_t default_host_budget()
+{
+#ifdef _SC_PHYS_PAGES
+	long pages, page_size;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	page_size = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && page_size > 0)
+		return (size_t)pages / 100 * page_size * BATCH_MEMORY_SHARE;
+#endif
+	return (size_t)1024 * 1024 * 1024;
+}
+
+/* processors online, the thread budget batch jobs share */
+static int n_processors()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 8;
+}
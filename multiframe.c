@@ -0,0 +1,447 @@
+/*
+ * Joint Richardson–Lucy over several observations of one image, each
+ * blurred by its own psf
+ *
+ * one latent image is estimated from n_frames observed frames y_k, frame
+ * k blurred by psf h_k; a pass is the mean of the per frame
+ * Richardson–Lucy corrections:
+ *
+ *	x <- x * 1/K sum_k h_k(-x) * (y_k / (h_k * x))
+ *
+ * the spectra of every frame's normalized psf are transformed once at
+ * create and cached, so memory grows only by one spectrum per frame (and
+ * psf) beyond the observations themselves.  the estimate is transformed
+ * once a pass and the correlations summed in the frequency domain, also
+ * transformed back once; the per frame convolutions go through fixed
+ * buffers of MULTIFRAME_BATCH frames, each batch with one batched fftw
+ * plan each way and one pool run per pointwise step
+ *
+ * edges wrap around, like the whole image transforms of a single frame
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fftw3.h>
+#include "thread_pool.h"
+#include "multiframe.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+struct multiframe {
+	int width, height;
+	/* complex values per spectrum, and per spectrum row */
+	int n_freqs, row_freqs;
+
+	/* cached psf spectra, psf p of frame k at (k * n_psfs + p) *
+	 * n_freqs */
+	int n_frames, n_psfs;
+	fftwf_complex *psf;
+
+	/* one batch of frame planes and their spectra; plans [0] do a
+	 * whole batch, [1] the frames left over at the end */
+	int batch;
+	float *planes;
+	fftwf_complex *spectra;
+	fftwf_plan forward_many[2], backward_many[2];
+
+	/* the estimate (and correction) plane, the estimate's spectrum
+	 * and the sum of the correlations */
+	float *plane;
+	fftwf_complex *spectrum, *sum;
+	fftwf_plan forward, backward;
+
+	struct thread_pool *pool;
+
+	/* arguments of the pass running on the pool */
+	int p, first, n;
+	float **observed;
+	float *estimate;
+};
+
+static int plan_batch(struct multiframe *frames, int i, int n, unsigned
+		fft_flags);
+static int init_psf_spectra(struct multiframe *frames, float **psfs, int
+		psf_width, int psf_height);
+static void blur_row(void *arg, int y);
+static void divide_row(void *arg, int y);
+static void correlate_row(void *arg, int y);
+static void update_row(void *arg, int y);
+static int wrap(int i, int n);
+
+/*
+ * cache the spectra of n_frames sets of n_psfs psfs (psf_width x
+ * psf_height, psf p of frame k at psfs[k * n_psfs + p]; one per channel,
+ * or one shared by all) for width x height frames, normalizing each;
+ * the transforms are planned with the fftw planner fft_flags
+ *
+ * returns the frames, or NULL on failure
+ */
+struct multiframe *multiframe_create(struct thread_pool *pool, float
+		**psfs, int n_frames, int n_psfs, int psf_width, int
+		psf_height, int width, int height, unsigned fft_flags)
+{
+	struct multiframe *frames;
+
+	frames = calloc(1, sizeof(*frames));
+	if (frames == NULL)
+		goto out_no_frames;
+
+	frames->pool = pool;
+	frames->width = width;
+	frames->height = height;
+	frames->row_freqs = width/2 + 1;
+	frames->n_freqs = frames->row_freqs * height;
+	frames->n_frames = n_frames;
+	frames->n_psfs = n_psfs;
+	frames->batch = n_frames < MULTIFRAME_BATCH ? n_frames :
+		MULTIFRAME_BATCH;
+
+	frames->planes = fftwf_malloc((size_t)frames->batch * width *
+			height * sizeof(*frames->planes));
+	frames->spectra = fftwf_malloc((size_t)frames->batch *
+			frames->n_freqs * sizeof(*frames->spectra));
+	frames->plane = fftwf_malloc((size_t)width * height *
+			sizeof(*frames->plane));
+	frames->spectrum = fftwf_malloc((size_t)frames->n_freqs *
+			sizeof(*frames->spectrum));
+	frames->sum = fftwf_malloc((size_t)frames->n_freqs *
+			sizeof(*frames->sum));
+	if (frames->planes == NULL || frames->spectra == NULL ||
+			frames->plane == NULL || frames->spectrum == NULL ||
+			frames->sum == NULL)
+		goto out_err;
+
+	if (plan_batch(frames, 0, frames->batch, fft_flags) != 0)
+		goto out_err;
+	if (n_frames % frames->batch != 0 && plan_batch(frames, 1, n_frames
+				% frames->batch, fft_flags) != 0)
+		goto out_err;
+
+	frames->forward = fftwf_plan_dft_r2c_2d(height, width,
+			frames->plane, frames->spectrum, fft_flags);
+	if (frames->forward == NULL)
+		goto out_err;
+
+	frames->backward = fftwf_plan_dft_c2r_2d(height, width,
+			frames->sum, frames->plane, fft_flags);
+	if (frames->backward == NULL)
+		goto out_err;
+
+	if (init_psf_spectra(frames, psfs, psf_width, psf_height) != 0)
+		goto out_err;
+
+	return frames;
+
+out_err:
+	multiframe_destroy(frames);
+out_no_frames:
+	say_function_failed();
+	return NULL;
+}
+
+/* free the frames (NULL is fine) */
+void multiframe_destroy(struct multiframe *frames)
+{
+	int i;
+
+	if (frames == NULL)
+		return;
+
+	if (frames->psf != NULL)
+		fftwf_free(frames->psf);
+	if (frames->backward != NULL)
+		fftwf_destroy_plan(frames->backward);
+	if (frames->forward != NULL)
+		fftwf_destroy_plan(frames->forward);
+	for (i = 0; i < 2; i++) {
+		if (frames->backward_many[i] != NULL)
+			fftwf_destroy_plan(frames->backward_many[i]);
+		if (frames->forward_many[i] != NULL)
+			fftwf_destroy_plan(frames->forward_many[i]);
+	}
+	if (frames->sum != NULL)
+		fftwf_free(frames->sum);
+	if (frames->spectrum != NULL)
+		fftwf_free(frames->spectrum);
+	if (frames->plane != NULL)
+		fftwf_free(frames->plane);
+	if (frames->spectra != NULL)
+		fftwf_free(frames->spectra);
+	if (frames->planes != NULL)
+		fftwf_free(frames->planes);
+	free(frames);
+}
+
+/*
+ * bytes multiframe_create would allocate for the same arguments (the
+ * observations are the caller's), for planning
+ */
+size_t multiframe_memory(int n_frames, int n_psfs, int width, int
+		height)
+{
+	size_t n_freqs;
+	int batch;
+
+	n_freqs = (size_t)(width/2 + 1) * height;
+	batch = n_frames < MULTIFRAME_BATCH ? n_frames : MULTIFRAME_BATCH;
+
+	return (size_t)(batch + 1) * width * height * sizeof(float) +
+		((size_t)n_frames * n_psfs + batch + 2) * n_freqs *
+		sizeof(fftwf_complex);
+}
+
+/*
+ * one pass on channel c: update estimate from the observed planes of
+ * every frame (observed[k] for frame k), with the psf of channel c
+ */
+void multiframe_iterate(struct multiframe *frames, int c, float
+		**observed, float *estimate)
+{
+	int i;
+
+	frames->p = c < frames->n_psfs ? c : 0;
+	frames->observed = observed;
+	frames->estimate = estimate;
+
+	memcpy(frames->plane, estimate, (size_t)frames->width *
+			frames->height * sizeof(*frames->plane));
+	fftwf_execute(frames->forward);
+
+	for (frames->first = 0; frames->first < frames->n_frames;
+			frames->first += frames->batch) {
+		frames->n = frames->n_frames - frames->first <
+			frames->batch ? frames->n_frames - frames->first :
+			frames->batch;
+		i = frames->n == frames->batch ? 0 : 1;
+
+		/* blur the estimate by each frame's psf, compare with
+		 * the frame and correlate the ratio with the psf again */
+		thread_pool_run(frames->pool, frames->height, blur_row,
+				frames);
+		fftwf_execute(frames->backward_many[i]);
+		thread_pool_run(frames->pool, frames->height, divide_row,
+				frames);
+		fftwf_execute(frames->forward_many[i]);
+		thread_pool_run(frames->pool, frames->height,
+				correlate_row, frames);
+	}
+
+	fftwf_execute(frames->backward);
+	thread_pool_run(frames->pool, frames->height, update_row, frames);
+}
+
+/*
+ * plan the transforms of n frames of the batch buffers each way as
+ * plans i
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int plan_batch(struct multiframe *frames, int i, int n, unsigned
+		fft_flags)
+{
+	int dims[2];
+	int size;
+
+	dims[0] = frames->height;
+	dims[1] = frames->width;
+	size = frames->width * frames->height;
+
+	frames->forward_many[i] = fftwf_plan_many_dft_r2c(2, dims, n,
+			frames->planes, NULL, 1, size,
+			frames->spectra, NULL, 1, frames->n_freqs,
+			fft_flags);
+	if (frames->forward_many[i] == NULL)
+		return -1;
+
+	frames->backward_many[i] = fftwf_plan_many_dft_c2r(2, dims, n,
+			frames->spectra, NULL, 1, frames->n_freqs,
+			frames->planes, NULL, 1, size, fft_flags);
+	if (frames->backward_many[i] == NULL)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * transform every normalized psf once, padded with its centre at 0 like
+ * the whole image psf, into the cached spectra
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_psf_spectra(struct multiframe *frames, float **psfs, int
+		psf_width, int psf_height)
+{
+	int i, j, k;
+	double total;
+	float *psf;
+	fftwf_complex *out;
+
+	frames->psf = fftwf_malloc((size_t)frames->n_frames *
+			frames->n_psfs * frames->n_freqs *
+			sizeof(*frames->psf));
+	if (frames->psf == NULL)
+		goto out_err;
+
+	/* the estimate plane and spectrum are free until the first
+	 * pass */
+	for (k = 0; k < frames->n_frames * frames->n_psfs; k++) {
+		psf = psfs[k];
+
+		total = 0;
+		for (i = 0; i < psf_width * psf_height; i++) {
+			total += psf[i];
+		}
+		if (total == 0)
+			total = 1;
+
+		memset(frames->plane, 0, (size_t)frames->width *
+				frames->height * sizeof(*frames->plane));
+		for (j = 0; j < psf_height; j++) {
+			for (i = 0; i < psf_width; i++) {
+				frames->plane[(size_t)wrap(j -
+						psf_height/2,
+						frames->height) *
+					frames->width + wrap(i -
+						psf_width/2,
+						frames->width)] =
+					psf[j * psf_width + i] / total;
+			}
+		}
+
+		fftwf_execute(frames->forward);
+
+		out = frames->psf + (size_t)k * frames->n_freqs;
+		memcpy(out, frames->spectrum, (size_t)frames->n_freqs *
+				sizeof(*out));
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * row y of the spectrum of each frame of the batch: the estimate's
+ * spectrum times the frame's psf spectrum, folding in the 1/n of the
+ * inverse transform
+ */
+static void blur_row(void *arg, int y)
+{
+	struct multiframe *frames;
+	int b, i;
+	size_t start;
+	float re, im, scale;
+	fftwf_complex *x, *h, *out;
+
+	frames = arg;
+	start = (size_t)y * frames->row_freqs;
+	scale = 1.0f / ((float)frames->width * frames->height);
+	x = frames->spectrum + start;
+
+	for (b = 0; b < frames->n; b++) {
+		h = frames->psf + ((size_t)(frames->first + b) *
+				frames->n_psfs + frames->p) *
+			frames->n_freqs + start;
+		out = frames->spectra + (size_t)b * frames->n_freqs + start;
+
+		for (i = 0; i < frames->row_freqs; i++) {
+			re = h[i][0] * scale;
+			im = h[i][1] * scale;
+			out[i][0] = x[i][0] * re - x[i][1] * im;
+			out[i][1] = x[i][0] * im + x[i][1] * re;
+		}
+	}
+}
+
+/* row y of each blurred estimate of the batch: the frame over it */
+static void divide_row(void *arg, int y)
+{
+	struct multiframe *frames;
+	int b, i;
+	size_t start;
+	float *observed, *blurred;
+
+	frames = arg;
+	start = (size_t)y * frames->width;
+
+	for (b = 0; b < frames->n; b++) {
+		observed = frames->observed[frames->first + b] + start;
+		blurred = frames->planes + (size_t)b * frames->width *
+			frames->height + start;
+
+		for (i = 0; i < frames->width; i++) {
+			blurred[i] = blurred[i] != 0 ? observed[i] /
+				blurred[i] : 0;
+		}
+	}
+}
+
+/*
+ * add row y of the ratio spectra of the batch times the complex
+ * conjugate of each frame's psf spectrum (the spectrum of psf(-x)) to
+ * the sum, folding in the 1/n of the inverse transform and the mean
+ * over the frames; the first batch starts the sum
+ */
+static void correlate_row(void *arg, int y)
+{
+	struct multiframe *frames;
+	int b, i;
+	size_t start;
+	float re, im, scale;
+	fftwf_complex *r, *h, *sum;
+
+	frames = arg;
+	start = (size_t)y * frames->row_freqs;
+	scale = 1.0f / ((float)frames->width * frames->height *
+			frames->n_frames);
+	sum = frames->sum + start;
+
+	if (frames->first == 0)
+		memset(sum, 0, frames->row_freqs * sizeof(*sum));
+
+	for (b = 0; b < frames->n; b++) {
+		h = frames->psf + ((size_t)(frames->first + b) *
+				frames->n_psfs + frames->p) *
+			frames->n_freqs + start;
+		r = frames->spectra + (size_t)b * frames->n_freqs + start;
+
+		for (i = 0; i < frames->row_freqs; i++) {
+			re = h[i][0] * scale;
+			im = -h[i][1] * scale;
+			sum[i][0] += r[i][0] * re - r[i][1] * im;
+			sum[i][1] += r[i][0] * im + r[i][1] * re;
+		}
+	}
+}
+
+/* row y of the estimate times the mean correction */
+static void update_row(void *arg, int y)
+{
+	struct multiframe *frames;
+	int i;
+	size_t start;
+
+	frames = arg;
+	start = (size_t)y * frames->width;
+
+	for (i = 0; i < frames->width; i++) {
+		frames->estimate[start + i] *= frames->plane[start + i];
+	}
+}
+
+/* i modulo n, in [0, n) for negative i too */
+static int wrap(int i, int n)
+{
+	i %= n;
+	return i < 0 ? i + n : i;
+}
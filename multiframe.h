@@ -0,0 +1,32 @@
+/*
+ * Joint Richardson–Lucy over several observations of one image, each
+ * blurred by its own psf
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _MULTIFRAME_H_
+#define _MULTIFRAME_H_
+
+#include <stddef.h>
+#include "thread_pool.h"
+
+/* frames transformed together by one batched fftw plan */
+#define MULTIFRAME_BATCH 8
+
+struct multiframe;
+
+struct multiframe *multiframe_create(struct thread_pool *pool, float
+		**psfs, int n_frames, int n_psfs, int psf_width, int
+		psf_height, int width, int height, unsigned fft_flags);
+void multiframe_destroy(struct multiframe *frames);
+size_t multiframe_memory(int n_frames, int n_psfs, int width, int
+		height);
+void multiframe_iterate(struct multiframe *frames, int c, float
+		**observed, float *estimate);
+
+#endif /* !_MULTIFRAME_H_ */
@@ -0,0 +1,411 @@
+/*
+ * Coarse-to-fine starting estimate from downsampled Richardson–Lucy
+ *
+ * the input and psf are halved n_levels times (a [1 2 1] filter at
+ * every other pixel, the psf about its centre so it stays centred);
+ * the coarsest level runs n_iterations passes from its input, and its
+ * estimate, upsampled (bilinear), starts the next finer level, up to
+ * the full size estimate the caller finishes off.  the early passes
+ * mostly recover low frequencies, which the coarse levels get at a
+ * quarter of the cost per level
+ *
+ * levels convolve with psf_grid (a 1 x 1 grid for one psf), on the
+ * cpu, so they need none of the whole image buffers
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fftw3.h>
+#include "deconvolute.h"
+#include "thread_pool.h"
+#include "psf_grid.h"
+#include "multires.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+/* one level of the pyramid; level 0 borrows the caller's input and psf */
+struct level {
+	int width, height;
+	float *input[DECONVOLUTE_MAX_CHANNELS];
+	float *estimate[DECONVOLUTE_MAX_CHANNELS];
+
+	int psf_width, psf_height;
+	float *psf[DECONVOLUTE_MAX_CHANNELS];
+};
+
+static int init_level(struct level *fine, struct level *coarse, int
+		n_channels, int n_psfs, int grid_x, int grid_y);
+static void cleanup_level(struct level *level);
+static int run_level(struct thread_pool *pool, struct level *level, int
+		n_channels, int n_psfs, int grid_x, int grid_y, int
+		n_iterations, double *cost);
+static void downsample(float *in, int width, int height, float *out,
+		int out_width, int out_height);
+static void downsample_psf(float *in, int width, int height, int
+		grid_x, int grid_y, float *out, int out_width, int
+		out_height);
+static void upsample(float *in, int width, int height, float *out, int
+		out_width, int out_height);
+static int wrap(int i, int n);
+
+/*
+ * run n_iterations Richardson–Lucy passes on each of up to n_levels
+ * halvings of the width x height input (fewer if the image gets
+ * smaller than MULTIRES_MIN_SIZE), coarsest first, and upsample the
+ * result into the full size estimate planes
+ *
+ * psf is n_psfs mosaics of grid_x x grid_y psfs as for
+ * psf_grid_create.  the cost of the transforms, in transforms of the
+ * full size image, is added to *cost
+ *
+ * returns the number of levels run, or -1 on failure
+ */
+int multires_estimate(struct thread_pool *pool, float **input, int
+		n_channels, int width, int height, float **psf, int
+		n_psfs, int psf_width, int psf_height, int grid_x, int
+		grid_y, int n_levels, int n_iterations, float **estimate,
+		double *cost)
+{
+	int ret;
+	int k, c, n;
+	double level_cost;
+	struct level *levels;
+
+	levels = calloc(n_levels + 1, sizeof(*levels));
+	if (levels == NULL)
+		goto out_no_levels;
+
+	levels[0].width = width;
+	levels[0].height = height;
+	levels[0].psf_width = psf_width;
+	levels[0].psf_height = psf_height;
+	for (c = 0; c < n_channels; c++) {
+		levels[0].input[c] = input[c];
+		levels[0].estimate[c] = estimate[c];
+	}
+	for (c = 0; c < n_psfs; c++) {
+		levels[0].psf[c] = psf[c];
+	}
+
+	/* downsample all the way first, each level from the last */
+	for (n = 0; n < n_levels; n++) {
+		if ((levels[n].width + 1) / 2 < MULTIRES_MIN_SIZE ||
+				(levels[n].height + 1) / 2 <
+				MULTIRES_MIN_SIZE)
+			break;
+
+		ret = init_level(&levels[n], &levels[n + 1], n_channels,
+				n_psfs, grid_x, grid_y);
+		if (ret != 0)
+			goto out_err;
+	}
+
+	if (n == 0) {
+		free(levels);
+		return 0;
+	}
+
+	for (c = 0; c < n_channels; c++) {
+		memcpy(levels[n].estimate[c], levels[n].input[c],
+				(size_t)levels[n].width *
+				levels[n].height *
+				sizeof(*levels[n].estimate[c]));
+	}
+
+	for (k = n; k > 0; k--) {
+		printf("Level %d (%dx%d): %d passes...\n", k,
+				levels[k].width, levels[k].height,
+				n_iterations);
+
+		level_cost = 0;
+		ret = run_level(pool, &levels[k], n_channels, n_psfs,
+				grid_x, grid_y, n_iterations, &level_cost);
+		if (ret != 0)
+			goto out_err;
+		*cost += level_cost / ((double)width * height);
+
+		for (c = 0; c < n_channels; c++) {
+			upsample(levels[k].estimate[c], levels[k].width,
+					levels[k].height,
+					levels[k - 1].estimate[c],
+					levels[k - 1].width,
+					levels[k - 1].height);
+		}
+	}
+
+	for (k = 1; k <= n; k++) {
+		cleanup_level(&levels[k]);
+	}
+	free(levels);
+
+	return n;
+
+out_err:
+	for (k = 1; k <= n_levels; k++) {
+		cleanup_level(&levels[k]);
+	}
+	free(levels);
+out_no_levels:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * alloc coarse, half the size of fine, and downsample fine's input and
+ * psf into it
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_level(struct level *fine, struct level *coarse, int
+		n_channels, int n_psfs, int grid_x, int grid_y)
+{
+	int c;
+	int cell_width, cell_height, left, right;
+
+	coarse->width = (fine->width + 1) / 2;
+	coarse->height = (fine->height + 1) / 2;
+
+	/* the pixels either side of a cell's centre halve (rounding up),
+	 * which keeps the centre at cell_width/2 */
+	cell_width = fine->psf_width / grid_x;
+	left = cell_width / 2;
+	right = cell_width - 1 - left;
+	coarse->psf_width = grid_x * ((left + 1) / 2 + (right + 1) / 2 +
+			1);
+	cell_height = fine->psf_height / grid_y;
+	left = cell_height / 2;
+	right = cell_height - 1 - left;
+	coarse->psf_height = grid_y * ((left + 1) / 2 + (right + 1) / 2 +
+			1);
+
+	for (c = 0; c < n_channels; c++) {
+		coarse->input[c] = malloc((size_t)coarse->width *
+				coarse->height * sizeof(*coarse->input[c]));
+		coarse->estimate[c] = malloc((size_t)coarse->width *
+				coarse->height *
+				sizeof(*coarse->estimate[c]));
+		if (coarse->input[c] == NULL)
+			goto out_err;
+		if (coarse->estimate[c] == NULL)
+			goto out_err;
+
+		downsample(fine->input[c], fine->width, fine->height,
+				coarse->input[c], coarse->width,
+				coarse->height);
+	}
+
+	for (c = 0; c < n_psfs; c++) {
+		coarse->psf[c] = calloc((size_t)coarse->psf_width *
+				coarse->psf_height,
+				sizeof(*coarse->psf[c]));
+		if (coarse->psf[c] == NULL)
+			goto out_err;
+
+		downsample_psf(fine->psf[c], fine->psf_width,
+				fine->psf_height, grid_x, grid_y,
+				coarse->psf[c], coarse->psf_width,
+				coarse->psf_height);
+	}
+
+	return 0;
+
+out_err:
+	say_function_failed();
+	cleanup_level(coarse);
+	return -1;
+}
+
+/* free a level made by init_level (a zeroed one is fine) */
+static void cleanup_level(struct level *level)
+{
+	int c;
+
+	for (c = 0; c < DECONVOLUTE_MAX_CHANNELS; c++) {
+		free(level->input[c]);
+		level->input[c] = NULL;
+		free(level->estimate[c]);
+		level->estimate[c] = NULL;
+		free(level->psf[c]);
+		level->psf[c] = NULL;
+	}
+}
+
+/*
+ * run n_iterations passes on level's estimate, adding the pixels
+ * transformed to *cost
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int run_level(struct thread_pool *pool, struct level *level, int
+		n_channels, int n_psfs, int grid_x, int grid_y, int
+		n_iterations, double *cost)
+{
+	int i, c;
+	size_t j, n;
+	float *a, *b;
+	struct psf_grid *grid;
+
+	n = (size_t)level->width * level->height;
+	a = malloc(n * sizeof(*a));
+	b = malloc(n * sizeof(*b));
+	if (a == NULL || b == NULL)
+		goto out_no_buffers;
+
+	grid = psf_grid_create(pool, level->psf, n_psfs, level->psf_width,
+			level->psf_height, grid_x, grid_y, level->width,
+			level->height, FFTW_MEASURE);
+	if (grid == NULL)
+		goto out_no_buffers;
+
+	for (i = 0; i < n_iterations; i++) {
+		for (c = 0; c < n_channels; c++) {
+			psf_grid_convolve(grid, c, level->estimate[c], a,
+					0);
+
+			/* same as the divide kernel */
+			for (j = 0; j < n; j++) {
+				b[j] = a[j] != 0 ? level->input[c][j] /
+					a[j] : 0;
+			}
+
+			psf_grid_convolve(grid, c, b, a, 1);
+
+			for (j = 0; j < n; j++) {
+				level->estimate[c][j] *= a[j];
+			}
+		}
+	}
+
+	/* two convolutions of two transforms each per pass */
+	*cost += 4.0 * n_iterations * n_channels *
+		psf_grid_transform_size(grid);
+
+	psf_grid_destroy(grid);
+	free(b);
+	free(a);
+
+	return 0;
+
+out_no_buffers:
+	free(b);
+	free(a);
+	say_function_failed();
+	return -1;
+}
+
+/* one [1 2 1] filtered pixel in every two, wrapping around the edges */
+static void downsample(float *in, int width, int height, float *out,
+		int out_width, int out_height)
+{
+	static const float w[3] = {0.25f, 0.5f, 0.25f};
+	int x, y, dx, dy;
+	float sum;
+
+	for (y = 0; y < out_height; y++) {
+		for (x = 0; x < out_width; x++) {
+			sum = 0;
+			for (dy = -1; dy <= 1; dy++) {
+				for (dx = -1; dx <= 1; dx++) {
+					sum += w[dx + 1] * w[dy + 1] *
+						in[wrap(2 * y + dy,
+						height) * width +
+						wrap(2 * x + dx, width)];
+				}
+			}
+			out[y * out_width + x] = sum;
+		}
+	}
+}
+
+/*
+ * downsample each cell of a psf mosaic like downsample, but about the
+ * cell centre and dropping what falls outside the cell (the cells are
+ * normalized later)
+ */
+static void downsample_psf(float *in, int width, int height, int
+		grid_x, int grid_y, float *out, int out_width, int
+		out_height)
+{
+	static const float w[3] = {0.25f, 0.5f, 0.25f};
+	int x, y, dx, dy, fx, fy;
+	int cell_width, cell_height, out_cell_width, out_cell_height;
+	int cell_x, cell_y;
+	float sum;
+
+	cell_width = width / grid_x;
+	cell_height = height / grid_y;
+	out_cell_width = out_width / grid_x;
+	out_cell_height = out_height / grid_y;
+
+	for (y = 0; y < out_height; y++) {
+		for (x = 0; x < out_width; x++) {
+			cell_x = x / out_cell_width;
+			cell_y = y / out_cell_height;
+
+			sum = 0;
+			for (dy = -1; dy <= 1; dy++) {
+				fy = cell_height/2 + 2 * (y %
+						out_cell_height -
+						out_cell_height/2) + dy;
+				if (fy < 0 || fy >= cell_height)
+					continue;
+
+				for (dx = -1; dx <= 1; dx++) {
+					fx = cell_width/2 + 2 * (x %
+							out_cell_width -
+							out_cell_width/2)
+						+ dx;
+					if (fx < 0 || fx >= cell_width)
+						continue;
+
+					sum += w[dx + 1] * w[dy + 1] *
+						in[(cell_y * cell_height
+						+ fy) * width + cell_x *
+						cell_width + fx];
+				}
+			}
+			out[y * out_width + x] = sum;
+		}
+	}
+}
+
+/* bilinear upsample, pixel x of out lying at x/2 of in */
+static void upsample(float *in, int width, int height, float *out, int
+		out_width, int out_height)
+{
+	int x, y, x0, y0, x1, y1;
+	float fx, fy;
+
+	for (y = 0; y < out_height; y++) {
+		y0 = wrap(y / 2, height);
+		y1 = wrap(y / 2 + 1, height);
+		fy = y % 2 ? 0.5f : 0;
+
+		for (x = 0; x < out_width; x++) {
+			x0 = wrap(x / 2, width);
+			x1 = wrap(x / 2 + 1, width);
+			fx = x % 2 ? 0.5f : 0;
+
+			out[y * out_width + x] = (1 - fy) * ((1 - fx) *
+					in[y0 * width + x0] + fx * in[y0 *
+					width + x1]) + fy * ((1 - fx) *
+					in[y1 * width + x0] + fx * in[y1 *
+					width + x1]);
+		}
+	}
+}
+
+/* i modulo n, in [0, n) for negative i too */
+static int wrap(int i, int n)
+{
+	i %= n;
+	return i < 0 ? i + n : i;
+}
@@ -0,0 +1,25 @@
+/*
+ * Coarse-to-fine starting estimate from downsampled Richardson–Lucy
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _MULTIRES_H_
+#define _MULTIRES_H_
+
+#include "thread_pool.h"
+
+/* levels stop halving once a side would be smaller than this */
+#define MULTIRES_MIN_SIZE 16
+
+int multires_estimate(struct thread_pool *pool, float **input, int
+		n_channels, int width, int height, float **psf, int
+		n_psfs, int psf_width, int psf_height, int grid_x, int
+		grid_y, int n_levels, int n_iterations, float **estimate,
+		double *cost);
+
+#endif /* !_MULTIRES_H_ */
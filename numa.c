@@ -0,0 +1,223 @@
+/*
+ * NUMA topology and thread pinning (Linux sysfs, no libnuma)
+ *
+ * the nodes and their cpus are read from /sys/devices/system/node; a
+ * machine without it is one node of all online cpus.  threads 0 to
+ * n_threads - 1 are spread over the nodes in contiguous blocks, so
+ * row bands handed out in thread order stay on one node each, and
+ * each thread is pinned to the cpus of its node (not a single cpu,
+ * which the scheduler is better at choosing)
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "numa.h"
+
+#define SYSFS_NODES "/sys/devices/system/node"
+
+static int read_cpulist(char *filename, struct numa_topology *topology,
+		int node);
+
+/* read the topology, or make it one node of all online cpus */
+void numa_read_topology(struct numa_topology *topology)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char filename[FILENAME_MAX];
+	int id, i, n, cpu, n_online;
+
+	memset(topology, 0, sizeof(*topology));
+	for (i = 0; i < NUMA_MAX_CPUS; i++) {
+		topology->cpu_node[i] = -1;
+	}
+
+	dir = opendir(SYSFS_NODES);
+	if (dir != NULL) {
+		while ((entry = readdir(dir)) != NULL &&
+				topology->n_nodes < NUMA_MAX_NODES) {
+			if (sscanf(entry->d_name, "node%d", &id) != 1)
+				continue;
+
+			snprintf(filename, sizeof(filename),
+					SYSFS_NODES "/%s/cpulist",
+					entry->d_name);
+			n = topology->n_nodes;
+			topology->node_id[n] = id;
+			if (read_cpulist(filename, topology, n) == 0 &&
+					topology->n_cpus[n] > 0)
+				topology->n_nodes++;
+		}
+		closedir(dir);
+	}
+
+	/* nodes in sysfs order, which readdir does not keep */
+	for (i = 1; i < topology->n_nodes; i++) {
+		for (n = i; n > 0 && topology->node_id[n - 1] >
+				topology->node_id[n]; n--) {
+			id = topology->node_id[n];
+			topology->node_id[n] = topology->node_id[n - 1];
+			topology->node_id[n - 1] = id;
+			cpu = topology->n_cpus[n];
+			topology->n_cpus[n] = topology->n_cpus[n - 1];
+			topology->n_cpus[n - 1] = cpu;
+			for (cpu = 0; cpu < NUMA_MAX_CPUS; cpu++) {
+				if (topology->cpu_node[cpu] == n)
+					topology->cpu_node[cpu] = n - 1;
+				else if (topology->cpu_node[cpu] == n - 1)
+					topology->cpu_node[cpu] = n;
+			}
+		}
+	}
+
+	if (topology->n_nodes > 0)
+		return;
+
+	n_online = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	n_online = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n_online < 1)
+		n_online = 1;
+	if (n_online > NUMA_MAX_CPUS)
+		n_online = NUMA_MAX_CPUS;
+
+	topology->n_nodes = 1;
+	topology->n_cpus[0] = n_online;
+	for (cpu = 0; cpu < n_online; cpu++) {
+		topology->cpu_node[cpu] = 0;
+	}
+}
+
+/* node (index) thread of n_threads runs on */
+int numa_node_of_thread(struct numa_topology *topology, int thread, int
+		n_threads)
+{
+	if (n_threads < 1)
+		return 0;
+
+	return (long)thread * topology->n_nodes / n_threads;
+}
+
+/*
+ * pin the calling thread to the cpus of node
+ *
+ * returns 0 on success, anything else otherwise
+ */
+int numa_pin(struct numa_topology *topology, int node)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int cpu;
+
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (topology->cpu_node[cpu] == node)
+			CPU_SET(cpu, &set);
+	}
+
+	return sched_setaffinity(0, sizeof(set), &set);
+#else
+	return -1;
+#endif
+}
+
+/* let the calling thread run on every cpu of the topology again */
+void numa_unpin(struct numa_topology *topology)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int cpu;
+
+	CPU_ZERO(&set);
+	for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (topology->cpu_node[cpu] >= 0)
+			CPU_SET(cpu, &set);
+	}
+
+	sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+/* report the nodes and which of n_threads threads run on each */
+void numa_print(struct numa_topology *topology, int n_threads)
+{
+	int node, first, last;
+
+	printf("NUMA: %d node%s, %d threads pinned\n", topology->n_nodes,
+			topology->n_nodes == 1 ? "" : "s", n_threads);
+
+	first = 0;
+	for (node = 0; node < topology->n_nodes; node++) {
+		last = first;
+		while (last < n_threads && numa_node_of_thread(topology,
+					last, n_threads) == node)
+			last++;
+
+		if (last > first)
+			printf("  node %d: %d CPUs, threads %d-%d\n",
+					topology->node_id[node],
+					topology->n_cpus[node], first,
+					last - 1);
+		else
+			printf("  node %d: %d CPUs, no threads\n",
+					topology->node_id[node],
+					topology->n_cpus[node]);
+		first = last;
+	}
+	fflush(stdout);
+}
+
+/*
+ * mark the cpus of a sysfs cpulist ("0-15,32-47") as on node
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int read_cpulist(char *filename, struct numa_topology *topology,
+		int node)
+{
+	FILE *file;
+	int first, last, cpu;
+	char separator;
+
+	file = fopen(filename, "r");
+	if (file == NULL)
+		return -1;
+
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		separator = fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+
+		for (cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS;
+				cpu++) {
+			if (cpu < 0 || topology->cpu_node[cpu] >= 0)
+				continue;
+			topology->cpu_node[cpu] = node;
+			topology->n_cpus[node]++;
+		}
+
+		if (separator != ',')
+			break;
+	}
+
+	fclose(file);
+	return 0;
+}
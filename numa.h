@@ -0,0 +1,34 @@
+/*
+ * NUMA topology and thread pinning (Linux sysfs, no libnuma)
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+/* most nodes and cpus the topology is read for */
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+struct numa_topology {
+	int n_nodes;
+	/* sysfs number and cpu count of each node */
+	int node_id[NUMA_MAX_NODES];
+	int n_cpus[NUMA_MAX_NODES];
+	/* node (index) of each cpu, -1 if offline or absent */
+	int cpu_node[NUMA_MAX_CPUS];
+};
+
+void numa_read_topology(struct numa_topology *topology);
+int numa_node_of_thread(struct numa_topology *topology, int thread, int
+		n_threads);
+int numa_pin(struct numa_topology *topology, int node);
+void numa_unpin(struct numa_topology *topology);
+void numa_print(struct numa_topology *topology, int n_threads);
+
+#endif /* !_NUMA_H_ */
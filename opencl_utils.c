@@ -11,66 +11,41 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <CL/opencl.h>
+#include "opencl_utils.h"
 
-/*
- * reads a file and returns a malloced char* of its contents
- * that needs to freed
- */
-static char *cl_utils_read_file(char *filename)
-{
-	FILE *file;
-	int size;
-	char *contents;
-
-	if ((file = fopen(filename, "r")) == NULL)
-		goto out_no_open;
-	if (fseek(file, 0, SEEK_END) == -1)
-		goto out_info_err;
-	if ((size = ftell(file)) == -1)
-		goto out_info_err;
-	if (fseek(file, 0, SEEK_SET) == -1)
-		goto out_info_err;
-
-	contents = malloc(size + 1);
-	if (contents == NULL)
-		goto out_nomem;
-
-	fread(contents, 1, size, file);
-	if (ferror(file)) {
-		free(contents);
-		goto out_read_err;
-	}
-
-	fclose(file);
-	contents[size] = '\0';
-	return contents;
-
-out_read_err:
-	free(contents);
-out_nomem:
-out_info_err:
-	fclose(file);
-out_no_open:
-	return NULL;
-}
+/* opencl platforms (installed runtimes) searched for a device */
+#define CL_UTILS_MAX_PLATFORMS 16
 
 /*
- * creates opencl context and command queue using gpu device
+ * creates opencl context and command queue using the first gpu device
+ * of any platform, or if there is none the first device of any type
+ * (e.g. a cpu runtime)
  *
  * returns 0 on success, anything else on failure
  */
 int cl_utils_setup_gpu(cl_context *context, cl_command_queue
 		*command_queue, cl_device_id *device)
 {
+	static const cl_device_type types[] = {CL_DEVICE_TYPE_GPU,
+		CL_DEVICE_TYPE_ALL};
 	cl_int err;
-	cl_platform_id platform;
+	cl_platform_id platforms[CL_UTILS_MAX_PLATFORMS];
+	cl_uint n_platforms, i, t;
 
-	err = clGetPlatformIDs(1, &platform, NULL);
+	err = clGetPlatformIDs(CL_UTILS_MAX_PLATFORMS, platforms,
+			&n_platforms);
 	if (err != CL_SUCCESS)
 		goto out_err;
-
-	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, device,
-			NULL);
+	if (n_platforms > CL_UTILS_MAX_PLATFORMS)
+		n_platforms = CL_UTILS_MAX_PLATFORMS;
+
+	err = CL_DEVICE_NOT_FOUND;
+	for (t = 0; t < 2 && err != CL_SUCCESS; t++) {
+		for (i = 0; i < n_platforms && err != CL_SUCCESS; i++) {
+			err = clGetDeviceIDs(platforms[i], types[t], 1,
+					device, NULL);
+		}
+	}
 	if (err != CL_SUCCESS)
 		goto out_err;
 
@@ -108,44 +83,38 @@ void cl_utils_cleanup_gpu(cl_context *context, cl_command_queue
 }
 
 /*
- * create a opencl program from source code in filename
+ * create an opencl program from source code (e.g. compiled into the
+ * program), built with the compiler options (e.g. -D definitions; NULL
+ * for none)
  *
  * returns 0 on success, anything else otherwise
  */
-int cl_utils_create_program(cl_program *program, char *filename,
-		cl_context context, cl_device_id device)
+int cl_utils_create_program_from_source(cl_program *program, const char
+		*source_code, char *options, cl_context context,
+		cl_device_id device)
 {
 	cl_int err;
-	char *source_code;
 	size_t build_log_size;
 	char *build_log;
 
-	source_code = cl_utils_read_file(filename);
-	if (source_code == NULL) {
-		fprintf(stderr, "cl_utils_create_program: could not read %s\n",
-				filename);
-		fflush(stderr);
-		goto out_no_source;
-	}
-
-	*program = clCreateProgramWithSource(context, 1,
-			(const char **) &source_code, NULL, &err);
+	*program = clCreateProgramWithSource(context, 1, &source_code,
+			NULL, &err);
 	if (err != CL_SUCCESS) {
-		fprintf(stderr, "cl_utils_create_program: clCreateProgramWithSource failed\n");
+		fprintf(stderr, "cl_utils_create_program_from_source: clCreateProgramWithSource failed\n");
 		fflush(stderr);
 		goto out_no_program;
 	}
 
-	err = clBuildProgram(*program, 1, &device, NULL, NULL, NULL);
+	err = clBuildProgram(*program, 1, &device, options, NULL, NULL);
 	if (err != CL_SUCCESS) {
-		fprintf(stderr, "cl_utils_create_program: clBuildProgram failed\n");
+		fprintf(stderr, "cl_utils_create_program_from_source: clBuildProgram failed\n");
 
 		clGetProgramBuildInfo(*program, device,
 				CL_PROGRAM_BUILD_LOG, 0, NULL,
 				&build_log_size);
 		build_log = malloc(build_log_size);
 		if (build_log == NULL) {
-			fprintf(stderr, "cl_utils_create_program: No memory for build log\n");
+			fprintf(stderr, "cl_utils_create_program_from_source: No memory for build log\n");
 			fflush(stderr);
 			goto out_build_fail;
 		}
@@ -159,14 +128,11 @@ int cl_utils_create_program(cl_program *program, char *filename,
 		goto out_build_fail;
 	}
 
-	free(source_code);
 	return 0;
 
 out_build_fail:
 	clReleaseProgram(*program);
 	*program = NULL;
 out_no_program:
-	free(source_code);
-out_no_source:
 	return -1;
 }
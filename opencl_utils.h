@@ -17,7 +17,8 @@ int cl_utils_setup_gpu(cl_context *context, cl_command_queue
 		*command_queue, cl_device_id *device);
 void cl_utils_cleanup_gpu(cl_context *context, cl_command_queue
 		*command_queue);
-int cl_utils_create_program(cl_program *program, char *filename,
-		cl_context context, cl_device_id device);
+int cl_utils_create_program_from_source(cl_program *program, const char
+		*source_code, char *options, cl_context context,
+		cl_device_id device);
 
 #endif /* !_OPEN_CL_UTILS_H_ */
@@ -0,0 +1,194 @@
+/*
+ * Background writing of preview images during a deconvolution
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "tiff_goodness.h"
+#include "convert.h"
+#include "preview.h"
+
+static void *write_preview(void *arg);
+
+/*
+ * prepare a writer for previews of n_channels width x height planes,
+ * downscaled by an integer factor scale (1 for full size); the first
+ * three channels are shown as RGB, or the first alone as gray if there
+ * are fewer
+ *
+ * returns 0 on success, anything else on failure
+ */
+int preview_writer_init(struct preview_writer *writer, int width, int
+		height, int n_channels, int scale)
+{
+	memset(writer, 0, sizeof(*writer));
+	atomic_init(&writer->done, 0);
+
+	if (scale < 1)
+		scale = 1;
+	writer->scale = scale;
+	writer->width = width;
+	writer->height = height;
+	writer->n_channels = n_channels >= 3 ? 3 : 1;
+
+	writer->data = malloc((size_t)writer->n_channels * (width/scale + 1)
+			* (height/scale + 1) * sizeof(*writer->data));
+	if (writer->data == NULL) {
+		fprintf(stderr, "preview_writer_init: no memory\n");
+		fflush(stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * check without blocking whether the writer is free to take new planes
+ * (the planes it borrowed last may then be reused)
+ *
+ * returns nonzero if idle, 0 if a write is still in progress
+ */
+int preview_writer_idle(struct preview_writer *writer)
+{
+	if (!writer->busy)
+		return 1;
+	if (!atomic_load(&writer->done))
+		return 0;
+
+	/* finished, so this join does not block */
+	preview_writer_wait(writer);
+	return 1;
+}
+
+/*
+ * start writing planes to filename on a background thread; the planes
+ * are borrowed, not copied, and must not be modified until the writer
+ * is idle again.  the writer must be idle
+ *
+ * returns 0 on success, anything else on failure
+ */
+int preview_write_async(struct preview_writer *writer, char *filename,
+		float **planes)
+{
+	int c, ret;
+
+	if (snprintf(writer->filename, FILENAME_MAX, "%s", filename) >=
+			FILENAME_MAX)
+		return -1;
+
+	for (c = 0; c < writer->n_channels; c++) {
+		writer->planes[c] = planes[c];
+	}
+
+	atomic_store(&writer->done, 0);
+	ret = pthread_create(&writer->thread, NULL, write_preview,
+			writer);
+	if (ret != 0)
+		return ret;
+	writer->busy = 1;
+
+	return 0;
+}
+
+/*
+ * wait for a pending write
+ *
+ * returns 0 if there was none or it succeeded, anything else otherwise
+ */
+int preview_writer_wait(struct preview_writer *writer)
+{
+	if (!writer->busy)
+		return 0;
+
+	pthread_join(writer->thread, NULL);
+	writer->busy = 0;
+
+	return writer->ret;
+}
+
+/* waits for a pending write and frees the writer's buffer */
+void preview_writer_cleanup(struct preview_writer *writer)
+{
+	preview_writer_wait(writer);
+
+	free(writer->data);
+	writer->data = NULL;
+}
+
+/*
+ * thread function box-filtering the borrowed planes down by scale,
+ * quantizing them and writing them via a temporary file, so viewers
+ * polling the preview never see a half-written one
+ */
+static void *write_preview(void *arg)
+{
+	int c, x, y, i, j;
+	int out_width, out_height, scale;
+	float sum;
+	struct preview_writer *writer;
+	char tmp_filename[FILENAME_MAX];
+
+	writer = arg;
+	scale = writer->scale;
+	out_width = writer->width / scale;
+	out_height = writer->height / scale;
+	if (out_width < 1 || out_height < 1) {
+		scale = 1;
+		out_width = writer->width;
+		out_height = writer->height;
+	}
+
+	for (y = 0; y < out_height; y++) {
+		for (x = 0; x < out_width; x++) {
+			for (c = 0; c < writer->n_channels; c++) {
+				sum = 0;
+				for (j = 0; j < scale; j++) {
+					for (i = 0; i < scale; i++) {
+						sum += writer->planes[c][(y
+							* scale + j) *
+							writer->width + x
+							* scale + i];
+					}
+				}
+				sum /= scale * scale;
+
+				writer->data[writer->n_channels * (y *
+						out_width + x) + c] =
+					convert_float_sample_to_u16(sum);
+			}
+		}
+	}
+
+	writer->ret = -1;
+	if (snprintf(tmp_filename, FILENAME_MAX, "%s.tmp",
+				writer->filename) >= FILENAME_MAX)
+		goto out;
+
+	if (write_tiff16(tmp_filename, writer->data, out_width,
+				out_height, writer->n_channels, 0) != 0) {
+		remove(tmp_filename);
+		goto out;
+	}
+
+	if (rename(tmp_filename, writer->filename) != 0) {
+		remove(tmp_filename);
+		goto out;
+	}
+
+	writer->ret = 0;
+out:
+	atomic_store(&writer->done, 1);
+	return NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ * Background writing of preview images during a deconvolution
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PREVIEW_H_
+#define _PREVIEW_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * writes (optionally downscaled) 16-bit RGB or grayscale previews of
+ * borrowed float planes on a background thread
+ */
+struct preview_writer {
+	pthread_t thread;
+	atomic_int done;
+	int busy;
+	int ret;
+	char filename[FILENAME_MAX];
+	float *planes[3];
+	int n_channels;
+	int width, height;
+	int scale;
+	uint16_t *data;
+};
+
+int preview_writer_init(struct preview_writer *writer, int width, int
+		height, int n_channels, int scale);
+int preview_writer_idle(struct preview_writer *writer);
+int preview_write_async(struct preview_writer *writer, char *filename,
+		float **planes);
+int preview_writer_wait(struct preview_writer *writer);
+void preview_writer_cleanup(struct preview_writer *writer);
+
+#endif /* !_PREVIEW_H_ */
@@ -0,0 +1,579 @@
+/*
+ * Spatially varying psf from a grid of psfs, applied tile by tile
+ *
+ * the psf image is a mosaic of grid_x by grid_y equally sized psfs,
+ * cell (i, j) being the psf at the centre of region (i, j) of the
+ * image split evenly the same way.  the image is cut into overlapping
+ * square tiles; each tile gets the bilinear interpolation (by its
+ * centre) of the cell spectra, computed once at create and cached, and
+ * a convolution transforms all tiles of a plane with one batched fftw
+ * plan each way, so it costs about as much as one transform of the
+ * whole (slightly enlarged) image
+ *
+ * tiles read past the image edges wrap around, like the whole image
+ * transforms do, so a grid of one psf gives the same result as the
+ * whole image transforms; a 1 x 1 grid is just that, one tile the size
+ * of the image with no margin
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fftw3.h>
+#include "deconvolute.h"
+#include "thread_pool.h"
+#include "psf_grid.h"
+
+#define say_function_failed() \
+	fprintf(stderr, "%s: %s: failed\n", __FILE__, __func__) \
+
+/* smallest tile side, and how many times the overlap a side is */
+#define MIN_TILE_SIZE 64
+#define TILE_OVERLAP_RATIO 4
+
+struct psf_grid {
+	int width, height;
+	/* tiles are tile_width x tile_height, of which the middle
+	 * core_width x core_height (margin in from each side) is written
+	 * back */
+	int tile_width, tile_height;
+	int core_width, core_height, margin;
+	int tiles_x, tiles_y, n_tiles;
+	/* complex values per tile spectrum */
+	int n_freqs;
+
+	/* the tiles of the plane being convolved and their spectra */
+	float *tiles;
+	fftwf_complex *spectra;
+	fftwf_plan forward, backward;
+
+	/* cached psf spectra of every tile, one set per psf */
+	int n_psfs;
+	fftwf_complex *psf[DECONVOLUTE_MAX_CHANNELS];
+
+	struct thread_pool *pool;
+
+	/* arguments of the convolution running on the pool */
+	float *in, *out;
+	fftwf_complex *psf_spectra;
+	int adjoint;
+	/* if > 0, wiener filter the tiles with it instead */
+	float regularization;
+};
+
+static void run_tiles(struct psf_grid *grid, int c, float *in, float
+		*out, int adjoint, float regularization);
+static void set_tiles(struct psf_grid *grid, int cell_width, int
+		cell_height, int grid_x, int grid_y, int width, int height);
+static int init_psf_spectra(struct psf_grid *grid, float **mosaic, int
+		mosaic_width, int mosaic_height, int grid_x, int grid_y);
+static void interpolate_tile(struct psf_grid *grid, fftwf_complex
+		*cells, int grid_x, int grid_y, int p, int t);
+static void gather_tile(void *arg, int t);
+static void multiply_tile(void *arg, int t);
+static void scatter_tile(void *arg, int t);
+static int wrap(int i, int n);
+
+/*
+ * split a width x height image into tiles and compute the spectrum of
+ * every tile's psf from the n_psfs mosaics (mosaic_width x
+ * mosaic_height, grid_x x grid_y cells; one mosaic per channel, or one
+ * shared by all), normalizing each cell; the transforms are planned
+ * with the fftw planner fft_flags
+ *
+ * returns the grid, or NULL on failure
+ */
+struct psf_grid *psf_grid_create(struct thread_pool *pool, float
+		**mosaic, int n_psfs, int mosaic_width, int mosaic_height,
+		int grid_x, int grid_y, int width, int height, unsigned
+		fft_flags)
+{
+	struct psf_grid *grid;
+	int n[2];
+	int cell_width, cell_height;
+
+	if (grid_x < 1 || grid_y < 1 || mosaic_width % grid_x != 0 ||
+			mosaic_height % grid_y != 0) {
+		fprintf(stderr, "%dx%d psf does not split into a %dx%d grid\n",
+				mosaic_width, mosaic_height, grid_x,
+				grid_y);
+		fflush(stderr);
+		goto out_no_grid;
+	}
+	cell_width = mosaic_width / grid_x;
+	cell_height = mosaic_height / grid_y;
+
+	grid = calloc(1, sizeof(*grid));
+	if (grid == NULL)
+		goto out_no_grid;
+
+	grid->pool = pool;
+	grid->n_psfs = n_psfs;
+	set_tiles(grid, cell_width, cell_height, grid_x, grid_y, width,
+			height);
+
+	grid->tiles = fftwf_malloc((size_t)grid->n_tiles *
+			grid->tile_width * grid->tile_height *
+			sizeof(*grid->tiles));
+	if (grid->tiles == NULL)
+		goto out_err;
+
+	grid->spectra = fftwf_malloc((size_t)grid->n_tiles *
+			grid->n_freqs * sizeof(*grid->spectra));
+	if (grid->spectra == NULL)
+		goto out_err;
+
+	/* one plan each way transforms every tile */
+	n[0] = grid->tile_height;
+	n[1] = grid->tile_width;
+	grid->forward = fftwf_plan_many_dft_r2c(2, n, grid->n_tiles,
+			grid->tiles, NULL, 1, grid->tile_width *
+			grid->tile_height,
+			grid->spectra, NULL, 1, grid->n_freqs,
+			fft_flags);
+	if (grid->forward == NULL)
+		goto out_err;
+
+	grid->backward = fftwf_plan_many_dft_c2r(2, n, grid->n_tiles,
+			grid->spectra, NULL, 1, grid->n_freqs,
+			grid->tiles, NULL, 1, grid->tile_width *
+			grid->tile_height, fft_flags);
+	if (grid->backward == NULL)
+		goto out_err;
+
+	if (init_psf_spectra(grid, mosaic, mosaic_width, mosaic_height,
+				grid_x, grid_y) != 0)
+		goto out_err;
+
+	return grid;
+
+out_err:
+	psf_grid_destroy(grid);
+out_no_grid:
+	say_function_failed();
+	return NULL;
+}
+
+/* free the grid (NULL is fine) */
+void psf_grid_destroy(struct psf_grid *grid)
+{
+	int p;
+
+	if (grid == NULL)
+		return;
+
+	for (p = 0; p < DECONVOLUTE_MAX_CHANNELS; p++) {
+		if (grid->psf[p] != NULL)
+			fftwf_free(grid->psf[p]);
+	}
+	if (grid->backward != NULL)
+		fftwf_destroy_plan(grid->backward);
+	if (grid->forward != NULL)
+		fftwf_destroy_plan(grid->forward);
+	if (grid->spectra != NULL)
+		fftwf_free(grid->spectra);
+	if (grid->tiles != NULL)
+		fftwf_free(grid->tiles);
+	free(grid);
+}
+
+/*
+ * bytes psf_grid_create would allocate for the same arguments (less
+ * the transient cell spectra), for planning
+ */
+size_t psf_grid_memory(int n_psfs, int mosaic_width, int mosaic_height,
+		int grid_x, int grid_y, int width, int height)
+{
+	struct psf_grid grid;
+
+	set_tiles(&grid, mosaic_width / grid_x, mosaic_height / grid_y,
+			grid_x, grid_y, width, height);
+
+	return (size_t)grid.n_tiles * grid.tile_width * grid.tile_height *
+		sizeof(float) + (size_t)(n_psfs + 1) * grid.n_tiles *
+		grid.n_freqs * sizeof(fftwf_complex);
+}
+
+/*
+ * size of the tiles (so of the transforms) psf_grid_create would cut a
+ * width x height image into, and how many, for planning
+ */
+void psf_grid_geometry(int mosaic_width, int mosaic_height, int grid_x,
+		int grid_y, int width, int height, int *tile_width, int
+		*tile_height, int *n_tiles)
+{
+	struct psf_grid grid;
+
+	set_tiles(&grid, mosaic_width / grid_x, mosaic_height / grid_y,
+			grid_x, grid_y, width, height);
+
+	*tile_width = grid.tile_width;
+	*tile_height = grid.tile_height;
+	*n_tiles = grid.n_tiles;
+}
+
+/* number of tiles the image was cut into */
+int psf_grid_tiles(struct psf_grid *grid)
+{
+	return grid->n_tiles;
+}
+
+/* pixels transformed by each batched transform of all tiles */
+long psf_grid_transform_size(struct psf_grid *grid)
+{
+	return (long)grid->n_tiles * grid->tile_width * grid->tile_height;
+}
+
+/*
+ * convolve the plane in of channel c with the psf of each tile, or
+ * with its mirror image psf(-x) if adjoint is nonzero, into out
+ * (which may be in)
+ */
+void psf_grid_convolve(struct psf_grid *grid, int c, float *in, float
+		*out, int adjoint)
+{
+	run_tiles(grid, c, in, out, adjoint, 0);
+}
+
+/*
+ * deconvolute the plane in of channel c in one step, tile by tile, by
+ * the wiener (tikhonov) filter conj(psf) / (|psf|^2 + regularization)
+ * of each tile's psf spectrum, into out (which may be in)
+ */
+void psf_grid_wiener(struct psf_grid *grid, int c, float *in, float
+		*out, float regularization)
+{
+	run_tiles(grid, c, in, out, 0, regularization);
+}
+
+/*
+ * gather the tiles of in, transform them, multiply them by their psf
+ * spectra of channel c (see multiply_tile), transform them back and
+ * scatter their cores to out
+ */
+static void run_tiles(struct psf_grid *grid, int c, float *in, float
+		*out, int adjoint, float regularization)
+{
+	grid->in = in;
+	grid->out = out;
+	grid->psf_spectra = grid->psf[c < grid->n_psfs ? c : 0];
+	grid->adjoint = adjoint;
+	grid->regularization = regularization;
+
+	thread_pool_run(grid->pool, grid->n_tiles, gather_tile, grid);
+	fftwf_execute(grid->forward);
+	thread_pool_run(grid->pool, grid->n_tiles, multiply_tile, grid);
+	fftwf_execute(grid->backward);
+	thread_pool_run(grid->pool, grid->n_tiles, scatter_tile, grid);
+}
+
+/* cut the width x height image into tiles for psfs of cell size */
+static void set_tiles(struct psf_grid *grid, int cell_width, int
+		cell_height, int grid_x, int grid_y, int width, int height)
+{
+	grid->width = width;
+	grid->height = height;
+
+	if (grid_x * grid_y == 1) {
+		/* one psf: the whole image is one wrapped-around tile */
+		grid->margin = 0;
+		grid->tile_width = width;
+		grid->tile_height = height;
+	} else {
+		/* the margin covers the psf either side of a core pixel */
+		grid->margin = (cell_width > cell_height ? cell_width :
+				cell_height) / 2 + 1;
+		grid->tile_width = MIN_TILE_SIZE;
+		while (grid->tile_width < TILE_OVERLAP_RATIO * 2 *
+				grid->margin)
+			grid->tile_width *= 2;
+		grid->tile_height = grid->tile_width;
+	}
+	grid->core_width = grid->tile_width - 2 * grid->margin;
+	grid->core_height = grid->tile_height - 2 * grid->margin;
+	grid->tiles_x = (width + grid->core_width - 1) / grid->core_width;
+	grid->tiles_y = (height + grid->core_height - 1) /
+		grid->core_height;
+	grid->n_tiles = grid->tiles_x * grid->tiles_y;
+	grid->n_freqs = (grid->tile_width/2 + 1) * grid->tile_height;
+}
+
+/*
+ * transform every normalized cell of every mosaic once (in the tile
+ * buffers) and interpolate them into the cached tile spectra
+ *
+ * returns 0 on success, anything else otherwise
+ */
+static int init_psf_spectra(struct psf_grid *grid, float **mosaic, int
+		mosaic_width, int mosaic_height, int grid_x, int grid_y)
+{
+	int n[2];
+	int p, t, i, j, x, y;
+	int cell, n_cells, cell_width, cell_height;
+	double total;
+	float *tile;
+	fftwf_complex *cells;
+	fftwf_plan plan;
+
+	n_cells = grid_x * grid_y;
+	cell_width = mosaic_width / grid_x;
+	cell_height = mosaic_height / grid_y;
+
+	cells = fftwf_malloc((size_t)n_cells * grid->n_freqs *
+			sizeof(*cells));
+	if (cells == NULL)
+		goto out_no_cells;
+
+	/* the tile buffers are free until the first convolution, and
+	 * hold n_cells tiles unless the grid is finer than the tiling */
+	tile = grid->tiles;
+	if (n_cells > grid->n_tiles) {
+		tile = fftwf_malloc((size_t)n_cells * grid->tile_width *
+				grid->tile_height * sizeof(*tile));
+		if (tile == NULL)
+			goto out_no_tile;
+	}
+
+	n[0] = grid->tile_height;
+	n[1] = grid->tile_width;
+	plan = fftwf_plan_many_dft_r2c(2, n, n_cells, tile, NULL, 1,
+			grid->tile_width * grid->tile_height, cells, NULL, 1,
+			grid->n_freqs, FFTW_ESTIMATE);
+	if (plan == NULL)
+		goto out_no_plan;
+
+	for (p = 0; p < grid->n_psfs; p++) {
+		grid->psf[p] = fftwf_malloc((size_t)grid->n_tiles *
+				grid->n_freqs * sizeof(*grid->psf[p]));
+		if (grid->psf[p] == NULL)
+			goto out_err;
+
+		/* pad each normalized cell with its centre at 0, like
+		 * the whole image psf */
+		memset(tile, 0, (size_t)n_cells * grid->tile_width *
+				grid->tile_height * sizeof(*tile));
+		for (cell = 0; cell < n_cells; cell++) {
+			x = cell % grid_x * cell_width;
+			y = cell / grid_x * cell_height;
+
+			total = 0;
+			for (j = 0; j < cell_height; j++) {
+				for (i = 0; i < cell_width; i++) {
+					total += mosaic[p][(y + j) *
+						mosaic_width + x + i];
+				}
+			}
+			if (total == 0)
+				total = 1;
+
+			for (j = 0; j < cell_height; j++) {
+				for (i = 0; i < cell_width; i++) {
+					tile[(size_t)cell *
+						grid->tile_width *
+						grid->tile_height + wrap(j -
+						cell_height/2,
+						grid->tile_height) *
+						grid->tile_width + wrap(i -
+						cell_width/2,
+						grid->tile_width)] =
+						mosaic[p][(y + j) *
+						mosaic_width + x + i] /
+						total;
+				}
+			}
+		}
+
+		fftwf_execute(plan);
+
+		for (t = 0; t < grid->n_tiles; t++) {
+			interpolate_tile(grid, cells, grid_x, grid_y, p, t);
+		}
+	}
+
+	fftwf_destroy_plan(plan);
+	if (tile != grid->tiles)
+		fftwf_free(tile);
+	fftwf_free(cells);
+
+	return 0;
+
+out_err:
+	fftwf_destroy_plan(plan);
+out_no_plan:
+	if (tile != grid->tiles)
+		fftwf_free(tile);
+out_no_tile:
+	fftwf_free(cells);
+out_no_cells:
+	say_function_failed();
+	return -1;
+}
+
+/*
+ * psf spectrum p of tile t: the cell spectra around the centre of the
+ * tile's core, bilinearly weighted (the same as transforming the
+ * interpolated psf)
+ */
+static void interpolate_tile(struct psf_grid *grid, fftwf_complex
+		*cells, int grid_x, int grid_y, int p, int t)
+{
+	int k, i[2], j[2];
+	int x0, x1, y0, y1;
+	float fx, fy, gx, gy, w[4];
+	fftwf_complex *out, *a, *b, *c, *d;
+
+	/* centre of the part of the core inside the image */
+	x0 = t % grid->tiles_x * grid->core_width;
+	y0 = t / grid->tiles_x * grid->core_height;
+	x1 = x0 + grid->core_width < grid->width ? x0 + grid->core_width :
+		grid->width;
+	y1 = y0 + grid->core_height < grid->height ? y0 +
+		grid->core_height : grid->height;
+
+	/* in cell units, with cell centres at whole numbers */
+	gx = 0.5f * (x0 + x1) * grid_x / grid->width - 0.5f;
+	gy = 0.5f * (y0 + y1) * grid_y / grid->height - 0.5f;
+	if (gx < 0)
+		gx = 0;
+	if (gx > grid_x - 1)
+		gx = grid_x - 1;
+	if (gy < 0)
+		gy = 0;
+	if (gy > grid_y - 1)
+		gy = grid_y - 1;
+
+	i[0] = (int)gx;
+	j[0] = (int)gy;
+	i[1] = i[0] + 1 < grid_x ? i[0] + 1 : i[0];
+	j[1] = j[0] + 1 < grid_y ? j[0] + 1 : j[0];
+	fx = gx - i[0];
+	fy = gy - j[0];
+
+	w[0] = (1 - fx) * (1 - fy);
+	w[1] = fx * (1 - fy);
+	w[2] = (1 - fx) * fy;
+	w[3] = fx * fy;
+
+	a = cells + (size_t)(j[0] * grid_x + i[0]) * grid->n_freqs;
+	b = cells + (size_t)(j[0] * grid_x + i[1]) * grid->n_freqs;
+	c = cells + (size_t)(j[1] * grid_x + i[0]) * grid->n_freqs;
+	d = cells + (size_t)(j[1] * grid_x + i[1]) * grid->n_freqs;
+	out = grid->psf[p] + (size_t)t * grid->n_freqs;
+
+	for (k = 0; k < grid->n_freqs; k++) {
+		out[k][0] = w[0] * a[k][0] + w[1] * b[k][0] + w[2] *
+			c[k][0] + w[3] * d[k][0];
+		out[k][1] = w[0] * a[k][1] + w[1] * b[k][1] + w[2] *
+			c[k][1] + w[3] * d[k][1];
+	}
+}
+
+/* copy the window of tile t (wrapping around the edges) out of in */
+static void gather_tile(void *arg, int t)
+{
+	struct psf_grid *grid;
+	int i, j, x0, y0, y;
+	float *tile, *row;
+
+	grid = arg;
+	tile = grid->tiles + (size_t)t * grid->tile_width *
+		grid->tile_height;
+	x0 = t % grid->tiles_x * grid->core_width - grid->margin;
+	y0 = t / grid->tiles_x * grid->core_height - grid->margin;
+
+	for (j = 0; j < grid->tile_height; j++) {
+		y = wrap(y0 + j, grid->height);
+		row = grid->in + (size_t)y * grid->width;
+
+		for (i = 0; i < grid->tile_width; i++) {
+			tile[(size_t)j * grid->tile_width + i] =
+				row[wrap(x0 + i, grid->width)];
+		}
+	}
+}
+
+/*
+ * multiply the spectrum of tile t by its psf spectrum (or that of
+ * psf(-x), its complex conjugate, or the wiener filter of it), folding
+ * in the 1/n of the inverse transform
+ */
+static void multiply_tile(void *arg, int t)
+{
+	struct psf_grid *grid;
+	int k;
+	float re, im, psf_re, psf_im, scale;
+	fftwf_complex *spectrum, *psf;
+
+	grid = arg;
+	spectrum = grid->spectra + (size_t)t * grid->n_freqs;
+	psf = grid->psf_spectra + (size_t)t * grid->n_freqs;
+	scale = 1.0f / ((float)grid->tile_width * grid->tile_height);
+
+	if (grid->regularization > 0) {
+		for (k = 0; k < grid->n_freqs; k++) {
+			re = spectrum[k][0];
+			im = spectrum[k][1];
+			psf_re = psf[k][0];
+			psf_im = psf[k][1];
+			scale = 1.0f / ((float)grid->tile_width *
+					grid->tile_height * (psf_re *
+						psf_re + psf_im * psf_im +
+						grid->regularization));
+
+			spectrum[k][0] = (re * psf_re + im * psf_im) *
+				scale;
+			spectrum[k][1] = (im * psf_re - re * psf_im) *
+				scale;
+		}
+		return;
+	}
+
+	for (k = 0; k < grid->n_freqs; k++) {
+		re = spectrum[k][0];
+		im = spectrum[k][1];
+		psf_re = psf[k][0] * scale;
+		psf_im = grid->adjoint ? -psf[k][1] * scale : psf[k][1] *
+			scale;
+
+		spectrum[k][0] = re * psf_re - im * psf_im;
+		spectrum[k][1] = re * psf_im + im * psf_re;
+	}
+}
+
+/* copy the core of tile t (the part inside the image) into out */
+static void scatter_tile(void *arg, int t)
+{
+	struct psf_grid *grid;
+	int j, x0, y0, n_x, n_y;
+	float *tile;
+
+	grid = arg;
+	tile = grid->tiles + (size_t)t * grid->tile_width *
+		grid->tile_height;
+	x0 = t % grid->tiles_x * grid->core_width;
+	y0 = t / grid->tiles_x * grid->core_height;
+	n_x = x0 + grid->core_width < grid->width ? grid->core_width :
+		grid->width - x0;
+	n_y = y0 + grid->core_height < grid->height ? grid->core_height :
+		grid->height - y0;
+
+	for (j = 0; j < n_y; j++) {
+		memcpy(grid->out + (size_t)(y0 + j) * grid->width + x0,
+				tile + (size_t)(grid->margin + j) *
+				grid->tile_width + grid->margin, n_x *
+				sizeof(*tile));
+	}
+}
+
+/* i modulo n, in [0, n) for negative i too */
+static int wrap(int i, int n)
+{
+	i %= n;
+	return i < 0 ? i + n : i;
+}
@@ -0,0 +1,36 @@
+/*
+ * Spatially varying psf from a grid of psfs, applied tile by tile
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PSF_GRID_H_
+#define _PSF_GRID_H_
+
+#include <stddef.h>
+#include "thread_pool.h"
+
+struct psf_grid;
+
+struct psf_grid *psf_grid_create(struct thread_pool *pool, float
+		**mosaic, int n_psfs, int mosaic_width, int mosaic_height,
+		int grid_x, int grid_y, int width, int height, unsigned
+		fft_flags);
+void psf_grid_destroy(struct psf_grid *grid);
+size_t psf_grid_memory(int n_psfs, int mosaic_width, int mosaic_height,
+		int grid_x, int grid_y, int width, int height);
+void psf_grid_geometry(int mosaic_width, int mosaic_height, int grid_x,
+		int grid_y, int width, int height, int *tile_width, int
+		*tile_height, int *n_tiles);
+int psf_grid_tiles(struct psf_grid *grid);
+long psf_grid_transform_size(struct psf_grid *grid);
+void psf_grid_convolve(struct psf_grid *grid, int c, float *in, float
+		*out, int adjoint);
+void psf_grid_wiener(struct psf_grid *grid, int c, float *in, float
+		*out, float regularization);
+
+#endif /* !_PSF_GRID_H_ */
@@ -0,0 +1,277 @@
+/*
+ * A small pool of worker threads for parallel loops
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "thread_pool.h"
+
+struct thread_pool {
+	/* workers, the thread calling thread_pool_run also works */
+	int n_workers;
+	pthread_t *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	/* the loop being run, protected by lock */
+	void (*task)(void *arg, int i);
+	void *arg;
+	int n_tasks;
+	int next_task;
+	int n_done;
+	unsigned long generation;
+	int shutdown;
+
+	/*
+	 * pinned pools run a loop statically, thread t (the caller being
+	 * 0) taking the t-th contiguous block of tasks, so the same
+	 * threads touch the same data every loop
+	 */
+	int pinned;
+	void (*pin)(void *arg, int thread);
+	void *pin_arg;
+	int n_started;
+};
+
+static void *worker(void *arg);
+static struct thread_pool *create(int n_threads, void (*pin)(void *arg,
+		int thread), void *pin_arg);
+
+/*
+ * run tasks of the current loop until there are none left
+ *
+ * must be called with pool->lock held, returns with it held
+ */
+static void run_tasks(struct thread_pool *pool)
+{
+	int i;
+
+	while (pool->next_task < pool->n_tasks) {
+		i = pool->next_task++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->task(pool->arg, i);
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->n_done == pool->n_tasks)
+			pthread_cond_broadcast(&pool->done_cond);
+	}
+}
+
+/*
+ * run the thread-th block of tasks of the current loop on a pinned
+ * pool
+ *
+ * must be called with pool->lock held, returns with it held
+ */
+static void run_block(struct thread_pool *pool, int thread)
+{
+	int i, first, last, n_threads;
+
+	n_threads = pool->n_workers + 1;
+	first = (long)thread * pool->n_tasks / n_threads;
+	last = (long)(thread + 1) * pool->n_tasks / n_threads;
+
+	pthread_mutex_unlock(&pool->lock);
+	for (i = first; i < last; i++) {
+		pool->task(pool->arg, i);
+	}
+	pthread_mutex_lock(&pool->lock);
+
+	pool->n_done += last - first;
+	if (pool->n_done == pool->n_tasks)
+		pthread_cond_broadcast(&pool->done_cond);
+}
+
+/*
+ * create a pool for running loops on n_threads threads in total
+ * (including the caller of thread_pool_run)
+ *
+ * returns the pool, or NULL if failed
+ */
+struct thread_pool *thread_pool_create(int n_threads)
+{
+	return create(n_threads, NULL, NULL);
+}
+
+/*
+ * create a pool like thread_pool_create whose workers call
+ * pin(pin_arg, thread) for thread 1 to n_threads - 1 when they start
+ * (thread 0 is the caller of thread_pool_run, which pins itself), and
+ * whose loops hand out tasks in contiguous blocks by thread
+ *
+ * returns the pool, or NULL if failed
+ */
+struct thread_pool *thread_pool_create_pinned(int n_threads, void
+		(*pin)(void *arg, int thread), void *pin_arg)
+{
+	return create(n_threads, pin, pin_arg);
+}
+
+/* stop and join the workers and free the pool (NULL is ignored) */
+void thread_pool_destroy(struct thread_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->n_workers; i++) {
+		pthread_join(pool->workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+/* number of threads loops run on (1 for a NULL pool) */
+int thread_pool_size(struct thread_pool *pool)
+{
+	if (pool == NULL)
+		return 1;
+
+	return pool->n_workers + 1;
+}
+
+/*
+ * run task(arg, i) for i in [0, n_tasks) on the pool and the calling
+ * thread, returning when all are done; a NULL pool runs them all on
+ * the calling thread
+ *
+ * only one thread may run loops on a pool at a time
+ */
+void thread_pool_run(struct thread_pool *pool, int n_tasks, void
+		(*task)(void *arg, int i), void *arg)
+{
+	int i;
+
+	if (pool == NULL || pool->n_workers == 0 || n_tasks <= 1) {
+		for (i = 0; i < n_tasks; i++) {
+			task(arg, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->n_tasks = n_tasks;
+	pool->next_task = 0;
+	pool->n_done = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	if (pool->pinned)
+		run_block(pool, 0);
+	else
+		run_tasks(pool);
+	while (pool->n_done < pool->n_tasks) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* worker thread function, runs tasks of each new loop */
+static void *worker(void *arg)
+{
+	unsigned long seen;
+	struct thread_pool *pool;
+	int thread;
+
+	pool = arg;
+	seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	thread = ++pool->n_started;
+	if (pool->pinned) {
+		pthread_mutex_unlock(&pool->lock);
+		pool->pin(pool->pin_arg, thread);
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	for (;;) {
+		while (!pool->shutdown && pool->generation == seen) {
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		}
+		if (pool->shutdown)
+			break;
+
+		seen = pool->generation;
+		if (pool->pinned)
+			run_block(pool, thread);
+		else
+			run_tasks(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* create a pool, pinned if pin is not NULL */
+static struct thread_pool *create(int n_threads, void (*pin)(void *arg,
+		int thread), void *pin_arg)
+{
+	int i;
+	struct thread_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		goto out_nomem;
+
+	pool->workers = calloc(n_threads > 1 ? n_threads - 1 : 1,
+			sizeof(*pool->workers));
+	if (pool->workers == NULL)
+		goto out_no_workers;
+
+	if (pthread_mutex_init(&pool->lock, NULL) != 0)
+		goto out_no_lock;
+	if (pthread_cond_init(&pool->work_cond, NULL) != 0)
+		goto out_no_work_cond;
+	if (pthread_cond_init(&pool->done_cond, NULL) != 0)
+		goto out_no_done_cond;
+
+	pool->pinned = pin != NULL;
+	pool->pin = pin;
+	pool->pin_arg = pin_arg;
+
+	for (i = 0; i < n_threads - 1; i++) {
+		if (pthread_create(&pool->workers[i], NULL, worker, pool)
+				!= 0)
+			break;
+		pool->n_workers++;
+	}
+
+	return pool;
+
+out_no_done_cond:
+	pthread_cond_destroy(&pool->work_cond);
+out_no_work_cond:
+	pthread_mutex_destroy(&pool->lock);
+out_no_lock:
+	free(pool->workers);
+out_no_workers:
+	free(pool);
+out_nomem:
+	fprintf(stderr, "thread_pool_create: failed\n");
+	fflush(stderr);
+	return NULL;
+}
@@ -0,0 +1,24 @@
+/*
+ * A small pool of worker threads for parallel loops
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+struct thread_pool;
+
+struct thread_pool *thread_pool_create(int n_threads);
+struct thread_pool *thread_pool_create_pinned(int n_threads, void
+		(*pin)(void *arg, int thread), void *pin_arg);
+void thread_pool_destroy(struct thread_pool *pool);
+int thread_pool_size(struct thread_pool *pool);
+void thread_pool_run(struct thread_pool *pool, int n_tasks, void
+		(*task)(void *arg, int i), void *arg);
+
+#endif /* !_THREAD_POOL_H_ */
@@ -11,21 +11,103 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <tiffio.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "thread_pool.h"
+#include "tiff_goodness.h"
 
 /*
- * read tiff, assumes tiff file has 3 channels per pixel, RGB,
- * with 16-bit channels
+ * uncompressed bytes per written strip, and strips (or tiles)
+ * (de)compressed per thread before the batch is written or the next
+ * batch read
+ */
+#define STRIP_SIZE (1 << 20)
+#define STRIPS_PER_THREAD 4
+
+/* room left for tags and compression overhead before going BigTIFF */
+#define BIGTIFF_MARGIN (1 << 24)
+
+/*
+ * a batch of consecutive strips, or tiles if tile_width is nonzero,
+ * (de)compressed on a thread pool
+ */
+struct strip_batch {
+	/* the whole uncompressed image */
+	char *image;
+	int width, height, rows_per_strip;
+	int tile_width, tile_height, tiles_across;
+	int n_samples, bits;
+	size_t row_size, chunk_size;
+
+	/* compression, predictor and byte order of the strips */
+	uint16_t compression;
+	int predictor;
+	int swab;
+
+	/* first strip of the batch, and per slot in the batch the
+	 * compressed strip, its size and capacity, scratch space for the
+	 * predictor and the result */
+	int first, n_slots;
+	char **raw;
+	size_t *raw_size, *raw_capacity;
+	char **scratch;
+	int *ret;
+};
+
+/* a 2x2 box filter from one pyramid level to the next */
+struct downsample {
+	uint16_t *in, *out;
+	int in_width, in_height;
+	int out_width;
+	int n_samples;
+};
+
+static int write_tiff(char *filename, uint16_t *image_data, int width,
+		int height, int n_samples, int n_extra, int compression, int
+		n_threads, int tile_size, int n_levels);
+static int write_image(TIFF *out, struct thread_pool *pool, int
+		n_threads, uint16_t *image_data, int width, int height, int
+		n_samples, uint16_t compression, int tile_size);
+static int set_tags(TIFF *out, int width, int height, int n_samples,
+		int n_extra);
+static void downsample_row(void *arg, int y);
+static int alloc_batch(struct strip_batch *batch, int n_slots, size_t
+		raw_capacity, int scratch);
+static void free_batch(struct strip_batch *batch);
+static int parallel_codec(uint16_t compression);
+static size_t strip_rows(struct strip_batch *batch, int strip);
+static size_t get_chunk(struct strip_batch *batch, int chunk, char
+		*scratch, int copy, char **data, int *n_rows, int
+		*row_width);
+static void predict_rows(char *data, int n_rows, int width, int
+		n_samples, int bits, int undo);
+static void compress_strip(void *arg, int i);
+static void decompress_strip(void *arg, int i);
+static int read_strips(TIFF *tif, char *image, int width, int height,
+		int n_samples, int bits, int n_threads);
+
+/*
+ * read page (directory, counting from 0) of a tiff with contiguous
+ * bits-bit samples and any number of samples per pixel; the trailing
+ * n_extra of the n_samples per pixel are extra samples (e.g. alpha).
+ * deflate (and, with HAVE_ZSTD, zstd) compressed strips are
+ * decompressed on n_threads threads
  *
- * returns a malloced uint16_t* that needs to be freed, or NULL if
- * failed
+ * returns a malloced buffer that needs to be freed, or NULL if failed
  */
-uint16_t *read_tiff16(char *filename, int *width, int *height)
+static void *read_tiff(char *filename, int page, int bits, int
+		n_threads, int *width, int *height, int *n_samples, int
+		*n_extra)
 {
-	int i;
 	TIFF *tif;
-	uint16_t *result;
+	char *result;
 	int scanline_size;
+	uint16_t samples_per_pixel, bits_per_sample, planar_config;
+	uint16_t extra_count, *extra_types;
 
 	if ((tif = TIFFOpen(filename, "r")) == NULL) {
 		fprintf(stderr, "read_tiff: could not open %s\n",
@@ -34,29 +116,47 @@ uint16_t *read_tiff16(char *filename, int *width, int *height)
 		goto out_no_open;
 	}
 
+	if (page != 0 && TIFFSetDirectory(tif, page) == 0) {
+		fprintf(stderr, "read_tiff: %s has no page %d\n",
+				filename, page);
+		fflush(stderr);
+		goto out_wrong_format;
+	}
+
 	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, width);
 	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL,
+			&samples_per_pixel);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE,
+			&bits_per_sample);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar_config);
+	if (TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &extra_count,
+				&extra_types) == 0)
+		extra_count = 0;
+
+	*n_samples = samples_per_pixel;
+	*n_extra = extra_count;
 	scanline_size = TIFFScanlineSize(tif);
-	if (scanline_size != 3 * (*width) * sizeof(*result)) {
-		fprintf(stderr, "read_tiff: %s is not in correct format.  TIFF file should have 16-bit channels in RGBRGB format.\n",
-				filename);
+	if (bits_per_sample != bits || planar_config !=
+			PLANARCONFIG_CONTIG || TIFFIsTiled(tif) ||
+			extra_count >= samples_per_pixel || scanline_size
+			!= (*n_samples) * (*width) * bits / 8) {
+		fprintf(stderr, "read_tiff: %s is not in correct format.  TIFF file should have %d-bit channels in contiguous (e.g. RGBRGB) format, in strips.\n",
+				filename, bits);
 		fflush(stderr);
 		goto out_wrong_format;
 	}
 
-	result = malloc((*height) * scanline_size);
+	result = malloc((size_t)(*height) * scanline_size);
 	if (result == NULL)
 		goto out_nomem;
 
-	for (i = 0; i < (*height); i++) {
-		if (TIFFReadScanline(tif, result + 3 * (*width) * i,
-					i, 0)
-				== -1) {
-			fprintf(stderr, "read_tiff: error in reading %s row %d\n",
-					filename, i);
-			fflush(stderr);
-			goto out_read_err;
-		}
+	if (read_strips(tif, result, *width, *height, *n_samples, bits,
+				n_threads) != 0) {
+		fprintf(stderr, "read_tiff: error in reading %s\n",
+				filename);
+		fflush(stderr);
+		goto out_read_err;
 	}
 
 	TIFFClose(tif);
@@ -72,54 +172,170 @@ out_no_open:
 }
 
 /*
- * read tiff, assumes tiff file has 3 channels per pixel, RGB,
- * with 8-bit channels
+ * read tiff with 16-bit channels, n_samples per pixel (gray, RGB,
+ * RGBA, ...) of which the trailing n_extra are extra samples such as
+ * alpha
  *
- * returns a malloced uint8_t* that needs to be freed, or NULL if failed
+ * returns a malloced uint16_t* that needs to be freed, or NULL if
+ * failed
  */
-uint8_t *read_tiff8(char *filename, int *width, int *height)
+uint16_t *read_tiff16(char *filename, int *width, int *height, int
+		*n_samples, int *n_extra)
+{
+	return read_tiff16_page(filename, 0, 1, width, height, n_samples,
+			n_extra);
+}
+
+/*
+ * same as read_tiff16, but reads the given page (directory, counting
+ * from 0) of a multi-page tiff, decompressing strips on n_threads
+ * threads
+ *
+ * returns a malloced uint16_t* that needs to be freed, or NULL if
+ * failed
+ */
+uint16_t *read_tiff16_page(char *filename, int page, int n_threads, int
+		*width, int *height, int *n_samples, int *n_extra)
+{
+	return read_tiff(filename, page, 16, n_threads, width, height,
+			n_samples, n_extra);
+}
+
+/*
+ * read the width x height region at x, y of page of a tiff with 16-bit
+ * channels, laid out like read_tiff16_page, decoding only the strips,
+ * or tiles of a tiled tiff, that it overlaps
+ *
+ * returns a malloced uint16_t* of the region that needs to be freed,
+ * or NULL if failed
+ */
+uint16_t *read_tiff16_region(char *filename, int page, int x, int y,
+		int width, int height, int *n_samples, int *n_extra)
 {
-	int i;
 	TIFF *tif;
-	uint8_t *result;
-	int scanline_size;
+	char *result, *chunk;
+	int tiled, cx, cy, x0, x1, y0, y1, j;
+	uint32_t image_width, image_height, chunk_width, chunk_height;
+	uint16_t samples_per_pixel, bits_per_sample, planar_config;
+	uint16_t extra_count, *extra_types;
+	size_t pixel_size, chunk_row_size;
+	tmsize_t chunk_size, n;
 
 	if ((tif = TIFFOpen(filename, "r")) == NULL) {
-		fprintf(stderr, "read_tiff: could not open %s\n",
+		fprintf(stderr, "read_tiff16_region: could not open %s\n",
 				filename);
 		fflush(stderr);
 		goto out_no_open;
 	}
 
-	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, width);
-	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, height);
-	scanline_size = TIFFScanlineSize(tif);
-	if (scanline_size != 3 * (*width) * sizeof(*result)) {
-		fprintf(stderr, "read_tiff: %s is not in correct format.  TIFF file should have 8-bit channels in RGBRGB format.\n",
+	if (page != 0 && TIFFSetDirectory(tif, page) == 0) {
+		fprintf(stderr, "read_tiff16_region: %s has no page %d\n",
+				filename, page);
+		fflush(stderr);
+		goto out_wrong_format;
+	}
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &image_width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &image_height);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL,
+			&samples_per_pixel);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE,
+			&bits_per_sample);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar_config);
+	if (TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &extra_count,
+				&extra_types) == 0)
+		extra_count = 0;
+
+	*n_samples = samples_per_pixel;
+	*n_extra = extra_count;
+	if (bits_per_sample != 16 || planar_config != PLANARCONFIG_CONTIG
+			|| extra_count >= samples_per_pixel) {
+		fprintf(stderr, "read_tiff16_region: %s is not in correct format.  TIFF file should have 16-bit channels in contiguous (e.g. RGBRGB) format.\n",
 				filename);
 		fflush(stderr);
 		goto out_wrong_format;
 	}
 
-	result = malloc((*height) * scanline_size);
+	if (x < 0 || y < 0 || width < 1 || height < 1 || (uint32_t)(x +
+				width) > image_width || (uint32_t)(y +
+				height) > image_height) {
+		fprintf(stderr, "read_tiff16_region: %dx%d at %d,%d is not within %s\n",
+				width, height, x, y, filename);
+		fflush(stderr);
+		goto out_wrong_format;
+	}
+
+	/* a strip is a chunk as wide as the image */
+	tiled = TIFFIsTiled(tif);
+	if (tiled) {
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &chunk_width);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &chunk_height);
+		chunk_size = TIFFTileSize(tif);
+	} else {
+		TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP,
+				&chunk_height);
+		if (chunk_height > image_height)
+			chunk_height = image_height;
+		chunk_width = image_width;
+		chunk_size = TIFFStripSize(tif);
+	}
+	pixel_size = (size_t)samples_per_pixel * 2;
+	chunk_row_size = chunk_width * pixel_size;
+
+	result = malloc((size_t)width * height * pixel_size);
 	if (result == NULL)
 		goto out_nomem;
+	chunk = malloc(chunk_size);
+	if (chunk == NULL)
+		goto out_no_chunk;
 
-	for (i = 0; i < (*height); i++) {
-		if (TIFFReadScanline(tif, result + 3 * (*width) * i,
-					i, 0)
-				== -1) {
-			fprintf(stderr, "read_tiff: error in reading %s row %d\n",
-					filename, i);
-			fflush(stderr);
-			goto out_read_err;
+	for (cy = y / chunk_height * chunk_height; cy < y + height; cy +=
+			chunk_height) {
+		for (cx = x / chunk_width * chunk_width; cx < x + width; cx
+				+= chunk_width) {
+			if (tiled)
+				n = TIFFReadEncodedTile(tif,
+						TIFFComputeTile(tif, cx,
+							cy, 0, 0), chunk,
+						chunk_size);
+			else
+				n = TIFFReadEncodedStrip(tif,
+						TIFFComputeStrip(tif, cy,
+							0), chunk,
+						chunk_size);
+			if (n == -1) {
+				fprintf(stderr, "read_tiff16_region: error in reading %s\n",
+						filename);
+				fflush(stderr);
+				goto out_read_err;
+			}
+
+			/* the part of the chunk in the region */
+			x0 = cx > x ? cx : x;
+			x1 = cx + (int)chunk_width < x + width ? cx +
+				(int)chunk_width : x + width;
+			y0 = cy > y ? cy : y;
+			y1 = cy + (int)chunk_height < y + height ? cy +
+				(int)chunk_height : y + height;
+			for (j = y0; j < y1; j++) {
+				memcpy(result + ((size_t)(j - y) * width +
+							x0 - x) *
+						pixel_size, chunk +
+						(size_t)(j - cy) *
+						chunk_row_size + (x0 - cx)
+						* pixel_size, (x1 - x0) *
+						pixel_size);
+			}
 		}
 	}
 
+	free(chunk);
 	TIFFClose(tif);
-	return result;
+	return (uint16_t *)result;
 
 out_read_err:
+	free(chunk);
+out_no_chunk:
 	free(result);
 out_nomem:
 out_wrong_format:
@@ -128,33 +344,844 @@ out_no_open:
 	return NULL;
 }
 
-/* write tiff with 3 channels per pixel, RGB, 16-bit per channel */
-int write_tiff16(char *filename, uint16_t *image_data, int width, int height)
+/*
+ * read tiff with 8-bit channels, n_samples per pixel
+ *
+ * returns a malloced uint8_t* that needs to be freed, or NULL if failed
+ */
+uint8_t *read_tiff8(char *filename, int *width, int *height, int
+		*n_samples)
 {
-	int i;
+	int n_extra;
+
+	return read_tiff(filename, 0, 8, 1, width, height, n_samples,
+			&n_extra);
+}
+
+/*
+ * read only the width, height and sample layout of a tiff, without
+ * decoding it
+ *
+ * returns 0 on success, anything else if failed
+ */
+int read_tiff_size(char *filename, int *width, int *height, int
+		*n_samples, int *n_extra)
+{
+	TIFF *tif;
+	uint16_t samples_per_pixel, extra_count;
+	uint16_t *extra_types;
+
+	if ((tif = TIFFOpen(filename, "r")) == NULL) {
+		fprintf(stderr, "read_tiff_size: could not open %s\n",
+				filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL,
+			&samples_per_pixel);
+	if (TIFFGetField(tif, TIFFTAG_EXTRASAMPLES, &extra_count,
+				&extra_types) == 0)
+		extra_count = 0;
+	*n_samples = samples_per_pixel;
+	*n_extra = extra_count;
+
+	TIFFClose(tif);
+	return 0;
+}
+
+/*
+ * count the pages (directories) of a tiff
+ *
+ * returns the number of pages, or -1 if failed
+ */
+int count_tiff_pages(char *filename)
+{
+	TIFF *tif;
+	int n_pages;
+
+	if ((tif = TIFFOpen(filename, "r")) == NULL) {
+		fprintf(stderr, "count_tiff_pages: could not open %s\n",
+				filename);
+		fflush(stderr);
+		return -1;
+	}
+
+	n_pages = TIFFNumberOfDirectories(tif);
+
+	TIFFClose(tif);
+	return n_pages;
+}
+
+/*
+ * write uncompressed tiff with n_samples 16-bit channels per pixel (RGB
+ * if there are at least 3 color channels, otherwise grayscale), the
+ * trailing n_extra of which are extra samples, the first of them alpha
+ */
+int write_tiff16(char *filename, uint16_t *image_data, int width, int
+		height, int n_samples, int n_extra)
+{
+	return write_tiff(filename, image_data, width, height, n_samples,
+			n_extra, TIFF_GOODNESS_NONE, 1, 0, 0);
+}
+
+/*
+ * same as write_tiff16, but compressed (a TIFF_GOODNESS_*) with a
+ * horizontal predictor.  deflate (and, with HAVE_ZSTD, zstd) strips
+ * are compressed on n_threads threads a batch at a time and written in
+ * order; other compressions go through libtiff one strip at a time
+ *
+ * returns 0 on success, anything else if failed
+ */
+int write_tiff16_compressed(char *filename, uint16_t *image_data, int
+		width, int height, int n_samples, int n_extra, int
+		compression, int n_threads)
+{
+	return write_tiff(filename, image_data, width, height, n_samples,
+			n_extra, compression, n_threads, 0, 0);
+}
+
+/*
+ * same as write_tiff16_compressed, but in tile_size x tile_size tiles
+ * (rounded up to a multiple of 16; 0 for strips) and with n_levels
+ * reduced-resolution copies, each half the size of the one before, as
+ * SubIFDs of the image.  files that could pass 4 GB are written as
+ * BigTIFF
+ *
+ * returns 0 on success, anything else if failed
+ */
+int write_tiff16_tiled(char *filename, uint16_t *image_data, int width,
+		int height, int n_samples, int n_extra, int compression,
+		int n_threads, int tile_size, int n_levels)
+{
+	return write_tiff(filename, image_data, width, height, n_samples,
+			n_extra, compression, n_threads, tile_size,
+			n_levels);
+}
+
+/*
+ * write image_data and n_levels pyramid levels below it to filename
+ * (see write_tiff16_tiled)
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int write_tiff(char *filename, uint16_t *image_data, int width,
+		int height, int n_samples, int n_extra, int compression, int
+		n_threads, int tile_size, int n_levels)
+{
+	int i, level_width, level_height;
 	TIFF *out;
+	uint64_t total_size;
+	uint64_t *subifd_offsets;
+	uint16_t **levels;
+	struct thread_pool *pool;
+	struct downsample down;
+	static const uint16_t tiff_compression[] = {
+		[TIFF_GOODNESS_NONE] = COMPRESSION_NONE,
+		[TIFF_GOODNESS_DEFLATE] = COMPRESSION_ADOBE_DEFLATE,
+		[TIFF_GOODNESS_ZSTD] = COMPRESSION_ZSTD,
+		[TIFF_GOODNESS_LZW] = COMPRESSION_LZW
+	};
+
+	if (compression < 0 || compression > TIFF_GOODNESS_LZW) {
+		fprintf(stderr, "write_tiff: unknown compression %d\n",
+				compression);
+		fflush(stderr);
+		return -1;
+	}
+
+	if (tile_size < 0)
+		tile_size = 0;
+	tile_size = (tile_size + 15) / 16 * 16;
+
+	/* no level smaller than a pixel */
+	for (i = 0; i < n_levels; i++) {
+		if ((width >> i) <= 1 && (height >> i) <= 1)
+			break;
+	}
+	n_levels = i;
+
+	pool = NULL;
+	if (n_threads > 1) {
+		pool = thread_pool_create(n_threads);
+		if (pool == NULL)
+			return -1;
+	}
+
+	levels = calloc(n_levels + 1, sizeof(*levels));
+	subifd_offsets = calloc(n_levels + 1, sizeof(*subifd_offsets));
+	if (levels == NULL || subifd_offsets == NULL)
+		goto out_no_levels;
+
+	/* downsample the pyramid levels, each from the one above */
+	levels[0] = image_data;
+	level_width = width;
+	level_height = height;
+	total_size = (uint64_t)width * height * n_samples *
+		sizeof(*image_data);
+	for (i = 1; i <= n_levels; i++) {
+		down.in = levels[i - 1];
+		down.in_width = level_width;
+		down.in_height = level_height;
+		down.n_samples = n_samples;
+		level_width = (level_width + 1) / 2;
+		level_height = (level_height + 1) / 2;
+		down.out_width = level_width;
+
+		levels[i] = malloc((size_t)level_width * level_height *
+				n_samples * sizeof(*image_data));
+		if (levels[i] == NULL)
+			goto out_no_pyramid;
+		down.out = levels[i];
+		thread_pool_run(pool, level_height, downsample_row, &down);
+
+		total_size += (uint64_t)level_width * level_height *
+			n_samples * sizeof(*image_data);
+	}
+
+	/* anything that might not fit 32-bit offsets is BigTIFF */
+	if ((out = TIFFOpen(filename, total_size + total_size / 64 >
+					UINT32_MAX - BIGTIFF_MARGIN ?
+					"w8" : "w")) == NULL) {
+		fprintf(stderr, "write_tiff: could not open %s\n",
+				filename);
+		fflush(stderr);
+		goto out_no_open;
+	}
+
+	/* the levels are written as the directories following the image,
+	 * which libtiff links in as its SubIFDs */
+	level_width = width;
+	level_height = height;
+	for (i = 0; i <= n_levels; i++) {
+		if (set_tags(out, level_width, level_height, n_samples,
+					n_extra) != 0)
+			goto out_write_err;
+		if (i == 0 && n_levels > 0)
+			TIFFSetField(out, TIFFTAG_SUBIFD, n_levels,
+					subifd_offsets);
+		if (i > 0)
+			TIFFSetField(out, TIFFTAG_SUBFILETYPE,
+					FILETYPE_REDUCEDIMAGE);
+
+		if (write_image(out, pool, n_threads, levels[i],
+					level_width, level_height,
+					n_samples,
+					tiff_compression[compression],
+					tile_size) != 0)
+			goto out_write_err;
+		if (TIFFWriteDirectory(out) == 0)
+			goto out_write_err;
+
+		level_width = (level_width + 1) / 2;
+		level_height = (level_height + 1) / 2;
+	}
+
+	TIFFClose(out);
+	for (i = 1; i <= n_levels; i++) {
+		free(levels[i]);
+	}
+	free(levels);
+	free(subifd_offsets);
+	thread_pool_destroy(pool);
+	return 0;
+
+out_write_err:
+	fprintf(stderr, "write_tiff: error in writing %s\n", filename);
+	fflush(stderr);
+	TIFFClose(out);
+out_no_open:
+out_no_pyramid:
+	for (i = 1; i <= n_levels; i++) {
+		free(levels[i]);
+	}
+out_no_levels:
+	free(levels);
+	free(subifd_offsets);
+	thread_pool_destroy(pool);
+	return -1;
+}
+
+/*
+ * write one image of the current directory in strips (or tiles if
+ * tile_size is nonzero).  deflate (and zstd) chunks are compressed on
+ * the pool a batch at a time and written in order, anything else goes
+ * through libtiff one chunk at a time
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int write_image(TIFF *out, struct thread_pool *pool, int
+		n_threads, uint16_t *image_data, int width, int height, int
+		n_samples, uint16_t compression, int tile_size)
+{
+	int i, n, n_chunks, n_slots, rows, row_width;
+	char *data, *scratch;
+	size_t size;
+	tmsize_t written;
+	struct strip_batch batch;
+
+	batch.image = (char *)image_data;
+	batch.width = width;
+	batch.height = height;
+	batch.n_samples = n_samples;
+	batch.bits = 16;
+	batch.row_size = (size_t)n_samples * width * sizeof(*image_data);
+	batch.compression = compression;
+	batch.predictor = compression != COMPRESSION_NONE;
+	batch.swab = 0;
+
+	if (tile_size > 0) {
+		batch.tile_width = tile_size;
+		batch.tile_height = tile_size;
+		batch.tiles_across = (width + tile_size - 1) / tile_size;
+		batch.rows_per_strip = 0;
+		batch.chunk_size = (size_t)tile_size * tile_size *
+			n_samples * sizeof(*image_data);
+		n_chunks = batch.tiles_across * ((height + tile_size - 1) /
+				tile_size);
+
+		TIFFSetField(out, TIFFTAG_TILEWIDTH, tile_size);
+		TIFFSetField(out, TIFFTAG_TILELENGTH, tile_size);
+	} else {
+		batch.tile_width = 0;
+		batch.rows_per_strip = STRIP_SIZE / batch.row_size;
+		if (batch.rows_per_strip < 1)
+			batch.rows_per_strip = 1;
+		if (batch.rows_per_strip > height)
+			batch.rows_per_strip = height;
+		batch.chunk_size = batch.rows_per_strip * batch.row_size;
+		n_chunks = (height + batch.rows_per_strip - 1) /
+			batch.rows_per_strip;
+
+		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP,
+				batch.rows_per_strip);
+	}
+
+	TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+	if (batch.predictor)
+		TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+
+	/* libtiff's own encoder, one chunk at a time */
+	if (!parallel_codec(compression)) {
+		scratch = malloc(batch.chunk_size);
+		if (scratch == NULL)
+			return -1;
+
+		for (i = 0; i < n_chunks; i++) {
+			size = get_chunk(&batch, i, scratch, 0, &data, &rows,
+					&row_width);
+			if (batch.tile_width > 0)
+				written = TIFFWriteEncodedTile(out, i, data,
+						size);
+			else
+				written = TIFFWriteEncodedStrip(out, i, data,
+						size);
+			if (written == -1) {
+				free(scratch);
+				return -1;
+			}
+		}
+
+		free(scratch);
+		return 0;
+	}
+
+	n_slots = STRIPS_PER_THREAD * (n_threads > 1 ? n_threads : 1);
+	if (n_slots > n_chunks)
+		n_slots = n_chunks;
+
+#ifdef HAVE_ZSTD
+	if (compression == COMPRESSION_ZSTD) {
+		if (alloc_batch(&batch, n_slots, ZSTD_compressBound(
+						batch.chunk_size), 1) != 0)
+			return -1;
+	} else
+#endif
+	if (alloc_batch(&batch, n_slots, compressBound(batch.chunk_size),
+				1) != 0)
+		return -1;
+
+	for (batch.first = 0; batch.first < n_chunks; batch.first +=
+			n_slots) {
+		n = n_chunks - batch.first < n_slots ? n_chunks -
+			batch.first : n_slots;
+
+		thread_pool_run(pool, n, compress_strip, &batch);
+
+		for (i = 0; i < n; i++) {
+			if (batch.ret[i] != 0)
+				goto out_err;
+
+			if (batch.tile_width > 0)
+				written = TIFFWriteRawTile(out, batch.first
+						+ i, batch.raw[i],
+						batch.raw_size[i]);
+			else
+				written = TIFFWriteRawStrip(out,
+						batch.first + i,
+						batch.raw[i],
+						batch.raw_size[i]);
+			if (written == -1)
+				goto out_err;
+		}
+	}
+
+	free_batch(&batch);
+	return 0;
+
+out_err:
+	free_batch(&batch);
+	return -1;
+}
+
+/* thread pool task box-filtering row y of a pyramid level */
+static void downsample_row(void *arg, int y)
+{
+	int x, c, x0, x1, y0, y1;
+	struct downsample *down;
+	uint16_t *in, *out;
+
+	down = arg;
+	y0 = 2 * y;
+	y1 = y0 + 1 < down->in_height ? y0 + 1 : y0;
+	out = down->out + (size_t)y * down->out_width * down->n_samples;
+
+	for (x = 0; x < down->out_width; x++) {
+		x0 = 2 * x;
+		x1 = x0 + 1 < down->in_width ? x0 + 1 : x0;
+
+		for (c = 0; c < down->n_samples; c++) {
+			in = down->in + c;
+			out[down->n_samples * x + c] = ((uint32_t)
+				in[((size_t)y0 * down->in_width + x0) *
+				down->n_samples] + in[((size_t)y0 *
+					down->in_width + x1) *
+				down->n_samples] + in[((size_t)y1 *
+					down->in_width + x0) *
+				down->n_samples] + in[((size_t)y1 *
+					down->in_width + x1) *
+				down->n_samples] + 2) / 4;
+		}
+	}
+}
 
-	out = TIFFOpen(filename, "w");
+/*
+ * set the tags describing a contiguous 16-bit image with n_samples per
+ * pixel, the trailing n_extra of them extra samples
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int set_tags(TIFF *out, int width, int height, int n_samples,
+		int n_extra)
+{
+	int i;
+	uint16_t *extra_types;
 
 	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
 	TIFFSetField(out, TIFFTAG_IMAGELENGTH, height);
-	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 3);
+	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, n_samples);
 	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 16);
 	TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
 	TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-
-	for (i = 0; i < height; i++) {
-		if (TIFFWriteScanline(out, image_data + 3 * i
-					* width, i, 0) == -1) {
-			fprintf(stderr, "write_tiff: error in writing %s on row %d",
-					filename, i);
-			fflush(stderr);
-			TIFFClose(out);
+	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, n_samples - n_extra >= 3 ?
+			PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+
+	if (n_extra > 0) {
+		extra_types = malloc(n_extra * sizeof(*extra_types));
+		if (extra_types == NULL)
 			return -1;
+
+		for (i = 0; i < n_extra; i++) {
+			extra_types[i] = i == 0 ? EXTRASAMPLE_UNASSALPHA :
+				EXTRASAMPLE_UNSPECIFIED;
+		}
+		TIFFSetField(out, TIFFTAG_EXTRASAMPLES, n_extra,
+				extra_types);
+		free(extra_types);
+	}
+
+	return 0;
+}
+
+/*
+ * allocate n_slots compressed strip buffers of raw_capacity bytes (and
+ * with scratch nonzero, as many uncompressed strips for the predictor)
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int alloc_batch(struct strip_batch *batch, int n_slots, size_t
+		raw_capacity, int scratch)
+{
+	int i;
+
+	batch->n_slots = n_slots;
+	batch->raw = calloc(n_slots, sizeof(*batch->raw));
+	batch->raw_size = calloc(n_slots, sizeof(*batch->raw_size));
+	batch->raw_capacity = calloc(n_slots,
+			sizeof(*batch->raw_capacity));
+	batch->scratch = calloc(n_slots, sizeof(*batch->scratch));
+	batch->ret = calloc(n_slots, sizeof(*batch->ret));
+	if (batch->raw == NULL || batch->raw_size == NULL ||
+			batch->raw_capacity == NULL || batch->scratch ==
+			NULL || batch->ret == NULL)
+		goto out_err;
+
+	for (i = 0; i < n_slots; i++) {
+		batch->raw[i] = malloc(raw_capacity);
+		if (batch->raw[i] == NULL)
+			goto out_err;
+		batch->raw_capacity[i] = raw_capacity;
+
+		if (scratch) {
+			batch->scratch[i] = malloc(batch->chunk_size);
+			if (batch->scratch[i] == NULL)
+				goto out_err;
 		}
 	}
 
-	TIFFClose(out);
 	return 0;
+
+out_err:
+	free_batch(batch);
+	return -1;
+}
+
+/* free the buffers of a batch */
+static void free_batch(struct strip_batch *batch)
+{
+	int i;
+
+	for (i = 0; batch->raw != NULL && i < batch->n_slots; i++) {
+		free(batch->raw[i]);
+	}
+	for (i = 0; batch->scratch != NULL && i < batch->n_slots; i++) {
+		free(batch->scratch[i]);
+	}
+
+	free(batch->raw);
+	free(batch->raw_size);
+	free(batch->raw_capacity);
+	free(batch->scratch);
+	free(batch->ret);
+	batch->raw = NULL;
+	batch->raw_size = NULL;
+	batch->raw_capacity = NULL;
+	batch->scratch = NULL;
+	batch->ret = NULL;
+}
+
+/* whether strips with a libtiff compression are (de)compressed here */
+static int parallel_codec(uint16_t compression)
+{
+	switch (compression) {
+	case COMPRESSION_ADOBE_DEFLATE:
+	case COMPRESSION_DEFLATE:
+#ifdef HAVE_ZSTD
+	case COMPRESSION_ZSTD:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* number of rows in a strip (the last one may be short) */
+static size_t strip_rows(struct strip_batch *batch, int strip)
+{
+	int rows;
+
+	rows = batch->height - strip * batch->rows_per_strip;
+	if (rows > batch->rows_per_strip)
+		rows = batch->rows_per_strip;
+
+	return rows;
+}
+
+/*
+ * horizontal predictor on n_rows rows of width pixels: replace each
+ * sample with its difference from the same sample of the pixel to the
+ * left, or with undo nonzero, sum the differences back up
+ */
+static void predict_rows(char *data, int n_rows, int width, int
+		n_samples, int bits, int undo)
+{
+	int i, j, n;
+	uint8_t *row8;
+	uint16_t *row16;
+
+	n = n_samples * width;
+	for (j = 0; j < n_rows; j++) {
+		if (bits == 16) {
+			row16 = (uint16_t *)data + (size_t)n * j;
+			if (undo) {
+				for (i = n_samples; i < n; i++) {
+					row16[i] += row16[i - n_samples];
+				}
+			} else {
+				for (i = n - 1; i >= n_samples; i--) {
+					row16[i] -= row16[i - n_samples];
+				}
+			}
+		} else {
+			row8 = (uint8_t *)data + (size_t)n * j;
+			if (undo) {
+				for (i = n_samples; i < n; i++) {
+					row8[i] += row8[i - n_samples];
+				}
+			} else {
+				for (i = n - 1; i >= n_samples; i--) {
+					row8[i] -= row8[i - n_samples];
+				}
+			}
+		}
+	}
+}
+
+/*
+ * find the uncompressed data of strip (or tile) chunk of a batch.  a
+ * tile is copied to scratch, padded out to the full tile size; a strip
+ * only if copy is nonzero
+ *
+ * returns the size of the chunk, with its data, rows and row width in
+ * pixels in *data, *n_rows and *row_width
+ */
+static size_t get_chunk(struct strip_batch *batch, int chunk, char
+		*scratch, int copy, char **data, int *n_rows, int
+		*row_width)
+{
+	int j, x, y, rows, cols;
+	size_t pixel_size, tile_row_size;
+
+	if (batch->tile_width == 0) {
+		*n_rows = strip_rows(batch, chunk);
+		*row_width = batch->width;
+		*data = batch->image + (size_t)chunk *
+			batch->rows_per_strip * batch->row_size;
+		if (copy) {
+			memcpy(scratch, *data, *n_rows * batch->row_size);
+			*data = scratch;
+		}
+
+		return *n_rows * batch->row_size;
+	}
+
+	pixel_size = (size_t)batch->n_samples * batch->bits / 8;
+	tile_row_size = batch->tile_width * pixel_size;
+	x = chunk % batch->tiles_across * batch->tile_width;
+	y = chunk / batch->tiles_across * batch->tile_height;
+	cols = batch->width - x < batch->tile_width ? batch->width - x :
+		batch->tile_width;
+	rows = batch->height - y < batch->tile_height ? batch->height - y
+		: batch->tile_height;
+
+	if (rows < batch->tile_height || cols < batch->tile_width)
+		memset(scratch, 0, batch->chunk_size);
+	for (j = 0; j < rows; j++) {
+		memcpy(scratch + j * tile_row_size, batch->image + (size_t)(y
+					+ j) * batch->row_size + x *
+				pixel_size, cols * pixel_size);
+	}
+
+	*n_rows = batch->tile_height;
+	*row_width = batch->tile_width;
+	*data = scratch;
+	return batch->chunk_size;
+}
+
+/*
+ * thread pool task compressing strip (or tile) first + i of a batch
+ * into slot i
+ */
+static void compress_strip(void *arg, int i)
+{
+	int rows, row_width;
+	size_t size;
+	char *src;
+	uLongf raw_size;
+	struct strip_batch *batch;
+
+	batch = arg;
+	size = get_chunk(batch, batch->first + i, batch->scratch[i],
+			batch->predictor, &src, &rows, &row_width);
+	if (batch->predictor)
+		predict_rows(src, rows, row_width, batch->n_samples,
+				batch->bits, 0);
+
+#ifdef HAVE_ZSTD
+	if (batch->compression == COMPRESSION_ZSTD) {
+		batch->raw_size[i] = ZSTD_compress(batch->raw[i],
+				batch->raw_capacity[i], src, size, 3);
+		batch->ret[i] = ZSTD_isError(batch->raw_size[i]) ? -1 : 0;
+		return;
+	}
+#endif
+
+	raw_size = batch->raw_capacity[i];
+	batch->ret[i] = compress2((Bytef *)batch->raw[i], &raw_size,
+			(Bytef *)src, size, Z_DEFAULT_COMPRESSION) == Z_OK ?
+		0 : -1;
+	batch->raw_size[i] = raw_size;
+}
+
+/*
+ * thread pool task decompressing slot i of a batch into its place in
+ * the image, then undoing byte swapping and the predictor
+ */
+static void decompress_strip(void *arg, int i)
+{
+	int rows;
+	size_t size;
+	char *dst;
+	uLongf dst_size;
+	struct strip_batch *batch;
+
+	batch = arg;
+	rows = strip_rows(batch, batch->first + i);
+	size = rows * batch->row_size;
+	dst = batch->image + (size_t)(batch->first + i) *
+		batch->rows_per_strip * batch->row_size;
+
+#ifdef HAVE_ZSTD
+	if (batch->compression == COMPRESSION_ZSTD) {
+		batch->ret[i] = ZSTD_decompress(dst, size, batch->raw[i],
+				batch->raw_size[i]) == size ? 0 : -1;
+	} else
+#endif
+	{
+		dst_size = size;
+		batch->ret[i] = uncompress((Bytef *)dst, &dst_size,
+				(Bytef *)batch->raw[i],
+				batch->raw_size[i]) == Z_OK && dst_size
+			== size ? 0 : -1;
+	}
+	if (batch->ret[i] != 0)
+		return;
+
+	if (batch->swab && batch->bits == 16)
+		TIFFSwabArrayOfShort((uint16_t *)dst, size / 2);
+	if (batch->predictor)
+		predict_rows(dst, rows, batch->width, batch->n_samples,
+				batch->bits, 1);
+}
+
+/*
+ * read all strips of the current directory of tif into image; strips
+ * compressed with a codec of our own are read in batches and
+ * decompressed on n_threads threads, anything else is decoded by
+ * libtiff one strip at a time
+ *
+ * returns 0 on success, anything else if failed
+ */
+static int read_strips(TIFF *tif, char *image, int width, int height,
+		int n_samples, int bits, int n_threads)
+{
+	int i, n, n_strips, n_slots;
+	uint16_t predictor;
+	uint32_t rows_per_strip;
+	tmsize_t raw_size;
+	struct thread_pool *pool;
+	struct strip_batch batch;
+
+	TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+	TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION,
+			&batch.compression);
+	predictor = PREDICTOR_NONE;
+	if (parallel_codec(batch.compression))
+		TIFFGetFieldDefaulted(tif, TIFFTAG_PREDICTOR, &predictor);
+
+	batch.image = image;
+	batch.width = width;
+	batch.height = height;
+	batch.rows_per_strip = rows_per_strip > (uint32_t)height ? height
+		: (int)rows_per_strip;
+	batch.n_samples = n_samples;
+	batch.bits = bits;
+	batch.tile_width = 0;
+	batch.row_size = (size_t)n_samples * width * bits / 8;
+	batch.chunk_size = batch.rows_per_strip * batch.row_size;
+	batch.predictor = predictor == PREDICTOR_HORIZONTAL;
+	batch.swab = TIFFIsByteSwapped(tif);
+
+	n_strips = TIFFNumberOfStrips(tif);
+	if (n_strips != (height + batch.rows_per_strip - 1) /
+			batch.rows_per_strip)
+		return -1;
+
+	/* libtiff's own decoder, one strip at a time */
+	if (!parallel_codec(batch.compression) || (predictor !=
+				PREDICTOR_NONE && !batch.predictor)) {
+		for (i = 0; i < n_strips; i++) {
+			if (TIFFReadEncodedStrip(tif, i, image + (size_t)i *
+						batch.rows_per_strip *
+						batch.row_size,
+						strip_rows(&batch, i) *
+						batch.row_size) == -1)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	n_slots = STRIPS_PER_THREAD * (n_threads > 1 ? n_threads : 1);
+	if (n_slots > n_strips)
+		n_slots = n_strips;
+
+	pool = NULL;
+	if (n_threads > 1 && n_strips > 1) {
+		pool = thread_pool_create(n_threads);
+		if (pool == NULL)
+			return -1;
+	}
+
+	if (alloc_batch(&batch, n_slots, batch.rows_per_strip *
+				batch.row_size, 0) != 0)
+		goto out_no_batch;
+
+	for (batch.first = 0; batch.first < n_strips; batch.first +=
+			n_slots) {
+		n = n_strips - batch.first < n_slots ? n_strips -
+			batch.first : n_slots;
+
+		/* read the compressed strips in order, then decompress
+		 * them in parallel */
+		for (i = 0; i < n; i++) {
+			raw_size = TIFFRawStripSize(tif, batch.first + i);
+			if (raw_size <= 0)
+				goto out_read_err;
+
+			if ((size_t)raw_size > batch.raw_capacity[i]) {
+				free(batch.raw[i]);
+				batch.raw[i] = malloc(raw_size);
+				batch.raw_capacity[i] = batch.raw[i] ==
+					NULL ? 0 : raw_size;
+				if (batch.raw[i] == NULL)
+					goto out_read_err;
+			}
+
+			batch.raw_size[i] = TIFFReadRawStrip(tif,
+					batch.first + i, batch.raw[i],
+					raw_size);
+			if (batch.raw_size[i] != (size_t)raw_size)
+				goto out_read_err;
+		}
+
+		thread_pool_run(pool, n, decompress_strip, &batch);
+
+		for (i = 0; i < n; i++) {
+			if (batch.ret[i] != 0)
+				goto out_read_err;
+		}
+	}
+
+	free_batch(&batch);
+	thread_pool_destroy(pool);
+	return 0;
+
+out_read_err:
+	free_batch(&batch);
+out_no_batch:
+	thread_pool_destroy(pool);
+	return -1;
 }
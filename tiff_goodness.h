@@ -13,9 +13,30 @@
 
 #include <stdint.h>
 
-uint16_t *read_tiff16(char *filename, int *width, int *height);
-uint8_t *read_tiff8(char *filename, int *width, int *height);
+/* compression of written tiffs */
+#define TIFF_GOODNESS_NONE 0
+#define TIFF_GOODNESS_DEFLATE 1
+#define TIFF_GOODNESS_ZSTD 2
+#define TIFF_GOODNESS_LZW 3
+
+uint16_t *read_tiff16(char *filename, int *width, int *height, int
+		*n_samples, int *n_extra);
+uint16_t *read_tiff16_page(char *filename, int page, int n_threads, int
+		*width, int *height, int *n_samples, int *n_extra);
+uint16_t *read_tiff16_region(char *filename, int page, int x, int y,
+		int width, int height, int *n_samples, int *n_extra);
+uint8_t *read_tiff8(char *filename, int *width, int *height, int
+		*n_samples);
+int read_tiff_size(char *filename, int *width, int *height, int
+		*n_samples, int *n_extra);
+int count_tiff_pages(char *filename);
 int write_tiff16(char *filename, uint16_t *image_data, int width, int
-		height);
+		height, int n_samples, int n_extra);
+int write_tiff16_compressed(char *filename, uint16_t *image_data, int
+		width, int height, int n_samples, int n_extra, int
+		compression, int n_threads);
+int write_tiff16_tiled(char *filename, uint16_t *image_data, int width,
+		int height, int n_samples, int n_extra, int compression,
+		int n_threads, int tile_size, int n_levels);
 
 #endif /* !_TIFF_GOODNESS_H_ */
@@ -0,0 +1,140 @@
+/*
+ * Small least-recently-used cache of resources kept warm between jobs
+ *
+ * a job takes an entry out (so nothing else can use or evict it while
+ * the job runs) and puts it back when done, which makes it the most
+ * recently used; putting into a full cache frees the least recently
+ * used entry.  caches hold a handful of entries, so they are searched
+ * linearly
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "warm_cache.h"
+
+struct warm_entry {
+	unsigned char key[WARM_CACHE_MAX_KEY];
+	size_t key_size;
+	void *value;
+	unsigned long used;
+};
+
+struct warm_cache {
+	int capacity, n_entries;
+	struct warm_entry *entries;
+	unsigned long clock;
+	void (*free_value)(void *value);
+};
+
+/*
+ * create a cache of at most capacity entries, freed with free_value
+ *
+ * returns the cache, or NULL on failure
+ */
+struct warm_cache *warm_cache_create(int capacity, void
+		(*free_value)(void *value))
+{
+	struct warm_cache *cache;
+
+	cache = malloc(sizeof(*cache));
+	if (cache == NULL)
+		goto out_no_cache;
+
+	cache->entries = calloc(capacity, sizeof(*cache->entries));
+	if (cache->entries == NULL)
+		goto out_no_entries;
+
+	cache->capacity = capacity;
+	cache->n_entries = 0;
+	cache->clock = 0;
+	cache->free_value = free_value;
+
+	return cache;
+
+out_no_entries:
+	free(cache);
+out_no_cache:
+	return NULL;
+}
+
+/* free the cache and every entry still in it (NULL is fine) */
+void warm_cache_destroy(struct warm_cache *cache)
+{
+	int i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->n_entries; i++) {
+		cache->free_value(cache->entries[i].value);
+	}
+	free(cache->entries);
+	free(cache);
+}
+
+/*
+ * take the entry with key out of the cache
+ *
+ * returns its value, or NULL if there is none
+ */
+void *warm_cache_take(struct warm_cache *cache, const void *key, size_t
+		key_size)
+{
+	int i;
+	void *value;
+
+	for (i = 0; i < cache->n_entries; i++) {
+		if (cache->entries[i].key_size != key_size ||
+				memcmp(cache->entries[i].key, key,
+					key_size) != 0)
+			continue;
+
+		value = cache->entries[i].value;
+		cache->entries[i] = cache->entries[--cache->n_entries];
+		return value;
+	}
+
+	return NULL;
+}
+
+/*
+ * put value into the cache under key (at most WARM_CACHE_MAX_KEY
+ * bytes, otherwise value is just freed), evicting the least recently
+ * used entry if the cache is full
+ */
+void warm_cache_put(struct warm_cache *cache, const void *key, size_t
+		key_size, void *value)
+{
+	int i, oldest;
+	struct warm_entry *entry;
+
+	if (key_size > WARM_CACHE_MAX_KEY || cache->capacity < 1) {
+		cache->free_value(value);
+		return;
+	}
+
+	if (cache->n_entries == cache->capacity) {
+		oldest = 0;
+		for (i = 1; i < cache->n_entries; i++) {
+			if (cache->entries[i].used <
+					cache->entries[oldest].used)
+				oldest = i;
+		}
+
+		cache->free_value(cache->entries[oldest].value);
+		cache->entries[oldest] =
+			cache->entries[--cache->n_entries];
+	}
+
+	entry = &cache->entries[cache->n_entries++];
+	memcpy(entry->key, key, key_size);
+	entry->key_size = key_size;
+	entry->value = value;
+	entry->used = ++cache->clock;
+}
@@ -0,0 +1,29 @@
+/*
+ * Small least-recently-used cache of resources kept warm between jobs
+ *
+ * Copyright (C) 2014 Bryance Oyang
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _WARM_CACHE_H_
+#define _WARM_CACHE_H_
+
+#include <stddef.h>
+
+/* keys are compared bytewise, so zero them before filling them in */
+#define WARM_CACHE_MAX_KEY 64
+
+struct warm_cache;
+
+struct warm_cache *warm_cache_create(int capacity, void
+		(*free_value)(void *value));
+void warm_cache_destroy(struct warm_cache *cache);
+void *warm_cache_take(struct warm_cache *cache, const void *key, size_t
+		key_size);
+void warm_cache_put(struct warm_cache *cache, const void *key, size_t
+		key_size, void *value);
+
+#endif /* !_WARM_CACHE_H_ */